@@ -0,0 +1,621 @@
+#include <ubackup/arena.h>
+#include <ubackup/protocol.h>
+#include <ubackup/timestamp.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define LINE_SIZE 4096
+#define NUM_PATHS 1024
+#define NUM_RARE 19
+
+#define array_sizeof(a) (sizeof(a) / sizeof(a[0]))
+
+/*
+ * The codec before protocol.c, which scanned one byte at a time, unescaped
+ * strings into an arena and looked up commands linearly. It is the baseline.
+ */
+
+static void
+ref_quote(char* dest, const char* path)
+{
+    char* q = dest;
+    *q = '\"';
+    q++;
+
+    const char* p;
+    for (p = path; *p != '\0'; p++) {
+        char c = *p;
+        if ((c == '\"') || (c == '\\')) {
+            *q = '\\';
+            q++;
+        }
+        *q = c;
+        q++;
+    }
+    strcpy(q, "\"");
+}
+
+struct Name2Type {
+    const char* name;
+    Type type;
+};
+
+typedef struct Name2Type Name2Type;
+
+static bool
+get_type_of_name(Type* type, const char* name, Name2Type* n2t)
+{
+    if (strcmp(name, n2t->name) != 0) {
+        return false;
+    }
+    *type = n2t->type;
+    return true;
+}
+
+static void
+skip(const char** p, int (*pred)(int))
+{
+    while (pred(**p)) {
+        (*p)++;
+    }
+}
+
+static void
+skip_whitespace(const char** p)
+{
+    skip(p, isblank);
+}
+
+static int
+is_command_char(int c)
+{
+    return isalpha(c) || (c == '_');
+}
+
+static int
+ref_parse_type(Type* type, const char** p)
+{
+    const char* from = *p;
+    skip(p, is_command_char);
+    size_t size = *p - from;
+    char name[size + 1];
+    memcpy(name, from, size);
+    name[size] = '\0';
+
+    Name2Type name2type[] = {
+        { "BODY", CMD_BODY },
+        { "BODY_END", CMD_BODY_END },
+        { "BODY_PART", CMD_BODY_PART },
+        { "CWD", CMD_CWD },
+        { "DELETE", CMD_DELETE },
+        { "DIFF", CMD_DIFF },
+        { "DIGEST", CMD_DIGEST },
+        { "DIR", CMD_DIR },
+        { "DISCARD", CMD_DISCARD },
+        { "DISK_TOTAL", CMD_DISK_TOTAL },
+        { "DISK_USAGE", CMD_DISK_USAGE },
+        { "ENDDIR", CMD_ENDDIR },
+        { "FILE", CMD_FILE },
+        { "NAME", CMD_NAME },
+        { "OPEN_BODY", CMD_OPEN_BODY },
+        { "PHASES", CMD_PHASES },
+        { "REMOVE_OLD", CMD_REMOVE_OLD },
+        { "SAVE_DIGEST", CMD_SAVE_DIGEST },
+        { "STREAM", CMD_STREAM },
+        { "SYMLINK", CMD_SYMLINK },
+        { "THANK_YOU", CMD_THANK_YOU }};
+    bool found = false;
+    size_t i;
+    for (i = 0; !found && (i < array_sizeof(name2type)); i++) {
+        found = get_type_of_name(type, name, &name2type[i]);
+    }
+    if (!found) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+isoctal(int c)
+{
+    return ('0' <= c) && (c < '8');
+}
+
+static int
+ref_parse_mode(mode_t* dest, const char** p)
+{
+    skip_whitespace(p);
+
+    mode_t mode = 0;
+    while (isoctal(**p)) {
+        mode = 8 * mode + **p - '0';
+        (*p)++;
+    }
+    *dest = mode;
+    return 0;
+}
+
+#define IMPLEMENT_PARSE_X(name, type, max) \
+    static int \
+    name(type* dest, const char** p) \
+    { \
+        skip_whitespace(p); \
+\
+        unsigned long l = 0; \
+        while (isdigit(**p)) { \
+            l = 10 * l + **p - '0'; \
+            (*p)++; \
+        } \
+        assert(l < max); \
+        *dest = (type)l; \
+        return 0; \
+    }
+IMPLEMENT_PARSE_X(ref_parse_decimal, size_t, ULONG_MAX)
+IMPLEMENT_PARSE_X(ref_parse_integer, unsigned int, UINT_MAX)
+
+static int
+ref_parse_string(Arena* arena, Slice* dest, const char** p)
+{
+    skip_whitespace(p);
+    if (**p != '\"') {
+        return 1;
+    }
+    (*p)++;
+
+    const char* end = *p;
+    while ((*end != '\"') && (*end != '\0')) {
+        end += (end[0] == '\\') && (end[1] != '\0') ? 2 : 1;
+    }
+    if (*end == '\0') {
+        return 1;
+    }
+    char* s = (char*)arena_alloc(arena, end - *p + 1);
+    if (s == NULL) {
+        return 1;
+    }
+    char* q = s;
+    while (*p < end) {
+        if (**p == '\\') {
+            (*p)++;
+        }
+        *q = **p;
+        (*p)++;
+        q++;
+    }
+    *q = '\0';
+    dest->ptr = s;
+    dest->len = q - s;
+
+    (*p)++;
+    return 0;
+}
+
+static int
+ref_parse_timestamp(Timestamp* dest, const char** p)
+{
+    skip_whitespace(p);
+    return timestamp_decode(dest, p) ? 0 : 1;
+}
+
+static int
+ref_parse_digest(Arena* arena, Slice* dest, const char* params)
+{
+    const char* p = params;
+    skip_whitespace(&p);
+    const char* from = p;
+    while ((*p != '\0') && !isspace(*p)) {
+        p++;
+    }
+    size_t len = p - from;
+    if (len == 0) {
+        return 1;
+    }
+    char* s = (char*)arena_alloc(arena, len + 1);
+    if (s == NULL) {
+        return 1;
+    }
+    memcpy(s, from, len);
+    s[len] = '\0';
+    dest->ptr = s;
+    dest->len = len;
+    return 0;
+}
+
+/*
+ * Parses the attributes which DIR, FILE and SYMLINK share. mtime is NULL for
+ * DIR and SYMLINK.
+ */
+static int
+ref_parse_entry(Arena* arena, const char** p, Slice* path, mode_t* mode, uid_t* uid, gid_t* gid,
+                Timestamp* mtime, Timestamp* ctime)
+{
+    if (ref_parse_string(arena, path, p) != 0) {
+        return 1;
+    }
+    if (ref_parse_mode(mode, p) != 0) {
+        return 1;
+    }
+    if (ref_parse_integer(uid, p) != 0) {
+        return 1;
+    }
+    if (ref_parse_integer(gid, p) != 0) {
+        return 1;
+    }
+    if ((mtime != NULL) && (ref_parse_timestamp(mtime, p) != 0)) {
+        return 1;
+    }
+    return ref_parse_timestamp(ctime, p);
+}
+
+static int
+ref_parse(Arena* arena, Command* cmd, const char* line)
+{
+    const char* p = line;
+    if (ref_parse_type(&cmd->type, &p) != 0) {
+        return 1;
+    }
+    switch (cmd->type) {
+    case CMD_BODY:
+    case CMD_BODY_PART:
+    case CMD_OPEN_BODY:
+        return ref_parse_decimal(&cmd->u.body.size, &p);
+    case CMD_CWD:
+        return ref_parse_string(arena, &cmd->u.cwd.path, &p);
+    case CMD_DELETE:
+        return ref_parse_string(arena, &cmd->u.del.name, &p);
+    case CMD_DIFF:
+        return ref_parse_string(arena, &cmd->u.diff.base, &p);
+    case CMD_DIGEST:
+    case CMD_SAVE_DIGEST:
+        return ref_parse_digest(arena, &cmd->u.digest.value, p);
+    case CMD_STREAM:
+        return ref_parse_integer(&cmd->u.stream.id, &p);
+    case CMD_DIR:
+        return ref_parse_entry(arena, &p, &cmd->u.dir.path, &cmd->u.dir.mode, &cmd->u.dir.uid,
+                               &cmd->u.dir.gid, NULL, &cmd->u.dir.ctime);
+    case CMD_FILE:
+        return ref_parse_entry(arena, &p, &cmd->u.file.path, &cmd->u.file.mode,
+                               &cmd->u.file.uid, &cmd->u.file.gid, &cmd->u.file.mtime,
+                               &cmd->u.file.ctime);
+    case CMD_SYMLINK:
+        if (ref_parse_entry(arena, &p, &cmd->u.symlink.path, &cmd->u.symlink.mode,
+                            &cmd->u.symlink.uid, &cmd->u.symlink.gid, NULL,
+                            &cmd->u.symlink.ctime) != 0) {
+            return 1;
+        }
+        return ref_parse_string(arena, &cmd->u.symlink.src, &p);
+    default:
+        break;
+    }
+    return 0;
+}
+
+/*
+ * Lines which a backupee sends for a tree like the one of "gentree small".
+ * Some names have characters to escape. rare lines are only checked, not
+ * timed: commands of diff sessions and malformed lines, which both codecs
+ * must reject or accept alike.
+ */
+struct Corpus {
+    char* paths[NUM_PATHS];
+    char* lines[NUM_PATHS];
+    char* commands[NUM_PATHS];
+    char* rare[NUM_RARE];
+};
+
+typedef struct Corpus Corpus;
+
+static char*
+strdup_or_die(const char* s)
+{
+    char* t = strdup(s);
+    if (t == NULL) {
+        fprintf(stderr, "Cannot allocate memory.\n");
+        exit(1);
+    }
+    return t;
+}
+
+static void
+make_corpus(Corpus* corpus)
+{
+    const char* commands[] = {
+        "ENDDIR", "THANK_YOU", "NAME", "PHASES", "DISK_USAGE", "REMOVE_OLD", "DISK_TOTAL",
+        "DISCARD", "BODY_END" };
+    const char* ctime = "1792281600.123456789";
+    size_t i;
+    for (i = 0; i < NUM_PATHS; i++) {
+        char path[LINE_SIZE];
+        const char* marks[] = { "", " copy", "", " \"draft\"", "", "\\old", "", "" };
+        snprintf(path, sizeof(path), "home/user/projects/d%03zu/sub%02zu/file-%05zu%s.txt",
+                 i / 64, i % 16, i, marks[(i / 8) % array_sizeof(marks)]);
+        corpus->paths[i] = strdup_or_die(path);
+
+        char quoted[2 * strlen(path) + 3];
+        protocol_quote(quoted, path);
+        char line[LINE_SIZE];
+        switch (i % 8) {
+        case 0:
+            snprintf(line, sizeof(line), "CWD %s", quoted);
+            break;
+        case 1:
+            snprintf(line, sizeof(line), "DIR %s %o %u %u %s", quoted, 0755, 1000, 1000, ctime);
+            break;
+        case 2:
+            snprintf(line, sizeof(line), "SYMLINK %s %o %u %u %s %s", quoted, 0777, 1000, 1000,
+                     ctime, quoted);
+            break;
+        case 3:
+            snprintf(line, sizeof(line), "BODY %zu", 4096 * i);
+            break;
+        case 4:
+            snprintf(line, sizeof(line), "DIGEST %016zx%016zx", i * 2654435761u, ~i);
+            break;
+        default:
+            snprintf(line, sizeof(line), "FILE %s %o %u %u %s %s", quoted, 0644, 1000, 1000,
+                     ctime, ctime);
+            break;
+        }
+        corpus->lines[i] = strdup_or_die(line);
+        corpus->commands[i] = strdup_or_die(commands[i % array_sizeof(commands)]);
+    }
+
+    const char* rare[NUM_RARE] = {
+        "DELETE \"file-00001 copy.txt\"", "DELETE \"sub\\\\dir\"",
+        "DIFF \"2026-10-18T03:00:00,702\"", "SAVE_DIGEST 0123456789abcdef0123456789abcdef",
+        "", "NOPE", "DELETE", "DIFF 2026-10-18", "SAVE_DIGEST 0123", "BODY x", "CWD \"home",
+        "FILE \"a\" 644 1000 1000 1792281600.0", "DIR \"a\" 755 x 1000 1792281600.0",
+        "SYMLINK \"a\" 777 1000 1000 1792281600.0", "DIGEST", "CWD home", "STREAM 2",
+        "OPEN_BODY 1048577", "BODY_PART 262144" };
+    for (i = 0; i < NUM_RARE; i++) {
+        corpus->rare[i] = strdup_or_die(rare[i]);
+    }
+}
+
+static bool
+is_same_slice(const Slice* a, const Slice* b)
+{
+    return (a->len == b->len) && (memcmp(a->ptr, b->ptr, a->len) == 0);
+}
+
+static bool
+is_same_timestamp(const Timestamp* a, const Timestamp* b)
+{
+    return timestamp_compare(a, b) == 0;
+}
+
+static bool
+is_same_command(const Command* a, const Command* b)
+{
+    if (a->type != b->type) {
+        return false;
+    }
+    switch (a->type) {
+    case CMD_BODY:
+    case CMD_BODY_PART:
+    case CMD_OPEN_BODY:
+        return a->u.body.size == b->u.body.size;
+    case CMD_STREAM:
+        return a->u.stream.id == b->u.stream.id;
+    case CMD_CWD:
+        return is_same_slice(&a->u.cwd.path, &b->u.cwd.path);
+    case CMD_DELETE:
+        return is_same_slice(&a->u.del.name, &b->u.del.name);
+    case CMD_DIFF:
+        return is_same_slice(&a->u.diff.base, &b->u.diff.base);
+    case CMD_DIGEST:
+    case CMD_SAVE_DIGEST:
+        return is_same_slice(&a->u.digest.value, &b->u.digest.value);
+    case CMD_DIR:
+        return is_same_slice(&a->u.dir.path, &b->u.dir.path)
+            && (a->u.dir.mode == b->u.dir.mode) && (a->u.dir.uid == b->u.dir.uid)
+            && (a->u.dir.gid == b->u.dir.gid)
+            && is_same_timestamp(&a->u.dir.ctime, &b->u.dir.ctime);
+    case CMD_FILE:
+        return is_same_slice(&a->u.file.path, &b->u.file.path)
+            && (a->u.file.mode == b->u.file.mode) && (a->u.file.uid == b->u.file.uid)
+            && (a->u.file.gid == b->u.file.gid)
+            && is_same_timestamp(&a->u.file.mtime, &b->u.file.mtime)
+            && is_same_timestamp(&a->u.file.ctime, &b->u.file.ctime);
+    case CMD_SYMLINK:
+        return is_same_slice(&a->u.symlink.path, &b->u.symlink.path)
+            && is_same_slice(&a->u.symlink.src, &b->u.symlink.src)
+            && (a->u.symlink.mode == b->u.symlink.mode)
+            && (a->u.symlink.uid == b->u.symlink.uid) && (a->u.symlink.gid == b->u.symlink.gid)
+            && is_same_timestamp(&a->u.symlink.ctime, &b->u.symlink.ctime);
+    case CMD_BODY_END:
+    case CMD_DISCARD:
+    case CMD_DISK_TOTAL:
+    case CMD_DISK_USAGE:
+    case CMD_ENDDIR:
+    case CMD_NAME:
+    case CMD_PHASES:
+    case CMD_REMOVE_OLD:
+    case CMD_THANK_YOU:
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Both codecs accept source as the same command, or both reject it.
+ */
+static bool
+check_parse(Arena* arena, const char* source)
+{
+    char line[LINE_SIZE];
+    strcpy(line, source);
+    Command cmd, ref;
+    arena_reset(arena);
+    bool accepted = ref_parse(arena, &ref, source) == 0;
+    if ((protocol_parse(&cmd, line) == 0) != accepted) {
+        return false;
+    }
+    return !accepted || is_same_command(&cmd, &ref);
+}
+
+/*
+ * Both codecs must agree before they are timed.
+ */
+static bool
+check(Corpus* corpus, Arena* arena)
+{
+    size_t i;
+    for (i = 0; i < NUM_PATHS; i++) {
+        char quoted[2 * strlen(corpus->paths[i]) + 3];
+        char expected[sizeof(quoted)];
+        protocol_quote(quoted, corpus->paths[i]);
+        ref_quote(expected, corpus->paths[i]);
+        if (strcmp(quoted, expected) != 0) {
+            fprintf(stderr, "quote differs: %s\n", corpus->paths[i]);
+            return false;
+        }
+
+        char* sources[] = { corpus->lines[i], corpus->commands[i] };
+        size_t j;
+        for (j = 0; j < array_sizeof(sources); j++) {
+            if (!check_parse(arena, sources[j])) {
+                fprintf(stderr, "parse differs: %s\n", sources[j]);
+                return false;
+            }
+        }
+    }
+    for (i = 0; i < NUM_RARE; i++) {
+        if (!check_parse(arena, corpus->rare[i])) {
+            fprintf(stderr, "parse differs: %s\n", corpus->rare[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keeps results alive, so that compilers do not drop the work. */
+static volatile size_t sink;
+
+static double
+time_quote(const Corpus* corpus, size_t rounds, void (*quote)(char*, const char*))
+{
+    double start = now();
+    size_t n = 0;
+    size_t r, i;
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < NUM_PATHS; i++) {
+            char buf[LINE_SIZE];
+            quote(buf, corpus->paths[i]);
+            n += buf[1];
+        }
+    }
+    sink = n;
+    return (now() - start) / (rounds * NUM_PATHS) * 1e9;
+}
+
+/*
+ * The server parses lines which fgets(3) wrote, so both codecs take a fresh
+ * copy of each line.
+ */
+static double
+time_parse(char* const* lines, size_t rounds, Arena* arena)
+{
+    double start = now();
+    size_t n = 0;
+    size_t r, i;
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < NUM_PATHS; i++) {
+            char line[LINE_SIZE];
+            strcpy(line, lines[i]);
+            Command cmd;
+            if (arena != NULL) {
+                arena_reset(arena);
+                n += ref_parse(arena, &cmd, line);
+            }
+            else {
+                n += protocol_parse(&cmd, line);
+            }
+            n += cmd.type;
+        }
+    }
+    sink = n;
+    return (now() - start) / (rounds * NUM_PATHS) * 1e9;
+}
+
+static void
+print_result(const char* label, double before, double after)
+{
+    printf("%-24s %12.1f %12.1f %8.2f\n", label, before, after, before / after);
+}
+
+static void
+usage()
+{
+    printf("codec [--rounds=n]\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct option opts[] = {
+        { "rounds", required_argument, NULL, 'r' },
+        { NULL, 0, NULL, 0 }
+    };
+    size_t rounds = 1000;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'r':
+            rounds = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (rounds == 0) {
+        usage();
+        return 1;
+    }
+
+    Corpus corpus;
+    make_corpus(&corpus);
+    Arena arena;
+    if (!arena_init(&arena, LINE_SIZE)) {
+        fprintf(stderr, "Cannot allocate memory.\n");
+        return 1;
+    }
+    if (!check(&corpus, &arena)) {
+        return 1;
+    }
+
+    printf("%-24s %12s %12s %8s\n", "codec", "before[ns]", "after[ns]", "speedup");
+    print_result("quote", time_quote(&corpus, rounds, ref_quote),
+                 time_quote(&corpus, rounds, protocol_quote));
+    print_result("dispatch", time_parse(corpus.commands, rounds, &arena),
+                 time_parse(corpus.commands, rounds, NULL));
+    print_result("parse", time_parse(corpus.lines, rounds, &arena),
+                 time_parse(corpus.lines, rounds, NULL));
+
+    arena_destroy(&arena);
+    return 0;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
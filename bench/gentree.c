@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define PATH_SIZE 4096
+
+struct Generator {
+    uint64_t state;
+    int scale;
+    uint64_t num_files;
+    uint64_t num_bytes;
+};
+
+typedef struct Generator Generator;
+
+static void
+print_errno(const char* msg, const char* info)
+{
+    fprintf(stderr, "%s: %s: %s\n", msg, strerror(errno), info);
+}
+
+static uint64_t
+next_random(Generator* gen)
+{
+    uint64_t x = gen->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    gen->state = x;
+    return x * 2685821657736338717ULL;
+}
+
+static uint64_t
+random_below(Generator* gen, uint64_t n)
+{
+    return n == 0 ? 0 : next_random(gen) % n;
+}
+
+static void
+make_dir(const char* path)
+{
+    if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) {
+        print_errno("mkdir failed", path);
+        exit(1);
+    }
+}
+
+static void
+fill(Generator* gen, char* buf, size_t size)
+{
+    size_t i;
+    for (i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t n = next_random(gen);
+        memcpy(buf + i, &n, sizeof(n));
+    }
+    for (; i < size; i++) {
+        buf[i] = (char)next_random(gen);
+    }
+}
+
+static void
+write_at(Generator* gen, int fd, off_t offset, uint64_t size, const char* path)
+{
+    size_t bufsize = 1024 * 1024;
+    char* buf = (char*)malloc(bufsize);
+    uint64_t rest = size;
+    while (0 < rest) {
+        size_t n = rest < bufsize ? rest : bufsize;
+        fill(gen, buf, n);
+        if (pwrite(fd, buf, n, offset) != (ssize_t)n) {
+            print_errno("pwrite failed", path);
+            exit(1);
+        }
+        offset += n;
+        rest -= n;
+    }
+    free(buf);
+}
+
+static void
+make_file(Generator* gen, const char* path, uint64_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        print_errno("open failed", path);
+        exit(1);
+    }
+    write_at(gen, fd, 0, size, path);
+    close(fd);
+    gen->num_files++;
+    gen->num_bytes += size;
+}
+
+static void
+make_sparse_file(Generator* gen, const char* path, uint64_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        print_errno("open failed", path);
+        exit(1);
+    }
+    if (ftruncate(fd, size) != 0) {
+        print_errno("ftruncate failed", path);
+        exit(1);
+    }
+    uint64_t extent = 64 * 1024;
+    uint64_t offset;
+    for (offset = 0; offset + extent <= size; offset += size / 16) {
+        write_at(gen, fd, offset, extent, path);
+    }
+    close(fd);
+    gen->num_files++;
+    gen->num_bytes += size;
+}
+
+static void
+generate_small(Generator* gen, const char* dir)
+{
+    int num_dirs = 100 * gen->scale;
+    int files_per_dir = 200;
+    int i;
+    for (i = 0; i < num_dirs; i++) {
+        char subdir[PATH_SIZE - 16];
+        snprintf(subdir, sizeof(subdir), "%s/d%04d", dir, i);
+        make_dir(subdir);
+        int j;
+        for (j = 0; j < files_per_dir; j++) {
+            char path[PATH_SIZE];
+            snprintf(path, sizeof(path), "%s/f%04d.dat", subdir, j);
+            make_file(gen, path, random_below(gen, 4096));
+        }
+    }
+}
+
+static void
+generate_deep(Generator* gen, const char* dir)
+{
+    int num_chains = 10 * gen->scale;
+    int depth = 64;
+    int i;
+    for (i = 0; i < num_chains; i++) {
+        char path[PATH_SIZE - 16];
+        int len = snprintf(path, sizeof(path), "%s/c%03d", dir, i);
+        make_dir(path);
+        int j;
+        for (j = 0; j < depth; j++) {
+            char file[PATH_SIZE];
+            snprintf(file, sizeof(file), "%s/leaf.dat", path);
+            make_file(gen, file, random_below(gen, 1024));
+            len += snprintf(path + len, sizeof(path) - len, "/l%02d", j);
+            make_dir(path);
+        }
+    }
+}
+
+static void
+generate_huge(Generator* gen, const char* dir)
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        char path[PATH_SIZE];
+        snprintf(path, sizeof(path), "%s/huge%d.dat", dir, i);
+        make_file(gen, path, (uint64_t)64 * 1024 * 1024 * gen->scale);
+    }
+}
+
+static void
+generate_sparse(Generator* gen, const char* dir)
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        char path[PATH_SIZE];
+        snprintf(path, sizeof(path), "%s/sparse%d.dat", dir, i);
+        make_sparse_file(gen, path, (uint64_t)256 * 1024 * 1024 * gen->scale);
+    }
+}
+
+/*
+ * Changes about 5% of files of a tree made by generate_small, removes 1% and
+ * adds 1% as new files. Used for measuring incremental backups.
+ */
+static void
+mutate_small(Generator* gen, const char* dir)
+{
+    int num_dirs = 100 * gen->scale;
+    int files_per_dir = 200;
+    int i;
+    for (i = 0; i < num_dirs; i++) {
+        int j;
+        for (j = 0; j < files_per_dir; j++) {
+            char path[PATH_SIZE];
+            snprintf(path, sizeof(path), "%s/d%04d/f%04d.dat", dir, i, j);
+            uint64_t n = random_below(gen, 100);
+            if (n < 5) {
+                make_file(gen, path, random_below(gen, 4096));
+            }
+            else if ((n == 5) && (unlink(path) != 0) && (errno != ENOENT)) {
+                print_errno("unlink failed", path);
+                exit(1);
+            }
+            else if (n == 6) {
+                snprintf(path, sizeof(path), "%s/d%04d/n%04d.dat", dir, i, j);
+                make_file(gen, path, random_below(gen, 4096));
+            }
+        }
+    }
+}
+
+struct Scenario {
+    const char* name;
+    void (*generate)(Generator*, const char*);
+};
+
+typedef struct Scenario Scenario;
+
+static void
+usage()
+{
+    printf("gentree [--seed=n] [--scale=n] small|deep|huge|sparse|mutate dir\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct option opts[] = {
+        { "scale", required_argument, NULL, 'S' },
+        { "seed", required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+    Generator gen;
+    gen.state = 42;
+    gen.scale = 1;
+    gen.num_files = gen.num_bytes = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'S':
+            gen.scale = atoi(optarg);
+            break;
+        case 's':
+            gen.state = strtoull(optarg, NULL, 10) | 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        return 1;
+    }
+    Scenario scenarios[] = {
+        { "small", generate_small },
+        { "deep", generate_deep },
+        { "huge", generate_huge },
+        { "sparse", generate_sparse },
+        { "mutate", mutate_small } };
+    const char* name = argv[optind];
+    const char* dir = argv[optind + 1];
+    size_t i;
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (strcmp(name, scenarios[i].name) != 0) {
+            continue;
+        }
+        make_dir(dir);
+        scenarios[i].generate(&gen, dir);
+        printf("%" PRIu64 " %" PRIu64 "\n", gen.num_files, gen.num_bytes);
+        return 0;
+    }
+    usage();
+    return 1;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
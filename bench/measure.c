@@ -0,0 +1,138 @@
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t num_files = 0;
+static uint64_t num_bytes = 0;
+
+static void
+count_tree(const char* path)
+{
+    struct stat sb;
+    if (lstat(path, &sb) != 0) {
+        return;
+    }
+    if (S_ISREG(sb.st_mode)) {
+        num_files++;
+        num_bytes += sb.st_size;
+        return;
+    }
+    if (!S_ISDIR(sb.st_mode)) {
+        return;
+    }
+    DIR* dirp = opendir(path);
+    if (dirp == NULL) {
+        return;
+    }
+    struct dirent* e;
+    while ((e = readdir(dirp)) != NULL) {
+        const char* name = e->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+            continue;
+        }
+        char child[strlen(path) + strlen(name) + 2];
+        sprintf(child, "%s/%s", path, name);
+        count_tree(child);
+    }
+    closedir(dirp);
+}
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+usage()
+{
+    printf("measure [--header] [--syscalls=n] [--tree=dir] label command...\n");
+}
+
+static void
+print_header()
+{
+    printf("%-24s %9s %9s %8s %10s %8s %10s %10s\n", "scenario", "files", "MB", "sec", "files/s", "MB/s", "syscalls", "maxrss[KB]");
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct option opts[] = {
+        { "header", no_argument, NULL, 'h' },
+        { "syscalls", required_argument, NULL, 's' },
+        { "tree", required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char* syscalls = "-";
+    const char* tree = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            print_header();
+            return 0;
+        case 's':
+            syscalls = optarg;
+            break;
+        case 't':
+            tree = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage();
+        return 1;
+    }
+    if (tree != NULL) {
+        count_tree(tree);
+    }
+
+    const char* label = argv[optind];
+    double start = now();
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        return 1;
+    }
+    if (pid == 0) {
+        execvp(argv[optind + 1], &argv[optind + 1]);
+        fprintf(stderr, "execvp failed: %s: %s\n", strerror(errno), argv[optind + 1]);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1) {
+        fprintf(stderr, "wait4 failed: %s\n", strerror(errno));
+        return 1;
+    }
+    double sec = now() - start;
+    double mega = num_bytes / (1024.0 * 1024.0);
+    double files_per_sec = 0 < sec ? num_files / sec : 0;
+    double mega_per_sec = 0 < sec ? mega / sec : 0;
+    printf("%-24s %9" PRIu64 " %9.1f %8.2f %10.0f %8.1f %10s %10ld\n", label, num_files, mega, sec, files_per_sec, mega_per_sec, syscalls, ru.ru_maxrss);
+    fflush(stdout);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,36 @@
+#if !defined(UBACKUP_ARENA_H_INCLUDED)
+#define UBACKUP_ARENA_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct Chunk;
+
+/*
+ * A bump allocator. Memory is released only by arena_reset() at once, so
+ * commands in a batch can share one arena.
+ */
+struct Arena {
+    struct Chunk* head;
+    struct Chunk* current;
+    size_t chunk_size;
+};
+
+typedef struct Arena Arena;
+
+struct Slice {
+    const char* ptr;
+    size_t len;
+};
+
+typedef struct Slice Slice;
+
+bool arena_init(Arena* arena, size_t chunk_size);
+void arena_destroy(Arena* arena);
+void* arena_alloc(Arena* arena, size_t size);
+void arena_reset(Arena* arena);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,43 @@
+#if !defined(UBACKUP_BUFRING_H_INCLUDED)
+#define UBACKUP_BUFRING_H_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BUFRING_NUM 4
+
+/*
+ * Buffers passed from a producer thread to a consumer thread in order. The
+ * producer fills buffers while the consumer drains earlier ones, so a disk and
+ * a pipe can be busy at the same time.
+ */
+struct BufRing {
+    char* bufs[BUFRING_NUM];
+    size_t lens[BUFRING_NUM];
+    size_t size;
+    size_t head;
+    size_t tail;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t readable;
+    pthread_cond_t writable;
+};
+
+typedef struct BufRing BufRing;
+
+bool bufring_init(BufRing* ring, size_t size, size_t alignment);
+void bufring_destroy(BufRing* ring);
+void bufring_reset(BufRing* ring);
+
+char* bufring_acquire(BufRing* ring);
+void bufring_commit(BufRing* ring, size_t len);
+void bufring_close(BufRing* ring);
+
+char* bufring_peek(BufRing* ring, size_t* len);
+void bufring_release(BufRing* ring);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,58 @@
+#if !defined(UBACKUP_CATALOG_H_INCLUDED)
+#define UBACKUP_CATALOG_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CATALOG_NAME in a backup directory lists backups, so that a backuper does
+ * not scan the directory to find the previous one or old ones. Each line is
+ * "name status files bytes milliseconds". The file is replaced atomically.
+ * A pending entry is a session which is running or which was not committed.
+ * Its backup has the temporary name "(name)".
+ */
+#define CATALOG_NAME ".catalog"
+#define CATALOG_NAME_SIZE 32
+
+enum CatalogStatus {
+    CATALOG_COMMITTED,
+    CATALOG_INCOMPLETE,
+    CATALOG_PENDING
+};
+
+typedef enum CatalogStatus CatalogStatus;
+
+struct CatalogEntry {
+    char name[CATALOG_NAME_SIZE];
+    CatalogStatus status;
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t msec;
+};
+
+typedef struct CatalogEntry CatalogEntry;
+
+/*
+ * Entries are sorted by names, which are timestamps, from the oldest.
+ */
+struct Catalog {
+    CatalogEntry* entries;
+    size_t num;
+};
+
+typedef struct Catalog Catalog;
+
+void catalog_init(Catalog* catalog);
+void catalog_destroy(Catalog* catalog);
+bool catalog_load(Catalog* catalog, const char* backup_dir, bool* found);
+bool catalog_save(const Catalog* catalog, const char* backup_dir);
+bool catalog_add(Catalog* catalog, const CatalogEntry* entry);
+void catalog_remove(Catalog* catalog, const char* name);
+int catalog_lock(const char* backup_dir);
+void catalog_unlock(int fd);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,43 @@
+#if !defined(UBACKUP_CONF_H_INCLUDED)
+#define UBACKUP_CONF_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ubackup/retention.h>
+
+#define CONF_NAME "ubackup.conf"
+/* Packed files are read into one buffer of a backuper. */
+#define CONF_PACK_SIZE_MAX (1024 * 1024)
+
+enum CloneMode {
+    CLONE_LINK,
+    CLONE_REFLINK,
+    CLONE_SNAPSHOT
+};
+
+typedef enum CloneMode CloneMode;
+
+/*
+ * Settings of a backup directory, which are in backup_dir/ubackup.conf.
+ * pack_size is zero if files are not packed. A backuper removes old backups
+ * before a backup until min_free bytes or min_free_percent of the disk is
+ * free. Both are zero if it does not.
+ */
+struct Conf {
+    CloneMode clone;
+    size_t pack_size;
+    RetentionPolicy retention;
+    uint64_t min_free;
+    unsigned int min_free_percent;
+};
+
+typedef struct Conf Conf;
+
+bool conf_load(Conf* conf, const char* backup_dir);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,28 @@
+#if !defined(UBACKUP_FILTER_H_INCLUDED)
+#define UBACKUP_FILTER_H_INCLUDED
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <time.h>
+
+enum FilterVerdict {
+    FILTER_NONE,
+    FILTER_EXCLUDE,
+    FILTER_INCLUDE
+};
+
+typedef enum FilterVerdict FilterVerdict;
+
+struct Filter;
+typedef struct Filter Filter;
+
+Filter* filter_compile(const char* path);
+void filter_destroy(Filter* filter);
+bool filter_has_dir_rules(const Filter* filter);
+FilterVerdict filter_match_path(const Filter* filter, const char* path, const char* name, bool is_dir);
+bool filter_match_stat(const Filter* filter, const struct stat* sb, time_t now);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
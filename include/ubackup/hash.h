@@ -0,0 +1,55 @@
+#if !defined(UBACKUP_HASH_H_INCLUDED)
+#define UBACKUP_HASH_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * XXH64 of bodies. A backuper appends a record of each body which it wrote to
+ * HASHES_PATH of the backup, and ubackup-scrub verifies files against them.
+ */
+struct Xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char mem[32];
+    size_t memsize;
+};
+
+typedef struct Xxh64 Xxh64;
+
+void xxh64_init(Xxh64* state);
+void xxh64_update(Xxh64* state, const void* data, size_t size);
+uint64_t xxh64_digest(const Xxh64* state);
+uint64_t xxh64(const void* data, size_t size);
+
+/*
+ * FNV-1a of a string, for open addressing tables of names.
+ */
+uint32_t hash_name(const char* name);
+
+#define HASHES_PATH ".meta/.hashes"
+
+/*
+ * A record is "hash size mtime path" terminated by a NUL. path is relative to
+ * the top of the backup. A record is stale if the file has another size or
+ * mtime.
+ */
+struct HashRecord {
+    uint64_t hash;
+    uint64_t size;
+    struct timespec mtime;
+    const char* path;
+};
+
+typedef struct HashRecord HashRecord;
+
+bool hash_record_write(FILE* fp, const HashRecord* record);
+bool hash_record_read(FILE* fp, HashRecord* record, char** buf, size_t* bufsize);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
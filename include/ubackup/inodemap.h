@@ -0,0 +1,35 @@
+#if !defined(UBACKUP_INODEMAP_H_INCLUDED)
+#define UBACKUP_INODEMAP_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct InodeEntry {
+    dev_t dev;
+    ino_t ino;
+    void* value;
+};
+
+typedef struct InodeEntry InodeEntry;
+
+/*
+ * Values by inodes, to find hard links of a file. Values must not be NULL.
+ */
+struct InodeMap {
+    InodeEntry* slots;
+    size_t capacity;
+    size_t num;
+};
+
+typedef struct InodeMap InodeMap;
+
+bool inode_map_init(InodeMap* map);
+void inode_map_destroy(InodeMap* map);
+void* inode_map_get(const InodeMap* map, dev_t dev, ino_t ino);
+bool inode_map_put(InodeMap* map, dev_t dev, ino_t ino, void* value);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
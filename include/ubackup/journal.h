@@ -0,0 +1,49 @@
+#if !defined(UBACKUP_JOURNAL_H_INCLUDED)
+#define UBACKUP_JOURNAL_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A journal is written by ubackupwatch. It is the magic with a session id in
+ * the first line, and records terminated with NUL. "C" path is a directory
+ * whose entries changed. "O" means that some events were lost. The watcher
+ * keeps the journal locked while it is running.
+ */
+#define JOURNAL_MAGIC "UBACKUP_JOURNAL 1 "
+#define JOURNAL_CHANGED 'C'
+#define JOURNAL_OVERFLOW 'O'
+
+enum JournalStatus {
+    JOURNAL_NONE,
+    JOURNAL_INCOMPLETE,
+    JOURNAL_OK
+};
+
+typedef enum JournalStatus JournalStatus;
+
+/*
+ * paths are sorted, so that descendants of a directory follow it.
+ */
+struct Journal {
+    char* data;
+    char session[64];
+    size_t end;
+    char** paths;
+    size_t num_paths;
+};
+
+typedef struct Journal Journal;
+
+JournalStatus journal_read(Journal* journal, const char* path);
+bool journal_save_position(const Journal* journal, const char* path);
+void journal_remove_position(const char* path);
+void journal_destroy(Journal* journal);
+
+int journal_create(const char* path);
+bool journal_compact(int fd, const char* path);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
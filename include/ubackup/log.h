@@ -0,0 +1,39 @@
+#if !defined(UBACKUP_LOG_H_INCLUDED)
+#define UBACKUP_LOG_H_INCLUDED
+
+#include <stdarg.h>
+#include <stdbool.h>
+
+enum LogLevel {
+    LEVEL_ERROR,
+    LEVEL_INFO,
+    LEVEL_DEBUG,
+    LEVEL_TRACE
+};
+
+typedef enum LogLevel LogLevel;
+
+extern LogLevel log_level;
+extern bool log_sampled;
+
+bool log_parse_level(LogLevel* dest, const char* name);
+bool log_open(const char* ident, const char* dir, const char* session, LogLevel level, int sample);
+void log_close();
+void log_vwrite(LogLevel level, const char* fmt, va_list ap);
+void log_write(LogLevel level, const char* fmt, ...);
+void log_sample_next();
+
+/*
+ * Protocol tracing costs only a comparison when it is disabled, because
+ * arguments are not evaluated.
+ */
+#define LOG_PROTOCOL(fmt, ...) do { \
+    if (log_sampled) { \
+        log_write(LEVEL_TRACE, (fmt), __VA_ARGS__); \
+    } \
+} while (0)
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,63 @@
+#if !defined(UBACKUP_MANIFEST_H_INCLUDED)
+#define UBACKUP_MANIFEST_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A manifest is what a backupee sent for a backup. It has a signature of each
+ * entry of each directory, so the next backup can send only the differences.
+ */
+struct ManifestEntry {
+    const char* name;
+    uint64_t sig;
+    bool seen;
+};
+
+typedef struct ManifestEntry ManifestEntry;
+
+struct ManifestDir {
+    const char* path;
+    ManifestEntry* entries;
+    size_t num;
+    bool visited;
+};
+
+typedef struct ManifestDir ManifestDir;
+
+struct Manifest;
+typedef struct Manifest Manifest;
+
+Manifest* manifest_load(const char* path);
+void manifest_destroy(Manifest* manifest);
+const char* manifest_base(const Manifest* manifest);
+ManifestDir* manifest_find_dir(Manifest* manifest, const char* path);
+ManifestEntry* manifest_find_entry(ManifestDir* dir, const char* name);
+void manifest_mark_visited(Manifest* manifest, const char* path);
+
+/*
+ * A new manifest is written into path.tmp, and replaces path at
+ * manifest_writer_commit().
+ */
+struct ManifestWriter {
+    FILE* fp;
+    char* path;
+    char* tmp_path;
+    bool failed;
+};
+
+typedef struct ManifestWriter ManifestWriter;
+
+bool manifest_writer_open(ManifestWriter* writer, const char* path, const char* base);
+void manifest_write_dir(ManifestWriter* writer, const char* path);
+void manifest_write_entry(ManifestWriter* writer, const char* name, uint64_t sig);
+void manifest_write_unvisited(ManifestWriter* writer, const Manifest* manifest);
+bool manifest_writer_commit(ManifestWriter* writer);
+void manifest_writer_abort(ManifestWriter* writer);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
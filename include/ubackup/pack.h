@@ -0,0 +1,79 @@
+#if !defined(UBACKUP_PACK_H_INCLUDED)
+#define UBACKUP_PACK_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <ubackup/arena.h>
+
+/*
+ * Small files are appended into pack files in PACK_DIR of a backup instead of
+ * being files of their own. PACK_INDEX in the .meta directory of each
+ * directory tells where its packed files are. pack of a record is the path of
+ * the pack file from the directory, like "../.meta/packs/name".
+ */
+#define PACK_DIR ".meta/packs"
+#define PACK_INDEX ".pack"
+#define PACK_MAX_SIZE (64 * 1024 * 1024)
+
+struct PackRecord {
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t length;
+    struct timespec mtime;
+    const char* pack;
+    const char* name;
+};
+
+typedef struct PackRecord PackRecord;
+
+bool pack_record_write(FILE* fp, const PackRecord* record);
+bool pack_record_read(FILE* fp, PackRecord* record, char** buf, size_t* bufsize);
+
+/*
+ * Records of a directory by their names.
+ */
+struct PackIndex {
+    Arena arena;
+    PackRecord* records;
+    size_t num;
+    size_t capacity;
+    size_t* slots;
+    size_t num_slots;
+};
+
+typedef struct PackIndex PackIndex;
+
+bool pack_index_init(PackIndex* index);
+void pack_index_destroy(PackIndex* index);
+void pack_index_clear(PackIndex* index);
+bool pack_index_load(PackIndex* index, int meta_fd);
+const PackRecord* pack_index_find(const PackIndex* index, const char* name);
+
+/*
+ * Appends bodies into prefix.0, prefix.1, ... in dirfd. A new pack file is
+ * started after PACK_MAX_SIZE bytes.
+ */
+struct PackWriter {
+    int dirfd;
+    char prefix[64];
+    unsigned int seq;
+    int fd;
+    char name[80];
+    off_t size;
+};
+
+typedef struct PackWriter PackWriter;
+
+void pack_writer_init(PackWriter* writer, int dirfd, const char* prefix);
+bool pack_writer_append(PackWriter* writer, const void* data, size_t size, off_t* offset);
+void pack_writer_close(PackWriter* writer);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,56 @@
+#if !defined(UBACKUP_PHASE_H_INCLUDED)
+#define UBACKUP_PHASE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PHASE_NUM_BUCKETS 40
+
+enum Phase {
+    PHASE_SCAN,
+    PHASE_STAT,
+    PHASE_OPEN,
+    PHASE_QUERY,
+    PHASE_BODY,
+    PHASE_MKDIR,
+    PHASE_LINK,
+    PHASE_META,
+    PHASE_REMOVE_OLD,
+    PHASE_NUM
+};
+
+typedef enum Phase Phase;
+
+/*
+ * buckets[i] counts durations shorter than 2^i nanoseconds (and not shorter
+ * than 2^(i-1)). The last bucket also counts longer ones.
+ */
+struct Histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[PHASE_NUM_BUCKETS];
+};
+
+typedef struct Histogram Histogram;
+
+struct Phases {
+    Histogram histograms[PHASE_NUM];
+};
+
+typedef struct Phases Phases;
+
+uint64_t phase_now();
+void phase_record(Phases* phases, Phase phase, uint64_t start);
+void phase_merge(Phases* dest, const Phases* src);
+void phase_encode(const Phases* phases, char* buf, size_t size);
+bool phase_decode(Phases* phases, const char* s);
+void phase_print_text(FILE* fp, const char* side, const Phases* phases);
+void phase_print_json(FILE* fp, const char* side, const Phases* phases);
+void phase_print_prometheus(FILE* fp, const char* side, const Phases* phases);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
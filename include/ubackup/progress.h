@@ -0,0 +1,44 @@
+#if !defined(UBACKUP_PROGRESS_H_INCLUDED)
+#define UBACKUP_PROGRESS_H_INCLUDED
+
+#include <stdint.h>
+
+#define PROGRESS_TICKS 256
+
+struct Progress {
+    const char* path;
+    uint64_t interval;
+    uint64_t start;
+    uint64_t last;
+    unsigned int ticks;
+    uint64_t prev_entries;
+    uint64_t prev_bytes;
+};
+
+typedef struct Progress Progress;
+
+void progress_init(Progress* progress, const char* path, int interval);
+void progress_report(Progress* progress, uint64_t entries, uint64_t bytes, const char* path);
+void progress_finish(Progress* progress, uint64_t entries, uint64_t bytes);
+
+/*
+ * Called for each entry and each chunk of bodies. Clock is read only once in
+ * PROGRESS_TICKS calls.
+ */
+static inline void
+progress_update(Progress* progress, uint64_t entries, uint64_t bytes, const char* path)
+{
+    if (progress->path == NULL) {
+        return;
+    }
+    progress->ticks++;
+    if (progress->ticks % PROGRESS_TICKS != 0) {
+        return;
+    }
+    progress_report(progress, entries, bytes, path);
+}
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,91 @@
+#if !defined(UBACKUP_PROTOCOL_H_INCLUDED)
+#define UBACKUP_PROTOCOL_H_INCLUDED
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <ubackup/arena.h>
+#include <ubackup/timestamp.h>
+
+enum Type {
+    CMD_BODY,
+    CMD_BODY_END,
+    CMD_BODY_PART,
+    CMD_CWD,
+    CMD_DELETE,
+    CMD_DIFF,
+    CMD_DIGEST,
+    CMD_DIR,
+    CMD_DISCARD,
+    CMD_DISK_TOTAL,
+    CMD_DISK_USAGE,
+    CMD_ENDDIR,
+    CMD_FILE,
+    CMD_NAME,
+    CMD_OPEN_BODY,
+    CMD_PHASES,
+    CMD_REMOVE_OLD,
+    CMD_SAVE_DIGEST,
+    CMD_STREAM,
+    CMD_SYMLINK,
+    CMD_THANK_YOU,
+};
+
+typedef enum Type Type;
+
+struct Command {
+    Type type;
+    union {
+        struct {
+            size_t size;
+        } body;
+        struct {
+            Slice path;
+        } cwd;
+        struct {
+            Slice name;
+        } del;
+        struct {
+            Slice base;
+        } diff;
+        struct {
+            Slice value;
+        } digest;
+        struct {
+            Slice path;
+            mode_t mode;
+            uid_t uid;
+            gid_t gid;
+            Timestamp ctime;
+        } dir;
+        struct {
+            Slice path;
+            mode_t mode;
+            uid_t uid;
+            gid_t gid;
+            Timestamp mtime;
+            Timestamp ctime;
+        } file;
+        struct {
+            unsigned int id;
+        } stream;
+        struct {
+            Slice path;
+            mode_t mode;
+            uid_t uid;
+            gid_t gid;
+            Timestamp ctime;
+            Slice src;
+        } symlink;
+    } u;
+};
+
+typedef struct Command Command;
+
+int protocol_parse(Command* cmd, char* line);
+void protocol_quote(char* dest, const char* path);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,38 @@
+#if !defined(UBACKUP_RETENTION_H_INCLUDED)
+#define UBACKUP_RETENTION_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <ubackup/catalog.h>
+
+#define RETENTION_KEEP_DEFAULT 93
+
+enum RetentionRule {
+    RETENTION_HOURLY,
+    RETENTION_DAILY,
+    RETENTION_WEEKLY,
+    RETENTION_MONTHLY,
+    RETENTION_NUM_RULES
+};
+
+typedef enum RetentionRule RetentionRule;
+
+/*
+ * keep newest backups are kept. Each rule also keeps the newest committed
+ * backup of each of its last counts[rule] hours, days, weeks or months.
+ */
+struct RetentionPolicy {
+    size_t keep;
+    size_t counts[RETENTION_NUM_RULES];
+};
+
+typedef struct RetentionPolicy RetentionPolicy;
+
+void retention_select(const RetentionPolicy* policy, const Catalog* catalog, const char* newest,
+                      bool* keep);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,19 @@
+#if !defined(UBACKUP_SNAPSHOT_H_INCLUDED)
+#define UBACKUP_SNAPSHOT_H_INCLUDED
+
+#include <stdbool.h>
+
+/*
+ * Subvolumes and snapshots of btrfs. All functions fail with ENOTSUP on other
+ * systems.
+ */
+bool snapshot_create_subvolume(int dirfd, const char* name);
+bool snapshot_create(int dirfd, const char* name, int src_fd);
+bool snapshot_set_readonly(int fd, bool readonly);
+bool snapshot_destroy(int dirfd, const char* name);
+bool snapshot_sync(int fd);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
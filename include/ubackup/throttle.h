@@ -0,0 +1,78 @@
+#if !defined(UBACKUP_THROTTLE_H_INCLUDED)
+#define UBACKUP_THROTTLE_H_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Limits of reading a source. Zero means no limit. adaptive backs off while
+ * latencies of reads and stats are above their usual level, and max_load
+ * backs off while the load average is above it.
+ */
+struct ThrottleConf {
+    uint64_t max_bandwidth;
+    uint64_t max_iops;
+    double max_load;
+    bool adaptive;
+};
+
+typedef struct ThrottleConf ThrottleConf;
+
+/*
+ * Latencies of one kind of operations. fast follows them quickly, and slow is
+ * their usual level.
+ */
+struct Latency {
+    double fast;
+    double slow;
+};
+
+typedef struct Latency Latency;
+
+/*
+ * State of one device of the source. Its limits are multiplied by scale, which
+ * halves while the device or the system is busy and grows back slowly. Without
+ * limits, scale is the part of time spent on the device. Latencies of reads
+ * are per byte, so that they are comparable whatever sizes reads have.
+ */
+struct ThrottleDevice {
+    dev_t dev;
+    double scale;
+    uint64_t bytes_ready;
+    uint64_t ops_ready;
+    Latency stat;
+    Latency read;
+    uint64_t last_adjusted;
+};
+
+typedef struct ThrottleDevice ThrottleDevice;
+
+/*
+ * Shared by all threads which read the source.
+ */
+struct Throttle {
+    ThrottleConf conf;
+    pthread_mutex_t lock;
+    ThrottleDevice* devices;
+    size_t num_devices;
+    uint64_t last_loaded;
+    double load;
+};
+
+typedef struct Throttle Throttle;
+
+bool throttle_is_enabled(const ThrottleConf* conf);
+bool throttle_init(Throttle* throttle, const ThrottleConf* conf);
+void throttle_destroy(Throttle* throttle);
+void throttle_account_stat(Throttle* throttle, dev_t dev, uint64_t ns);
+void throttle_account_read(Throttle* throttle, dev_t dev, uint64_t bytes, uint64_t ns);
+
+bool throttle_set_ioprio(const char* spec);
+bool throttle_join_cgroup(const char* dir);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
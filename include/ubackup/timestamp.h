@@ -0,0 +1,30 @@
+#if !defined(UBACKUP_TIMESTAMP_H_INCLUDED)
+#define UBACKUP_TIMESTAMP_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* "-9223372036854775808.999999999" */
+#define TIMESTAMP_MAXSIZE 32
+/* "yyyy-mm-ddThh:nn:ss" */
+#define TIMESTAMP_ISO8601_MAXSIZE 20
+
+struct Timestamp {
+    time_t sec;
+    long nsec;
+};
+
+typedef struct Timestamp Timestamp;
+
+void timestamp_encode(char* buf, const struct timespec* ts);
+bool timestamp_decode(Timestamp* dest, const char** p);
+int timestamp_compare(const Timestamp* a, const Timestamp* b);
+
+void timestamp_format_iso8601(char* buf, time_t t);
+bool timestamp_parse_iso8601(time_t* dest, const char** p);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,68 @@
+#if !defined(UBACKUP_VERSIONS_H_INCLUDED)
+#define UBACKUP_VERSIONS_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <ubackup/arena.h>
+
+/*
+ * An index of versions of files across backups. VERSIONS_DIR in a backup
+ * directory has a file of changes for each backup, which is named after the
+ * backup, and VERSIONS_LIVE which lists files of the last indexed backup. A
+ * version of a file is identified by its size and mtime in backups, which
+ * links, clones, snapshots and packs keep.
+ *
+ * Records of all files are sorted by versions_compare_paths(), so the files
+ * are merged without loading them into memory.
+ */
+#define VERSIONS_DIR ".versions"
+#define VERSIONS_LIVE "live"
+
+/*
+ * op is '+' for a new version and '-' for a removed file. ino is zero for a
+ * packed file.
+ */
+struct VersionRecord {
+    char op;
+    uint64_t size;
+    struct timespec mtime;
+    uint64_t ino;
+    const char* path;
+};
+
+typedef struct VersionRecord VersionRecord;
+
+bool version_record_write(FILE* fp, const VersionRecord* record);
+bool version_record_read(FILE* fp, VersionRecord* record, char** buf, size_t* bufsize);
+int versions_compare_paths(const char* a, const char* b);
+
+/*
+ * Files which a session put into a new backup ('+') or removed from it ('-'),
+ * in the order of the operations. A removal covers everything under its path.
+ */
+struct VersionLog {
+    Arena arena;
+    VersionRecord* records;
+    size_t num;
+    size_t capacity;
+    bool failed;
+};
+
+typedef struct VersionLog VersionLog;
+
+bool version_log_init(VersionLog* log);
+void version_log_destroy(VersionLog* log);
+void version_log_add(VersionLog* log, const VersionRecord* record);
+
+bool versions_update(const char* backup_dir, const char* name, int root_fd, const VersionLog* log,
+                     const char* base);
+bool versions_compact(const char* backup_dir);
+
+#endif
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -1,9 +1,17 @@
 
 ubackupee_opts=""
+ubackuper_opts=""
 while [ 0 -lt $# ]
 do
     case "$1" in
-    --print-statistics|--root=*)
+    --log-dir=*|--log-level=*|--trace-sample=*)
+        ubackuper_opts="${ubackuper_opts} $1"
+        shift
+        ;;
+    --adaptive|--cgroup=*|--direct-io|--exclude-from=*|--from-journal=*|\
+    --ioprio=*|--jobs-per-device=*|--manifest=*|--max-bandwidth=*|--max-iops=*|\
+    --max-load=*|--print-statistics|--progress=*|--progress-interval=*|--root=*|\
+    --stats-format=*)
         ubackupee_opts="${ubackupee_opts} $1"
         shift
         ;;
@@ -30,7 +38,18 @@ esac
 
 srcdirs=""
 while [ $# -gt 1 ]; do
-    srcdirs="${srcdirs} $1"
+    case "$1" in
+    --log-dir=*|--log-level=*|--trace-sample=*)
+        ubackuper_opts="${ubackuper_opts} $1"
+        ;;
+    --adaptive|--cgroup=*|--direct-io|--from-journal=*|--ioprio=*|\
+    --jobs-per-device=*|--manifest=*|--max-bandwidth=*|--max-iops=*|--max-load=*)
+        ubackupee_opts="${ubackupee_opts} $1"
+        ;;
+    *)
+        srcdirs="${srcdirs} $1"
+        ;;
+    esac
     shift
 done
 
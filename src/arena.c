@@ -0,0 +1,87 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <ubackup/arena.h>
+
+#define ALIGNMENT sizeof(void*)
+
+struct Chunk {
+    struct Chunk* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+typedef struct Chunk Chunk;
+
+static Chunk*
+alloc_chunk(size_t size)
+{
+    Chunk* chunk = (Chunk*)malloc(sizeof(Chunk) + size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+bool
+arena_init(Arena* arena, size_t chunk_size)
+{
+    arena->chunk_size = chunk_size;
+    arena->head = arena->current = alloc_chunk(chunk_size);
+    return arena->head != NULL;
+}
+
+void
+arena_destroy(Arena* arena)
+{
+    Chunk* chunk = arena->head;
+    while (chunk != NULL) {
+        Chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = arena->current = NULL;
+}
+
+/*
+ * Chunks after the current one are kept for reuse by arena_reset(). A new
+ * chunk is allocated only when none of them has enough room.
+ */
+void*
+arena_alloc(Arena* arena, size_t size)
+{
+    size_t aligned = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    Chunk* chunk = arena->current;
+    while (chunk->size - chunk->used < aligned) {
+        if (chunk->next == NULL) {
+            size_t chunk_size = arena->chunk_size;
+            Chunk* next = alloc_chunk(aligned < chunk_size ? chunk_size : aligned);
+            if (next == NULL) {
+                return NULL;
+            }
+            chunk->next = next;
+        }
+        chunk = chunk->next;
+        chunk->used = 0;
+    }
+    arena->current = chunk;
+    void* p = chunk->data + chunk->used;
+    chunk->used += aligned;
+    return p;
+}
+
+void
+arena_reset(Arena* arena)
+{
+    arena->current = arena->head;
+    arena->head->used = 0;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
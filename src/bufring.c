@@ -0,0 +1,119 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <ubackup/bufring.h>
+
+bool
+bufring_init(BufRing* ring, size_t size, size_t alignment)
+{
+    size_t i;
+    for (i = 0; i < BUFRING_NUM; i++) {
+        void* p;
+        if (posix_memalign(&p, alignment, size) != 0) {
+            while (0 < i) {
+                i--;
+                free(ring->bufs[i]);
+            }
+            return false;
+        }
+        ring->bufs[i] = (char*)p;
+    }
+    ring->size = size;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->readable, NULL);
+    pthread_cond_init(&ring->writable, NULL);
+    bufring_reset(ring);
+    return true;
+}
+
+void
+bufring_destroy(BufRing* ring)
+{
+    size_t i;
+    for (i = 0; i < BUFRING_NUM; i++) {
+        free(ring->bufs[i]);
+    }
+    pthread_cond_destroy(&ring->writable);
+    pthread_cond_destroy(&ring->readable);
+    pthread_mutex_destroy(&ring->lock);
+}
+
+/*
+ * Must be called when no thread uses the ring.
+ */
+void
+bufring_reset(BufRing* ring)
+{
+    ring->head = ring->tail = 0;
+    ring->closed = false;
+}
+
+/*
+ * Returns a free buffer of ring->size bytes for the producer.
+ */
+char*
+bufring_acquire(BufRing* ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    while (ring->head - ring->tail == BUFRING_NUM) {
+        pthread_cond_wait(&ring->writable, &ring->lock);
+    }
+    char* buf = ring->bufs[ring->head % BUFRING_NUM];
+    pthread_mutex_unlock(&ring->lock);
+    return buf;
+}
+
+void
+bufring_commit(BufRing* ring, size_t len)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->lens[ring->head % BUFRING_NUM] = len;
+    ring->head++;
+    pthread_cond_signal(&ring->readable);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void
+bufring_close(BufRing* ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->closed = true;
+    pthread_cond_signal(&ring->readable);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Returns the oldest filled buffer, or NULL after the producer closed the ring
+ * and all buffers were released.
+ */
+char*
+bufring_peek(BufRing* ring, size_t* len)
+{
+    pthread_mutex_lock(&ring->lock);
+    while ((ring->head == ring->tail) && !ring->closed) {
+        pthread_cond_wait(&ring->readable, &ring->lock);
+    }
+    char* buf = NULL;
+    if (ring->head != ring->tail) {
+        size_t i = ring->tail % BUFRING_NUM;
+        buf = ring->bufs[i];
+        *len = ring->lens[i];
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return buf;
+}
+
+void
+bufring_release(BufRing* ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->tail++;
+    pthread_cond_signal(&ring->writable);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
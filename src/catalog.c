@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <ubackup/catalog.h>
+
+#define PATH_SIZE 4096
+
+static const char* status_names[] = { "committed", "incomplete", "pending" };
+
+void
+catalog_init(Catalog* catalog)
+{
+    catalog->entries = NULL;
+    catalog->num = 0;
+}
+
+void
+catalog_destroy(Catalog* catalog)
+{
+    free(catalog->entries);
+    catalog_init(catalog);
+}
+
+static int
+compare_entries(const void* a, const void* b)
+{
+    return strcmp(((const CatalogEntry*)a)->name, ((const CatalogEntry*)b)->name);
+}
+
+/*
+ * An entry of the same name is replaced.
+ */
+bool
+catalog_add(Catalog* catalog, const CatalogEntry* entry)
+{
+    size_t i;
+    for (i = 0; i < catalog->num; i++) {
+        if (strcmp(catalog->entries[i].name, entry->name) == 0) {
+            catalog->entries[i] = *entry;
+            return true;
+        }
+    }
+    size_t size = (catalog->num + 1) * sizeof(CatalogEntry);
+    CatalogEntry* entries = (CatalogEntry*)realloc(catalog->entries, size);
+    if (entries == NULL) {
+        return false;
+    }
+    entries[catalog->num] = *entry;
+    catalog->entries = entries;
+    catalog->num++;
+    qsort(catalog->entries, catalog->num, sizeof(CatalogEntry), compare_entries);
+    return true;
+}
+
+void
+catalog_remove(Catalog* catalog, const char* name)
+{
+    size_t i;
+    for (i = 0; i < catalog->num; i++) {
+        if (strcmp(catalog->entries[i].name, name) != 0) {
+            continue;
+        }
+        size_t rest = catalog->num - i - 1;
+        memmove(&catalog->entries[i], &catalog->entries[i + 1], rest * sizeof(CatalogEntry));
+        catalog->num--;
+        return;
+    }
+}
+
+static bool
+parse_entry(CatalogEntry* entry, const char* line)
+{
+    char status[16];
+    int n = sscanf(line, "%31s %15s %" SCNu64 " %" SCNu64 " %" SCNu64, entry->name, status,
+                   &entry->files, &entry->bytes, &entry->msec);
+    if (n != 5) {
+        return false;
+    }
+    size_t i;
+    for (i = 0; i < sizeof(status_names) / sizeof(status_names[0]); i++) {
+        if (strcmp(status, status_names[i]) == 0) {
+            entry->status = (CatalogStatus)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * found is false if the backup directory has no catalog yet. Broken lines are
+ * skipped.
+ */
+bool
+catalog_load(Catalog* catalog, const char* backup_dir, bool* found)
+{
+    catalog_init(catalog);
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", backup_dir, CATALOG_NAME);
+    FILE* fp = fopen(path, "r");
+    *found = fp != NULL;
+    if (fp == NULL) {
+        return errno == ENOENT;
+    }
+    bool ok = true;
+    char line[256];
+    while (ok && (fgets(line, sizeof(line), fp) != NULL)) {
+        CatalogEntry entry;
+        if (parse_entry(&entry, line)) {
+            ok = catalog_add(catalog, &entry);
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+bool
+catalog_save(const Catalog* catalog, const char* backup_dir)
+{
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", backup_dir, CATALOG_NAME);
+    char tmp[PATH_SIZE];
+    snprintf(tmp, sizeof(tmp), "%s/%s.tmp", backup_dir, CATALOG_NAME);
+    FILE* fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        return false;
+    }
+    bool ok = true;
+    size_t i;
+    for (i = 0; ok && (i < catalog->num); i++) {
+        const CatalogEntry* e = &catalog->entries[i];
+        const char* fmt = "%s %s %" PRIu64 " %" PRIu64 " %" PRIu64 "\n";
+        ok = 0 <= fprintf(fp, fmt, e->name, status_names[e->status], e->files, e->bytes, e->msec);
+    }
+    ok = (fflush(fp) == 0) && (fsync(fileno(fp)) == 0) && ok;
+    ok = (fclose(fp) == 0) && ok;
+    ok = ok && (rename(tmp, path) == 0);
+    if (!ok) {
+        int e = errno;
+        unlink(tmp);
+        errno = e;
+    }
+    return ok;
+}
+
+/*
+ * Backupers of one backup directory may run at once. Each of them changes the
+ * catalog under this lock on the directory, after loading the catalog again,
+ * so that no change of another is lost. Returns the descriptor to unlock, or
+ * -1.
+ */
+int
+catalog_lock(const char* backup_dir)
+{
+    int fd = open(backup_dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return -1;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    return fd;
+}
+
+void
+catalog_unlock(int fd)
+{
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,247 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <ubackup/conf.h>
+
+#define PATH_SIZE 4096
+
+static void
+print_error(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static char*
+strip(char* s)
+{
+    while (isspace(*s)) {
+        s++;
+    }
+    char* p = s + strlen(s);
+    while ((s < p) && isspace(p[-1])) {
+        p--;
+    }
+    *p = '\0';
+    return s;
+}
+
+struct Name2Mode {
+    const char* name;
+    CloneMode mode;
+};
+
+typedef struct Name2Mode Name2Mode;
+
+static bool
+parse_clone(Conf* conf, const char* value)
+{
+    Name2Mode modes[] = {
+        { "link", CLONE_LINK },
+        { "reflink", CLONE_REFLINK },
+        { "snapshot", CLONE_SNAPSHOT } };
+    size_t i;
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (strcmp(value, modes[i].name) == 0) {
+            conf->clone = modes[i].mode;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * A size is a number with an optional unit of K, M, G or T.
+ */
+static bool
+parse_size(uint64_t* dest, const char* value, uint64_t max)
+{
+    char* end;
+    unsigned long long n = strtoull(value, &end, 10);
+    if ((end == value) || !isdigit(*value)) {
+        return false;
+    }
+    const char* units = "KMGT";
+    const char* unit = *end != '\0' ? strchr(units, *end) : NULL;
+    uint64_t scale = 1;
+    if (unit != NULL) {
+        scale <<= 10 * (unit - units + 1);
+        end++;
+    }
+    if ((*end != '\0') || (max / scale < n)) {
+        return false;
+    }
+    *dest = n * scale;
+    return true;
+}
+
+static bool
+parse_pack(Conf* conf, const char* value)
+{
+    uint64_t size;
+    if (!parse_size(&size, value, CONF_PACK_SIZE_MAX)) {
+        return false;
+    }
+    conf->pack_size = size;
+    return true;
+}
+
+static bool
+parse_count(size_t* dest, const char* value)
+{
+    char* end;
+    unsigned long n = strtoul(value, &end, 10);
+    if ((end == value) || !isdigit(*value) || (*end != '\0')) {
+        return false;
+    }
+    *dest = n;
+    return true;
+}
+
+/*
+ * min_free is a size, or a percentage of the disk like "10%".
+ */
+static bool
+parse_min_free(Conf* conf, const char* value)
+{
+    size_t len = strlen(value);
+    if ((0 < len) && (value[len - 1] == '%')) {
+        char buf[len];
+        memcpy(buf, value, len - 1);
+        buf[len - 1] = '\0';
+        size_t percent;
+        if (!parse_count(&percent, buf) || (100 < percent)) {
+            return false;
+        }
+        conf->min_free_percent = percent;
+        return true;
+    }
+    return parse_size(&conf->min_free, value, UINT64_MAX);
+}
+
+struct Name2Rule {
+    const char* name;
+    RetentionRule rule;
+};
+
+typedef struct Name2Rule Name2Rule;
+
+static bool
+parse_retention(Conf* conf, const char* key, const char* value)
+{
+    if (strcmp(key, "keep") == 0) {
+        return parse_count(&conf->retention.keep, value);
+    }
+    Name2Rule rules[] = {
+        { "keep_hourly", RETENTION_HOURLY },
+        { "keep_daily", RETENTION_DAILY },
+        { "keep_weekly", RETENTION_WEEKLY },
+        { "keep_monthly", RETENTION_MONTHLY } };
+    size_t i;
+    for (i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        if (strcmp(key, rules[i].name) == 0) {
+            return parse_count(&conf->retention.counts[rules[i].rule], value);
+        }
+    }
+    return false;
+}
+
+static bool
+parse_line(Conf* conf, char* line)
+{
+    char* eq = strchr(line, '=');
+    if (eq == NULL) {
+        return false;
+    }
+    *eq = '\0';
+    const char* key = strip(line);
+    const char* value = strip(eq + 1);
+    if (strcmp(key, "clone") == 0) {
+        return parse_clone(conf, value);
+    }
+    if (strcmp(key, "pack") == 0) {
+        return parse_pack(conf, value);
+    }
+    if (strcmp(key, "min_free") == 0) {
+        return parse_min_free(conf, value);
+    }
+    return parse_retention(conf, key, value);
+}
+
+#define KEEP_UNSET SIZE_MAX
+
+/*
+ * Without any keep settings, RETENTION_KEEP_DEFAULT backups are kept. With
+ * rules only, the newest one is kept at least.
+ */
+static void
+fix_retention(RetentionPolicy* policy)
+{
+    if (policy->keep != KEEP_UNSET) {
+        policy->keep = policy->keep != 0 ? policy->keep : 1;
+        return;
+    }
+    bool ruled = false;
+    int rule;
+    for (rule = 0; rule < RETENTION_NUM_RULES; rule++) {
+        ruled = ruled || (policy->counts[rule] != 0);
+    }
+    policy->keep = ruled ? 1 : RETENTION_KEEP_DEFAULT;
+}
+
+/*
+ * Lines are "key = value". A missing file means the defaults.
+ */
+bool
+conf_load(Conf* conf, const char* backup_dir)
+{
+    conf->clone = CLONE_LINK;
+    conf->pack_size = 0;
+    bzero(&conf->retention, sizeof(conf->retention));
+    conf->retention.keep = KEEP_UNSET;
+    conf->min_free = 0;
+    conf->min_free_percent = 0;
+
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", backup_dir, CONF_NAME);
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            fix_retention(&conf->retention);
+            return true;
+        }
+        print_error("fopen failed: %s: %s", strerror(errno), path);
+        return false;
+    }
+    bool error = false;
+    char buf[4096];
+    int lineno = 0;
+    while (!error && (fgets(buf, sizeof(buf), fp) != NULL)) {
+        lineno++;
+        char* line = strip(buf);
+        if ((line[0] == '\0') || (line[0] == '#')) {
+            continue;
+        }
+        if (!parse_line(conf, line)) {
+            print_error("Invalid setting: %s:%d", path, lineno);
+            error = true;
+        }
+    }
+    fclose(fp);
+    fix_retention(&conf->retention);
+    return !error;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,618 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <ubackup/filter.h>
+#include <ubackup/hash.h>
+
+enum RuleKind {
+    RULE_PATH,
+    RULE_NAME,
+    RULE_GLOB_PATH,
+    RULE_GLOB_NAME,
+    RULE_SIZE,
+    RULE_AGE
+};
+
+typedef enum RuleKind RuleKind;
+
+struct Rule {
+    RuleKind kind;
+    bool negated;
+    bool dir_only;
+    char* pattern;
+    const char* tail;
+    size_t tail_len;
+    bool suffix_only;
+    char op;
+    uint64_t value;
+};
+
+typedef struct Rule Rule;
+
+/*
+ * Each node of the trie is a path component of an anchored literal pattern.
+ * rule and dir_rule hold the last rule ending at the node, so that lookups
+ * need no further comparisons.
+ */
+struct Node {
+    char* name;
+    struct Node** children;
+    size_t num_children;
+    int rule;
+    int dir_rule;
+};
+
+typedef struct Node Node;
+
+struct Slot {
+    const char* name;
+    int rule;
+    int dir_rule;
+};
+
+typedef struct Slot Slot;
+
+struct Filter {
+    Rule* rules;
+    int num_rules;
+    Node* trie;
+    Slot* names;
+    size_t names_mask;
+    int* globs;
+    int num_globs;
+    int* predicates;
+    int num_predicates;
+    bool has_dir_rules;
+};
+
+static void
+print_error(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    FILE* out = stderr;
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    va_end(ap);
+}
+
+static void*
+alloc_or_die(size_t size)
+{
+    void* p = calloc(1, size);
+    if (p == NULL) {
+        print_error("Cannot allocate memory.");
+        abort();
+    }
+    return p;
+}
+
+static Node*
+node_new(const char* name, size_t len)
+{
+    Node* node = (Node*)alloc_or_die(sizeof(Node));
+    node->name = (char*)alloc_or_die(len + 1);
+    memcpy(node->name, name, len);
+    node->rule = node->dir_rule = -1;
+    return node;
+}
+
+static void
+node_destroy(Node* node)
+{
+    size_t i;
+    for (i = 0; i < node->num_children; i++) {
+        node_destroy(node->children[i]);
+    }
+    free(node->children);
+    free(node->name);
+    free(node);
+}
+
+static int
+compare_component(const char* name, size_t len, const Node* node)
+{
+    int n = strncmp(name, node->name, len);
+    if (n != 0) {
+        return n;
+    }
+    return node->name[len] == '\0' ? 0 : -1;
+}
+
+static size_t
+find_child(const Node* node, const char* name, size_t len, bool* found)
+{
+    size_t lo = 0;
+    size_t hi = node->num_children;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int n = compare_component(name, len, node->children[mid]);
+        if (n == 0) {
+            *found = true;
+            return mid;
+        }
+        if (n < 0) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    *found = false;
+    return lo;
+}
+
+static Node*
+insert_child(Node* node, const char* name, size_t len)
+{
+    bool found;
+    size_t pos = find_child(node, name, len, &found);
+    if (found) {
+        return node->children[pos];
+    }
+    size_t n = node->num_children;
+    Node** children = (Node**)realloc(node->children, (n + 1) * sizeof(Node*));
+    if (children == NULL) {
+        print_error("Cannot allocate memory.");
+        abort();
+    }
+    memmove(&children[pos + 1], &children[pos], (n - pos) * sizeof(Node*));
+    children[pos] = node_new(name, len);
+    node->children = children;
+    node->num_children = n + 1;
+    return children[pos];
+}
+
+static const char*
+find_separator(const char* p)
+{
+    const char* q = strchr(p, '/');
+    return q != NULL ? q : p + strlen(p);
+}
+
+static void
+trie_insert(Node* root, const char* path, int rule, bool dir_only)
+{
+    Node* node = root;
+    const char* p = path;
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        const char* end = find_separator(p);
+        node = insert_child(node, p, end - p);
+        p = end;
+    }
+    if (dir_only) {
+        node->dir_rule = rule;
+        return;
+    }
+    node->rule = rule;
+}
+
+static int
+trie_lookup(const Node* root, const char* path, bool is_dir)
+{
+    const Node* node = root;
+    const char* p = path;
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        const char* end = find_separator(p);
+        bool found;
+        size_t pos = find_child(node, p, end - p, &found);
+        if (!found) {
+            return -1;
+        }
+        node = node->children[pos];
+        p = end;
+    }
+    int rule = node->rule;
+    if (is_dir && (rule < node->dir_rule)) {
+        return node->dir_rule;
+    }
+    return rule;
+}
+
+static Slot*
+find_slot(const Filter* filter, const char* name)
+{
+    size_t mask = filter->names_mask;
+    size_t i = hash_name(name) & mask;
+    while (filter->names[i].name != NULL) {
+        if (strcmp(filter->names[i].name, name) == 0) {
+            return &filter->names[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return &filter->names[i];
+}
+
+static void
+build_name_table(Filter* filter)
+{
+    int n = 0;
+    int i;
+    for (i = 0; i < filter->num_rules; i++) {
+        n += filter->rules[i].kind == RULE_NAME ? 1 : 0;
+    }
+    size_t size = 16;
+    while (size < 2 * (size_t)n) {
+        size *= 2;
+    }
+    filter->names = (Slot*)alloc_or_die(size * sizeof(Slot));
+    filter->names_mask = size - 1;
+    for (i = 0; i < filter->num_rules; i++) {
+        const Rule* rule = &filter->rules[i];
+        if (rule->kind != RULE_NAME) {
+            continue;
+        }
+        Slot* slot = find_slot(filter, rule->pattern);
+        if (slot->name == NULL) {
+            slot->name = rule->pattern;
+            slot->rule = slot->dir_rule = -1;
+        }
+        if (rule->dir_only) {
+            slot->dir_rule = i;
+            continue;
+        }
+        slot->rule = i;
+    }
+}
+
+static int
+name_lookup(const Filter* filter, const char* name, bool is_dir)
+{
+    const Slot* slot = find_slot(filter, name);
+    if (slot->name == NULL) {
+        return -1;
+    }
+    if (is_dir && (slot->rule < slot->dir_rule)) {
+        return slot->dir_rule;
+    }
+    return slot->rule;
+}
+
+static bool
+is_glob_char(char c)
+{
+    return (c == '*') || (c == '?') || (c == '[') || (c == '\\');
+}
+
+static void
+compile_glob(Rule* rule)
+{
+    const char* pattern = rule->pattern;
+    if (strchr(pattern, '\\') != NULL) {
+        return;
+    }
+    const char* tail = pattern;
+    const char* p;
+    for (p = pattern; *p != '\0'; p++) {
+        if ((*p == '*') || (*p == '?') || (*p == ']')) {
+            tail = p + 1;
+        }
+    }
+    rule->tail = tail;
+    rule->tail_len = strlen(tail);
+    bool name_rule = rule->kind == RULE_GLOB_NAME;
+    rule->suffix_only = name_rule && (pattern[0] == '*') && (tail == pattern + 1);
+}
+
+static bool
+match_glob(const Rule* rule, const char* path, const char* name)
+{
+    const char* s = rule->kind == RULE_GLOB_NAME ? name : path;
+    if (rule->tail != NULL) {
+        size_t len = strlen(s);
+        if (len < rule->tail_len) {
+            return false;
+        }
+        const char* end = s + len - rule->tail_len;
+        if (memcmp(end, rule->tail, rule->tail_len) != 0) {
+            return false;
+        }
+        if (rule->suffix_only) {
+            return true;
+        }
+    }
+    int flags = rule->kind == RULE_GLOB_PATH ? FNM_PATHNAME : 0;
+    return fnmatch(rule->pattern, s, flags) == 0;
+}
+
+static bool
+parse_unit(uint64_t* dest, const char* s, const char* units, const uint64_t* scales)
+{
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if ((errno != 0) || (end == s)) {
+        return false;
+    }
+    if (*end == '\0') {
+        *dest = n;
+        return true;
+    }
+    const char* p = strchr(units, toupper((unsigned char)*end));
+    if ((p == NULL) || (end[1] != '\0')) {
+        return false;
+    }
+    *dest = n * scales[p - units];
+    return true;
+}
+
+static bool
+parse_predicate(Rule* rule, const char* s)
+{
+    static const uint64_t sizes[] = {
+        1024ULL, 1024ULL * 1024, 1024ULL * 1024 * 1024,
+        1024ULL * 1024 * 1024 * 1024 };
+    static const uint64_t ages[] = { 1, 60, 60 * 60, 24 * 60 * 60,
+        7 * 24 * 60 * 60 };
+    size_t len;
+    if (strncmp(s, "size", len = strlen("size")) == 0) {
+        rule->kind = RULE_SIZE;
+    }
+    else if (strncmp(s, "age", len = strlen("age")) == 0) {
+        rule->kind = RULE_AGE;
+    }
+    else {
+        return false;
+    }
+    char op = s[len];
+    if ((op != '<') && (op != '>')) {
+        return false;
+    }
+    rule->op = op;
+    const char* value = s + len + 1;
+    if (rule->kind == RULE_SIZE) {
+        return parse_unit(&rule->value, value, "KMGT", sizes);
+    }
+    return parse_unit(&rule->value, value, "SMHDW", ages);
+}
+
+static bool
+is_predicate(const char* s)
+{
+    const char* heads[] = { "size<", "size>", "age<", "age>" };
+    size_t i;
+    for (i = 0; i < sizeof(heads) / sizeof(heads[0]); i++) {
+        if (strncmp(s, heads[i], strlen(heads[i])) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+strip(char* s)
+{
+    char* p = s + strlen(s);
+    while ((s < p) && isspace((unsigned char)p[-1])) {
+        p--;
+    }
+    *p = '\0';
+}
+
+static bool
+parse_rule(Rule* rule, char* line)
+{
+    char* p = line;
+    if (*p == '!') {
+        rule->negated = true;
+        p++;
+    }
+    if (is_predicate(p)) {
+        return !rule->negated && parse_predicate(rule, p);
+    }
+    size_t len = strlen(p);
+    if (strcmp(p + len - (len < 3 ? len : 3), "/**") == 0) {
+        p[len - 2] = '\0';
+        len -= 2;
+    }
+    if ((0 < len) && (p[len - 1] == '/')) {
+        rule->dir_only = true;
+        p[--len] = '\0';
+    }
+    if (strncmp(p, "**/", 3) == 0) {
+        p += 3;
+    }
+    if (*p == '\0') {
+        return false;
+    }
+    bool anchored = strchr(p, '/') != NULL;
+    bool glob = false;
+    const char* q;
+    for (q = p; !glob && (*q != '\0'); q++) {
+        glob = is_glob_char(*q);
+    }
+    size_t size = strlen(p) + 2;
+    rule->pattern = (char*)alloc_or_die(size);
+    snprintf(rule->pattern, size, "%s%s", anchored && (*p != '/') ? "/" : "", p);
+    if (glob) {
+        rule->kind = anchored ? RULE_GLOB_PATH : RULE_GLOB_NAME;
+        compile_glob(rule);
+        return true;
+    }
+    rule->kind = anchored ? RULE_PATH : RULE_NAME;
+    return true;
+}
+
+static void
+add_rule(Filter* filter, const Rule* rule)
+{
+    int n = filter->num_rules;
+    size_t size = (n + 1) * sizeof(Rule);
+    Rule* rules = (Rule*)realloc(filter->rules, size);
+    if (rules == NULL) {
+        print_error("Cannot allocate memory.");
+        abort();
+    }
+    memcpy(&rules[n], rule, sizeof(Rule));
+    filter->rules = rules;
+    filter->num_rules = n + 1;
+}
+
+static void
+build_index(Filter* filter)
+{
+    int n = filter->num_rules;
+    filter->globs = (int*)alloc_or_die((n + 1) * sizeof(int));
+    filter->predicates = (int*)alloc_or_die((n + 1) * sizeof(int));
+    filter->trie = node_new("", 0);
+    int i;
+    for (i = 0; i < n; i++) {
+        const Rule* rule = &filter->rules[i];
+        filter->has_dir_rules |= rule->dir_only;
+        switch (rule->kind) {
+        case RULE_PATH:
+            trie_insert(filter->trie, rule->pattern, i, rule->dir_only);
+            break;
+        case RULE_GLOB_PATH:
+        case RULE_GLOB_NAME:
+            filter->globs[filter->num_globs] = i;
+            filter->num_globs++;
+            break;
+        case RULE_SIZE:
+        case RULE_AGE:
+            filter->predicates[filter->num_predicates] = i;
+            filter->num_predicates++;
+            break;
+        case RULE_NAME:
+        default:
+            break;
+        }
+    }
+    build_name_table(filter);
+}
+
+Filter*
+filter_compile(const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        print_error("fopen failed: %s: %s", strerror(errno), path);
+        return NULL;
+    }
+    Filter* filter = (Filter*)alloc_or_die(sizeof(Filter));
+    bool error = false;
+    char line[4096];
+    int lineno = 0;
+    while (!error && (fgets(line, sizeof(line), fp) != NULL)) {
+        lineno++;
+        strip(line);
+        if ((line[0] == '\0') || (line[0] == '#')) {
+            continue;
+        }
+        Rule rule;
+        memset(&rule, 0, sizeof(rule));
+        if (!parse_rule(&rule, line)) {
+            print_error("Invalid rule: %s:%d: %s", path, lineno, line);
+            free(rule.pattern);
+            error = true;
+            continue;
+        }
+        add_rule(filter, &rule);
+    }
+    fclose(fp);
+    build_index(filter);
+    if (error) {
+        filter_destroy(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+void
+filter_destroy(Filter* filter)
+{
+    int i;
+    for (i = 0; i < filter->num_rules; i++) {
+        free(filter->rules[i].pattern);
+    }
+    free(filter->rules);
+    node_destroy(filter->trie);
+    free(filter->names);
+    free(filter->globs);
+    free(filter->predicates);
+    free(filter);
+}
+
+bool
+filter_has_dir_rules(const Filter* filter)
+{
+    return filter->has_dir_rules;
+}
+
+FilterVerdict
+filter_match_path(const Filter* filter, const char* path, const char* name, bool is_dir)
+{
+    int best = trie_lookup(filter->trie, path, is_dir);
+    int named = name_lookup(filter, name, is_dir);
+    best = best < named ? named : best;
+    int i;
+    for (i = filter->num_globs - 1; 0 <= i; i--) {
+        int index = filter->globs[i];
+        if (index < best) {
+            break;
+        }
+        const Rule* rule = &filter->rules[index];
+        if (rule->dir_only && !is_dir) {
+            continue;
+        }
+        if (match_glob(rule, path, name)) {
+            best = index;
+            break;
+        }
+    }
+    if (best < 0) {
+        return FILTER_NONE;
+    }
+    return filter->rules[best].negated ? FILTER_INCLUDE : FILTER_EXCLUDE;
+}
+
+static bool
+compare(uint64_t actual, char op, uint64_t expected)
+{
+    return op == '<' ? actual < expected : expected < actual;
+}
+
+bool
+filter_match_stat(const Filter* filter, const struct stat* sb, time_t now)
+{
+    if (!S_ISREG(sb->st_mode)) {
+        return false;
+    }
+    int i;
+    for (i = 0; i < filter->num_predicates; i++) {
+        const Rule* rule = &filter->rules[filter->predicates[i]];
+        uint64_t actual = sb->st_size;
+        if (rule->kind == RULE_AGE) {
+            actual = sb->st_mtime < now ? now - sb->st_mtime : 0;
+        }
+        if (compare(actual, rule->op, rule->value)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
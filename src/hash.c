@@ -0,0 +1,221 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ubackup/hash.h>
+
+#define PRIME1 11400714785074694791ull
+#define PRIME2 14029467366897019727ull
+#define PRIME3 1609587929392839161ull
+#define PRIME4 9650029242287828579ull
+#define PRIME5 2870177450012600261ull
+
+static uint64_t
+rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+read64(const unsigned char* p)
+{
+    uint64_t n;
+    memcpy(&n, p, sizeof(n));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    n = __builtin_bswap64(n);
+#endif
+    return n;
+}
+
+static uint32_t
+read32(const unsigned char* p)
+{
+    uint32_t n;
+    memcpy(&n, p, sizeof(n));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    n = __builtin_bswap32(n);
+#endif
+    return n;
+}
+
+static uint64_t
+round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t
+merge64(uint64_t acc, uint64_t v)
+{
+    acc ^= round64(0, v);
+    return acc * PRIME1 + PRIME4;
+}
+
+void
+xxh64_init(Xxh64* state)
+{
+    state->v[0] = PRIME1 + PRIME2;
+    state->v[1] = PRIME2;
+    state->v[2] = 0;
+    state->v[3] = -PRIME1;
+    state->total = 0;
+    state->memsize = 0;
+}
+
+/*
+ * The four lanes are independent, so a CPU runs them in parallel.
+ */
+static const unsigned char*
+consume_stripes(uint64_t* v, const unsigned char* p, const unsigned char* end)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    while (p + 32 <= end) {
+        v0 = round64(v0, read64(p));
+        v1 = round64(v1, read64(p + 8));
+        v2 = round64(v2, read64(p + 16));
+        v3 = round64(v3, read64(p + 24));
+        p += 32;
+    }
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+    return p;
+}
+
+void
+xxh64_update(Xxh64* state, const void* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+    state->total += size;
+    if (state->memsize + size < 32) {
+        memcpy(state->mem + state->memsize, p, size);
+        state->memsize += size;
+        return;
+    }
+    if (0 < state->memsize) {
+        size_t n = 32 - state->memsize;
+        memcpy(state->mem + state->memsize, p, n);
+        consume_stripes(state->v, state->mem, state->mem + 32);
+        p += n;
+        state->memsize = 0;
+    }
+    p = consume_stripes(state->v, p, end);
+    memcpy(state->mem, p, end - p);
+    state->memsize = end - p;
+}
+
+uint64_t
+xxh64_digest(const Xxh64* state)
+{
+    const uint64_t* v = state->v;
+    uint64_t h;
+    if (32 <= state->total) {
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        h = merge64(h, v[0]);
+        h = merge64(h, v[1]);
+        h = merge64(h, v[2]);
+        h = merge64(h, v[3]);
+    }
+    else {
+        h = PRIME5;
+    }
+    h += state->total;
+
+    const unsigned char* p = state->mem;
+    const unsigned char* end = p + state->memsize;
+    while (p + 8 <= end) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t
+xxh64(const void* data, size_t size)
+{
+    Xxh64 state;
+    xxh64_init(&state);
+    xxh64_update(&state, data, size);
+    return xxh64_digest(&state);
+}
+
+uint32_t
+hash_name(const char* name)
+{
+    uint32_t h = 2166136261u;
+    const unsigned char* p;
+    for (p = (const unsigned char*)name; *p != '\0'; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+bool
+hash_record_write(FILE* fp, const HashRecord* record)
+{
+    const char* fmt = "%016" PRIx64 " %" PRIu64 " %" PRId64 ".%09ld %s";
+    int n = fprintf(fp, fmt, record->hash, record->size, (int64_t)record->mtime.tv_sec,
+                    record->mtime.tv_nsec, record->path);
+    return (0 <= n) && (fputc('\0', fp) != EOF);
+}
+
+/*
+ * record->path points into *buf, which is reused for the next record.
+ */
+bool
+hash_record_read(FILE* fp, HashRecord* record, char** buf, size_t* bufsize)
+{
+    while (getdelim(buf, bufsize, '\0', fp) != -1) {
+        char* p = *buf;
+        char* end;
+        record->hash = strtoull(p, &end, 16);
+        if (*end != ' ') {
+            continue;
+        }
+        record->size = strtoull(end + 1, &end, 10);
+        if (*end != ' ') {
+            continue;
+        }
+        record->mtime.tv_sec = strtoll(end + 1, &end, 10);
+        if (*end != '.') {
+            continue;
+        }
+        record->mtime.tv_nsec = strtol(end + 1, &end, 10);
+        if (*end != ' ') {
+            continue;
+        }
+        record->path = end + 1;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
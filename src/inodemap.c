@@ -0,0 +1,88 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include <ubackup/inodemap.h>
+
+#define INITIAL_CAPACITY 1024
+
+static uint64_t
+hash_inode(dev_t dev, ino_t ino)
+{
+    uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ull;
+    return h ^ (uint64_t)dev;
+}
+
+static InodeEntry*
+find_slot(InodeEntry* slots, size_t capacity, dev_t dev, ino_t ino)
+{
+    size_t i = hash_inode(dev, ino) & (capacity - 1);
+    while ((slots[i].value != NULL) && ((slots[i].dev != dev) || (slots[i].ino != ino))) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+bool
+inode_map_init(InodeMap* map)
+{
+    map->capacity = INITIAL_CAPACITY;
+    map->num = 0;
+    map->slots = (InodeEntry*)calloc(map->capacity, sizeof(InodeEntry));
+    return map->slots != NULL;
+}
+
+void
+inode_map_destroy(InodeMap* map)
+{
+    free(map->slots);
+}
+
+void*
+inode_map_get(const InodeMap* map, dev_t dev, ino_t ino)
+{
+    return find_slot(map->slots, map->capacity, dev, ino)->value;
+}
+
+static bool
+grow(InodeMap* map)
+{
+    size_t capacity = 2 * map->capacity;
+    InodeEntry* slots = (InodeEntry*)calloc(capacity, sizeof(InodeEntry));
+    if (slots == NULL) {
+        return false;
+    }
+    size_t i;
+    for (i = 0; i < map->capacity; i++) {
+        const InodeEntry* e = &map->slots[i];
+        if (e->value != NULL) {
+            *find_slot(slots, capacity, e->dev, e->ino) = *e;
+        }
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->capacity = capacity;
+    return true;
+}
+
+bool
+inode_map_put(InodeMap* map, dev_t dev, ino_t ino, void* value)
+{
+    if ((map->capacity < 2 * (map->num + 1)) && !grow(map)) {
+        return false;
+    }
+    InodeEntry* e = find_slot(map->slots, map->capacity, dev, ino);
+    if (e->value == NULL) {
+        map->num++;
+    }
+    e->dev = dev;
+    e->ino = ino;
+    e->value = value;
+    return true;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ubackup/journal.h>
+
+#define POS_EXT ".pos"
+#define COMPACT_SIZE (64 * 1024)
+
+static void
+print_error(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+/*
+ * "/" is the smallest character, so that "a/b" comes right after "a" before
+ * "a b".
+ */
+static int
+compare_paths(const void* p, const void* q)
+{
+    const unsigned char* s = *(const unsigned char**)p;
+    const unsigned char* t = *(const unsigned char**)q;
+    while ((*s != '\0') && (*s == *t)) {
+        s++;
+        t++;
+    }
+    int c = *s == '/' ? 1 : *s;
+    int d = *t == '/' ? 1 : *t;
+    return c - d;
+}
+
+static char*
+read_all(int fd, size_t* size)
+{
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        return NULL;
+    }
+    char* data = (char*)malloc(sb.st_size + 1);
+    if (data == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    while (n < (size_t)sb.st_size) {
+        ssize_t m = pread(fd, data + n, sb.st_size - n, n);
+        if (m <= 0) {
+            break;
+        }
+        n += m;
+    }
+    data[n] = '\0';
+    *size = n;
+    return data;
+}
+
+static bool
+read_position(const char* path, char* session, size_t size, size_t* offset)
+{
+    char pos_path[strlen(path) + strlen(POS_EXT) + 1];
+    sprintf(pos_path, "%s%s", path, POS_EXT);
+    FILE* fp = fopen(pos_path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    char buf[256];
+    bool read = fgets(buf, sizeof(buf), fp) != NULL;
+    fclose(fp);
+    char* sp = read ? strchr(buf, ' ') : NULL;
+    if ((sp == NULL) || (size <= (size_t)(sp - buf))) {
+        return false;
+    }
+    memcpy(session, buf, sp - buf);
+    session[sp - buf] = '\0';
+    *offset = strtoul(sp + 1, NULL, 10);
+    return true;
+}
+
+static bool
+write_position(const char* path, const char* session, size_t offset)
+{
+    char pos_path[strlen(path) + strlen(POS_EXT) + 1];
+    sprintf(pos_path, "%s%s", path, POS_EXT);
+    char tmp_path[strlen(pos_path) + 5];
+    sprintf(tmp_path, "%s.tmp", pos_path);
+    FILE* fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        print_error("fopen failed: %s: %s", strerror(errno), tmp_path);
+        return false;
+    }
+    fprintf(fp, "%s %zu\n", session, offset);
+    if ((fclose(fp) != 0) || (rename(tmp_path, pos_path) != 0)) {
+        print_error("Cannot save a journal position: %s: %s", strerror(errno), pos_path);
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Returns the offset of the first record after the header of data, or 0 if
+ * the header is invalid.
+ */
+static size_t
+parse_header(const char* data, size_t size, char* session, size_t session_size)
+{
+    size_t magic_len = strlen(JOURNAL_MAGIC);
+    bool valid = (magic_len < size) && (memcmp(data, JOURNAL_MAGIC, magic_len) == 0);
+    const char* newline = valid ? (const char*)memchr(data + magic_len, '\n', size - magic_len) : NULL;
+    size_t session_len = newline != NULL ? newline - data - magic_len : 0;
+    if ((newline == NULL) || (session_size <= session_len)) {
+        return 0;
+    }
+    memcpy(session, data + magic_len, session_len);
+    session[session_len] = '\0';
+    return newline - data + 1;
+}
+
+/*
+ * Each session of a journal has a unique id, so that a position in an old
+ * session is never taken for one in the new session.
+ */
+static bool
+write_header(int fd, char* session, size_t session_size)
+{
+    static unsigned int generation = 0;
+    snprintf(session, session_size, "%ld.%ld.%u", (long)time(NULL), (long)getpid(), generation);
+    generation++;
+    char header[128];
+    int len = snprintf(header, sizeof(header), "%s%s\n", JOURNAL_MAGIC, session);
+    return write(fd, header, len) == len;
+}
+
+static bool
+add_path(Journal* journal, char* path, size_t* capacity)
+{
+    if (journal->num_paths == *capacity) {
+        size_t n = *capacity == 0 ? 64 : 2 * *capacity;
+        char** paths = (char**)realloc(journal->paths, n * sizeof(paths[0]));
+        if (paths == NULL) {
+            return false;
+        }
+        journal->paths = paths;
+        *capacity = n;
+    }
+    journal->paths[journal->num_paths] = path;
+    journal->num_paths++;
+    return true;
+}
+
+static void
+unique_paths(Journal* journal)
+{
+    qsort(journal->paths, journal->num_paths, sizeof(journal->paths[0]), compare_paths);
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < journal->num_paths; i++) {
+        if ((n == 0) || (strcmp(journal->paths[n - 1], journal->paths[i]) != 0)) {
+            journal->paths[n] = journal->paths[i];
+            n++;
+        }
+    }
+    journal->num_paths = n;
+}
+
+/*
+ * Reads paths recorded after the position of the last backup. JOURNAL_NONE
+ * means that no watcher is running, so the next journal will not be complete
+ * either. JOURNAL_INCOMPLETE means that the watcher was restarted or lost
+ * events after the last backup. The backupee must walk everything for both.
+ * A record which is being written is left to the next time.
+ */
+JournalStatus
+journal_read(Journal* journal, const char* path)
+{
+    memset(journal, 0, sizeof(*journal));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            print_error("open failed: %s: %s", strerror(errno), path);
+        }
+        return JOURNAL_NONE;
+    }
+    if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+        print_error("No watcher is running for %s", path);
+        close(fd);
+        return JOURNAL_NONE;
+    }
+    size_t size;
+    char* data = read_all(fd, &size);
+    close(fd);
+    size_t start = data != NULL ? parse_header(data, size, journal->session, sizeof(journal->session)) : 0;
+    if (start == 0) {
+        print_error("Invalid journal: %s", path);
+        free(data);
+        return JOURNAL_NONE;
+    }
+    journal->data = data;
+
+    char session[sizeof(journal->session)];
+    size_t offset;
+    JournalStatus status = JOURNAL_INCOMPLETE;
+    if (read_position(path, session, sizeof(session), &offset)) {
+        bool same = strcmp(session, journal->session) == 0;
+        if (same && (start <= offset) && (offset <= size)) {
+            start = offset;
+            status = JOURNAL_OK;
+        }
+    }
+    size_t capacity = 0;
+    char* p = data + start;
+    const char* end = data + size;
+    while (p < end) {
+        char* term = (char*)memchr(p, '\0', end - p);
+        if (term == NULL) {
+            break;
+        }
+        if (*p == JOURNAL_OVERFLOW) {
+            status = JOURNAL_INCOMPLETE;
+        }
+        if ((*p == JOURNAL_CHANGED) && (status == JOURNAL_OK) && !add_path(journal, p + 1, &capacity)) {
+            status = JOURNAL_INCOMPLETE;
+        }
+        p = term + 1;
+    }
+    journal->end = p - data;
+    if (status == JOURNAL_OK) {
+        unique_paths(journal);
+    }
+    return status;
+}
+
+/*
+ * The position is saved after a successful backup, so that the next backup
+ * reads from there.
+ */
+bool
+journal_save_position(const Journal* journal, const char* path)
+{
+    return write_position(path, journal->session, journal->end);
+}
+
+void
+journal_remove_position(const char* path)
+{
+    char pos_path[strlen(path) + strlen(POS_EXT) + 1];
+    sprintf(pos_path, "%s%s", path, POS_EXT);
+    unlink(pos_path);
+}
+
+void
+journal_destroy(Journal* journal)
+{
+    free(journal->paths);
+    free(journal->data);
+}
+
+/*
+ * Starts a new session of the watcher. The journal is locked until the
+ * watcher exits. Returns -1 if another watcher has it.
+ */
+int
+journal_create(const char* path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        print_error("open failed: %s: %s", strerror(errno), path);
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        print_error("Another watcher is running: %s", path);
+        close(fd);
+        return -1;
+    }
+    char session[64];
+    if ((ftruncate(fd, 0) != 0) || !write_header(fd, session, sizeof(session))) {
+        print_error("Cannot start a journal: %s: %s", strerror(errno), path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Drops records which backups already read, once they are COMPACT_SIZE or
+ * more, so that the journal does not grow forever. The rest is moved to the
+ * top under a new session, and then the position is moved to it. A backupee
+ * which read the journal meanwhile saves a position in the old session, so
+ * the next backup walks everything instead of missing changes. Only the
+ * watcher calls this, because it is the only writer.
+ */
+bool
+journal_compact(int fd, const char* path)
+{
+    char session[64];
+    size_t offset;
+    if (!read_position(path, session, sizeof(session), &offset) || (offset < COMPACT_SIZE)) {
+        return true;
+    }
+    size_t size;
+    char* data = read_all(fd, &size);
+    if (data == NULL) {
+        print_error("Cannot read a journal: %s: %s", strerror(errno), path);
+        return false;
+    }
+    char current[sizeof(session)];
+    size_t start = parse_header(data, size, current, sizeof(current));
+    if ((start == 0) || (strcmp(session, current) != 0) || (offset < start) || (size < offset)) {
+        free(data);
+        return true;
+    }
+    bool ok = (ftruncate(fd, 0) == 0) && write_header(fd, session, sizeof(session));
+    size_t n = offset;
+    while (ok && (n < size)) {
+        ssize_t m = write(fd, data + n, size - n);
+        ok = 0 < m;
+        n += ok ? m : 0;
+    }
+    free(data);
+    if (!ok) {
+        print_error("Cannot compact a journal: %s: %s", strerror(errno), path);
+        return false;
+    }
+    off_t top = lseek(fd, 0, SEEK_END) - (off_t)(size - offset);
+    return write_position(path, session, top);
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ubackup/log.h>
+
+#define RING_SIZE (1024 * 1024)
+#define LINE_SIZE 8192
+
+LogLevel log_level = LEVEL_INFO;
+bool log_sampled = false;
+
+/*
+ * Lines are copied into the ring under the lock, and the writer thread writes
+ * them into the session log file. Callers wait only when the ring is full.
+ */
+struct Ring {
+    char buf[RING_SIZE];
+    size_t head;
+    size_t tail;
+    bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t readable;
+    pthread_cond_t writable;
+    pthread_t writer;
+    int fd;
+};
+
+typedef struct Ring Ring;
+
+static Ring* ring = NULL;
+static int sample = 0;
+static unsigned int num_commands = 0;
+
+static const char* level_names[] = { "error", "info", "debug", "trace" };
+
+#define array_sizeof(a) (sizeof(a) / sizeof(a[0]))
+
+bool
+log_parse_level(LogLevel* dest, const char* name)
+{
+    size_t i;
+    for (i = 0; i < array_sizeof(level_names); i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *dest = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+write_all(int fd, const char* buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, buf + done, size - done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "write failed: %s", strerror(errno));
+            return;
+        }
+        done += n;
+    }
+}
+
+static void*
+drain(void* arg)
+{
+    Ring* r = (Ring*)arg;
+    pthread_mutex_lock(&r->lock);
+    while (true) {
+        while ((r->head == r->tail) && !r->closing) {
+            pthread_cond_wait(&r->readable, &r->lock);
+        }
+        if (r->head == r->tail) {
+            break;
+        }
+        size_t from = r->tail % RING_SIZE;
+        size_t size = r->head - r->tail;
+        size = from + size <= RING_SIZE ? size : RING_SIZE - from;
+        pthread_mutex_unlock(&r->lock);
+        write_all(r->fd, r->buf + from, size);
+        pthread_mutex_lock(&r->lock);
+        r->tail += size;
+        pthread_cond_broadcast(&r->writable);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static void
+push(Ring* r, const char* line, size_t size)
+{
+    pthread_mutex_lock(&r->lock);
+    while (RING_SIZE - (r->head - r->tail) < size) {
+        pthread_cond_wait(&r->writable, &r->lock);
+    }
+    size_t from = r->head % RING_SIZE;
+    size_t n = from + size <= RING_SIZE ? size : RING_SIZE - from;
+    memcpy(r->buf + from, line, n);
+    memcpy(r->buf, line + n, size - n);
+    r->head += size;
+    pthread_cond_signal(&r->readable);
+    pthread_mutex_unlock(&r->lock);
+}
+
+bool
+log_open(const char* ident, const char* dir, const char* session, LogLevel level, int n)
+{
+    openlog(ident, LOG_PID, LOG_LOCAL0);
+    log_level = level;
+    sample = n;
+    if (dir == NULL) {
+        return true;
+    }
+
+    char path[strlen(dir) + strlen(session) + 6];
+    sprintf(path, "%s/%s.log", dir, session);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "open failed: %s: %s\n", strerror(errno), path);
+        return false;
+    }
+    ring = (Ring*)malloc(sizeof(Ring));
+    if (ring == NULL) {
+        fprintf(stderr, "Cannot allocate memory.\n");
+        close(fd);
+        return false;
+    }
+    ring->head = ring->tail = 0;
+    ring->closing = false;
+    ring->fd = fd;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->readable, NULL);
+    pthread_cond_init(&ring->writable, NULL);
+    if (pthread_create(&ring->writer, NULL, drain, ring) != 0) {
+        fprintf(stderr, "pthread_create failed.\n");
+        close(fd);
+        free(ring);
+        ring = NULL;
+        return false;
+    }
+    return true;
+}
+
+void
+log_close()
+{
+    log_sampled = false;
+    if (ring != NULL) {
+        pthread_mutex_lock(&ring->lock);
+        ring->closing = true;
+        pthread_cond_signal(&ring->readable);
+        pthread_mutex_unlock(&ring->lock);
+        pthread_join(ring->writer, NULL);
+        close(ring->fd);
+        pthread_mutex_destroy(&ring->lock);
+        pthread_cond_destroy(&ring->readable);
+        pthread_cond_destroy(&ring->writable);
+        free(ring);
+        ring = NULL;
+    }
+    closelog();
+}
+
+/*
+ * strftime(3) runs only once in a second.
+ */
+static size_t
+format_time(char* buf, size_t size)
+{
+    static time_t last = 0;
+    static char cache[32];
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    if (tv.tv_sec != last) {
+        struct tm tm;
+        localtime_r(&tv.tv_sec, &tm);
+        strftime(cache, sizeof(cache), "%Y-%m-%dT%H:%M:%S", &tm);
+        last = tv.tv_sec;
+    }
+    return snprintf(buf, size, "%s,%03ld", cache, (long)tv.tv_usec / 1000);
+}
+
+static int
+priority_of(LogLevel level)
+{
+    return level == LEVEL_ERROR ? LOG_ERR : LOG_INFO;
+}
+
+void
+log_vwrite(LogLevel level, const char* fmt, va_list ap)
+{
+    if (log_level < level) {
+        return;
+    }
+    if (ring == NULL) {
+        if (level < LEVEL_TRACE) {
+            vsyslog(priority_of(level), fmt, ap);
+        }
+        return;
+    }
+    if (level == LEVEL_ERROR) {
+        va_list aq;
+        va_copy(aq, ap);
+        vsyslog(LOG_ERR, fmt, aq);
+        va_end(aq);
+    }
+
+    char line[LINE_SIZE];
+    size_t len = format_time(line, sizeof(line));
+    const char* name = level_names[level];
+    len += snprintf(line + len, sizeof(line) - len, " %s ", name);
+    size_t rest = sizeof(line) - len - 1;
+    int n = vsnprintf(line + len, rest, fmt, ap);
+    if (0 < n) {
+        len += (size_t)n < rest ? (size_t)n : rest - 1;
+    }
+    line[len] = '\n';
+    push(ring, line, len + 1);
+}
+
+void
+log_write(LogLevel level, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    log_vwrite(level, fmt, ap);
+    va_end(ap);
+}
+
+/*
+ * Decides whether the next command and its responses are traced. Only one in
+ * sample commands is traced.
+ */
+void
+log_sample_next()
+{
+    if ((log_level < LEVEL_TRACE) || (sample <= 0)) {
+        log_sampled = false;
+        return;
+    }
+    log_sampled = num_commands % sample == 0;
+    num_commands++;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
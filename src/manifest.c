@@ -0,0 +1,352 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ubackup/manifest.h>
+
+#define MAGIC "UBACKUP_MANIFEST 1\n"
+#define SIG_LEN 16
+
+/*
+ * The file is the magic line, the base backup name in a line, then records.
+ * A record is "D" path or "E" 16 hex digits of the signature and name, and
+ * terminated with NUL, so that any names can be stored. Entries follow their
+ * directory.
+ */
+struct Manifest {
+    char* data;
+    const char* base;
+    ManifestDir* dirs;
+    size_t num_dirs;
+    ManifestEntry* entries;
+    size_t num_entries;
+};
+
+static void
+print_error(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static char*
+read_file(const char* path, size_t* size)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            print_error("fopen failed: %s: %s", strerror(errno), path);
+        }
+        return NULL;
+    }
+    struct stat sb;
+    char* data = fstat(fileno(fp), &sb) == 0 ? (char*)malloc(sb.st_size + 1) : NULL;
+    if (data == NULL) {
+        print_error("Cannot read %s: %s", path, strerror(errno));
+        fclose(fp);
+        return NULL;
+    }
+    size_t n = fread(data, 1, sb.st_size, fp);
+    fclose(fp);
+    data[n] = '\0';
+    *size = n;
+    return data;
+}
+
+static bool
+parse_sig(uint64_t* dest, const char* s)
+{
+    uint64_t n = 0;
+    int i;
+    for (i = 0; i < SIG_LEN; i++) {
+        char c = s[i];
+        int d = ('0' <= c) && (c <= '9') ? c - '0' : ('a' <= c) && (c <= 'f') ? c - 'a' + 10 : -1;
+        if (d < 0) {
+            return false;
+        }
+        n = 16 * n + d;
+    }
+    *dest = n;
+    return true;
+}
+
+/*
+ * Counts records first if dirs is NULL, and fills them the next time.
+ */
+static bool
+parse_records(Manifest* manifest, char* p, const char* end)
+{
+    size_t num_dirs = 0;
+    size_t num_entries = 0;
+    ManifestDir* dir = NULL;
+    while (p < end) {
+        char type = *p;
+        char* s = p + 1;
+        char* term = (char*)memchr(s, '\0', end - s);
+        if (term == NULL) {
+            return false;
+        }
+        if (type == 'D') {
+            if (manifest->dirs != NULL) {
+                dir = &manifest->dirs[num_dirs];
+                dir->path = s;
+                dir->entries = &manifest->entries[num_entries];
+                dir->num = 0;
+                dir->visited = false;
+            }
+            num_dirs++;
+        }
+        else if ((type == 'E') && (0 < num_dirs) && (SIG_LEN < term - s)) {
+            if (manifest->dirs != NULL) {
+                ManifestEntry* entry = &manifest->entries[num_entries];
+                if (!parse_sig(&entry->sig, s)) {
+                    return false;
+                }
+                entry->name = s + SIG_LEN;
+                entry->seen = false;
+                dir->num++;
+            }
+            num_entries++;
+        }
+        else {
+            return false;
+        }
+        p = term + 1;
+    }
+    manifest->num_dirs = num_dirs;
+    manifest->num_entries = num_entries;
+    return true;
+}
+
+static int
+compare_dirs(const void* p, const void* q)
+{
+    return strcmp(((const ManifestDir*)p)->path, ((const ManifestDir*)q)->path);
+}
+
+static int
+compare_entries(const void* p, const void* q)
+{
+    return strcmp(((const ManifestEntry*)p)->name, ((const ManifestEntry*)q)->name);
+}
+
+/*
+ * Returns NULL if the file does not exist or is broken. A broken manifest is
+ * same as no manifest, because the backupee can always send everything.
+ */
+Manifest*
+manifest_load(const char* path)
+{
+    size_t size;
+    char* data = read_file(path, &size);
+    if (data == NULL) {
+        return NULL;
+    }
+    Manifest* manifest = (Manifest*)calloc(1, sizeof(Manifest));
+    size_t magic_len = strlen(MAGIC);
+    char* base = data + magic_len;
+    char* newline = (size < magic_len) || (memcmp(data, MAGIC, magic_len) != 0) ? NULL : strchr(base, '\n');
+    if ((manifest == NULL) || (newline == NULL)) {
+        print_error("Invalid manifest: %s", path);
+        free(manifest);
+        free(data);
+        return NULL;
+    }
+    *newline = '\0';
+    manifest->data = data;
+    manifest->base = base;
+    char* records = newline + 1;
+    const char* end = data + size;
+    bool parsed = parse_records(manifest, records, end);
+    if (parsed) {
+        manifest->dirs = (ManifestDir*)malloc((manifest->num_dirs + 1) * sizeof(ManifestDir));
+        manifest->entries = (ManifestEntry*)malloc((manifest->num_entries + 1) * sizeof(ManifestEntry));
+        parsed = (manifest->dirs != NULL) && (manifest->entries != NULL) && parse_records(manifest, records, end);
+    }
+    if (!parsed) {
+        print_error("Invalid manifest: %s", path);
+        manifest_destroy(manifest);
+        return NULL;
+    }
+
+    qsort(manifest->dirs, manifest->num_dirs, sizeof(ManifestDir), compare_dirs);
+    size_t i;
+    for (i = 0; i < manifest->num_dirs; i++) {
+        ManifestDir* dir = &manifest->dirs[i];
+        qsort(dir->entries, dir->num, sizeof(ManifestEntry), compare_entries);
+    }
+    return manifest;
+}
+
+void
+manifest_destroy(Manifest* manifest)
+{
+    free(manifest->entries);
+    free(manifest->dirs);
+    free(manifest->data);
+    free(manifest);
+}
+
+const char*
+manifest_base(const Manifest* manifest)
+{
+    return manifest->base;
+}
+
+ManifestDir*
+manifest_find_dir(Manifest* manifest, const char* path)
+{
+    ManifestDir key;
+    key.path = path;
+    size_t num = manifest->num_dirs;
+    return (ManifestDir*)bsearch(&key, manifest->dirs, num, sizeof(ManifestDir), compare_dirs);
+}
+
+ManifestEntry*
+manifest_find_entry(ManifestDir* dir, const char* name)
+{
+    ManifestEntry key;
+    key.name = name;
+    size_t size = sizeof(ManifestEntry);
+    return (ManifestEntry*)bsearch(&key, dir->entries, dir->num, size, compare_entries);
+}
+
+/*
+ * Marks path and all directories under it, whose records are written again.
+ */
+void
+manifest_mark_visited(Manifest* manifest, const char* path)
+{
+    size_t len = strlen(path);
+    size_t i;
+    for (i = 0; i < manifest->num_dirs; i++) {
+        ManifestDir* dir = &manifest->dirs[i];
+        const char* s = dir->path;
+        bool under = (strncmp(s, path, len) == 0) && ((s[len] == '\0') || (s[len] == '/'));
+        dir->visited = dir->visited || under;
+    }
+}
+
+static void
+write_record(ManifestWriter* writer, const char* fmt, ...)
+{
+    if (writer->fp == NULL) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vfprintf(writer->fp, fmt, ap);
+    va_end(ap);
+    writer->failed = writer->failed || (n < 0) || (fputc('\0', writer->fp) == EOF);
+}
+
+bool
+manifest_writer_open(ManifestWriter* writer, const char* path, const char* base)
+{
+    writer->fp = NULL;
+    writer->failed = false;
+    writer->path = strdup(path);
+    size_t size = strlen(path) + strlen(".tmp") + 1;
+    writer->tmp_path = (char*)malloc(size);
+    if ((writer->path == NULL) || (writer->tmp_path == NULL)) {
+        print_error("Cannot allocate memory for a manifest.");
+        manifest_writer_abort(writer);
+        return false;
+    }
+    snprintf(writer->tmp_path, size, "%s.tmp", path);
+    writer->fp = fopen(writer->tmp_path, "w");
+    if (writer->fp == NULL) {
+        print_error("fopen failed: %s: %s", strerror(errno), writer->tmp_path);
+        manifest_writer_abort(writer);
+        return false;
+    }
+    fprintf(writer->fp, "%s%s\n", MAGIC, base);
+    return true;
+}
+
+void
+manifest_write_dir(ManifestWriter* writer, const char* path)
+{
+    write_record(writer, "D%s", path);
+}
+
+void
+manifest_write_entry(ManifestWriter* writer, const char* name, uint64_t sig)
+{
+    write_record(writer, "E%016llx%s", (unsigned long long)sig, name);
+}
+
+/*
+ * Copies directories which this backup did not visit from the old manifest.
+ */
+void
+manifest_write_unvisited(ManifestWriter* writer, const Manifest* manifest)
+{
+    size_t i;
+    for (i = 0; i < manifest->num_dirs; i++) {
+        const ManifestDir* dir = &manifest->dirs[i];
+        if (dir->visited) {
+            continue;
+        }
+        manifest_write_dir(writer, dir->path);
+        size_t j;
+        for (j = 0; j < dir->num; j++) {
+            manifest_write_entry(writer, dir->entries[j].name, dir->entries[j].sig);
+        }
+    }
+}
+
+bool
+manifest_writer_commit(ManifestWriter* writer)
+{
+    if (writer->fp == NULL) {
+        return false;
+    }
+    bool failed = writer->failed || (fflush(writer->fp) != 0) || (fsync(fileno(writer->fp)) != 0);
+    failed = (fclose(writer->fp) != 0) || failed;
+    writer->fp = NULL;
+    if (failed || (rename(writer->tmp_path, writer->path) != 0)) {
+        print_error("Cannot write a manifest: %s: %s", strerror(errno), writer->path);
+        manifest_writer_abort(writer);
+        return false;
+    }
+    free(writer->path);
+    free(writer->tmp_path);
+    writer->path = writer->tmp_path = NULL;
+    return true;
+}
+
+/*
+ * The old manifest is removed too, because it does not describe the latest
+ * backup any more.
+ */
+void
+manifest_writer_abort(ManifestWriter* writer)
+{
+    if (writer->fp != NULL) {
+        fclose(writer->fp);
+        writer->fp = NULL;
+    }
+    if (writer->tmp_path != NULL) {
+        unlink(writer->tmp_path);
+    }
+    if (writer->path != NULL) {
+        unlink(writer->path);
+    }
+    free(writer->path);
+    free(writer->tmp_path);
+    writer->path = writer->tmp_path = NULL;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
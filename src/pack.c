@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ubackup/arena.h>
+#include <ubackup/hash.h>
+#include <ubackup/pack.h>
+
+#define INITIAL_SLOTS 64
+#define EMPTY SIZE_MAX
+
+bool
+pack_record_write(FILE* fp, const PackRecord* record)
+{
+    const char* fmt = "%016" PRIx64 " %" PRIu64 " %" PRIu64 " %" PRId64 ".%09ld %s %s";
+    int n = fprintf(fp, fmt, record->hash, record->offset, record->length,
+                    (int64_t)record->mtime.tv_sec, record->mtime.tv_nsec, record->pack,
+                    record->name);
+    return (0 <= n) && (fputc('\0', fp) != EOF);
+}
+
+static bool
+parse_number(uint64_t* dest, char** p, int base, char terminator)
+{
+    char* end;
+    *dest = strtoull(*p, &end, base);
+    if ((end == *p) || (*end != terminator)) {
+        return false;
+    }
+    *p = end + 1;
+    return true;
+}
+
+/*
+ * record->pack and record->name point into *buf, which is reused for the next
+ * record. Broken records are skipped.
+ */
+bool
+pack_record_read(FILE* fp, PackRecord* record, char** buf, size_t* bufsize)
+{
+    while (getdelim(buf, bufsize, '\0', fp) != -1) {
+        char* p = *buf;
+        uint64_t sec, nsec;
+        bool ok = parse_number(&record->hash, &p, 16, ' ')
+            && parse_number(&record->offset, &p, 10, ' ')
+            && parse_number(&record->length, &p, 10, ' ')
+            && parse_number(&sec, &p, 10, '.')
+            && parse_number(&nsec, &p, 10, ' ');
+        char* space = ok ? strchr(p, ' ') : NULL;
+        if (space == NULL) {
+            continue;
+        }
+        *space = '\0';
+        record->mtime.tv_sec = sec;
+        record->mtime.tv_nsec = nsec;
+        record->pack = p;
+        record->name = space + 1;
+        return true;
+    }
+    return false;
+}
+
+static size_t*
+find_slot(const PackIndex* index, size_t* slots, size_t num_slots, const char* name)
+{
+    size_t i = hash_name(name) & (num_slots - 1);
+    while ((slots[i] != EMPTY) && (strcmp(index->records[slots[i]].name, name) != 0)) {
+        i = (i + 1) & (num_slots - 1);
+    }
+    return &slots[i];
+}
+
+static bool
+alloc_slots(PackIndex* index, size_t num_slots)
+{
+    size_t* slots = (size_t*)malloc(num_slots * sizeof(size_t));
+    if (slots == NULL) {
+        return false;
+    }
+    memset(slots, 0xff, num_slots * sizeof(size_t));
+    size_t i;
+    for (i = 0; i < index->num; i++) {
+        *find_slot(index, slots, num_slots, index->records[i].name) = i;
+    }
+    free(index->slots);
+    index->slots = slots;
+    index->num_slots = num_slots;
+    return true;
+}
+
+bool
+pack_index_init(PackIndex* index)
+{
+    index->records = NULL;
+    index->num = index->capacity = 0;
+    index->slots = NULL;
+    if (!arena_init(&index->arena, 16 * 1024)) {
+        return false;
+    }
+    if (!alloc_slots(index, INITIAL_SLOTS)) {
+        arena_destroy(&index->arena);
+        return false;
+    }
+    return true;
+}
+
+void
+pack_index_destroy(PackIndex* index)
+{
+    arena_destroy(&index->arena);
+    free(index->records);
+    free(index->slots);
+}
+
+void
+pack_index_clear(PackIndex* index)
+{
+    if (index->num == 0) {
+        return;
+    }
+    arena_reset(&index->arena);
+    index->num = 0;
+    if ((index->num_slots == INITIAL_SLOTS) || !alloc_slots(index, INITIAL_SLOTS)) {
+        memset(index->slots, 0xff, index->num_slots * sizeof(size_t));
+    }
+}
+
+static char*
+copy_string(Arena* arena, const char* s)
+{
+    size_t size = strlen(s) + 1;
+    char* t = (char*)arena_alloc(arena, size);
+    if (t != NULL) {
+        memcpy(t, s, size);
+    }
+    return t;
+}
+
+/*
+ * A later record of the same name replaces the earlier one.
+ */
+static bool
+add_record(PackIndex* index, const PackRecord* record)
+{
+    if ((index->num_slots <= 2 * (index->num + 1)) && !alloc_slots(index, 2 * index->num_slots)) {
+        return false;
+    }
+    if (index->num == index->capacity) {
+        size_t capacity = index->capacity == 0 ? 16 : 2 * index->capacity;
+        PackRecord* records = (PackRecord*)realloc(index->records, capacity * sizeof(PackRecord));
+        if (records == NULL) {
+            return false;
+        }
+        index->records = records;
+        index->capacity = capacity;
+    }
+    PackRecord* r = &index->records[index->num];
+    *r = *record;
+    r->pack = copy_string(&index->arena, record->pack);
+    r->name = copy_string(&index->arena, record->name);
+    if ((r->pack == NULL) || (r->name == NULL)) {
+        return false;
+    }
+    size_t* slot = find_slot(index, index->slots, index->num_slots, r->name);
+    if (*slot != EMPTY) {
+        index->records[*slot] = *r;
+        return true;
+    }
+    *slot = index->num;
+    index->num++;
+    return true;
+}
+
+/*
+ * Reads PACK_INDEX in meta_fd. A missing index is an empty one.
+ */
+bool
+pack_index_load(PackIndex* index, int meta_fd)
+{
+    pack_index_clear(index);
+    int fd = openat(meta_fd, PACK_INDEX, O_RDONLY);
+    FILE* fp = fd != -1 ? fdopen(fd, "r") : NULL;
+    if (fp == NULL) {
+        bool missing = errno == ENOENT;
+        if (fd != -1) {
+            close(fd);
+        }
+        return missing;
+    }
+    char* buf = NULL;
+    size_t bufsize = 0;
+    PackRecord record;
+    bool ok = true;
+    while (ok && pack_record_read(fp, &record, &buf, &bufsize)) {
+        ok = add_record(index, &record);
+    }
+    free(buf);
+    fclose(fp);
+    return ok;
+}
+
+const PackRecord*
+pack_index_find(const PackIndex* index, const char* name)
+{
+    size_t i = *find_slot(index, index->slots, index->num_slots, name);
+    return i != EMPTY ? &index->records[i] : NULL;
+}
+
+void
+pack_writer_init(PackWriter* writer, int dirfd, const char* prefix)
+{
+    writer->dirfd = dirfd;
+    snprintf(writer->prefix, sizeof(writer->prefix), "%s", prefix);
+    writer->seq = 0;
+    writer->fd = -1;
+    writer->name[0] = '\0';
+    writer->size = 0;
+}
+
+static bool
+open_next(PackWriter* writer)
+{
+    pack_writer_close(writer);
+    snprintf(writer->name, sizeof(writer->name), "%s.%u", writer->prefix, writer->seq);
+    int flags = O_WRONLY | O_CREAT | O_EXCL | O_APPEND;
+    writer->fd = openat(writer->dirfd, writer->name, flags, 0444);
+    if (writer->fd == -1) {
+        return false;
+    }
+    writer->seq++;
+    writer->size = 0;
+    return true;
+}
+
+/*
+ * Sets the offset of the data in writer->name. A failed write is truncated, so
+ * the next one starts at the known size.
+ */
+bool
+pack_writer_append(PackWriter* writer, const void* data, size_t size, off_t* offset)
+{
+    bool full = PACK_MAX_SIZE < writer->size + (off_t)size;
+    if (((writer->fd == -1) || full) && !open_next(writer)) {
+        return false;
+    }
+    const char* p = (const char*)data;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(writer->fd, p + written, size - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int e = errno;
+            ftruncate(writer->fd, writer->size);
+            errno = e;
+            return false;
+        }
+        written += n;
+    }
+    *offset = writer->size;
+    writer->size += size;
+    return true;
+}
+
+void
+pack_writer_close(PackWriter* writer)
+{
+    if (writer->fd != -1) {
+        close(writer->fd);
+    }
+    writer->fd = -1;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,265 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ubackup/phase.h>
+
+static const char* names[] = {
+    "scan",
+    "stat",
+    "open",
+    "query",
+    "body",
+    "mkdir",
+    "link",
+    "meta",
+    "remove_old" };
+
+uint64_t
+phase_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bucket_of(uint64_t ns)
+{
+    int n = 0;
+    while ((ns != 0) && (n < PHASE_NUM_BUCKETS - 1)) {
+        ns >>= 1;
+        n++;
+    }
+    return n;
+}
+
+void
+phase_record(Phases* phases, Phase phase, uint64_t start)
+{
+    uint64_t now = phase_now();
+    uint64_t ns = start < now ? now - start : 0;
+    Histogram* h = &phases->histograms[phase];
+    h->count++;
+    h->sum += ns;
+    h->max = h->max < ns ? ns : h->max;
+    h->buckets[bucket_of(ns)]++;
+}
+
+/*
+ * Adds histograms of src, which threads record on their own, into dest.
+ */
+void
+phase_merge(Phases* dest, const Phases* src)
+{
+    int i;
+    for (i = 0; i < PHASE_NUM; i++) {
+        Histogram* d = &dest->histograms[i];
+        const Histogram* s = &src->histograms[i];
+        d->count += s->count;
+        d->sum += s->sum;
+        d->max = d->max < s->max ? s->max : d->max;
+        int j;
+        for (j = 0; j < PHASE_NUM_BUCKETS; j++) {
+            d->buckets[j] += s->buckets[j];
+        }
+    }
+}
+
+static int
+find_phase(const char* name, size_t len)
+{
+    int i;
+    for (i = 0; i < PHASE_NUM; i++) {
+        if ((strncmp(names[i], name, len) == 0) && (names[i][len] == '\0')) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Encodes into one line of "name:count:sum:max:first:bucket,...;..." for the
+ * protocol. Only non-zero buckets from the first one are written.
+ */
+void
+phase_encode(const Phases* phases, char* buf, size_t size)
+{
+    char* p = buf;
+    char* end = buf + size;
+    *p = '\0';
+    int i;
+    for (i = 0; i < PHASE_NUM; i++) {
+        const Histogram* h = &phases->histograms[i];
+        if (h->count == 0) {
+            continue;
+        }
+        int first = 0;
+        while (h->buckets[first] == 0) {
+            first++;
+        }
+        int last = PHASE_NUM_BUCKETS - 1;
+        while (h->buckets[last] == 0) {
+            last--;
+        }
+        const char* fmt = "%s:%" PRIu64 ":%" PRIu64 ":%" PRIu64 ":%d:";
+        p += snprintf(p, end - p, fmt, names[i], h->count, h->sum, h->max, first);
+        int j;
+        for (j = first; (j <= last) && (p < end); j++) {
+            const char* sep = j == last ? ";" : ",";
+            p += snprintf(p, end - p, "%" PRIu64 "%s", h->buckets[j], sep);
+        }
+        if (end <= p) {
+            buf[0] = '\0';
+            return;
+        }
+    }
+}
+
+static bool
+parse_uint64(uint64_t* dest, const char** p, char sep)
+{
+    char* end;
+    *dest = strtoull(*p, &end, 10);
+    if ((end == *p) || (*end != sep)) {
+        return false;
+    }
+    *p = end + 1;
+    return true;
+}
+
+bool
+phase_decode(Phases* phases, const char* s)
+{
+    memset(phases, 0, sizeof(*phases));
+    const char* p = s;
+    while (*p != '\0') {
+        const char* colon = strchr(p, ':');
+        if (colon == NULL) {
+            return false;
+        }
+        int phase = find_phase(p, colon - p);
+        Histogram h;
+        memset(&h, 0, sizeof(h));
+        p = colon + 1;
+        uint64_t first;
+        if (!parse_uint64(&h.count, &p, ':') || !parse_uint64(&h.sum, &p, ':')) {
+            return false;
+        }
+        if (!parse_uint64(&h.max, &p, ':') || !parse_uint64(&first, &p, ':')) {
+            return false;
+        }
+        uint64_t i = first;
+        bool done = false;
+        while (!done) {
+            char* end;
+            uint64_t n = strtoull(p, &end, 10);
+            if ((end == p) || ((*end != ',') && (*end != ';'))) {
+                return false;
+            }
+            if (i < PHASE_NUM_BUCKETS) {
+                h.buckets[i] = n;
+            }
+            i++;
+            done = *end == ';';
+            p = end + 1;
+        }
+        if (0 <= phase) {
+            memcpy(&phases->histograms[phase], &h, sizeof(h));
+        }
+    }
+    return true;
+}
+
+static double
+to_sec(uint64_t ns)
+{
+    return ns / 1e9;
+}
+
+static double
+upper_bound_of(int bucket)
+{
+    return to_sec((uint64_t)1 << bucket);
+}
+
+void
+phase_print_text(FILE* fp, const char* side, const Phases* phases)
+{
+    int i;
+    for (i = 0; i < PHASE_NUM; i++) {
+        const Histogram* h = &phases->histograms[i];
+        if (h->count == 0) {
+            continue;
+        }
+        double sum = to_sec(h->sum);
+        const char* fmt = "Phase %s/%s: %" PRIu64 "[times] %.3f[sec] (average %.1f[usec], max %.1f[usec])\n";
+        double avg = 1e6 * sum / h->count;
+        fprintf(fp, fmt, side, names[i], h->count, sum, avg, h->max / 1e3);
+    }
+}
+
+void
+phase_print_json(FILE* fp, const char* side, const Phases* phases)
+{
+    fprintf(fp, "\"%s\": {", side);
+    const char* sep = "";
+    int i;
+    for (i = 0; i < PHASE_NUM; i++) {
+        const Histogram* h = &phases->histograms[i];
+        if (h->count == 0) {
+            continue;
+        }
+        const char* fmt = "%s\"%s\": {\"count\": %" PRIu64 ", \"sum_seconds\": %.9f, \"max_seconds\": %.9f, \"buckets\": [";
+        fprintf(fp, fmt, sep, names[i], h->count, to_sec(h->sum), to_sec(h->max));
+        sep = ", ";
+        const char* bucket_sep = "";
+        uint64_t n = 0;
+        int j;
+        for (j = 0; j < PHASE_NUM_BUCKETS; j++) {
+            if (h->buckets[j] == 0) {
+                continue;
+            }
+            n += h->buckets[j];
+            const char* fmt = "%s{\"le\": %g, \"count\": %" PRIu64 "}";
+            fprintf(fp, fmt, bucket_sep, upper_bound_of(j), n);
+            bucket_sep = ", ";
+        }
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "}");
+}
+
+void
+phase_print_prometheus(FILE* fp, const char* side, const Phases* phases)
+{
+    int i;
+    for (i = 0; i < PHASE_NUM; i++) {
+        const Histogram* h = &phases->histograms[i];
+        if (h->count == 0) {
+            continue;
+        }
+        const char* name = "ubackup_phase_seconds";
+        const char* labels = "side=\"%s\",phase=\"%s\"";
+        char buf[128];
+        snprintf(buf, sizeof(buf), labels, side, names[i]);
+        uint64_t n = 0;
+        int j;
+        for (j = 0; j < PHASE_NUM_BUCKETS - 1; j++) {
+            n += h->buckets[j];
+            const char* fmt = "%s_bucket{%s,le=\"%g\"} %" PRIu64 "\n";
+            fprintf(fp, fmt, name, buf, upper_bound_of(j), n);
+        }
+        fprintf(fp, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n", name, buf, h->count);
+        fprintf(fp, "%s_sum{%s} %.9f\n", name, buf, to_sec(h->sum));
+        fprintf(fp, "%s_count{%s} %" PRIu64 "\n", name, buf, h->count);
+    }
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ubackup/phase.h>
+#include <ubackup/progress.h>
+
+#define NANO 1000000000
+
+static bool
+is_stderr(const char* path)
+{
+    return strcmp(path, "-") == 0;
+}
+
+/*
+ * Totals of the previous run are taken from the last line of the status file,
+ * which progress_finish() leaves.
+ */
+static void
+read_previous(Progress* progress)
+{
+    FILE* fp = fopen(progress->path, "r");
+    if (fp == NULL) {
+        return;
+    }
+    char buf[4096];
+    if (fgets(buf, sizeof(buf), fp) != NULL) {
+        const char* fmt = "done entries=%" SCNu64 " bytes=%" SCNu64;
+        uint64_t entries;
+        uint64_t bytes;
+        if (sscanf(buf, fmt, &entries, &bytes) == 2) {
+            progress->prev_entries = entries;
+            progress->prev_bytes = bytes;
+        }
+    }
+    fclose(fp);
+}
+
+void
+progress_init(Progress* progress, const char* path, int interval)
+{
+    progress->path = path;
+    progress->interval = (uint64_t)interval * NANO;
+    progress->start = progress->last = phase_now();
+    progress->ticks = 0;
+    progress->prev_entries = progress->prev_bytes = 0;
+    if ((path != NULL) && !is_stderr(path)) {
+        read_previous(progress);
+    }
+}
+
+static void
+write_status(Progress* progress, const char* line)
+{
+    if (is_stderr(progress->path)) {
+        fprintf(stderr, "%s\n", line);
+        return;
+    }
+    const char* path = progress->path;
+    char tmp[strlen(path) + 5];
+    sprintf(tmp, "%s.tmp", path);
+    FILE* fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen failed: %s: %s\n", strerror(errno), tmp);
+        return;
+    }
+    fprintf(fp, "%s\n", line);
+    fclose(fp);
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "rename failed: %s: %s\n", strerror(errno), tmp);
+    }
+}
+
+static void
+format_eta(char* buf, size_t size, uint64_t rest, double rate)
+{
+    if ((rest == 0) || (rate <= 0)) {
+        snprintf(buf, size, "-");
+        return;
+    }
+    snprintf(buf, size, "%.0f", rest / rate);
+}
+
+void
+progress_report(Progress* progress, uint64_t entries, uint64_t bytes, const char* path)
+{
+    uint64_t now = phase_now();
+    if (now - progress->last < progress->interval) {
+        return;
+    }
+    progress->last = now;
+    double elapsed = (double)(now - progress->start) / NANO;
+    double files_per_sec = entries / elapsed;
+    double bytes_per_sec = bytes / elapsed;
+    uint64_t prev = progress->prev_entries;
+    char eta[32];
+    format_eta(eta, sizeof(eta), entries < prev ? prev - entries : 0, files_per_sec);
+    char line[4096 + 256];
+    const char* fmt = "running entries=%" PRIu64 " bytes=%" PRIu64 " files/s=%.0f bytes/s=%.0f elapsed=%.0f eta=%s path=%s";
+    snprintf(line, sizeof(line), fmt, entries, bytes, files_per_sec, bytes_per_sec, elapsed, eta, path);
+    write_status(progress, line);
+}
+
+void
+progress_finish(Progress* progress, uint64_t entries, uint64_t bytes)
+{
+    if (progress->path == NULL) {
+        return;
+    }
+    double elapsed = (double)(phase_now() - progress->start) / NANO;
+    char line[256];
+    const char* fmt = "done entries=%" PRIu64 " bytes=%" PRIu64 " elapsed=%.0f";
+    snprintf(line, sizeof(line), fmt, entries, bytes, elapsed);
+    write_status(progress, line);
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
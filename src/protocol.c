@@ -0,0 +1,381 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <ubackup/arena.h>
+#include <ubackup/protocol.h>
+#include <ubackup/timestamp.h>
+
+/*
+ * Names of commands are looked up by their first and last characters and
+ * lengths, which no two commands share in a table of COMMAND_SLOTS.
+ */
+#define COMMAND_SLOTS 32
+#define HASH_COMMAND(first, last, len) \
+    ((2 * (first) + 16 * (last) + 7 * (len)) & (COMMAND_SLOTS - 1))
+
+struct CommandName {
+    const char* name;
+    size_t len;
+    Type type;
+};
+
+typedef struct CommandName CommandName;
+
+#define COMMAND(name, first, last, type) \
+    [HASH_COMMAND(first, last, sizeof(name) - 1)] = { name, sizeof(name) - 1, type }
+
+static const CommandName commands[COMMAND_SLOTS] = {
+    COMMAND("BODY", 'B', 'Y', CMD_BODY),
+    COMMAND("BODY_END", 'B', 'D', CMD_BODY_END),
+    COMMAND("BODY_PART", 'B', 'T', CMD_BODY_PART),
+    COMMAND("CWD", 'C', 'D', CMD_CWD),
+    COMMAND("DELETE", 'D', 'E', CMD_DELETE),
+    COMMAND("DIFF", 'D', 'F', CMD_DIFF),
+    COMMAND("DIGEST", 'D', 'T', CMD_DIGEST),
+    COMMAND("DIR", 'D', 'R', CMD_DIR),
+    COMMAND("DISCARD", 'D', 'D', CMD_DISCARD),
+    COMMAND("DISK_TOTAL", 'D', 'L', CMD_DISK_TOTAL),
+    COMMAND("DISK_USAGE", 'D', 'E', CMD_DISK_USAGE),
+    COMMAND("ENDDIR", 'E', 'R', CMD_ENDDIR),
+    COMMAND("FILE", 'F', 'E', CMD_FILE),
+    COMMAND("NAME", 'N', 'E', CMD_NAME),
+    COMMAND("OPEN_BODY", 'O', 'Y', CMD_OPEN_BODY),
+    COMMAND("PHASES", 'P', 'S', CMD_PHASES),
+    COMMAND("REMOVE_OLD", 'R', 'D', CMD_REMOVE_OLD),
+    COMMAND("SAVE_DIGEST", 'S', 'T', CMD_SAVE_DIGEST),
+    COMMAND("STREAM", 'S', 'M', CMD_STREAM),
+    COMMAND("SYMLINK", 'S', 'K', CMD_SYMLINK),
+    COMMAND("THANK_YOU", 'T', 'U', CMD_THANK_YOU) };
+
+static bool
+is_command_char(char c)
+{
+    return ((unsigned int)((c | 0x20) - 'a') < 26) || (c == '_');
+}
+
+static bool
+is_digit(char c, unsigned int base)
+{
+    return (unsigned int)(c - '0') < base;
+}
+
+static void
+skip_whitespace(char** p)
+{
+    while ((**p == ' ') || (**p == '\t')) {
+        (*p)++;
+    }
+}
+
+static int
+parse_type(Type* type, char** p)
+{
+    const char* from = *p;
+    char* q = *p;
+    while (is_command_char(*q)) {
+        q++;
+    }
+    *p = q;
+    size_t len = q - from;
+    if (len == 0) {
+        return 1;
+    }
+    unsigned char first = from[0];
+    unsigned char last = q[-1];
+    const CommandName* command = &commands[HASH_COMMAND(first, last, len)];
+    if ((command->len != len) || (memcmp(command->name, from, len) != 0)) {
+        return 1;
+    }
+    *type = command->type;
+    return 0;
+}
+
+static int
+parse_mode(mode_t* dest, char** p)
+{
+    skip_whitespace(p);
+
+    mode_t mode = 0;
+    while (is_digit(**p, 8)) {
+        mode = 8 * mode + **p - '0';
+        (*p)++;
+    }
+    *dest = mode;
+    return 0;
+}
+
+#define IMPLEMENT_PARSE_X(name, type, max) \
+    static int \
+    name(type* dest, char** p) \
+    { \
+        skip_whitespace(p); \
+\
+        unsigned long l = 0; \
+        while (is_digit(**p, 10)) { \
+            l = 10 * l + **p - '0'; \
+            (*p)++; \
+        } \
+        assert(l < max); \
+        *dest = (type)l; \
+        return 0; \
+    }
+IMPLEMENT_PARSE_X(parse_decimal, size_t, ULONG_MAX)
+IMPLEMENT_PARSE_X(parse_integer, unsigned int, UINT_MAX)
+
+/*
+ * The unquoted string is never longer than the quoted one, so it is unescaped
+ * over itself. Runs between escapes are found by strcspn(3), which libc scans
+ * many bytes at a time.
+ */
+static int
+parse_string(Slice* dest, char** p)
+{
+    skip_whitespace(p);
+    if (**p != '\"') {
+        return 1;
+    }
+    char* s = *p + 1;
+    char* q = s;
+    const char* r = s;
+    while (true) {
+        size_t n = strcspn(r, "\"\\");
+        if (q != r) {
+            memmove(q, r, n);
+        }
+        q += n;
+        r += n;
+        if ((*r != '\\') || (r[1] == '\0')) {
+            break;
+        }
+        *q = r[1];
+        q++;
+        r += 2;
+    }
+    if (*r != '\"') {
+        return 1;
+    }
+    *q = '\0';
+    dest->ptr = s;
+    dest->len = q - s;
+    *p = (char*)r + 1;
+    return 0;
+}
+
+static int
+parse_timestamp(Timestamp* dest, char** p)
+{
+    skip_whitespace(p);
+    const char* q = *p;
+    if (!timestamp_decode(dest, &q)) {
+        return 1;
+    }
+    *p += q - *p;
+    return 0;
+}
+
+static int
+parse_body(Command* cmd, char* params)
+{
+    char* p = params;
+    return parse_decimal(&cmd->u.body.size, &p);
+}
+
+static int
+parse_stream(Command* cmd, char* params)
+{
+    char* p = params;
+    return parse_integer(&cmd->u.stream.id, &p);
+}
+
+static int
+parse_digest(Command* cmd, char* params)
+{
+    char* p = params;
+    skip_whitespace(&p);
+    size_t len = strcspn(p, " \t\n\v\f\r");
+    if (len == 0) {
+        return 1;
+    }
+    p[len] = '\0';
+    cmd->u.digest.value.ptr = p;
+    cmd->u.digest.value.len = len;
+    return 0;
+}
+
+static int
+parse_cwd(Command* cmd, char* params)
+{
+    char* p = params;
+    return parse_string(&cmd->u.cwd.path, &p);
+}
+
+static int
+parse_delete(Command* cmd, char* params)
+{
+    char* p = params;
+    return parse_string(&cmd->u.del.name, &p);
+}
+
+static int
+parse_diff(Command* cmd, char* params)
+{
+    char* p = params;
+    return parse_string(&cmd->u.diff.base, &p);
+}
+
+static int
+parse_symlink(Command* cmd, char* params)
+{
+    char* p = params;
+    if (parse_string(&cmd->u.symlink.path, &p) != 0) {
+        return 1;
+    }
+    if (parse_mode(&cmd->u.symlink.mode, &p) != 0) {
+        return 1;
+    }
+    if (parse_integer(&cmd->u.symlink.uid, &p) != 0) {
+        return 1;
+    }
+    if (parse_integer(&cmd->u.symlink.gid, &p) != 0) {
+        return 1;
+    }
+    if (parse_timestamp(&cmd->u.symlink.ctime, &p) != 0) {
+        return 1;
+    }
+    if (parse_string(&cmd->u.symlink.src, &p) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+static int
+parse_file(Command* cmd, char* params)
+{
+    char* p = params;
+    if (parse_string(&cmd->u.file.path, &p) != 0) {
+        return 1;
+    }
+    if (parse_mode(&cmd->u.file.mode, &p) != 0) {
+        return 1;
+    }
+    if (parse_integer(&cmd->u.file.uid, &p) != 0) {
+        return 1;
+    }
+    if (parse_integer(&cmd->u.file.gid, &p) != 0) {
+        return 1;
+    }
+    if (parse_timestamp(&cmd->u.file.mtime, &p) != 0) {
+        return 1;
+    }
+    if (parse_timestamp(&cmd->u.file.ctime, &p) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+static int
+parse_dir(Command* cmd, char* params)
+{
+    char* p = params;
+    if (parse_string(&cmd->u.dir.path, &p) != 0) {
+        return 1;
+    }
+    if (parse_mode(&cmd->u.dir.mode, &p) != 0) {
+        return 1;
+    }
+    if (parse_integer(&cmd->u.dir.uid, &p) != 0) {
+        return 1;
+    }
+    if (parse_integer(&cmd->u.dir.gid, &p) != 0) {
+        return 1;
+    }
+    if (parse_timestamp(&cmd->u.dir.ctime, &p) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Parses line in place. Strings of cmd point into line, so they live as long
+ * as it.
+ */
+int
+protocol_parse(Command* cmd, char* line)
+{
+    char* p = line;
+    if (parse_type(&cmd->type, &p) != 0) {
+        return 1;
+    }
+    switch (cmd->type) {
+    case CMD_BODY:
+    case CMD_BODY_PART:
+    case CMD_OPEN_BODY:
+        return parse_body(cmd, p);
+    case CMD_CWD:
+        return parse_cwd(cmd, p);
+    case CMD_DELETE:
+        return parse_delete(cmd, p);
+    case CMD_DIFF:
+        return parse_diff(cmd, p);
+    case CMD_DIGEST:
+    case CMD_SAVE_DIGEST:
+        return parse_digest(cmd, p);
+    case CMD_DIR:
+        return parse_dir(cmd, p);
+    case CMD_FILE:
+        return parse_file(cmd, p);
+    case CMD_STREAM:
+        return parse_stream(cmd, p);
+    case CMD_SYMLINK:
+        return parse_symlink(cmd, p);
+    case CMD_BODY_END:
+    case CMD_DISCARD:
+    case CMD_DISK_TOTAL:
+    case CMD_DISK_USAGE:
+    case CMD_ENDDIR:
+    case CMD_NAME:
+    case CMD_PHASES:
+    case CMD_REMOVE_OLD:
+    case CMD_THANK_YOU:
+        return 0;
+    default:
+        break;
+    }
+    return 1;
+}
+
+/*
+ * Writes path in double quotes, escaping '"' and '\\'. dest must have
+ * 2 * strlen(path) + 3 bytes.
+ */
+void
+protocol_quote(char* dest, const char* path)
+{
+    char* q = dest;
+    *q = '\"';
+    q++;
+
+    const char* p = path;
+    while (true) {
+        size_t n = strcspn(p, "\"\\");
+        memcpy(q, p, n);
+        q += n;
+        p += n;
+        if (*p == '\0') {
+            break;
+        }
+        q[0] = '\\';
+        q[1] = *p;
+        q += 2;
+        p++;
+    }
+    strcpy(q, "\"");
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,87 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include <ubackup/catalog.h>
+#include <ubackup/retention.h>
+#include <ubackup/timestamp.h>
+
+#define BUCKET_SIZE 32
+
+/*
+ * Backups are named with the local time, so that buckets are in the local
+ * time too. Weeks start on Monday.
+ */
+static bool
+find_bucket(char* dest, RetentionRule rule, const char* name)
+{
+    static const char* formats[] = { "%Y-%m-%dT%H", "%Y-%m-%d", "%G-W%V", "%Y-%m" };
+    const char* p = name;
+    time_t t;
+    if (!timestamp_parse_iso8601(&t, &p)) {
+        return false;
+    }
+    struct tm tm;
+    if (localtime_r(&t, &tm) == NULL) {
+        return false;
+    }
+    return strftime(dest, BUCKET_SIZE, formats[rule], &tm) != 0;
+}
+
+static void
+select_by_rule(const Catalog* catalog, const char* newest, RetentionRule rule, size_t count,
+               bool* keep)
+{
+    char last[BUCKET_SIZE] = "";
+    if ((newest != NULL) && (0 < count) && find_bucket(last, rule, newest)) {
+        count--;
+    }
+    size_t i = catalog->num;
+    while ((0 < count) && (0 < i)) {
+        i--;
+        const CatalogEntry* entry = &catalog->entries[i];
+        char bucket[BUCKET_SIZE];
+        if (entry->status != CATALOG_COMMITTED) {
+            continue;
+        }
+        if (!find_bucket(bucket, rule, entry->name) || (strcmp(bucket, last) == 0)) {
+            continue;
+        }
+        keep[i] = true;
+        strcpy(last, bucket);
+        count--;
+    }
+}
+
+/*
+ * Marks backups in catalog to keep. newest is the name of a new backup which
+ * is not in the catalog yet, or NULL. It is never removed, so it takes the
+ * first place of keep and of each rule. Pending sessions are kept, and they do
+ * not take places.
+ */
+void
+retention_select(const RetentionPolicy* policy, const Catalog* catalog, const char* newest,
+                 bool* keep)
+{
+    size_t taken = newest != NULL ? 1 : 0;
+    size_t i = catalog->num;
+    while (0 < i) {
+        i--;
+        if (catalog->entries[i].status == CATALOG_PENDING) {
+            keep[i] = true;
+            continue;
+        }
+        taken++;
+        keep[i] = taken <= policy->keep;
+    }
+    int rule;
+    for (rule = 0; rule < RETENTION_NUM_RULES; rule++) {
+        size_t count = policy->counts[rule];
+        select_by_rule(catalog, newest, (RetentionRule)rule, count, keep);
+    }
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
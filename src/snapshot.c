@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#if defined(__linux__)
+#include <linux/btrfs.h>
+#endif
+
+#include <ubackup/snapshot.h>
+
+#if defined(BTRFS_IOC_SNAP_CREATE_V2)
+static bool
+copy_name(char* dest, size_t size, const char* name)
+{
+    if (size <= strlen(name)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(dest, name);
+    return true;
+}
+
+bool
+snapshot_create_subvolume(int dirfd, const char* name)
+{
+    struct btrfs_ioctl_vol_args args;
+    memset(&args, 0, sizeof(args));
+    if (!copy_name(args.name, sizeof(args.name), name)) {
+        return false;
+    }
+    return ioctl(dirfd, BTRFS_IOC_SUBVOL_CREATE, &args) == 0;
+}
+
+/*
+ * Makes a writable snapshot of the subvolume of src_fd as name in dirfd.
+ */
+bool
+snapshot_create(int dirfd, const char* name, int src_fd)
+{
+    struct btrfs_ioctl_vol_args_v2 args;
+    memset(&args, 0, sizeof(args));
+    if (!copy_name(args.name, sizeof(args.name), name)) {
+        return false;
+    }
+    args.fd = src_fd;
+    return ioctl(dirfd, BTRFS_IOC_SNAP_CREATE_V2, &args) == 0;
+}
+
+bool
+snapshot_set_readonly(int fd, bool readonly)
+{
+    uint64_t flags;
+    if (ioctl(fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) != 0) {
+        return false;
+    }
+    flags = readonly ? flags | BTRFS_SUBVOL_RDONLY : flags & ~(uint64_t)BTRFS_SUBVOL_RDONLY;
+    return ioctl(fd, BTRFS_IOC_SUBVOL_SETFLAGS, &flags) == 0;
+}
+
+bool
+snapshot_destroy(int dirfd, const char* name)
+{
+    struct btrfs_ioctl_vol_args args;
+    memset(&args, 0, sizeof(args));
+    if (!copy_name(args.name, sizeof(args.name), name)) {
+        return false;
+    }
+    return ioctl(dirfd, BTRFS_IOC_SNAP_DESTROY, &args) == 0;
+}
+
+/*
+ * Commits the transaction of the filesystem of fd, which hands destroyed
+ * subvolumes to the cleaner.
+ */
+bool
+snapshot_sync(int fd)
+{
+    uint64_t transid;
+    if (ioctl(fd, BTRFS_IOC_START_SYNC, &transid) != 0) {
+        return false;
+    }
+    return ioctl(fd, BTRFS_IOC_WAIT_SYNC, &transid) == 0;
+}
+#else
+bool
+snapshot_create_subvolume(int dirfd, const char* name)
+{
+    (void)dirfd;
+    (void)name;
+    errno = ENOTSUP;
+    return false;
+}
+
+bool
+snapshot_create(int dirfd, const char* name, int src_fd)
+{
+    (void)dirfd;
+    (void)name;
+    (void)src_fd;
+    errno = ENOTSUP;
+    return false;
+}
+
+bool
+snapshot_set_readonly(int fd, bool readonly)
+{
+    (void)fd;
+    (void)readonly;
+    errno = ENOTSUP;
+    return false;
+}
+
+bool
+snapshot_destroy(int dirfd, const char* name)
+{
+    (void)dirfd;
+    (void)name;
+    errno = ENOTSUP;
+    return false;
+}
+
+bool
+snapshot_sync(int fd)
+{
+    (void)fd;
+    errno = ENOTSUP;
+    return false;
+}
+#endif
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
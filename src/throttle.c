@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include <ubackup/phase.h>
+#include <ubackup/throttle.h>
+
+#define NANO 1000000000
+/* Bursts of this long are allowed after an idle time. */
+#define BURST_NS (NANO / 10)
+#define ADJUST_NS (NANO / 10)
+#define LOAD_NS NANO
+#define MIN_SCALE (1.0 / 64)
+#define SCALE_STEP (1.0 / 16)
+/*
+ * Latencies this many times as long as usual, and at least LATENCY_FLOOR_NS
+ * for a stat or for reading PAGE_BYTES, are slow.
+ */
+#define LATENCY_RATIO 4
+#define LATENCY_FLOOR_NS (NANO / 1000)
+#define PAGE_BYTES 4096
+
+bool
+throttle_is_enabled(const ThrottleConf* conf)
+{
+    bool limited = (conf->max_bandwidth != 0) || (conf->max_iops != 0);
+    return limited || (conf->max_load != 0) || conf->adaptive;
+}
+
+bool
+throttle_init(Throttle* throttle, const ThrottleConf* conf)
+{
+    bzero(throttle, sizeof(*throttle));
+    throttle->conf = *conf;
+    return pthread_mutex_init(&throttle->lock, NULL) == 0;
+}
+
+void
+throttle_destroy(Throttle* throttle)
+{
+    free(throttle->devices);
+    pthread_mutex_destroy(&throttle->lock);
+}
+
+/*
+ * Returns NULL when no memory is left, and then the operation is not
+ * throttled.
+ */
+static ThrottleDevice*
+find_device(Throttle* throttle, dev_t dev)
+{
+    size_t n = throttle->num_devices;
+    for (size_t i = 0; i < n; i++) {
+        if (throttle->devices[i].dev == dev) {
+            return &throttle->devices[i];
+        }
+    }
+    ThrottleDevice* devices = realloc(throttle->devices, sizeof(devices[0]) * (n + 1));
+    if (devices == NULL) {
+        return NULL;
+    }
+    throttle->devices = devices;
+    throttle->num_devices = n + 1;
+    ThrottleDevice* device = &devices[n];
+    bzero(device, sizeof(*device));
+    device->dev = dev;
+    device->scale = 1;
+    return device;
+}
+
+static bool
+is_overloaded(Throttle* throttle, uint64_t now)
+{
+    if (throttle->conf.max_load == 0) {
+        return false;
+    }
+    if ((throttle->last_loaded == 0) || (throttle->last_loaded + LOAD_NS <= now)) {
+        double load;
+        throttle->load = getloadavg(&load, 1) == 1 ? load : 0;
+        throttle->last_loaded = now;
+    }
+    return throttle->conf.max_load < throttle->load;
+}
+
+static bool
+is_latency_slow(const Latency* latency, double floor)
+{
+    return (floor < latency->fast) && (LATENCY_RATIO * latency->slow < latency->fast);
+}
+
+static bool
+is_slow(const Throttle* throttle, const ThrottleDevice* device)
+{
+    if (!throttle->conf.adaptive) {
+        return false;
+    }
+    if (is_latency_slow(&device->stat, LATENCY_FLOOR_NS)) {
+        return true;
+    }
+    return is_latency_slow(&device->read, LATENCY_FLOOR_NS / (double)PAGE_BYTES);
+}
+
+static void
+average(Latency* latency, double value)
+{
+    if (latency->slow == 0) {
+        latency->fast = latency->slow = value;
+    }
+    latency->fast += (value - latency->fast) / 8;
+    latency->slow += (value - latency->slow) / 256;
+}
+
+static void
+adjust(Throttle* throttle, ThrottleDevice* device, uint64_t now)
+{
+    if (now < device->last_adjusted + ADJUST_NS) {
+        return;
+    }
+    device->last_adjusted = now;
+    double scale = device->scale;
+    if (is_slow(throttle, device) || is_overloaded(throttle, now)) {
+        scale /= 2;
+        device->scale = scale < MIN_SCALE ? MIN_SCALE : scale;
+        return;
+    }
+    scale += SCALE_STEP;
+    device->scale = 1 < scale ? 1 : scale;
+}
+
+/*
+ * ready is when the bucket has room for the next amount. It does not lag
+ * behind now more than BURST_NS.
+ */
+static uint64_t
+take(uint64_t* ready, uint64_t amount, uint64_t rate, double scale, uint64_t now)
+{
+    if (rate == 0) {
+        return 0;
+    }
+    uint64_t earliest = BURST_NS < now ? now - BURST_NS : 0;
+    uint64_t start = *ready < earliest ? earliest : *ready;
+    *ready = start + (uint64_t)(amount * (double)NANO / (rate * scale));
+    return now < *ready ? *ready - now : 0;
+}
+
+/*
+ * Accounts an operation on dev which read bytes in ns, and sleeps to keep the
+ * limits of the device. stat is whether the operation was lstat(2).
+ */
+static void
+account(Throttle* throttle, dev_t dev, bool stat, uint64_t bytes, uint64_t ns)
+{
+    const ThrottleConf* conf = &throttle->conf;
+    uint64_t now = phase_now();
+    pthread_mutex_lock(&throttle->lock);
+    ThrottleDevice* device = find_device(throttle, dev);
+    if (device == NULL) {
+        pthread_mutex_unlock(&throttle->lock);
+        return;
+    }
+    if (stat) {
+        average(&device->stat, ns);
+    }
+    else if (0 < bytes) {
+        average(&device->read, ns / (double)bytes);
+    }
+    adjust(throttle, device, now);
+    double scale = device->scale;
+    uint64_t wait = take(&device->bytes_ready, bytes, conf->max_bandwidth, scale, now);
+    uint64_t ops_wait = take(&device->ops_ready, 1, conf->max_iops, scale, now);
+    wait = wait < ops_wait ? ops_wait : wait;
+    if ((conf->max_bandwidth == 0) && (conf->max_iops == 0)) {
+        wait = (uint64_t)(ns * (1 / scale - 1));
+    }
+    pthread_mutex_unlock(&throttle->lock);
+    if (wait == 0) {
+        return;
+    }
+    struct timespec ts = { wait / NANO, wait % NANO };
+    while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR)) {
+    }
+}
+
+void
+throttle_account_stat(Throttle* throttle, dev_t dev, uint64_t ns)
+{
+    account(throttle, dev, true, 0, ns);
+}
+
+void
+throttle_account_read(Throttle* throttle, dev_t dev, uint64_t bytes, uint64_t ns)
+{
+    account(throttle, dev, false, bytes, ns);
+}
+
+/*
+ * spec is "idle", or "best-effort" with an optional level from 0 (highest)
+ * to 7 like "best-effort:7". Threads made later inherit it. An invalid spec
+ * fails with EINVAL, and a valid one fails with ENOTSUP on other systems than
+ * Linux.
+ */
+bool
+throttle_set_ioprio(const char* spec)
+{
+    enum { CLASS_BE = 2, CLASS_IDLE = 3, CLASS_SHIFT = 13, WHO_PROCESS = 1 };
+    int prio;
+    if (strcmp(spec, "idle") == 0) {
+        prio = CLASS_IDLE << CLASS_SHIFT;
+    }
+    else if (strncmp(spec, "best-effort", 11) == 0) {
+        const char* p = spec + 11;
+        int level = 4;
+        if (*p == ':') {
+            char* end;
+            level = (int)strtol(p + 1, &end, 10);
+            if ((end == p + 1) || (*end != '\0') || (level < 0) || (7 < level)) {
+                errno = EINVAL;
+                return false;
+            }
+        }
+        else if (*p != '\0') {
+            errno = EINVAL;
+            return false;
+        }
+        prio = (CLASS_BE << CLASS_SHIFT) | level;
+    }
+    else {
+        errno = EINVAL;
+        return false;
+    }
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    return syscall(SYS_ioprio_set, WHO_PROCESS, 0, prio) == 0;
+#else
+    (void)prio;
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+/*
+ * Moves this process into a cgroup v2 directory, whose io.max, io.latency and
+ * cpu.max set by the administrator limit the backup.
+ */
+bool
+throttle_join_cgroup(const char* dir)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+    int fd = open(path, O_WRONLY);
+    if (fd == -1) {
+        return false;
+    }
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%ld\n", (long)getpid());
+    bool ok = write(fd, buf, len) == len;
+    int e = errno;
+    close(fd);
+    errno = e;
+    return ok;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,270 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <ubackup/timestamp.h>
+
+#define SECONDS_PER_DAY 86400
+#define OFFSET_SPAN 900
+
+/*
+ * Converts a date of the proleptic Gregorian calendar into days from
+ * 1970-01-01 and back without any calls of the C library. The algorithm is
+ * Howard Hinnant's days_from_civil/civil_from_days.
+ */
+static int64_t
+days_from_civil(int64_t y, int m, int d)
+{
+    y -= m <= 2;
+    int64_t era = (0 <= y ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (2 < m ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void
+civil_from_days(int64_t days, int64_t* y, int* m, int* d)
+{
+    days += 719468;
+    int64_t era = (0 <= days ? days : days - 146096) / 146097;
+    int64_t doe = days - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = yoe + era * 400 + (*m <= 2);
+}
+
+/*
+ * The UTC offset of the local time is asked to localtime_r() only once in
+ * OFFSET_SPAN seconds. Offsets of time zones are multiples of 15 minutes, like
+ * +10:30 of Australia/Adelaide or +05:45 of Asia/Kathmandu, and they change at
+ * boundaries of quarter hours, so the cached offset is valid in the whole span.
+ */
+static struct {
+    bool valid;
+    time_t start;
+    long offset;
+} offset_cache;
+
+static long
+offset_of(time_t t)
+{
+    time_t start = t - (t % OFFSET_SPAN + OFFSET_SPAN) % OFFSET_SPAN;
+    if (offset_cache.valid && (offset_cache.start == start)) {
+        return offset_cache.offset;
+    }
+    struct tm tm;
+    localtime_r(&t, &tm);
+    int64_t days = days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    int64_t local = days * SECONDS_PER_DAY + tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+    offset_cache.valid = true;
+    offset_cache.start = start;
+    offset_cache.offset = (long)(local - t);
+    return offset_cache.offset;
+}
+
+static char*
+write_digits(char* p, uint64_t n, int width)
+{
+    char buf[20];
+    int len = 0;
+    do {
+        buf[len] = '0' + n % 10;
+        n /= 10;
+        len++;
+    } while (n != 0);
+    while (len < width) {
+        buf[len] = '0';
+        len++;
+    }
+    while (0 < len) {
+        len--;
+        *p = buf[len];
+        p++;
+    }
+    return p;
+}
+
+/*
+ * Writes "seconds.nanoseconds" from the epoch. buf must have
+ * TIMESTAMP_MAXSIZE bytes.
+ */
+void
+timestamp_encode(char* buf, const struct timespec* ts)
+{
+    char* p = buf;
+    int64_t sec = ts->tv_sec;
+    if (sec < 0) {
+        *p = '-';
+        p++;
+    }
+    p = write_digits(p, sec < 0 ? -(uint64_t)sec : (uint64_t)sec, 1);
+    *p = '.';
+    p = write_digits(p + 1, ts->tv_nsec, 9);
+    *p = '\0';
+}
+
+static bool
+parse_digits(int64_t* dest, const char** p, int width)
+{
+    const char* q = *p;
+    int64_t n = 0;
+    int i;
+    for (i = 0; (i < width) && ('0' <= q[i]) && (q[i] <= '9'); i++) {
+        n = 10 * n + q[i] - '0';
+    }
+    if (i != width) {
+        return false;
+    }
+    *dest = n;
+    *p = q + width;
+    return true;
+}
+
+static bool
+expect(const char** p, char c)
+{
+    if (**p != c) {
+        return false;
+    }
+    (*p)++;
+    return true;
+}
+
+/*
+ * Parses "yyyy-mm-ddThh:nn:ss" in the local time.
+ */
+bool
+timestamp_parse_iso8601(time_t* dest, const char** p)
+{
+    const char* q = *p;
+    int64_t year, month, day, hour, minute, second;
+    if (!parse_digits(&year, &q, 4) || !expect(&q, '-')) {
+        return false;
+    }
+    if (!parse_digits(&month, &q, 2) || !expect(&q, '-')) {
+        return false;
+    }
+    if (!parse_digits(&day, &q, 2) || !expect(&q, 'T')) {
+        return false;
+    }
+    if (!parse_digits(&hour, &q, 2) || !expect(&q, ':')) {
+        return false;
+    }
+    if (!parse_digits(&minute, &q, 2) || !expect(&q, ':')) {
+        return false;
+    }
+    if (!parse_digits(&second, &q, 2)) {
+        return false;
+    }
+    if ((month < 1) || (12 < month) || (day < 1) || (31 < day)) {
+        return false;
+    }
+    int64_t days = days_from_civil(year, (int)month, (int)day);
+    int64_t local = days * SECONDS_PER_DAY + hour * 3600 + minute * 60 + second;
+    /*
+     * The offset depends on the UTC time which is being computed. Guessing it
+     * with the cached offset is right except around changes of offsets.
+     */
+    time_t t = local - offset_of(local - offset_cache.offset);
+    long offset = offset_of(t);
+    *dest = local - offset;
+    *p = q;
+    return true;
+}
+
+/*
+ * Writes "yyyy-mm-ddThh:nn:ss" in the local time. buf must have
+ * TIMESTAMP_ISO8601_MAXSIZE bytes.
+ */
+void
+timestamp_format_iso8601(char* buf, time_t t)
+{
+    int64_t local = t + offset_of(t);
+    int64_t days = local / SECONDS_PER_DAY;
+    int64_t rest = local % SECONDS_PER_DAY;
+    if (rest < 0) {
+        days--;
+        rest += SECONDS_PER_DAY;
+    }
+    int64_t year;
+    int month, day;
+    civil_from_days(days, &year, &month, &day);
+    char* p = write_digits(buf, year, 4);
+    *p = '-';
+    p = write_digits(p + 1, month, 2);
+    *p = '-';
+    p = write_digits(p + 1, day, 2);
+    *p = 'T';
+    p = write_digits(p + 1, rest / 3600, 2);
+    *p = ':';
+    p = write_digits(p + 1, rest / 60 % 60, 2);
+    *p = ':';
+    p = write_digits(p + 1, rest % 60, 2);
+    *p = '\0';
+}
+
+/*
+ * Parses "seconds.nanoseconds" from timestamp_encode(). The old format of
+ * "yyyy-mm-ddThh:nn:ss" is also accepted for old backupees.
+ */
+bool
+timestamp_decode(Timestamp* dest, const char** p)
+{
+    const char* q = *p;
+    while (*q == ' ') {
+        q++;
+    }
+    time_t t;
+    if (timestamp_parse_iso8601(&t, &q)) {
+        dest->sec = t;
+        dest->nsec = 0;
+        *p = q;
+        return true;
+    }
+    bool negative = *q == '-';
+    q += negative ? 1 : 0;
+    if ((*q < '0') || ('9' < *q)) {
+        return false;
+    }
+    uint64_t sec = 0;
+    while (('0' <= *q) && (*q <= '9')) {
+        sec = 10 * sec + *q - '0';
+        q++;
+    }
+    long nsec = 0;
+    if (*q == '.') {
+        q++;
+        int i;
+        for (i = 0; ('0' <= *q) && (*q <= '9'); i++, q++) {
+            nsec = i < 9 ? 10 * nsec + *q - '0' : nsec;
+        }
+        for (; i < 9; i++) {
+            nsec *= 10;
+        }
+    }
+    dest->sec = negative ? -(time_t)sec : (time_t)sec;
+    dest->nsec = nsec;
+    *p = q;
+    return true;
+}
+
+int
+timestamp_compare(const Timestamp* a, const Timestamp* b)
+{
+    if (a->sec != b->sec) {
+        return a->sec < b->sec ? -1 : 1;
+    }
+    if (a->nsec != b->nsec) {
+        return a->nsec < b->nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,1191 @@
+#include <ubackup/arena.h>
+#include <ubackup/bufring.h>
+#include <ubackup/config.h>
+#include <ubackup/inodemap.h>
+#include <ubackup/pack.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATH_SIZE 4096
+#define IO_SIZE (1024 * 1024)
+#define IO_ALIGNMENT 4096
+#define META_DIR ".meta"
+#define META_EXT ".meta"
+/*
+ * Prefetchers read heads of PREFETCH_WINDOW files ahead of the sender. Larger
+ * files are read ahead by the kernel while they are sent.
+ */
+#define PREFETCH_WINDOW 32
+#define PREFETCH_SIZE (256 * 1024)
+#define DEFAULT_JOBS 4
+
+#if !defined(O_NOATIME)
+#define O_NOATIME 0
+#endif
+
+/*
+ * A restore stream has records of a header line and a path of plen bytes:
+ *
+ *   D plen mode uid gid mtime
+ *   F plen mode uid gid mtime size
+ *   S plen uid gid mtime tlen    (followed by the target of tlen bytes)
+ *   L plen tlen                  (a hard link to the earlier path of tlen bytes)
+ *   END
+ *
+ * After an F record, extents come as "offset length" lines with their data,
+ * and "0 0" ends them. A file is truncated to size first, so holes are kept.
+ * "-1 0" ends extents which could not be read, and the receiver removes the
+ * file instead of keeping a corrupted one. The receiver answers "OK" or "NG number_of_errors" to END.
+ */
+
+static void
+print_error(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static void
+print_errno(const char* msg, int e, const char* info)
+{
+    print_error("%s: %s: %s", msg, strerror(e), info);
+}
+
+static void
+print_version()
+{
+    printf("%s of ubackup %s\n", getprogname(), UBACKUP_VERSION);
+}
+
+static void*
+realloc_or_die(void* p, size_t size)
+{
+    void* q = realloc(p, size);
+    if (q == NULL) {
+        print_error("Cannot allocate memory.");
+        exit(1);
+    }
+    return q;
+}
+
+static char*
+strdup_or_die(const char* s)
+{
+    char* t = strdup(s);
+    if (t == NULL) {
+        print_error("Cannot allocate memory.");
+        exit(1);
+    }
+    return t;
+}
+
+static void
+join(char* dest, size_t size, const char* dir, const char* name)
+{
+    if (dir[0] == '\0') {
+        snprintf(dest, size, "%s", name);
+        return;
+    }
+    snprintf(dest, size, "%s/%s", dir, name);
+}
+
+struct Extent {
+    off_t offset;
+    off_t length;
+};
+
+typedef struct Extent Extent;
+
+struct Meta {
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+};
+
+typedef struct Meta Meta;
+
+/*
+ * Paths of files which have other hard links, by their inodes. A file whose
+ * inode was sent is sent as a hard link.
+ */
+struct LinkTable {
+    InodeMap paths;
+    Arena arena;
+};
+
+typedef struct LinkTable LinkTable;
+
+struct Prefetcher {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t* threads;
+    int num_threads;
+    char** paths;
+    size_t num;
+    size_t next;
+    size_t sent;
+    int busy;
+    bool closing;
+};
+
+typedef struct Prefetcher Prefetcher;
+
+struct Sender {
+    FILE* out;
+    BufRing ring;
+    LinkTable links;
+    Prefetcher prefetcher;
+    int num_errors;
+};
+
+typedef struct Sender Sender;
+
+static bool
+link_table_init(LinkTable* table)
+{
+    return inode_map_init(&table->paths) && arena_init(&table->arena, 64 * 1024);
+}
+
+static void
+link_table_destroy(LinkTable* table)
+{
+    inode_map_destroy(&table->paths);
+    arena_destroy(&table->arena);
+}
+
+/*
+ * Returns the path which was sent with the inode, or NULL after remembering
+ * path for it.
+ */
+static const char*
+link_table_add(LinkTable* table, const struct stat* sb, const char* path)
+{
+    const char* sent = (const char*)inode_map_get(&table->paths, sb->st_dev, sb->st_ino);
+    if (sent != NULL) {
+        return sent;
+    }
+    size_t size = strlen(path) + 1;
+    char* s = (char*)arena_alloc(&table->arena, size);
+    if ((s == NULL) || !inode_map_put(&table->paths, sb->st_dev, sb->st_ino, s)) {
+        print_error("Cannot allocate memory.");
+        exit(1);
+    }
+    memcpy(s, path, size);
+    return NULL;
+}
+
+static int
+open_file(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_NOATIME);
+    if ((fd == -1) && (errno == EPERM) && (O_NOATIME != 0)) {
+        fd = open(path, O_RDONLY);
+    }
+    return fd;
+}
+
+static void*
+prefetch(void* arg)
+{
+    Prefetcher* p = (Prefetcher*)arg;
+    pthread_mutex_lock(&p->lock);
+    while (true) {
+        while (!p->closing && ((p->num <= p->next) || (p->sent + PREFETCH_WINDOW <= p->next))) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->closing) {
+            break;
+        }
+        const char* path = p->paths[p->next];
+        p->next++;
+        p->busy++;
+        pthread_mutex_unlock(&p->lock);
+        int fd = open_file(path);
+        if (fd != -1) {
+            posix_fadvise(fd, 0, PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+        pthread_mutex_lock(&p->lock);
+        p->busy--;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void
+prefetcher_init(Prefetcher* p, int num_threads)
+{
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->paths = NULL;
+    p->num = p->next = p->sent = 0;
+    p->busy = 0;
+    p->closing = false;
+    p->threads = (pthread_t*)realloc_or_die(NULL, num_threads * sizeof(pthread_t));
+    p->num_threads = 0;
+    int i;
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&p->threads[i], NULL, prefetch, p) != 0) {
+            break;
+        }
+        p->num_threads++;
+    }
+}
+
+static void
+prefetcher_destroy(Prefetcher* p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->closing = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    int i;
+    for (i = 0; i < p->num_threads; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+    free(p->threads);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+}
+
+/*
+ * paths must be alive until prefetcher_clear().
+ */
+static void
+prefetcher_start(Prefetcher* p, char** paths, size_t num)
+{
+    pthread_mutex_lock(&p->lock);
+    p->paths = paths;
+    p->num = num;
+    p->next = p->sent = 0;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void
+prefetcher_advance(Prefetcher* p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->sent++;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void
+prefetcher_clear(Prefetcher* p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->num = 0;
+    while (0 < p->busy) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    p->paths = NULL;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Meta data of a backuped entry are in its .meta file. Those of the stat(2) are
+ * used if it is missing.
+ */
+static void
+read_meta(Meta* meta, const char* dir, const char* name, const struct stat* sb)
+{
+    meta->mode = sb->st_mode & 07777;
+    meta->uid = sb->st_uid;
+    meta->gid = sb->st_gid;
+    char path[strlen(dir) + strlen(name) + strlen(META_DIR) + strlen(META_EXT) + 3];
+    sprintf(path, "%s/%s/%s%s", dir, META_DIR, name, META_EXT);
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return;
+    }
+    unsigned int mode, uid, gid;
+    if (fscanf(fp, "%o %u %u", &mode, &uid, &gid) == 3) {
+        meta->mode = mode & 07777;
+        meta->uid = uid;
+        meta->gid = gid;
+    }
+    fclose(fp);
+}
+
+static void
+send_header(Sender* sender, const char* line, const char* path)
+{
+    fputs(line, sender->out);
+    fputs("\n", sender->out);
+    fwrite(path, 1, strlen(path), sender->out);
+}
+
+static void
+send_dir(Sender* sender, const char* rel, const Meta* meta, const struct stat* sb)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "D %zu %o %u %u %" PRId64 ".%09ld", strlen(rel), meta->mode,
+             meta->uid, meta->gid, (int64_t)sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec);
+    send_header(sender, line, rel);
+}
+
+static bool
+send_symlink(Sender* sender, const char* path, const char* rel, const Meta* meta, const struct stat* sb)
+{
+    char target[PATH_SIZE];
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if (len == -1) {
+        print_errno("readlink failed", errno, path);
+        return false;
+    }
+    target[len] = '\0';
+    char line[256];
+    snprintf(line, sizeof(line), "S %zu %u %u %" PRId64 ".%09ld %zd", strlen(rel), meta->uid,
+             meta->gid, (int64_t)sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec, len);
+    send_header(sender, line, rel);
+    fwrite(target, 1, len, sender->out);
+    return true;
+}
+
+static void
+send_link(Sender* sender, const char* rel, const char* target)
+{
+    char line[64];
+    snprintf(line, sizeof(line), "L %zu %zu", strlen(rel), strlen(target));
+    send_header(sender, line, rel);
+    fwrite(target, 1, strlen(target), sender->out);
+}
+
+static void
+add_extent(Extent** extents, size_t* num, off_t offset, off_t length)
+{
+    *extents = (Extent*)realloc_or_die(*extents, (*num + 1) * sizeof(Extent));
+    (*extents)[*num].offset = offset;
+    (*extents)[*num].length = length;
+    (*num)++;
+}
+
+/*
+ * A file with fewer blocks than its size may have holes, which are skipped
+ * with SEEK_DATA and SEEK_HOLE.
+ */
+static Extent*
+find_extents(int fd, const struct stat* sb, size_t* num)
+{
+    Extent* extents = NULL;
+    *num = 0;
+    off_t size = sb->st_size;
+    if (size == 0) {
+        return NULL;
+    }
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if ((off_t)sb->st_blocks * 512 < size) {
+        off_t offset = 0;
+        while (offset < size) {
+            off_t data = lseek(fd, offset, SEEK_DATA);
+            if (data == -1) {
+                if (errno == ENXIO) {
+                    return extents;
+                }
+                break;
+            }
+            off_t hole = lseek(fd, data, SEEK_HOLE);
+            hole = (hole == -1) || (size < hole) ? size : hole;
+            add_extent(&extents, num, data, hole - data);
+            offset = hole;
+        }
+        if (size <= offset) {
+            return extents;
+        }
+        free(extents);
+        extents = NULL;
+        *num = 0;
+    }
+#else
+    (void)fd;
+#endif
+    add_extent(&extents, num, 0, size);
+    return extents;
+}
+
+/*
+ * Extents are at base in fd. base is not zero for a file in a pack.
+ */
+struct ExtentReader {
+    BufRing* ring;
+    int fd;
+    off_t base;
+    const Extent* extents;
+    size_t num;
+    int error;
+    size_t index;
+    off_t done;
+};
+
+typedef struct ExtentReader ExtentReader;
+
+/*
+ * Fills one buffer of the ring, and returns false after the last extent.
+ * Buffers do not go across extents. What cannot be read is sent as zeros to
+ * keep the stream, and error tells that the file is broken.
+ */
+static bool
+read_next_extent(ExtentReader* reader)
+{
+    while ((reader->index < reader->num)
+           && (reader->extents[reader->index].length <= reader->done)) {
+        reader->index++;
+        reader->done = 0;
+    }
+    if (reader->num <= reader->index) {
+        return false;
+    }
+    BufRing* ring = reader->ring;
+    off_t offset = reader->extents[reader->index].offset + reader->done;
+    off_t rest = reader->extents[reader->index].length - reader->done;
+    char* buf = bufring_acquire(ring);
+    size_t size = (off_t)ring->size < rest ? ring->size : (size_t)rest;
+    ssize_t nbytes = pread(reader->fd, buf, size, reader->base + offset);
+    if (nbytes <= 0) {
+        reader->error = nbytes == -1 ? errno : EIO;
+        memset(buf, 0, size);
+        nbytes = size;
+    }
+    bufring_commit(ring, nbytes);
+    reader->done += nbytes;
+    return true;
+}
+
+static void*
+read_extents(void* arg)
+{
+    ExtentReader* reader = (ExtentReader*)arg;
+    while (read_next_extent(reader)) {
+    }
+    bufring_close(reader->ring);
+    return NULL;
+}
+
+/*
+ * Sends an F record with extents, which are freed.
+ */
+static bool
+send_body(Sender* sender, const ExtentReader* src, const char* path, const char* rel,
+          const Meta* meta, const struct stat* sb)
+{
+    Extent* extents = (Extent*)src->extents;
+    size_t num = src->num;
+
+    char line[256];
+    snprintf(line, sizeof(line), "F %zu %o %u %u %" PRId64 ".%09ld %" PRId64, strlen(rel),
+             meta->mode, meta->uid, meta->gid, (int64_t)sb->st_mtim.tv_sec,
+             sb->st_mtim.tv_nsec, (int64_t)sb->st_size);
+    send_header(sender, line, rel);
+
+    BufRing* ring = &sender->ring;
+    bufring_reset(ring);
+    ExtentReader reader = *src;
+    reader.ring = ring;
+    pthread_t reader_thread;
+    bool threaded = (1 < num) || ((num == 1) && ((off_t)ring->size < extents[0].length));
+    if (threaded && (pthread_create(&reader_thread, NULL, read_extents, &reader) != 0)) {
+        threaded = false;
+    }
+    size_t i;
+    for (i = 0; i < num; i++) {
+        fprintf(sender->out, "%" PRId64 " %" PRId64 "\n", (int64_t)extents[i].offset,
+                (int64_t)extents[i].length);
+        off_t rest = extents[i].length;
+        while (0 < rest) {
+            /* Without the thread, a buffer is read just before it is sent. */
+            if (!threaded) {
+                read_next_extent(&reader);
+            }
+            size_t len;
+            char* buf = bufring_peek(ring, &len);
+            fwrite(buf, 1, len, sender->out);
+            bufring_release(ring);
+            rest -= len;
+        }
+    }
+    if (threaded) {
+        pthread_join(reader_thread, NULL);
+    }
+    fputs(reader.error == 0 ? "0 0\n" : "-1 0\n", sender->out);
+    free(extents);
+    if (reader.error != 0) {
+        print_errno("read failed", reader.error, path);
+        return false;
+    }
+    return true;
+}
+
+static bool
+send_file(Sender* sender, const char* path, const char* rel, const Meta* meta, const struct stat* sb)
+{
+    if (1 < sb->st_nlink) {
+        const char* target = link_table_add(&sender->links, sb, rel);
+        if (target != NULL) {
+            send_link(sender, rel, target);
+            return true;
+        }
+    }
+    int fd = open_file(path);
+    if (fd == -1) {
+        print_errno("open failed", errno, path);
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ExtentReader reader = { NULL, fd, 0, NULL, 0, 0, 0, 0 };
+    reader.extents = find_extents(fd, sb, &reader.num);
+    bool sent = send_body(sender, &reader, path, rel, meta, sb);
+    close(fd);
+    return sent;
+}
+
+/*
+ * Sends files in pack files, which PACK_INDEX of the directory lists. Records
+ * of a directory are mostly in one pack, so the last pack is kept open.
+ */
+static void
+send_packed(Sender* sender, const char* path, const char* rel)
+{
+    char index_path[PATH_SIZE];
+    snprintf(index_path, sizeof(index_path), "%s/%s/%s", path, META_DIR, PACK_INDEX);
+    FILE* fp = fopen(index_path, "r");
+    if (fp == NULL) {
+        return;
+    }
+    char pack[PATH_SIZE] = "";
+    int fd = -1;
+    struct stat pack_sb;
+    char* buf = NULL;
+    size_t bufsize = 0;
+    PackRecord record;
+    while (pack_record_read(fp, &record, &buf, &bufsize)) {
+        char pack_path[PATH_SIZE];
+        join(pack_path, sizeof(pack_path), path, record.pack);
+        if (strcmp(pack, pack_path) != 0) {
+            if (fd != -1) {
+                close(fd);
+            }
+            snprintf(pack, sizeof(pack), "%s", pack_path);
+            fd = open_file(pack);
+            if ((fd == -1) || (fstat(fd, &pack_sb) != 0)) {
+                print_errno("open failed", errno, pack);
+                pack[0] = '\0';
+            }
+        }
+        if (pack[0] == '\0') {
+            sender->num_errors++;
+            continue;
+        }
+        struct stat sb = pack_sb;
+        sb.st_mode = S_IFREG | 0644;
+        sb.st_size = record.length;
+        sb.st_mtim = record.mtime;
+        Meta meta;
+        read_meta(&meta, path, record.name, &sb);
+        char subrel[PATH_SIZE];
+        join(subrel, sizeof(subrel), rel, record.name);
+        ExtentReader reader = { NULL, fd, record.offset, NULL, 0, 0, 0, 0 };
+        Extent* extents = NULL;
+        if (0 < record.length) {
+            add_extent(&extents, &reader.num, 0, record.length);
+        }
+        reader.extents = extents;
+        if (!send_body(sender, &reader, pack, subrel, &meta, &sb)) {
+            sender->num_errors++;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(buf);
+    fclose(fp);
+}
+
+struct Listing {
+    char** names;
+    size_t num;
+};
+
+typedef struct Listing Listing;
+
+static int
+compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+static bool
+list_dir(Listing* listing, const char* path)
+{
+    listing->names = NULL;
+    listing->num = 0;
+    DIR* dirp = opendir(path);
+    if (dirp == NULL) {
+        print_errno("opendir failed", errno, path);
+        return false;
+    }
+    struct dirent* e;
+    while ((e = readdir(dirp)) != NULL) {
+        const char* name = e->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+            continue;
+        }
+        if (strcmp(name, META_DIR) == 0) {
+            continue;
+        }
+        size_t size = (listing->num + 1) * sizeof(char*);
+        listing->names = (char**)realloc_or_die(listing->names, size);
+        listing->names[listing->num] = strdup_or_die(name);
+        listing->num++;
+    }
+    closedir(dirp);
+    qsort(listing->names, listing->num, sizeof(char*), compare_names);
+    return true;
+}
+
+static void
+free_names(char** names, size_t num)
+{
+    size_t i;
+    for (i = 0; i < num; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+/*
+ * Sends entries of a directory, and then its subdirectories. Regular files of
+ * the directory are prefetched while they are sent.
+ */
+static void
+send_tree(Sender* sender, const char* path, const char* rel)
+{
+    Listing listing;
+    if (!list_dir(&listing, path)) {
+        sender->num_errors++;
+        return;
+    }
+    size_t num = listing.num;
+    struct stat* sbs = (struct stat*)realloc_or_die(NULL, (num + 1) * sizeof(struct stat));
+    bool* stated = (bool*)realloc_or_die(NULL, (num + 1) * sizeof(bool));
+    char** files = (char**)realloc_or_die(NULL, (num + 1) * sizeof(char*));
+    size_t num_files = 0;
+    size_t i;
+    for (i = 0; i < num; i++) {
+        char fullpath[PATH_SIZE];
+        join(fullpath, sizeof(fullpath), path, listing.names[i]);
+        stated[i] = lstat(fullpath, &sbs[i]) == 0;
+        if (!stated[i]) {
+            print_errno("lstat failed", errno, fullpath);
+            sender->num_errors++;
+            continue;
+        }
+        if (S_ISREG(sbs[i].st_mode)) {
+            files[num_files] = strdup_or_die(fullpath);
+            num_files++;
+        }
+    }
+    prefetcher_start(&sender->prefetcher, files, num_files);
+    for (i = 0; i < num; i++) {
+        const char* name = listing.names[i];
+        if (!stated[i] || S_ISDIR(sbs[i].st_mode)) {
+            continue;
+        }
+        char fullpath[PATH_SIZE];
+        join(fullpath, sizeof(fullpath), path, name);
+        char subrel[PATH_SIZE];
+        join(subrel, sizeof(subrel), rel, name);
+        Meta meta;
+        read_meta(&meta, path, name, &sbs[i]);
+        mode_t mode = sbs[i].st_mode;
+        bool sent = true;
+        if (S_ISREG(mode)) {
+            sent = send_file(sender, fullpath, subrel, &meta, &sbs[i]);
+            prefetcher_advance(&sender->prefetcher);
+        }
+        else if (S_ISLNK(mode)) {
+            sent = send_symlink(sender, fullpath, subrel, &meta, &sbs[i]);
+        }
+        sender->num_errors += sent ? 0 : 1;
+    }
+    prefetcher_clear(&sender->prefetcher);
+    free_names(files, num_files);
+    send_packed(sender, path, rel);
+
+    for (i = 0; i < num; i++) {
+        const char* name = listing.names[i];
+        if (!stated[i] || !S_ISDIR(sbs[i].st_mode)) {
+            continue;
+        }
+        char fullpath[PATH_SIZE];
+        join(fullpath, sizeof(fullpath), path, name);
+        char subrel[PATH_SIZE];
+        join(subrel, sizeof(subrel), rel, name);
+        Meta meta;
+        read_meta(&meta, path, name, &sbs[i]);
+        send_dir(sender, subrel, &meta, &sbs[i]);
+        send_tree(sender, fullpath, subrel);
+    }
+    free(stated);
+    free(sbs);
+    free_names(listing.names, listing.num);
+}
+
+static int
+run_sender(const char* path, int jobs)
+{
+    struct stat sb;
+    if (lstat(path, &sb) != 0) {
+        print_errno("lstat failed", errno, path);
+        return 1;
+    }
+    if (!S_ISDIR(sb.st_mode)) {
+        print_error("Not a directory: %s", path);
+        return 1;
+    }
+    Sender sender;
+    sender.out = stdout;
+    sender.num_errors = 0;
+    if (!bufring_init(&sender.ring, IO_SIZE, IO_ALIGNMENT) || !link_table_init(&sender.links)) {
+        print_error("Cannot allocate memory.");
+        return 1;
+    }
+    prefetcher_init(&sender.prefetcher, jobs);
+
+    char buf[strlen(path) + 1];
+    strcpy(buf, path);
+    char parent[strlen(path) + 1];
+    strcpy(parent, dirname(buf));
+    strcpy(buf, path);
+    Meta meta;
+    read_meta(&meta, parent, basename(buf), &sb);
+    send_dir(&sender, "", &meta, &sb);
+    send_tree(&sender, path, "");
+    fputs("END\n", sender.out);
+    fflush(sender.out);
+
+    prefetcher_destroy(&sender.prefetcher);
+    link_table_destroy(&sender.links);
+    bufring_destroy(&sender.ring);
+
+    char line[64];
+    if (fgets(line, sizeof(line), stdin) == NULL) {
+        print_error("Receiving a response failed.");
+        return 1;
+    }
+    if (strncmp(line, "OK", 2) != 0) {
+        print_error("The receiver failed: %s", line);
+        return 1;
+    }
+    return sender.num_errors == 0 ? 0 : 1;
+}
+
+struct DirMeta {
+    char* path;
+    Meta meta;
+    struct timespec mtime;
+};
+
+typedef struct DirMeta DirMeta;
+
+/*
+ * Meta data of directories are applied at the end in the reverse order, after
+ * their entries were made, and before their parents get their times.
+ */
+struct Receiver {
+    int root;
+    char* buf;
+    DirMeta* dirs;
+    size_t num_dirs;
+    bool is_root;
+    int num_errors;
+};
+
+typedef struct Receiver Receiver;
+
+static bool
+parse_time(struct timespec* ts, const char* s)
+{
+    char* end;
+    long long sec = strtoll(s, &end, 10);
+    if (*end != '.') {
+        return false;
+    }
+    ts->tv_sec = sec;
+    ts->tv_nsec = strtol(end + 1, NULL, 10);
+    return true;
+}
+
+static bool
+read_bytes(char* dest, size_t size)
+{
+    return fread(dest, 1, size, stdin) == size;
+}
+
+static bool
+read_path(char* dest, size_t len)
+{
+    if ((PATH_SIZE <= len) || !read_bytes(dest, len)) {
+        return false;
+    }
+    dest[len] = '\0';
+    return true;
+}
+
+/*
+ * Paths must stay under the target directory.
+ */
+static bool
+is_safe_path(const char* path)
+{
+    if (path[0] == '/') {
+        return false;
+    }
+    const char* p = path;
+    while (*p != '\0') {
+        const char* slash = strchr(p, '/');
+        size_t len = slash != NULL ? (size_t)(slash - p) : strlen(p);
+        if ((len == 2) && (strncmp(p, "..", 2) == 0)) {
+            return false;
+        }
+        p += slash != NULL ? len + 1 : len;
+    }
+    return true;
+}
+
+static const char*
+at_path(const char* path)
+{
+    return path[0] != '\0' ? path : ".";
+}
+
+static void
+apply_owner(Receiver* receiver, int rc, const char* path)
+{
+    if ((rc != 0) && (errno != EPERM) && receiver->is_root) {
+        print_errno("chown failed", errno, path);
+        receiver->num_errors++;
+    }
+}
+
+static bool
+recv_dir(Receiver* receiver, const char* path, const Meta* meta, const struct timespec* mtime)
+{
+    if ((path[0] != '\0') && (mkdirat(receiver->root, path, 0700) != 0) && (errno != EEXIST)) {
+        print_errno("mkdir failed", errno, path);
+        return false;
+    }
+    size_t size = (receiver->num_dirs + 1) * sizeof(DirMeta);
+    receiver->dirs = (DirMeta*)realloc_or_die(receiver->dirs, size);
+    DirMeta* dir = &receiver->dirs[receiver->num_dirs];
+    dir->path = strdup_or_die(path);
+    dir->meta = *meta;
+    dir->mtime = *mtime;
+    receiver->num_dirs++;
+    return true;
+}
+
+static void
+apply_dir_metas(Receiver* receiver)
+{
+    while (0 < receiver->num_dirs) {
+        receiver->num_dirs--;
+        DirMeta* dir = &receiver->dirs[receiver->num_dirs];
+        const char* path = at_path(dir->path);
+        int rc = fchownat(receiver->root, path, dir->meta.uid, dir->meta.gid, AT_SYMLINK_NOFOLLOW);
+        apply_owner(receiver, rc, path);
+        if (fchmodat(receiver->root, path, dir->meta.mode, 0) != 0) {
+            print_errno("chmod failed", errno, path);
+            receiver->num_errors++;
+        }
+        struct timespec times[] = { dir->mtime, dir->mtime };
+        utimensat(receiver->root, path, times, AT_SYMLINK_NOFOLLOW);
+        free(dir->path);
+    }
+}
+
+/*
+ * Extents are read even if the file cannot be written, to keep the stream. A
+ * file which the sender could not read is removed.
+ */
+static bool
+recv_file(Receiver* receiver, const char* path, const Meta* meta, const struct timespec* mtime,
+          off_t size)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+    int fd = openat(receiver->root, path, flags, 0600);
+    bool ok = fd != -1;
+    if (!ok) {
+        print_errno("open failed", errno, path);
+    }
+    if (ok && (ftruncate(fd, size) != 0)) {
+        print_errno("ftruncate failed", errno, path);
+        ok = false;
+    }
+    bool broken = false;
+    while (true) {
+        char line[64];
+        if (fgets(line, sizeof(line), stdin) == NULL) {
+            print_error("Receiving an extent of %s failed.", path);
+            exit(1);
+        }
+        long long offset, length;
+        if (sscanf(line, "%lld %lld", &offset, &length) != 2) {
+            print_error("Invalid extent of %s: %s", path, line);
+            exit(1);
+        }
+        if (length == 0) {
+            broken = offset == -1;
+            break;
+        }
+        while (0 < length) {
+            size_t n = IO_SIZE < length ? IO_SIZE : (size_t)length;
+            if (!read_bytes(receiver->buf, n)) {
+                print_error("Receiving a body of %s failed.", path);
+                exit(1);
+            }
+            if (ok && (pwrite(fd, receiver->buf, n, offset) != (ssize_t)n)) {
+                print_errno("write failed", errno, path);
+                ok = false;
+            }
+            offset += n;
+            length -= n;
+        }
+    }
+    if (fd == -1) {
+        return false;
+    }
+    if (broken) {
+        print_error("%s could not be read from the backup.", path);
+        close(fd);
+        unlinkat(receiver->root, path, 0);
+        return false;
+    }
+    apply_owner(receiver, fchown(fd, meta->uid, meta->gid), path);
+    if (fchmod(fd, meta->mode) != 0) {
+        print_errno("chmod failed", errno, path);
+        ok = false;
+    }
+    struct timespec times[] = { *mtime, *mtime };
+    futimens(fd, times);
+    close(fd);
+    return ok;
+}
+
+static bool
+recv_symlink(Receiver* receiver, const char* path, const char* target, const Meta* meta,
+             const struct timespec* mtime)
+{
+    if (symlinkat(target, receiver->root, path) != 0) {
+        print_errno("symlink failed", errno, path);
+        return false;
+    }
+    int rc = fchownat(receiver->root, path, meta->uid, meta->gid, AT_SYMLINK_NOFOLLOW);
+    apply_owner(receiver, rc, path);
+    struct timespec times[] = { *mtime, *mtime };
+    utimensat(receiver->root, path, times, AT_SYMLINK_NOFOLLOW);
+    return true;
+}
+
+static bool
+recv_link(Receiver* receiver, const char* path, const char* target)
+{
+    if (linkat(receiver->root, target, receiver->root, path, 0) != 0) {
+        print_errno("link failed", errno, path);
+        return false;
+    }
+    return true;
+}
+
+static void
+die_invalid(const char* line)
+{
+    print_error("Invalid record: %s", line);
+    exit(1);
+}
+
+static bool
+recv_record(Receiver* receiver, const char* line)
+{
+    char type = line[0];
+    char path[PATH_SIZE];
+    char target[PATH_SIZE];
+    size_t plen, tlen;
+    Meta meta;
+    unsigned int mode, uid, gid;
+    char time_s[64];
+    struct timespec mtime;
+    long long size;
+    switch (type) {
+    case 'D':
+        if (sscanf(line, "D %zu %o %u %u %63s", &plen, &mode, &uid, &gid, time_s) != 5) {
+            die_invalid(line);
+        }
+        break;
+    case 'F':
+        if (sscanf(line, "F %zu %o %u %u %63s %lld", &plen, &mode, &uid, &gid, time_s, &size) != 6) {
+            die_invalid(line);
+        }
+        break;
+    case 'S':
+        if (sscanf(line, "S %zu %u %u %63s %zu", &plen, &uid, &gid, time_s, &tlen) != 5) {
+            die_invalid(line);
+        }
+        mode = 0777;
+        break;
+    case 'L':
+        if (sscanf(line, "L %zu %zu", &plen, &tlen) != 2) {
+            die_invalid(line);
+        }
+        break;
+    default:
+        die_invalid(line);
+        return false;
+    }
+    if (!read_path(path, plen) || !is_safe_path(path)) {
+        die_invalid(line);
+    }
+    if (((type == 'S') || (type == 'L')) && !read_path(target, tlen)) {
+        die_invalid(line);
+    }
+    if (type == 'L') {
+        if (!is_safe_path(target)) {
+            die_invalid(line);
+        }
+        return recv_link(receiver, path, target);
+    }
+    if (!parse_time(&mtime, time_s)) {
+        die_invalid(line);
+    }
+    meta.mode = mode & 07777;
+    meta.uid = uid;
+    meta.gid = gid;
+    switch (type) {
+    case 'D':
+        return recv_dir(receiver, path, &meta, &mtime);
+    case 'F':
+        return recv_file(receiver, path, &meta, &mtime, size);
+    default:
+        return recv_symlink(receiver, path, target, &meta, &mtime);
+    }
+}
+
+static int
+run_receiver(const char* target)
+{
+    if ((mkdir(target, 0700) != 0) && (errno != EEXIST)) {
+        print_errno("mkdir failed", errno, target);
+        return 1;
+    }
+    Receiver receiver;
+    receiver.root = open(target, O_RDONLY | O_DIRECTORY);
+    if (receiver.root == -1) {
+        print_errno("open failed", errno, target);
+        return 1;
+    }
+    receiver.buf = (char*)realloc_or_die(NULL, IO_SIZE);
+    receiver.dirs = NULL;
+    receiver.num_dirs = 0;
+    receiver.is_root = geteuid() == 0;
+    receiver.num_errors = 0;
+
+    char line[256];
+    bool ended = false;
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        char* p = strchr(line, '\n');
+        if (p != NULL) {
+            *p = '\0';
+        }
+        if (strcmp(line, "END") == 0) {
+            ended = true;
+            break;
+        }
+        receiver.num_errors += recv_record(&receiver, line) ? 0 : 1;
+    }
+    apply_dir_metas(&receiver);
+    free(receiver.dirs);
+    free(receiver.buf);
+    close(receiver.root);
+    if (!ended) {
+        print_error("The stream ended unexpectedly.");
+        return 1;
+    }
+    if (receiver.num_errors == 0) {
+        printf("OK\n");
+    }
+    else {
+        printf("NG %d\n", receiver.num_errors);
+    }
+    fflush(stdout);
+    return receiver.num_errors == 0 ? 0 : 1;
+}
+
+static void
+usage(const char* ident)
+{
+    printf("%s send [--jobs=n] backup_path\n", ident);
+    printf("%s recv target_dir\n", ident);
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct option opts[] = {
+        { "jobs", required_argument, NULL, 'j' },
+        { "version", no_argument, NULL, 'v' },
+        { NULL, 0, NULL, 0 }
+    };
+    int jobs = DEFAULT_JOBS;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "v", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'v':
+            print_version();
+            return 0;
+        default:
+            usage(basename(argv[0]));
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(basename(argv[0]));
+        return 1;
+    }
+    const char* mode = argv[optind];
+    const char* path = argv[optind + 1];
+    if (strcmp(mode, "send") == 0) {
+        return run_sender(path, 0 < jobs ? jobs : 1);
+    }
+    if (strcmp(mode, "recv") == 0) {
+        return run_receiver(path);
+    }
+    usage(basename(argv[0]));
+    return 1;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,660 @@
+#include <ubackup/arena.h>
+#include <ubackup/config.h>
+#include <ubackup/hash.h>
+#include <ubackup/inodemap.h>
+#include <ubackup/pack.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define PATH_SIZE 4096
+#define IO_SIZE (1024 * 1024)
+#define IO_ALIGNMENT 4096
+/* Pages of a file are dropped after every DROP_SIZE bytes which were read. */
+#define DROP_SIZE (8 * 1024 * 1024)
+#define DEFAULT_JOBS 4
+
+#if !defined(O_NOATIME)
+#define O_NOATIME 0
+#endif
+
+static void
+print_error(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static void
+print_errno(const char* msg, int e, const char* info)
+{
+    print_error("%s: %s: %s", msg, strerror(e), info);
+}
+
+static void
+print_version()
+{
+    printf("%s of ubackup %s\n", getprogname(), UBACKUP_VERSION);
+}
+
+static void*
+realloc_or_die(void* p, size_t size)
+{
+    void* q = realloc(p, size);
+    if (q == NULL) {
+        print_error("Cannot allocate memory.");
+        exit(1);
+    }
+    return q;
+}
+
+/*
+ * A range of a pack file which holds the body of path.
+ */
+struct Span {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t hash;
+    const char* path;
+};
+
+typedef struct Span Span;
+
+/*
+ * A file to verify, or a pack file with spans of the files in it. Hard links
+ * in backups are verified only once, with the record of the newest backup.
+ */
+struct Job {
+    uint64_t hash;
+    uint64_t size;
+    const char* path;
+    Span* spans;
+    size_t num_spans;
+    size_t spans_capacity;
+};
+
+typedef struct Job Job;
+
+struct Scrubber {
+    const char* backup_dir;
+    InodeMap inodes;
+    Arena arena;
+    Job** jobs;
+    size_t num_jobs;
+    size_t jobs_capacity;
+    size_t stale;
+    size_t packs;
+
+    pthread_mutex_t lock;
+    size_t next;
+    uint64_t bytes;
+    size_t packed;
+    size_t mismatches;
+    size_t errors;
+};
+
+typedef struct Scrubber Scrubber;
+
+static char*
+alloc_string(Scrubber* scrubber, size_t size)
+{
+    char* s = (char*)arena_alloc(&scrubber->arena, size);
+    if (s == NULL) {
+        print_error("Cannot allocate memory.");
+        exit(1);
+    }
+    return s;
+}
+
+static char*
+copy_path(Scrubber* scrubber, const char* name, const char* path)
+{
+    size_t size = strlen(scrubber->backup_dir) + strlen(name) + strlen(path) + 3;
+    char* s = alloc_string(scrubber, size);
+    snprintf(s, size, "%s/%s/%s", scrubber->backup_dir, name, path);
+    return s;
+}
+
+static Job*
+find_job(Scrubber* scrubber, const struct stat* sb)
+{
+    Job* job = (Job*)inode_map_get(&scrubber->inodes, sb->st_dev, sb->st_ino);
+    if (job != NULL) {
+        return job;
+    }
+    job = (Job*)arena_alloc(&scrubber->arena, sizeof(Job));
+    bool ok = job != NULL;
+    ok = ok && inode_map_put(&scrubber->inodes, sb->st_dev, sb->st_ino, job);
+    if (!ok) {
+        print_error("Cannot allocate memory.");
+        exit(1);
+    }
+    bzero(job, sizeof(*job));
+    if (scrubber->num_jobs == scrubber->jobs_capacity) {
+        size_t capacity = 2 * scrubber->jobs_capacity;
+        scrubber->jobs = (Job**)realloc_or_die(scrubber->jobs, sizeof(Job*) * capacity);
+        scrubber->jobs_capacity = capacity;
+    }
+    scrubber->jobs[scrubber->num_jobs] = job;
+    scrubber->num_jobs++;
+    return job;
+}
+
+static void
+add_job(Scrubber* scrubber, const struct stat* sb, const char* name, const HashRecord* record)
+{
+    Job* job = find_job(scrubber, sb);
+    job->hash = record->hash;
+    job->size = record->size;
+    job->path = copy_path(scrubber, name, record->path);
+}
+
+static char*
+copy_string(Scrubber* scrubber, const char* s)
+{
+    size_t size = strlen(s) + 1;
+    return memcpy(alloc_string(scrubber, size), s, size);
+}
+
+/*
+ * A pack which backups share by hard links gets the records of all of them,
+ * and duplicates are skipped when it is verified.
+ */
+static void
+add_span(Scrubber* scrubber, const struct stat* sb, const char* pack, const char* path,
+         const PackRecord* record)
+{
+    Job* job = find_job(scrubber, sb);
+    if (job->path == NULL) {
+        job->path = copy_string(scrubber, pack);
+        scrubber->packs++;
+    }
+    if (job->num_spans == job->spans_capacity) {
+        size_t capacity = job->spans_capacity == 0 ? 16 : 2 * job->spans_capacity;
+        job->spans = (Span*)realloc_or_die(job->spans, sizeof(Span) * capacity);
+        job->spans_capacity = capacity;
+    }
+    Span* span = &job->spans[job->num_spans];
+    span->offset = record->offset;
+    span->length = record->length;
+    span->hash = record->hash;
+    span->path = copy_string(scrubber, path);
+    job->num_spans++;
+}
+
+/*
+ * A record is stale if the file was replaced or modified after the backup,
+ * like one in a later snapshot.
+ */
+static bool
+is_stale(const struct stat* sb, const HashRecord* record)
+{
+    return !S_ISREG(sb->st_mode) || ((uint64_t)sb->st_size != record->size)
+        || (sb->st_mtim.tv_sec != record->mtime.tv_sec)
+        || (sb->st_mtim.tv_nsec != record->mtime.tv_nsec);
+}
+
+static bool
+read_hashes(Scrubber* scrubber, const char* name)
+{
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", scrubber->backup_dir, name);
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        print_errno("open failed", errno, path);
+        return false;
+    }
+    int fd = openat(dirfd, HASHES_PATH, O_RDONLY);
+    FILE* fp = fd != -1 ? fdopen(fd, "r") : NULL;
+    if (fp == NULL) {
+        bool missing = errno == ENOENT;
+        if (!missing) {
+            print_errno("open failed", errno, path);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        close(dirfd);
+        return missing;
+    }
+    char* buf = NULL;
+    size_t bufsize = 0;
+    HashRecord record;
+    while (hash_record_read(fp, &record, &buf, &bufsize)) {
+        struct stat sb;
+        if ((fstatat(dirfd, record.path, &sb, AT_SYMLINK_NOFOLLOW) != 0) || is_stale(&sb, &record)) {
+            scrubber->stale++;
+            continue;
+        }
+        add_job(scrubber, &sb, name, &record);
+    }
+    free(buf);
+    fclose(fp);
+    close(dirfd);
+    return true;
+}
+
+/*
+ * Records of PACK_INDEX in the .meta directory of dir.
+ */
+static bool
+read_pack_index(Scrubber* scrubber, const char* dir)
+{
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/.meta/%s", dir, PACK_INDEX);
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        bool missing = errno == ENOENT;
+        if (!missing) {
+            print_errno("open failed", errno, path);
+        }
+        return missing;
+    }
+    char* buf = NULL;
+    size_t bufsize = 0;
+    PackRecord record;
+    bool ok = true;
+    while (pack_record_read(fp, &record, &buf, &bufsize)) {
+        char pack[PATH_SIZE];
+        snprintf(pack, sizeof(pack), "%s/%s", dir, record.pack);
+        snprintf(path, sizeof(path), "%s/%s", dir, record.name);
+        struct stat sb;
+        if (stat(pack, &sb) != 0) {
+            print_errno("stat failed", errno, pack);
+            ok = false;
+            continue;
+        }
+        add_span(scrubber, &sb, pack, path, &record);
+    }
+    free(buf);
+    fclose(fp);
+    return ok;
+}
+
+/*
+ * Reads pack indexes of dir and of its subdirectories. dir is a buffer of
+ * PATH_SIZE bytes, which has len bytes.
+ */
+static bool
+walk_pack_indexes(Scrubber* scrubber, char* dir, size_t len)
+{
+    bool ok = read_pack_index(scrubber, dir);
+    DIR* dirp = opendir(dir);
+    if (dirp == NULL) {
+        print_errno("opendir failed", errno, dir);
+        return false;
+    }
+    struct dirent* e;
+    while ((e = readdir(dirp)) != NULL) {
+        const char* name = e->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)
+            || (strcmp(name, ".meta") == 0)) {
+            continue;
+        }
+        size_t n = strlen(name);
+        if (PATH_SIZE <= len + n + 1) {
+            print_error("Too long path: %s/%s", dir, name);
+            ok = false;
+            continue;
+        }
+        snprintf(dir + len, PATH_SIZE - len, "/%s", name);
+        bool is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN) {
+            struct stat sb;
+            is_dir = (lstat(dir, &sb) == 0) && S_ISDIR(sb.st_mode);
+        }
+        if (is_dir) {
+            ok = walk_pack_indexes(scrubber, dir, len + n + 1) && ok;
+        }
+        dir[len] = '\0';
+    }
+    closedir(dirp);
+    return ok;
+}
+
+/*
+ * Only a backup which has PACK_DIR is walked for pack indexes.
+ */
+static bool
+read_packs(Scrubber* scrubber, const char* name)
+{
+    char dir[PATH_SIZE];
+    snprintf(dir, sizeof(dir), "%s/%s/%s", scrubber->backup_dir, name, PACK_DIR);
+    struct stat sb;
+    if (stat(dir, &sb) != 0) {
+        return true;
+    }
+    int len = snprintf(dir, sizeof(dir), "%s/%s", scrubber->backup_dir, name);
+    return walk_pack_indexes(scrubber, dir, len);
+}
+
+static int
+compar(const void* p, const void* q)
+{
+    return strcmp(*(const char**)p, *(const char**)q);
+}
+
+/*
+ * Backups are read from the oldest, so that the newest record of an inode
+ * wins. Backups in progress are skipped.
+ */
+static bool
+collect_jobs(Scrubber* scrubber)
+{
+    const char* dir = scrubber->backup_dir;
+    DIR* dirp = opendir(dir);
+    if (dirp == NULL) {
+        print_errno("opendir failed", errno, dir);
+        return false;
+    }
+    char** names = NULL;
+    size_t num = 0;
+    struct dirent* e;
+    while ((e = readdir(dirp)) != NULL) {
+        if (!isdigit((unsigned char)e->d_name[0])) {
+            continue;
+        }
+        names = (char**)realloc_or_die(names, sizeof(char*) * (num + 1));
+        size_t size = strlen(e->d_name) + 1;
+        names[num] = memcpy(alloc_string(scrubber, size), e->d_name, size);
+        num++;
+    }
+    closedir(dirp);
+    qsort(names, num, sizeof(names[0]), compar);
+    bool ok = true;
+    size_t i;
+    for (i = 0; i < num; i++) {
+        ok = read_hashes(scrubber, names[i]) && ok;
+        ok = read_packs(scrubber, names[i]) && ok;
+    }
+    free(names);
+    return ok;
+}
+
+static void
+report(Scrubber* scrubber, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&scrubber->lock);
+    vprintf(fmt, ap);
+    printf("\n");
+    fflush(stdout);
+    pthread_mutex_unlock(&scrubber->lock);
+    va_end(ap);
+}
+
+static int
+open_file(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_NOATIME);
+    if ((fd == -1) && (errno == EPERM) && (O_NOATIME != 0)) {
+        fd = open(path, O_RDONLY);
+    }
+    return fd;
+}
+
+/*
+ * Returns false if the file could not be read. The size is checked too,
+ * because the file may be truncated after the record was read.
+ */
+static bool
+hash_file(const char* path, char* buf, uint64_t* hash, uint64_t* size)
+{
+    int fd = open_file(path);
+    if (fd == -1) {
+        print_errno("open failed", errno, path);
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    Xxh64 state;
+    xxh64_init(&state);
+    off_t total = 0;
+    off_t dropped = 0;
+    ssize_t n;
+    while (0 < (n = read(fd, buf, IO_SIZE))) {
+        xxh64_update(&state, buf, n);
+        total += n;
+        if (DROP_SIZE <= total - dropped) {
+            posix_fadvise(fd, dropped, total - dropped, POSIX_FADV_DONTNEED);
+            dropped = total;
+        }
+    }
+    int e = errno;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    if (n == -1) {
+        print_errno("read failed", e, path);
+        return false;
+    }
+    *hash = xxh64_digest(&state);
+    *size = total;
+    return true;
+}
+
+static Job*
+next_job(Scrubber* scrubber)
+{
+    pthread_mutex_lock(&scrubber->lock);
+    size_t i = scrubber->next;
+    scrubber->next += i < scrubber->num_jobs ? 1 : 0;
+    pthread_mutex_unlock(&scrubber->lock);
+    return i < scrubber->num_jobs ? scrubber->jobs[i] : NULL;
+}
+
+static void
+count(Scrubber* scrubber, uint64_t bytes, bool matched, bool read)
+{
+    pthread_mutex_lock(&scrubber->lock);
+    scrubber->bytes += bytes;
+    scrubber->mismatches += read && !matched ? 1 : 0;
+    scrubber->errors += read ? 0 : 1;
+    pthread_mutex_unlock(&scrubber->lock);
+}
+
+static int
+compare_spans(const void* p, const void* q)
+{
+    const Span* a = (const Span*)p;
+    const Span* b = (const Span*)q;
+    if (a->offset != b->offset) {
+        return a->offset < b->offset ? -1 : 1;
+    }
+    return a->length < b->length ? -1 : (a->length == b->length ? 0 : 1);
+}
+
+/*
+ * Spans are read in the order of their offsets. A span which backups share is
+ * verified once.
+ */
+static void
+scrub_pack(Scrubber* scrubber, Job* job, char* buf)
+{
+    qsort(job->spans, job->num_spans, sizeof(Span), compare_spans);
+    int fd = open_file(job->path);
+    if (fd == -1) {
+        print_errno("open failed", errno, job->path);
+        count(scrubber, 0, false, false);
+        return;
+    }
+    size_t packed = 0;
+    const Span* prev = NULL;
+    size_t i;
+    for (i = 0; i < job->num_spans; i++) {
+        const Span* span = &job->spans[i];
+        bool same = (prev != NULL) && (prev->offset == span->offset)
+            && (prev->length == span->length) && (prev->hash == span->hash);
+        if (same) {
+            continue;
+        }
+        prev = span;
+        Xxh64 state;
+        xxh64_init(&state);
+        uint64_t done = 0;
+        bool read = true;
+        while (read && (done < span->length)) {
+            size_t size = IO_SIZE < span->length - done ? IO_SIZE : span->length - done;
+            ssize_t n = pread(fd, buf, size, span->offset + done);
+            if (n == -1) {
+                print_errno("read failed", errno, job->path);
+            }
+            else if (n == 0) {
+                print_error("%s ends before the body of %s", job->path, span->path);
+            }
+            read = 0 < n;
+            if (read) {
+                xxh64_update(&state, buf, n);
+                done += n;
+            }
+        }
+        uint64_t hash = xxh64_digest(&state);
+        bool matched = read && (hash == span->hash);
+        if (read && !matched) {
+            report(scrubber, "MISMATCH %s in %s (expected %016" PRIx64 ", got %016" PRIx64 ")",
+                   span->path, job->path, span->hash, hash);
+        }
+        count(scrubber, read ? span->length : 0, matched, read);
+        packed++;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    pthread_mutex_lock(&scrubber->lock);
+    scrubber->packed += packed;
+    pthread_mutex_unlock(&scrubber->lock);
+}
+
+static void*
+scrub(void* arg)
+{
+    Scrubber* scrubber = (Scrubber*)arg;
+    char* buf;
+    if (posix_memalign((void**)&buf, IO_ALIGNMENT, IO_SIZE) != 0) {
+        print_error("Cannot allocate memory.");
+        exit(1);
+    }
+    Job* job;
+    while ((job = next_job(scrubber)) != NULL) {
+        if (job->spans != NULL) {
+            scrub_pack(scrubber, job, buf);
+            continue;
+        }
+        uint64_t hash, size;
+        bool read = hash_file(job->path, buf, &hash, &size);
+        bool matched = read && (hash == job->hash) && (size == job->size);
+        if (read && !matched) {
+            struct stat sb;
+            nlink_t nlink = stat(job->path, &sb) == 0 ? sb.st_nlink : 0;
+            report(scrubber, "MISMATCH %s (expected %016" PRIx64 ", got %016" PRIx64 ", %ju links)",
+                   job->path, job->hash, hash, (uintmax_t)nlink);
+        }
+        count(scrubber, read ? size : 0, matched, read);
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Reads files by jobs threads, so that latencies of a disk array overlap. A
+ * thread which cannot start is not an error while one is running.
+ */
+static int
+run_scrubber(const char* backup_dir, int jobs)
+{
+    Scrubber scrubber;
+    bzero(&scrubber, sizeof(scrubber));
+    scrubber.backup_dir = backup_dir;
+    scrubber.jobs_capacity = 1024;
+    scrubber.jobs = (Job**)realloc_or_die(NULL, sizeof(Job*) * scrubber.jobs_capacity);
+    if (!inode_map_init(&scrubber.inodes) || !arena_init(&scrubber.arena, 64 * 1024)) {
+        print_error("Cannot allocate memory.");
+        return 1;
+    }
+    pthread_mutex_init(&scrubber.lock, NULL);
+    bool collected = collect_jobs(&scrubber);
+
+    pthread_t threads[jobs];
+    int started = 0;
+    while ((started < jobs) && (pthread_create(&threads[started], NULL, scrub, &scrubber) == 0)) {
+        started++;
+    }
+    if (started == 0) {
+        scrub(&scrubber);
+    }
+    int i;
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("files=%zu packed=%zu bytes=%" PRIu64 " stale=%zu mismatches=%zu errors=%zu\n",
+           scrubber.num_jobs - scrubber.packs, scrubber.packed, scrubber.bytes, scrubber.stale,
+           scrubber.mismatches, scrubber.errors);
+    bool ok = collected && (scrubber.mismatches == 0) && (scrubber.errors == 0);
+
+    size_t j;
+    for (j = 0; j < scrubber.num_jobs; j++) {
+        free(scrubber.jobs[j]->spans);
+    }
+    pthread_mutex_destroy(&scrubber.lock);
+    arena_destroy(&scrubber.arena);
+    inode_map_destroy(&scrubber.inodes);
+    free(scrubber.jobs);
+    return ok ? 0 : 1;
+}
+
+static void
+usage(const char* ident)
+{
+    printf("%s [--jobs=n] backup_dir\n", ident);
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct option opts[] = {
+        { "jobs", required_argument, NULL, 'j' },
+        { "version", no_argument, NULL, 'v' },
+        { NULL, 0, NULL, 0 }
+    };
+    int jobs = DEFAULT_JOBS;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "v", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'v':
+            print_version();
+            return 0;
+        default:
+            usage(basename(argv[0]));
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage(basename(argv[0]));
+        return 1;
+    }
+    return run_scrubber(argv[optind], 0 < jobs ? jobs : 1);
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
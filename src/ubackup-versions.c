@@ -0,0 +1,337 @@
+#include <ubackup/config.h>
+#include <ubackup/timestamp.h>
+#include <ubackup/versions.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PATH_SIZE 4096
+#define INITIAL_SLOTS 1024
+#define EMPTY SIZE_MAX
+
+static void
+print_error(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static void
+print_errno(const char* msg, int e, const char* info)
+{
+    print_error("%s: %s: %s", msg, strerror(e), info);
+}
+
+static void
+print_version()
+{
+    printf("%s of ubackup %s\n", getprogname(), UBACKUP_VERSION);
+}
+
+static void*
+realloc_or_die(void* p, size_t size)
+{
+    void* q = realloc(p, size);
+    if (q == NULL) {
+        print_error("Cannot allocate memory.");
+        exit(1);
+    }
+    return q;
+}
+
+static char*
+strdup_or_die(const char* s)
+{
+    char* t = strdup(s);
+    if (t == NULL) {
+        print_error("Cannot allocate memory.");
+        exit(1);
+    }
+    return t;
+}
+
+/*
+ * A version of a file from the backup of start until the one of end. end is
+ * NULL if the version is in the last indexed backup.
+ */
+struct Run {
+    char* path;
+    const char* start;
+    const char* end;
+    uint64_t size;
+    struct timespec mtime;
+};
+
+typedef struct Run Run;
+
+/*
+ * Runs, and indexes of the last runs by paths.
+ */
+struct Runs {
+    Run* runs;
+    size_t num;
+    size_t* slots;
+    size_t num_slots;
+    size_t num_paths;
+};
+
+typedef struct Runs Runs;
+
+static uint32_t
+hash_path(const char* path)
+{
+    uint32_t h = 2166136261u;
+    const unsigned char* p;
+    for (p = (const unsigned char*)path; *p != '\0'; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static size_t*
+find_slot(const Runs* runs, size_t* slots, size_t num_slots, const char* path)
+{
+    size_t i = hash_path(path) & (num_slots - 1);
+    while ((slots[i] != EMPTY) && (strcmp(runs->runs[slots[i]].path, path) != 0)) {
+        i = (i + 1) & (num_slots - 1);
+    }
+    return &slots[i];
+}
+
+static void
+grow_slots(Runs* runs)
+{
+    size_t num_slots = runs->num_slots == 0 ? INITIAL_SLOTS : 2 * runs->num_slots;
+    size_t* slots = (size_t*)realloc_or_die(NULL, num_slots * sizeof(size_t));
+    memset(slots, 0xff, num_slots * sizeof(size_t));
+    size_t i;
+    for (i = 0; i < runs->num_slots; i++) {
+        size_t j = runs->slots[i];
+        if (j != EMPTY) {
+            *find_slot(runs, slots, num_slots, runs->runs[j].path) = j;
+        }
+    }
+    free(runs->slots);
+    runs->slots = slots;
+    runs->num_slots = num_slots;
+}
+
+/*
+ * A new version or a removal ends the last run of the path if it is open.
+ */
+static void
+apply(Runs* runs, const VersionRecord* record, const char* name)
+{
+    if (runs->num_slots <= 2 * (runs->num_paths + 1)) {
+        grow_slots(runs);
+    }
+    size_t* slot = find_slot(runs, runs->slots, runs->num_slots, record->path);
+    if ((*slot != EMPTY) && (runs->runs[*slot].end == NULL)) {
+        runs->runs[*slot].end = name;
+    }
+    if (record->op != '+') {
+        return;
+    }
+    runs->runs = (Run*)realloc_or_die(runs->runs, (runs->num + 1) * sizeof(Run));
+    Run* run = &runs->runs[runs->num];
+    run->path = *slot != EMPTY ? runs->runs[*slot].path : strdup_or_die(record->path);
+    run->start = name;
+    run->end = NULL;
+    run->size = record->size;
+    run->mtime = record->mtime;
+    runs->num_paths += *slot == EMPTY ? 1 : 0;
+    *slot = runs->num;
+    runs->num++;
+}
+
+static int
+compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+static int
+compare_runs(const void* a, const void* b)
+{
+    const Run* p = (const Run*)a;
+    const Run* q = (const Run*)b;
+    int cmp = versions_compare_paths(p->path, q->path);
+    return cmp != 0 ? cmp : strcmp(p->start, q->start);
+}
+
+/*
+ * Names starting with a digit in dir, sorted.
+ */
+static char**
+list_names(const char* dir, size_t* num)
+{
+    *num = 0;
+    DIR* dirp = opendir(dir);
+    if (dirp == NULL) {
+        print_errno("opendir failed", errno, dir);
+        return NULL;
+    }
+    char** names = (char**)realloc_or_die(NULL, sizeof(char*));
+    struct dirent* e;
+    while ((e = readdir(dirp)) != NULL) {
+        if (!isdigit((unsigned char)e->d_name[0])) {
+            continue;
+        }
+        names = (char**)realloc_or_die(names, (*num + 1) * sizeof(char*));
+        names[*num] = strdup_or_die(e->d_name);
+        (*num)++;
+    }
+    closedir(dirp);
+    qsort(names, *num, sizeof(char*), compare_names);
+    return names;
+}
+
+static bool
+read_changes(Runs* runs, const char* dir, const char* name, const char* pattern)
+{
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        print_errno("fopen failed", errno, path);
+        return false;
+    }
+    char* buf = NULL;
+    size_t bufsize = 0;
+    VersionRecord record;
+    while (version_record_read(fp, &record, &buf, &bufsize)) {
+        if (fnmatch(pattern, record.path, 0) == 0) {
+            apply(runs, &record, name);
+        }
+    }
+    free(buf);
+    fclose(fp);
+    return true;
+}
+
+/*
+ * Prints the first and the last existing backups which have the version. A
+ * version only in removed backups is not printed.
+ */
+static void
+print_run(const Run* run, char** backups, size_t num_backups)
+{
+    size_t first = 0;
+    while ((first < num_backups) && (strcmp(backups[first], run->start) < 0)) {
+        first++;
+    }
+    size_t last = first;
+    while ((last < num_backups) && ((run->end == NULL) || (strcmp(backups[last], run->end) < 0))) {
+        last++;
+    }
+    if (last == first) {
+        return;
+    }
+    char stored[TIMESTAMP_ISO8601_MAXSIZE];
+    timestamp_format_iso8601(stored, run->mtime.tv_sec);
+    printf("%s %s %" PRIu64 " %s %s\n", backups[first], backups[last - 1], run->size, stored,
+           run->path);
+}
+
+/*
+ * since and until are prefixes of backup names like "2026-10-18". A version
+ * is printed if it appeared in a backup between them.
+ */
+static bool
+is_in_range(const Run* run, const char* since, const char* until)
+{
+    if ((since != NULL) && (strcmp(run->start, since) < 0)) {
+        return false;
+    }
+    return (until == NULL) || (strncmp(run->start, until, strlen(until)) <= 0);
+}
+
+static int
+query(const char* backup_dir, const char* pattern, const char* since, const char* until)
+{
+    char dir[PATH_SIZE];
+    snprintf(dir, sizeof(dir), "%s/%s", backup_dir, VERSIONS_DIR);
+    size_t num_changes, num_backups;
+    char** changes = list_names(dir, &num_changes);
+    char** backups = list_names(backup_dir, &num_backups);
+    if ((changes == NULL) || (backups == NULL)) {
+        return 1;
+    }
+    while (*pattern == '/') {
+        pattern++;
+    }
+    Runs runs;
+    bzero(&runs, sizeof(runs));
+    bool ok = true;
+    size_t i;
+    for (i = 0; i < num_changes; i++) {
+        ok = read_changes(&runs, dir, changes[i], pattern) && ok;
+    }
+    qsort(runs.runs, runs.num, sizeof(Run), compare_runs);
+    for (i = 0; i < runs.num; i++) {
+        if (is_in_range(&runs.runs[i], since, until)) {
+            print_run(&runs.runs[i], backups, num_backups);
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+static void
+usage(const char* ident)
+{
+    printf("%s [--since=time] [--until=time] backup_dir pattern\n", ident);
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct option opts[] = {
+        { "since", required_argument, NULL, 's' },
+        { "until", required_argument, NULL, 'u' },
+        { "version", no_argument, NULL, 'v' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char* since = NULL;
+    const char* until = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "v", opts, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            since = optarg;
+            break;
+        case 'u':
+            until = optarg;
+            break;
+        case 'v':
+            print_version();
+            return 0;
+        default:
+            usage(basename(argv[0]));
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(basename(argv[0]));
+        return 1;
+    }
+    return query(argv[optind], argv[optind + 1], since, until);
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
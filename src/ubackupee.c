@@ -1,10 +1,23 @@
+#include <ubackup/bufring.h>
 #include <ubackup/config.h>
+#include <ubackup/filter.h>
+#include <ubackup/journal.h>
+#include <ubackup/manifest.h>
+#include <ubackup/phase.h>
+#include <ubackup/progress.h>
+#include <ubackup/protocol.h>
+#include <ubackup/throttle.h>
+#include <ubackup/timestamp.h>
 
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -22,24 +35,80 @@
 
 #define PATH_SIZE 4096
 #define BUF_SIZE PATH_SIZE
+/*
+ * Files of LARGE_FILE_SIZE or more are read without staying in the page cache,
+ * so a backup does not evict caches of other processes. READ_SIZE is a
+ * multiple of the block size for O_DIRECT.
+ */
+#define LARGE_FILE_SIZE (8 * 1024 * 1024)
+#define READ_SIZE (256 * 1024)
+#define READ_ALIGNMENT 4096
+/*
+ * While senders of devices share the pipe, bodies of more than
+ * PARTED_BODY_SIZE are sent in parts, so that a large file does not hold the
+ * pipe. Smaller ones go in one BODY, which the backuper may pack.
+ */
+#define PARTED_BODY_SIZE (1024 * 1024)
+
+#if !defined(O_NOATIME)
+#define O_NOATIME 0
+#endif
 
 #define TRACE(fmt, ...) do { \
     fprintf(stderr, "%s:%u " fmt "\n", __FILE__, __LINE__, __VA_ARGS__); \
 } while (0)
 
+/*
+ * The pipe to the backuper, which senders of devices share. Each sender has
+ * its own stream, and STREAM is sent when another one used the pipe last.
+ * records guards the manifest writer and the progress, which count entries of
+ * all senders.
+ */
+struct Mux {
+    pthread_mutex_t lock;
+    unsigned int stream;
+    size_t num_streams;
+    pthread_mutex_t records;
+    ManifestWriter* manifest_writer;
+    Progress* progress;
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+typedef struct Mux Mux;
+
 struct Client {
     FILE* in;
     FILE* out;
+    Mux* mux;
+    unsigned int stream;
+    uint64_t reported_entries;
+    uint64_t reported_bytes;
     char root[PATH_SIZE];
+    char cwd[PATH_SIZE];
+    Filter* filter;
+    Manifest* manifest;
+    ManifestWriter manifest_writer;
+    bool diff;
+    bool writing_manifest;
+    char** walked;
+    size_t num_walked;
+    bool direct_io;
+    Throttle* throttle;
+    BufRing ring;
     struct {
         int num_files;
         int num_changed;
         uint64_t send_bytes;
         int num_skipped;
+        int num_excluded;
         int num_dir;
         int num_symlinks;
         time_t start_time;
+        uint64_t start_ns;
     } stat;
+    Phases phases;
+    Progress progress;
     struct {
         bool block_special;
         bool char_special;
@@ -78,40 +147,130 @@ print_errno2(const char* msg, int e)
 
 #define PRINT_ERRNO2(msg) print_errno2((msg), errno)
 
+static uint64_t
+count_entries(const Client* client)
+{
+    int n = client->stat.num_files + client->stat.num_dir;
+    n += client->stat.num_symlinks + client->stat.num_skipped;
+    return n + client->stat.num_excluded;
+}
+
+/*
+ * A sender adds what it did since its last report to the totals of all
+ * senders.
+ */
+static void
+update_progress(Client* client, uint64_t bytes, const char* path)
+{
+    uint64_t entries = count_entries(client);
+    Mux* mux = client->mux;
+    if (mux == NULL) {
+        progress_update(&client->progress, entries, bytes, path);
+        return;
+    }
+    pthread_mutex_lock(&mux->records);
+    mux->entries += entries - client->reported_entries;
+    mux->bytes += bytes - client->reported_bytes;
+    client->reported_entries = entries;
+    client->reported_bytes = bytes;
+    progress_update(mux->progress, mux->entries, mux->bytes, path);
+    pthread_mutex_unlock(&mux->records);
+}
+
 static int
+do_lstat(const Client* client, Phases* phases, const char* path, struct stat* sb)
+{
+    uint64_t t = phase_now();
+    int status = lstat(path, sb);
+    phase_record(phases, PHASE_STAT, t);
+    if ((client->throttle != NULL) && (status == 0)) {
+        throttle_account_stat(client->throttle, sb->st_dev, phase_now() - t);
+    }
+    return status;
+}
+
+/*
+ * Responses of FILE. FILE_FAILED is for NG, when the backuper could not make
+ * the entry.
+ */
+enum FileStatus {
+    FILE_CHANGED,
+    FILE_UNCHANGED,
+    FILE_FAILED
+};
+
+typedef enum FileStatus FileStatus;
+
+static void
+unlock_pipe(Client* client)
+{
+    if (client->mux != NULL) {
+        pthread_mutex_unlock(&client->mux->lock);
+    }
+}
+
+/*
+ * Receives the response of the last command, and unlocks the pipe which send()
+ * locked.
+ */
+static char*
+recv_line(Client* client, char* buf, size_t size)
+{
+    char* line = fgets(buf, size, client->in);
+    unlock_pipe(client);
+    return line;
+}
+
+static FileStatus
 recv_changed(Client* client)
 {
     size_t size = 4096;
     char buf[size];
-    if (fgets(buf, size, client->in) == NULL) {
+    if (recv_line(client, buf, size) == NULL) {
         PRINT_ERRNO2("Receiving \"CHANGED\" failed");
         abort();
     }
-    const char* expected = "CHANGED";
-    return strncmp(expected, buf, strlen(expected));
+    if (strncmp(buf, "CHANGED", 7) == 0) {
+        return FILE_CHANGED;
+    }
+    if (strncmp(buf, "UNCHANGED", 9) == 0) {
+        return FILE_UNCHANGED;
+    }
+    return FILE_FAILED;
 }
 
-static void
+/*
+ * Returns false for NG. Callers which can do nothing about a failure ignore it,
+ * because the backuper marks the current directory as failed by itself.
+ */
+static bool
 recv_ok(Client* client)
 {
     size_t size = 4096;
     char buf[size];
-    if (fgets(buf, size, client->in) == NULL) {
+    if (recv_line(client, buf, size) == NULL) {
         PRINT_ERRNO2("Receiving \"OK\" failed");
         abort();
     }
-#if 0
-    const char* expected = "OK";
-    if (strncmp(expected, buf, strlen(expected)) != 0) {
-        abort();
-    }
-#endif
+    return strncmp(buf, "OK", 2) == 0;
 }
 
+/*
+ * A sender keeps the pipe locked until recv_line() receives the response, or
+ * until unlock_pipe() for a command without one.
+ */
 static void
 send(Client* client, const char* fmt, ...)
 {
     FILE* fp = client->out;
+    Mux* mux = client->mux;
+    if (mux != NULL) {
+        pthread_mutex_lock(&mux->lock);
+        if (mux->stream != client->stream) {
+            fprintf(fp, "STREAM %u\r\n", client->stream);
+            mux->stream = client->stream;
+        }
+    }
     va_list ap;
     va_start(ap, fmt);
     vfprintf(fp, fmt, ap);
@@ -120,60 +279,55 @@ send(Client* client, const char* fmt, ...)
     fflush(fp);
 }
 
-static void
-quote(char* dest, const char* path)
-{
-    char* q = dest;
-    *q = '\"';
-    q++;
-
-    const char* p;
-    for (p = path; *p != '\0'; p++) {
-        char c = *p;
-        if ((c == '\"') || (c == '\\')) {
-            *q = '\\';
-            q++;
-        }
-        *q = c;
-        q++;
-    }
-    strcpy(q, "\"");
-}
-
 static void
 get_path_from_root(char* dest, const char* root, const char* path)
 {
     strcpy(dest, path + (strcmp(root, "/") == 0 ? 0 : strlen(root)));
 }
 
-#define ISO_8601_MAXSIZE (strlen("yyyy-mm-ddThh:nn:ss") + 1)
-
+/*
+ * Names in DIR, FILE and SYMLINK commands are relative to the directory of the
+ * last CWD command. It is sent only when the directory changes.
+ */
 static void
-to_iso8601(char* buf, size_t bufsize, const time_t* clock)
+change_dir(Client* client, const char* path)
 {
-    struct tm tm;
-    localtime_r(clock, &tm);
-    strftime(buf, bufsize, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (strcmp(client->cwd, path) == 0) {
+        return;
+    }
+    char path_from_root[strlen(path) + 1];
+    get_path_from_root(path_from_root, client->root, path);
+    char buf[2 * strlen(path_from_root) + 3];
+    protocol_quote(buf, path_from_root);
+    uint64_t t = phase_now();
+    send(client, "CWD %s", buf);
+    recv_ok(client);
+    phase_record(&client->phases, PHASE_QUERY, t);
+    snprintf(client->cwd, sizeof(client->cwd), "%s", path);
 }
 
-static void
-send_dir(Client* client, const char* path)
+/*
+ * name is an absolute path from the root, or a name in the current directory
+ * of the backuper.
+ */
+static bool
+send_dir(Client* client, const char* path, const char* name)
 {
     struct stat sb;
-    if (lstat(path, &sb) != 0) {
+    if (do_lstat(client, &client->phases, path, &sb) != 0) {
         PRINT_ERRNO("lstat directory failed", path);
-        return;
+        return false;
     }
-    char path_from_root[strlen(path) + 1];
-    get_path_from_root(path_from_root, client->root, path);
-    char buf[2 * strlen(path_from_root) + 3];
-    quote(buf, path_from_root);
-    size_t maxsize = ISO_8601_MAXSIZE;
-    char ctime[maxsize];
-    to_iso8601(ctime, maxsize, &sb.st_ctime);
+    char buf[2 * strlen(name) + 3];
+    protocol_quote(buf, name);
+    char ctime[TIMESTAMP_MAXSIZE];
+    timestamp_encode(ctime, &sb.st_ctim);
     const char* fmt = "DIR %s %o %d %d %s";
+    uint64_t t = phase_now();
     send(client, fmt, buf, 0777 & sb.st_mode, sb.st_uid, sb.st_gid, ctime);
-    recv_ok(client);
+    bool made = recv_ok(client);
+    phase_record(&client->phases, PHASE_QUERY, t);
+    return made;
 }
 
 #define array_sizeof(a) (sizeof(a) / sizeof(a[0]))
@@ -194,21 +348,21 @@ backup_parent(Client* client, const char* path)
     strcpy(dir, parent);
     backup_parent(client, dir);
 
-    send_dir(client, path);
+    char path_from_root[strlen(path) + 1];
+    get_path_from_root(path_from_root, client->root, path);
+    send_dir(client, path, path_from_root);
 }
 
-static void
-send_symlink(Client* client, const char* path)
+static bool
+send_symlink(Client* client, const char* path, const char* name)
 {
-    char path_from_root[strlen(path) + 1];
-    get_path_from_root(path_from_root, client->root, path);
-    char quoted_path[2 * strlen(path_from_root) + 3];
-    quote(quoted_path, path_from_root);
+    char quoted_path[2 * strlen(name) + 3];
+    protocol_quote(quoted_path, name);
 
     struct stat sb;
-    if (lstat(path, &sb) != 0) {
+    if (do_lstat(client, &client->phases, path, &sb) != 0) {
         PRINT_ERRNO("lstat symlink failed", path);
-        return;
+        return false;
     }
 
     size_t src_size = 4096;
@@ -216,188 +370,1398 @@ send_symlink(Client* client, const char* path)
     ssize_t size = readlink(path, src, src_size);
     if (size == -1) {
         PRINT_ERRNO("readlink failed", path);
-        return;
+        return false;
     }
     src[size] = '\0';
     char quoted_src[2 * strlen(src) + 3];
-    quote(quoted_src, src);
-    size_t maxsize = ISO_8601_MAXSIZE;
-    char ctime[maxsize];
-    to_iso8601(ctime, maxsize, &sb.st_ctime);
+    protocol_quote(quoted_src, src);
+    char ctime[TIMESTAMP_MAXSIZE];
+    timestamp_encode(ctime, &sb.st_ctim);
 
     const char* fmt = "SYMLINK %s %o %u %u %s %s";
     mode_t mode = 0777 & sb.st_mode;
     uid_t uid = sb.st_uid;
     gid_t gid = sb.st_gid;
+    uint64_t t = phase_now();
     send(client, fmt, quoted_path, mode, uid, gid, ctime, quoted_src);
-    recv_ok(client);
+    bool made = recv_ok(client);
+    phase_record(&client->phases, PHASE_QUERY, t);
+    return made;
 }
 
+/*
+ * Large files are read with O_DIRECT if --direct-io is given and the
+ * filesystem supports it. Otherwise pages which were sent are dropped from
+ * the page cache, and the next ones are asked to be read ahead.
+ */
 static void
-send_locked_file(Client* client, const char* path, FILE* fp)
+start_reading(Client* client, int fd, size_t size)
 {
-    char path_from_root[strlen(path) + 1];
-    get_path_from_root(path_from_root, client->root, path);
-    char buf[2 * strlen(path_from_root) + 3];
-    quote(buf, path_from_root);
+    if (size < LARGE_FILE_SIZE) {
+        return;
+    }
+#if defined(O_DIRECT)
+    if (client->direct_io) {
+        int flags = fcntl(fd, F_GETFL);
+        if ((flags != -1) && (fcntl(fd, F_SETFL, flags | O_DIRECT) == 0)) {
+            return;
+        }
+    }
+#else
+    (void)client;
+#endif
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, LARGE_FILE_SIZE, POSIX_FADV_WILLNEED);
+}
+
+static bool
+is_direct(int fd)
+{
+#if defined(O_DIRECT)
+    int flags = fcntl(fd, F_GETFL);
+    return (flags != -1) && ((flags & O_DIRECT) != 0);
+#else
+    (void)fd;
+    return false;
+#endif
+}
+
+static void
+drop_pages(int fd, off_t from, off_t to)
+{
+    posix_fadvise(fd, from, to - from, POSIX_FADV_DONTNEED);
+    posix_fadvise(fd, to, LARGE_FILE_SIZE, POSIX_FADV_WILLNEED);
+}
+
+static ssize_t
+read_chunk(int fd, char* buf)
+{
+    ssize_t nbytes = read(fd, buf, READ_SIZE);
+    if ((nbytes != -1) || (errno != EINVAL) || !is_direct(fd)) {
+        return nbytes;
+    }
+#if defined(O_DIRECT)
+    /* O_DIRECT is not supported by the filesystem, or the offset is odd. */
+    int flags = fcntl(fd, F_GETFL);
+    if ((flags == -1) || (fcntl(fd, F_SETFL, flags & ~O_DIRECT) != 0)) {
+        return -1;
+    }
+    return read(fd, buf, READ_SIZE);
+#else
+    return nbytes;
+#endif
+}
+
+struct Reader {
+    Client* client;
+    int fd;
+    dev_t dev;
+    size_t size;
+    int error;
+    size_t rest;
+    off_t dropped;
+    bool large;
+};
+
+typedef struct Reader Reader;
+
+static void
+init_reader(Reader* reader, Client* client, int fd, dev_t dev, size_t size)
+{
+    reader->client = client;
+    reader->fd = fd;
+    reader->dev = dev;
+    reader->size = size;
+    reader->error = 0;
+    reader->rest = size;
+    reader->dropped = 0;
+    reader->large = (LARGE_FILE_SIZE <= size) && !is_direct(fd);
+}
+
+/*
+ * Fills one buffer of the ring. Returns false when size bytes were read or the
+ * file ended.
+ */
+static bool
+read_next(Reader* reader)
+{
+    if (reader->rest == 0) {
+        return false;
+    }
+    Throttle* throttle = reader->client->throttle;
+    BufRing* ring = &reader->client->ring;
+    int fd = reader->fd;
+    char* buf = bufring_acquire(ring);
+    uint64_t t = phase_now();
+    ssize_t nbytes = read_chunk(fd, buf);
+    if (throttle != NULL) {
+        throttle_account_read(throttle, reader->dev, 0 < nbytes ? nbytes : 0, phase_now() - t);
+    }
+    if (nbytes <= 0) {
+        reader->error = nbytes == -1 ? errno : 0;
+        return false;
+    }
+    size_t n = (size_t)nbytes < reader->rest ? (size_t)nbytes : reader->rest;
+    bufring_commit(ring, n);
+    reader->rest -= n;
+    off_t offset = reader->size - reader->rest;
+    if (reader->large && (reader->dropped + LARGE_FILE_SIZE <= offset)) {
+        drop_pages(fd, reader->dropped, offset);
+        reader->dropped = offset;
+    }
+    return true;
+}
+
+static void
+finish_reading(Reader* reader)
+{
+    bufring_close(&reader->client->ring);
+    if (reader->large) {
+        posix_fadvise(reader->fd, reader->dropped, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+/*
+ * Fills buffers of the ring with the body until size bytes are read or the
+ * file ends.
+ */
+static void*
+read_body(void* arg)
+{
+    Reader* reader = (Reader*)arg;
+    while (read_next(reader)) {
+    }
+    finish_reading(reader);
+    return NULL;
+}
+
+/*
+ * Each part holds the pipe only while it is written.
+ */
+static void
+write_body(Client* client, const char* buf, size_t len, bool parted)
+{
+    if (!parted) {
+        fwrite(buf, 1, len, client->out);
+        return;
+    }
+    send(client, "BODY_PART %zu", len);
+    fwrite(buf, 1, len, client->out);
+    fflush(client->out);
+    unlock_pipe(client);
+}
+
+/*
+ * A body of more than one buffer is read by another thread, so that reading the
+ * disk and writing the pipe overlap. Without the thread, each buffer is sent
+ * as soon as it is read, because the ring cannot hold the whole body. If the
+ * file shrank after lstat(2), or reading it failed, the rest is filled with
+ * zeros to keep the protocol, and false tells the caller to discard the body.
+ * A parted body just ends short instead.
+ */
+static bool
+send_body(Client* client, const char* path, int fd, dev_t dev, size_t size, bool parted)
+{
+    start_reading(client, fd, size);
+    BufRing* ring = &client->ring;
+    bufring_reset(ring);
+    Reader reader;
+    init_reader(&reader, client, fd, dev, size);
+    pthread_t reader_thread;
+    bool threaded = READ_SIZE < size;
+    if (threaded && (pthread_create(&reader_thread, NULL, read_body, &reader) != 0)) {
+        threaded = false;
+    }
+    bool reading = !threaded;
+    size_t sent = 0;
+    char* buf;
+    size_t len;
+    while (true) {
+        if (reading && !read_next(&reader)) {
+            finish_reading(&reader);
+            reading = false;
+        }
+        if ((buf = bufring_peek(ring, &len)) == NULL) {
+            break;
+        }
+        write_body(client, buf, len, parted);
+        bufring_release(ring);
+        sent += len;
+        update_progress(client, client->stat.send_bytes + sent, path);
+    }
+    if (threaded) {
+        pthread_join(reader_thread, NULL);
+    }
+    bool complete = size <= sent;
+    if (!complete && (reader.error != 0)) {
+        print_errno("read failed", reader.error, path);
+    }
+    else if (!complete) {
+        print_error("%s was truncated during its backup", path);
+    }
+    if (parted) {
+        return complete;
+    }
+    static const char zeros[4096];
+    while (sent < size) {
+        size_t n = sizeof(zeros) < size - sent ? sizeof(zeros) : size - sent;
+        fwrite(zeros, 1, n, client->out);
+        sent += n;
+    }
+    fflush(client->out);
+    return complete;
+}
+
+static bool
+send_locked_file(Client* client, const char* path, const char* name, int fd)
+{
+    char buf[2 * strlen(name) + 3];
+    protocol_quote(buf, name);
 
     struct stat sb;
-    if (lstat(path, &sb) != 0) {
+    if (do_lstat(client, &client->phases, path, &sb) != 0) {
         PRINT_ERRNO("lstat file failed", path);
-        return;
+        return false;
     }
 
-    size_t maxsize = ISO_8601_MAXSIZE;
-    char mtime[maxsize];
-    to_iso8601(mtime, maxsize, &sb.st_mtime);
-    char ctime[maxsize];
-    to_iso8601(ctime, maxsize, &sb.st_ctime);
+    char mtime[TIMESTAMP_MAXSIZE];
+    timestamp_encode(mtime, &sb.st_mtim);
+    char ctime[TIMESTAMP_MAXSIZE];
+    timestamp_encode(ctime, &sb.st_ctim);
 
     const char* fmt = "FILE %s %o %u %u %s %s";
     mode_t mode = 0777 & sb.st_mode;
+    uint64_t t = phase_now();
     send(client, fmt, buf, mode, sb.st_uid, sb.st_gid, mtime, ctime);
+    FileStatus status = recv_changed(client);
+    phase_record(&client->phases, PHASE_QUERY, t);
+    if (status != FILE_CHANGED) {
+        return status == FILE_UNCHANGED;
+    }
+    client->stat.num_changed++;
+
+    t = phase_now();
+    size_t size = sb.st_size;
+    const Mux* mux = client->mux;
+    bool parted = (mux != NULL) && (1 < mux->num_streams) && (PARTED_BODY_SIZE < size);
+    if (parted) {
+        send(client, "OPEN_BODY %zu", size);
+        unlock_pipe(client);
+    }
+    else {
+        send(client, "BODY %zu", size);
+    }
+    bool complete = send_body(client, path, fd, sb.st_dev, size, parted);
+    if (parted) {
+        send(client, "BODY_END");
+    }
+    bool stored = recv_ok(client);
+    if (!complete || !stored) {
+        /* The backuper removes the file, so the next backup sends it again. */
+        send(client, "DISCARD");
+        recv_ok(client);
+    }
+    phase_record(&client->phases, PHASE_BODY, t);
+    client->stat.send_bytes += size;
+    return complete && stored;
+}
+
+/*
+ * O_NOATIME keeps atimes of files, and avoids writes of their inodes. It is
+ * allowed only for owners of files.
+ */
+static int
+open_file(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_NOATIME);
+    if ((fd == -1) && (errno == EPERM) && (O_NOATIME != 0)) {
+        fd = open(path, O_RDONLY);
+    }
+    return fd;
+}
+
+static bool
+send_file(Client* client, const char* path, const char* name)
+{
+    uint64_t t = phase_now();
+    int fd = open_file(path);
+    if (fd == -1) {
+        PRINT_ERRNO("open failed", path);
+        return false;
+    }
+    if (flock(fd, LOCK_SH | LOCK_NB) != 0) {
+        PRINT_ERRNO("flock to lock failed", path);
+        close(fd);
+        return false;
+    }
+    phase_record(&client->phases, PHASE_OPEN, t);
+    bool sent = send_locked_file(client, path, name, fd);
+    if (flock(fd, LOCK_UN) != 0) {
+        PRINT_ERRNO("flock to unlock failed", path);
+    }
+    close(fd);
+    return sent;
+}
 
-    if (recv_changed(client) != 0) {
+static void
+print_skipped_warning(bool disabled, const char* path, const char* name)
+{
+    if (disabled) {
         return;
     }
-    client->stat.num_changed++;
+    fprintf(stderr, "%s is a %s, skipped.\n", path, name);
+}
+
+static bool
+is_ignored(const char* path, const char* name)
+{
+    if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+        return true;
+    }
+    if (strcmp(name, ".meta") == 0) {
+        print_error("Warning: Ignored %s/%s", path, name);
+        return true;
+    }
+    return false;
+}
+
+static bool
+is_excluded_path(const Client* client, const char* path, const char* name, bool is_dir)
+{
+    if (client->filter == NULL) {
+        return false;
+    }
+    char path_from_root[strlen(path) + 1];
+    get_path_from_root(path_from_root, client->root, path);
+    FilterVerdict verdict;
+    verdict = filter_match_path(client->filter, path_from_root, name, is_dir);
+    return verdict == FILTER_EXCLUDE;
+}
+
+static bool
+is_excluded_stat(const Client* client, const struct stat* sb)
+{
+    if (client->filter == NULL) {
+        return false;
+    }
+    return filter_match_stat(client->filter, sb, client->stat.start_time);
+}
+
+static bool
+need_lstat_to_filter(const Client* client, unsigned char type)
+{
+    if ((client->filter == NULL) || (type != DT_UNKNOWN)) {
+        return false;
+    }
+    return filter_has_dir_rules(client->filter);
+}
+
+/*
+ * Regular files, directories and symbolic links in a directory. Others are
+ * counted as skipped when they are listed. sigs are for the manifest. Zero
+ * means that the entry must be sent next time.
+ */
+struct Listing {
+    char** names;
+    mode_t* modes;
+    uint64_t* sigs;
+    size_t num;
+    size_t capacity;
+    uint64_t digest;
+    size_t num_digested;
+    int num_skipped;
+    int num_excluded;
+};
+
+typedef struct Listing Listing;
+
+static void*
+realloc_or_die(void* p, size_t size)
+{
+    void* q = realloc(p, size);
+    if (q == NULL) {
+        PRINT_ERRNO2("realloc failed");
+        abort();
+    }
+    return q;
+}
+
+static char*
+strdup_or_die(const char* s)
+{
+    char* t = strdup(s);
+    if (t == NULL) {
+        PRINT_ERRNO2("strdup failed");
+        abort();
+    }
+    return t;
+}
+
+static void
+add_listing(Listing* listing, const char* name, mode_t mode, uint64_t sig)
+{
+    if (listing->num == listing->capacity) {
+        size_t capacity = listing->capacity == 0 ? 64 : 2 * listing->capacity;
+        size_t size = capacity * sizeof(listing->names[0]);
+        listing->names = (char**)realloc_or_die(listing->names, size);
+        size = capacity * sizeof(listing->modes[0]);
+        listing->modes = (mode_t*)realloc_or_die(listing->modes, size);
+        size = capacity * sizeof(listing->sigs[0]);
+        listing->sigs = (uint64_t*)realloc_or_die(listing->sigs, size);
+        listing->capacity = capacity;
+    }
+    char* s = strdup(name);
+    if (s == NULL) {
+        PRINT_ERRNO2("strdup failed");
+        abort();
+    }
+    listing->names[listing->num] = s;
+    listing->modes[listing->num] = mode;
+    listing->sigs[listing->num] = sig;
+    listing->num++;
+}
+
+static void
+free_listing(Listing* listing)
+{
+    size_t i;
+    for (i = 0; i < listing->num; i++) {
+        free(listing->names[i]);
+    }
+    free(listing->names);
+    free(listing->modes);
+    free(listing->sigs);
+}
+
+static uint64_t
+fnv1a(uint64_t h, const void* p, size_t size)
+{
+    const unsigned char* q = (const unsigned char*)p;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        h ^= q[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t
+hash_entry(const char* name, const struct stat* sb)
+{
+    uint64_t fields[] = {
+        sb->st_mode,
+        sb->st_uid,
+        sb->st_gid,
+        sb->st_size,
+        sb->st_mtim.tv_sec,
+        sb->st_mtim.tv_nsec,
+        sb->st_ctim.tv_sec,
+        sb->st_ctim.tv_nsec };
+    uint64_t h = fnv1a(14695981039346656037ULL, name, strlen(name) + 1);
+    return fnv1a(h, fields, sizeof(fields));
+}
+
+/*
+ * The digest of a directory is a sum of hashes of its non-directory entries,
+ * so it does not depend on the order of readdir(3).
+ */
+static void
+add_digest(Listing* listing, uint64_t h, mode_t mode)
+{
+    if (S_ISDIR(mode)) {
+        return;
+    }
+    listing->digest += h ^ (h >> 29);
+    listing->num_digested++;
+}
+
+/*
+ * Only reads client, so that scanners can list directories concurrently.
+ */
+static void
+list_entry(const Client* client, Phases* phases, Listing* listing, const char* path,
+           const char* name, unsigned char type)
+{
+    if (is_ignored(path, name)) {
+        return;
+    }
+
+    char fullpath[strlen(path) + strlen(name) + 2];
+    sprintf(fullpath, "%s/%s", path, name);
+    struct stat sb;
+    bool stated = need_lstat_to_filter(client, type);
+    if (stated && (do_lstat(client, phases, fullpath, &sb) != 0)) {
+        PRINT_ERRNO("lstat directory entry failed", fullpath);
+        return;
+    }
+    bool is_dir = stated ? S_ISDIR(sb.st_mode) : type == DT_DIR;
+    if (is_excluded_path(client, fullpath, name, is_dir)) {
+        listing->num_excluded++;
+        return;
+    }
+    if (!stated && (do_lstat(client, phases, fullpath, &sb) != 0)) {
+        PRINT_ERRNO("lstat directory entry failed", fullpath);
+        return;
+    }
+    if (is_excluded_stat(client, &sb)) {
+        listing->num_excluded++;
+        return;
+    }
+    mode_t mode = sb.st_mode;
+    if (S_ISREG(mode) || S_ISDIR(mode) || S_ISLNK(mode)) {
+        uint64_t h = hash_entry(name, &sb);
+        add_listing(listing, name, mode, h != 0 ? h : 1);
+        add_digest(listing, h, mode);
+        return;
+    }
+    listing->num_skipped++;
+#define INFO(pred, desc, flag) do { \
+    if (pred(mode)) { \
+        bool disabled = client->disable_skipped_warning.flag; \
+        print_skipped_warning(disabled, fullpath, desc); \
+        return; \
+    } \
+} while (0)
+    INFO(S_ISBLK, "block special file", block_special);
+    INFO(S_ISCHR, "character special file", char_special);
+    INFO(S_ISFIFO, "pipe for FIFO special file", pipe);
+    INFO(S_ISSOCK, "socket", socket);
+    INFO(S_ISWHT, "whiteout", whiteout);
+#undef INFO
+    /* NOTREACHED */
+    assert(42 != 42);
+}
+
+static struct dirent*
+read_entry(Phases* phases, DIR* dirp)
+{
+    uint64_t t = phase_now();
+    struct dirent* e = readdir(dirp);
+    phase_record(phases, PHASE_SCAN, t);
+    return e;
+}
+
+static bool
+list_dir(const Client* client, Phases* phases, const char* path, Listing* listing)
+{
+    bzero(listing, sizeof(*listing));
+    uint64_t t = phase_now();
+    DIR* dirp = opendir(path);
+    if (dirp == NULL) {
+        PRINT_ERRNO("opendir failed", path);
+        return false;
+    }
+    phase_record(phases, PHASE_SCAN, t);
+    struct dirent* e;
+    while ((e = read_entry(phases, dirp)) != NULL) {
+        list_entry(client, phases, listing, path, e->d_name, e->d_type);
+    }
+    closedir(dirp);
+    return true;
+}
+
+/*
+ * When the backuper has the same digest in the previous backup, it clones all
+ * non-directory entries at once, and the backupee sends nothing for them.
+ */
+static bool
+query_digest(Client* client, const Listing* listing)
+{
+    uint64_t t = phase_now();
+    send(client, "DIGEST %016" PRIx64 ":%zu", listing->digest, listing->num_digested);
+    char buf[BUF_SIZE];
+    if (recv_line(client, buf, sizeof(buf)) == NULL) {
+        PRINT_ERRNO2("Receiving a response of DIGEST failed");
+        abort();
+    }
+    phase_record(&client->phases, PHASE_QUERY, t);
+    const char* expected = "UNCHANGED";
+    return strncmp(expected, buf, strlen(expected)) == 0;
+}
+
+static void
+save_digest(Client* client, const Listing* listing)
+{
+    uint64_t t = phase_now();
+    send(client, "SAVE_DIGEST %016" PRIx64 ":%zu", listing->digest, listing->num_digested);
+    recv_ok(client);
+    phase_record(&client->phases, PHASE_QUERY, t);
+}
+
+static void
+end_dir(Client* client)
+{
+    uint64_t t = phase_now();
+    send(client, "ENDDIR");
+    recv_ok(client);
+    phase_record(&client->phases, PHASE_QUERY, t);
+}
+
+/*
+ * Sends the i-th entry of path. Its signature is cleared if it failed, so the
+ * next diff session sends it again.
+ */
+static bool
+send_entry(Client* client, const char* path, Listing* listing, size_t i)
+{
+    const char* name = listing->names[i];
+    mode_t mode = listing->modes[i];
+    char fullpath[strlen(path) + strlen(name) + 2];
+    sprintf(fullpath, "%s/%s", path, name);
+    update_progress(client, client->stat.send_bytes, fullpath);
+    bool sent;
+    if (S_ISDIR(mode)) {
+        sent = send_dir(client, fullpath, name);
+    }
+    else if (S_ISREG(mode)) {
+        sent = send_file(client, fullpath, name);
+    }
+    else {
+        sent = send_symlink(client, fullpath, name);
+    }
+    if (!sent) {
+        listing->sigs[i] = 0;
+    }
+    return sent;
+}
+
+/*
+ * All entries are sent while the current directory of the backuper is this
+ * one, so ENDDIR can tell it that the rest are gone.
+ */
+static void
+send_listing(Client* client, const char* path, Listing* listing)
+{
+    change_dir(client, path);
+    bool unchanged = query_digest(client, listing);
+    bool sent = true;
+    size_t i;
+    for (i = 0; i < listing->num; i++) {
+        if (!S_ISDIR(listing->modes[i]) && !unchanged) {
+            sent = send_entry(client, path, listing, i) && sent;
+        }
+    }
+    if (!unchanged && sent) {
+        save_digest(client, listing);
+    }
+
+    for (i = 0; i < listing->num; i++) {
+        if (S_ISDIR(listing->modes[i])) {
+            send_entry(client, path, listing, i);
+        }
+    }
+    end_dir(client);
+}
+
+static bool
+delete_entry(Client* client, const char* name)
+{
+    char buf[2 * strlen(name) + 3];
+    protocol_quote(buf, name);
+    uint64_t t = phase_now();
+    send(client, "DELETE %s", buf);
+    char response[BUF_SIZE];
+    if (recv_line(client, response, sizeof(response)) == NULL) {
+        PRINT_ERRNO2("Receiving a response of DELETE failed");
+        abort();
+    }
+    phase_record(&client->phases, PHASE_QUERY, t);
+    return strncmp(response, "OK", 2) == 0;
+}
+
+/*
+ * Sends only entries whose signatures differ from the manifest, and DELETE
+ * for entries which are gone. The backuper does not even visit a directory
+ * without changes. Entries of old which were handled are marked as seen.
+ */
+static void
+send_diff(Client* client, const char* path, Listing* listing, ManifestDir* old)
+{
+    size_t num = listing->num;
+    bool changed[num + 1];
+    bool files_changed = false;
+    bool dirs_changed = false;
+    size_t i;
+    for (i = 0; i < num; i++) {
+        ManifestEntry* entry = manifest_find_entry(old, listing->names[i]);
+        if (entry != NULL) {
+            entry->seen = true;
+        }
+        changed[i] = (entry == NULL) || (entry->sig != listing->sigs[i]);
+        bool is_dir = S_ISDIR(listing->modes[i]);
+        files_changed = files_changed || (changed[i] && !is_dir);
+        dirs_changed = dirs_changed || (changed[i] && is_dir);
+    }
+    bool deleted = false;
+    for (i = 0; i < old->num; i++) {
+        deleted = deleted || !old->entries[i].seen;
+    }
+    if (!files_changed && !dirs_changed && !deleted) {
+        return;
+    }
+
+    change_dir(client, path);
+    bool digested = files_changed || deleted;
+    bool unchanged = digested ? query_digest(client, listing) : true;
+    bool sent = true;
+    for (i = 0; i < num; i++) {
+        if (changed[i] && !S_ISDIR(listing->modes[i]) && !unchanged) {
+            sent = send_entry(client, path, listing, i) && sent;
+        }
+    }
+    for (i = 0; i < old->num; i++) {
+        ManifestEntry* entry = &old->entries[i];
+        if (!entry->seen) {
+            entry->seen = delete_entry(client, entry->name);
+            sent = entry->seen && sent;
+        }
+    }
+    if (digested && !unchanged && sent) {
+        save_digest(client, listing);
+    }
+    for (i = 0; i < num; i++) {
+        if (changed[i] && S_ISDIR(listing->modes[i])) {
+            send_entry(client, path, listing, i);
+        }
+    }
+}
+
+/*
+ * Entries of old which could not be deleted are kept with no signature, so
+ * they are deleted next time.
+ */
+static void
+write_manifest(Client* client, const char* path, const Listing* listing, const ManifestDir* old)
+{
+    if (!client->writing_manifest) {
+        return;
+    }
+    Mux* mux = client->mux;
+    ManifestWriter* writer = &client->manifest_writer;
+    if (mux != NULL) {
+        pthread_mutex_lock(&mux->records);
+        writer = mux->manifest_writer;
+    }
+    manifest_write_dir(writer, path);
+    size_t i;
+    for (i = 0; i < listing->num; i++) {
+        manifest_write_entry(writer, listing->names[i], listing->sigs[i]);
+    }
+    for (i = 0; (old != NULL) && (i < old->num); i++) {
+        if (!old->entries[i].seen) {
+            manifest_write_entry(writer, old->entries[i].name, 0);
+        }
+    }
+    if (mux != NULL) {
+        pthread_mutex_unlock(&mux->records);
+    }
+}
+
+static void
+count_listing(Client* client, const Listing* listing)
+{
+    client->stat.num_skipped += listing->num_skipped;
+    client->stat.num_excluded += listing->num_excluded;
+    size_t i;
+    for (i = 0; i < listing->num; i++) {
+        mode_t mode = listing->modes[i];
+        if (S_ISDIR(mode)) {
+            client->stat.num_dir++;
+        }
+        else if (S_ISREG(mode)) {
+            client->stat.num_files++;
+        }
+        else {
+            client->stat.num_symlinks++;
+        }
+    }
+}
+
+/*
+ * WALK_ALL visits all subdirectories. WALK_JOURNAL visits only new ones, whose
+ * subtrees are walked with WALK_FRESH. WALK_FRESH does not use the manifest,
+ * because a record of the same path may be of a directory which was removed.
+ */
+enum Walk {
+    WALK_ALL,
+    WALK_JOURNAL,
+    WALK_FRESH
+};
+
+typedef enum Walk Walk;
+
+static void
+add_walked(Client* client, const char* path)
+{
+    size_t size = (client->num_walked + 1) * sizeof(client->walked[0]);
+    client->walked = (char**)realloc_or_die(client->walked, size);
+    char* s = strdup(path);
+    if (s == NULL) {
+        PRINT_ERRNO2("strdup failed");
+        abort();
+    }
+    client->walked[client->num_walked] = s;
+    client->num_walked++;
+}
+
+/*
+ * Subdirectories are visited after all entries of this directory were sent.
+ */
+static void
+visit_dir(Client* client, const char* path, Walk walk)
+{
+    update_progress(client, client->stat.send_bytes, path);
+    Listing listing;
+    if (!list_dir(client, &client->phases, path, &listing)) {
+        return;
+    }
+    count_listing(client, &listing);
+
+    char path_from_root[strlen(path) + 1];
+    get_path_from_root(path_from_root, client->root, path);
+    ManifestDir* old = NULL;
+    if (client->diff && (walk != WALK_FRESH)) {
+        old = manifest_find_dir(client->manifest, path_from_root);
+    }
+    if ((walk == WALK_JOURNAL) && (old == NULL)) {
+        add_walked(client, path);
+        if (client->manifest != NULL) {
+            manifest_mark_visited(client->manifest, path_from_root);
+        }
+        walk = WALK_FRESH;
+    }
+    if (old != NULL) {
+        old->visited = true;
+        send_diff(client, path, &listing, old);
+    }
+    else {
+        send_listing(client, path, &listing);
+    }
+    write_manifest(client, path_from_root, &listing, old);
+
+    size_t i;
+    for (i = 0; i < listing.num; i++) {
+        const char* name = listing.names[i];
+        if (!S_ISDIR(listing.modes[i])) {
+            continue;
+        }
+        char fullpath[strlen(path) + strlen(name) + 2];
+        sprintf(fullpath, "%s/%s", path, name);
+        if (walk != WALK_JOURNAL) {
+            visit_dir(client, fullpath, walk);
+            continue;
+        }
+        if (manifest_find_entry(old, name) != NULL) {
+            continue;
+        }
+        add_walked(client, fullpath);
+        char sub_from_root[strlen(fullpath) + 1];
+        get_path_from_root(sub_from_root, client->root, fullpath);
+        manifest_mark_visited(client->manifest, sub_from_root);
+        visit_dir(client, fullpath, WALK_FRESH);
+    }
+    free_listing(&listing);
+}
+
+/*
+ * Listings which scanners of a device made wait in its queue until the sender
+ * of the device sends them. Senders share one session, in which each one has
+ * its own stream, so that devices are walked and their bodies are read and
+ * sent concurrently.
+ */
+#define SCAN_QUEUE_SIZE 256
+
+struct Scanned {
+    char* path;
+    Listing listing;
+    struct Scanned* next;
+};
+
+typedef struct Scanned Scanned;
+
+/*
+ * Directories to scan on one device. The first num_roots ones are source
+ * roots, and the others are their subdirectories which were split off.
+ */
+struct Device {
+    dev_t dev;
+    char** dirs;
+    size_t num_dirs;
+    size_t num_roots;
+    size_t next;
+    int busy;
+    Scanned* head;
+    Scanned* tail;
+    size_t num_scanned;
+    size_t num_scanners;
+};
+
+typedef struct Device Device;
+
+struct Scan {
+    const Client* client;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Device* devices;
+    size_t num_devices;
+    bool split;
+};
+
+typedef struct Scan Scan;
+
+struct Scanner {
+    Scan* scan;
+    Device* device;
+    Phases phases;
+    pthread_t thread;
+};
+
+typedef struct Scanner Scanner;
+
+/*
+ * client is a copy of the main one with its own stream, buffers and counters.
+ * Only the sender reads bodies of the device.
+ */
+struct Sender {
+    Scan* scan;
+    Device* device;
+    Client client;
+    pthread_t thread;
+};
+
+typedef struct Sender Sender;
+
+static Device*
+find_device(Scan* scan, dev_t dev)
+{
+    size_t i;
+    for (i = 0; i < scan->num_devices; i++) {
+        if (scan->devices[i].dev == dev) {
+            return &scan->devices[i];
+        }
+    }
+    size_t size = (scan->num_devices + 1) * sizeof(scan->devices[0]);
+    scan->devices = (Device*)realloc_or_die(scan->devices, size);
+    Device* device = &scan->devices[scan->num_devices];
+    bzero(device, sizeof(*device));
+    device->dev = dev;
+    scan->num_devices++;
+    return device;
+}
+
+static void
+add_dir(Device* device, const char* path)
+{
+    size_t size = (device->num_dirs + 1) * sizeof(device->dirs[0]);
+    device->dirs = (char**)realloc_or_die(device->dirs, size);
+    device->dirs[device->num_dirs] = strdup_or_die(path);
+    device->num_dirs++;
+}
+
+/*
+ * A scanner without a directory waits while another one of the device is
+ * scanning, because it may split off more.
+ */
+static char*
+take_dir(Scanner* scanner, bool* is_root)
+{
+    Scan* scan = scanner->scan;
+    Device* device = scanner->device;
+    pthread_mutex_lock(&scan->lock);
+    while ((device->next == device->num_dirs) && (0 < device->busy)) {
+        pthread_cond_wait(&scan->cond, &scan->lock);
+    }
+    char* path = NULL;
+    if (device->next < device->num_dirs) {
+        *is_root = device->next < device->num_roots;
+        path = device->dirs[device->next];
+        device->dirs[device->next] = NULL;
+        device->next++;
+        device->busy++;
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return path;
+}
+
+static void
+finish_dir(Scanner* scanner, char* path)
+{
+    Scan* scan = scanner->scan;
+    pthread_mutex_lock(&scan->lock);
+    scanner->device->busy--;
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+    free(path);
+}
+
+static void
+split_dir(Scanner* scanner, const char* path)
+{
+    Scan* scan = scanner->scan;
+    pthread_mutex_lock(&scan->lock);
+    add_dir(scanner->device, path);
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+/*
+ * The queue owns listing after this.
+ */
+static void
+push_scanned(Scanner* scanner, const char* path, const Listing* listing)
+{
+    Scanned* scanned = (Scanned*)realloc_or_die(NULL, sizeof(Scanned));
+    scanned->path = strdup_or_die(path);
+    scanned->listing = *listing;
+    scanned->next = NULL;
+    Scan* scan = scanner->scan;
+    Device* device = scanner->device;
+    pthread_mutex_lock(&scan->lock);
+    while (SCAN_QUEUE_SIZE <= device->num_scanned) {
+        pthread_cond_wait(&scan->cond, &scan->lock);
+    }
+    if (device->tail != NULL) {
+        device->tail->next = scanned;
+    }
+    else {
+        device->head = scanned;
+    }
+    device->tail = scanned;
+    device->num_scanned++;
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+/*
+ * Returns NULL after all scanners of the device finished.
+ */
+static Scanned*
+pop_scanned(Scan* scan, Device* device)
+{
+    pthread_mutex_lock(&scan->lock);
+    while ((device->head == NULL) && (0 < device->num_scanners)) {
+        pthread_cond_wait(&scan->cond, &scan->lock);
+    }
+    Scanned* scanned = device->head;
+    if (scanned != NULL) {
+        device->head = scanned->next;
+        device->tail = device->head != NULL ? device->tail : NULL;
+        device->num_scanned--;
+        pthread_cond_broadcast(&scan->cond);
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return scanned;
+}
+
+/*
+ * Subdirectories are scanned after this directory was queued, so that the
+ * backuper has made them when their listings are sent. Those of a root are
+ * split off for other scanners of the device if split is true.
+ */
+static void
+scan_dir(Scanner* scanner, const char* path, bool split)
+{
+    Scan* scan = scanner->scan;
+    Listing listing;
+    if (!list_dir(scan->client, &scanner->phases, path, &listing)) {
+        return;
+    }
+    char** subdirs = (char**)realloc_or_die(NULL, (listing.num + 1) * sizeof(subdirs[0]));
+    size_t num = 0;
+    size_t i;
+    for (i = 0; i < listing.num; i++) {
+        const char* name = listing.names[i];
+        if (!S_ISDIR(listing.modes[i])) {
+            continue;
+        }
+        char fullpath[strlen(path) + strlen(name) + 2];
+        sprintf(fullpath, "%s/%s", path, name);
+        subdirs[num] = strdup_or_die(fullpath);
+        num++;
+    }
+    push_scanned(scanner, path, &listing);
+    for (i = 0; i < num; i++) {
+        if (split) {
+            split_dir(scanner, subdirs[i]);
+        }
+        else {
+            scan_dir(scanner, subdirs[i], false);
+        }
+        free(subdirs[i]);
+    }
+    free(subdirs);
+}
+
+static void*
+run_scanner(void* arg)
+{
+    Scanner* scanner = (Scanner*)arg;
+    Scan* scan = scanner->scan;
+    bool is_root;
+    char* path;
+    while ((path = take_dir(scanner, &is_root)) != NULL) {
+        scan_dir(scanner, path, scan->split && is_root);
+        finish_dir(scanner, path);
+    }
+    pthread_mutex_lock(&scan->lock);
+    scanner->device->num_scanners--;
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+static void
+send_scanned(Client* client, const char* path, Listing* listing)
+{
+    count_listing(client, listing);
+    char path_from_root[strlen(path) + 1];
+    get_path_from_root(path_from_root, client->root, path);
+    ManifestDir* old = NULL;
+    if (client->diff) {
+        old = manifest_find_dir(client->manifest, path_from_root);
+    }
+    if (old != NULL) {
+        old->visited = true;
+        send_diff(client, path, listing, old);
+    }
+    else {
+        send_listing(client, path, listing);
+    }
+    write_manifest(client, path_from_root, listing, old);
+}
 
-    size_t size = sb.st_size;
-    send(client, "BODY %zu", size);
-    size_t rest = size;
-    while (0 < rest) {
-        size_t size = 4096;
-        char buf[size];
-        size_t n = size < rest ? size : rest;
-        size_t nbytes = fread(buf, 1, n, fp);
-        fwrite(buf, 1, nbytes, client->out);
-        fflush(client->out);
-        rest -= nbytes;
+static void*
+run_sender(void* arg)
+{
+    Sender* sender = (Sender*)arg;
+    Scanned* scanned;
+    while ((scanned = pop_scanned(sender->scan, sender->device)) != NULL) {
+        send_scanned(&sender->client, scanned->path, &scanned->listing);
+        free_listing(&scanned->listing);
+        free(scanned->path);
+        free(scanned);
     }
-    recv_ok(client);
-    client->stat.send_bytes += size;
+    return NULL;
 }
 
+/*
+ * Streams are numbered from 1 for devices, and the only device keeps stream 0
+ * of the session. A new stream of the backuper has no current directory.
+ */
 static void
-send_file(Client* client, const char* path)
+init_sender(Sender* sender, Scan* scan, size_t i, const Client* client, Mux* mux)
 {
-    FILE* fp = fopen(path, "r");
-    if (fp == NULL) {
-        PRINT_ERRNO("fopen failed", path);
-        return;
-    }
-    int fd = fileno(fp);
-    if (flock(fd, LOCK_SH | LOCK_NB) != 0) {
-        PRINT_ERRNO("flock to lock failed", path);
-        fclose(fp);
-        return;
+    sender->scan = scan;
+    sender->device = &scan->devices[i];
+    Client* c = &sender->client;
+    *c = *client;
+    c->mux = mux;
+    c->stream = 1 < scan->num_devices ? i + 1 : 0;
+    c->reported_entries = c->reported_bytes = 0;
+    if (c->stream != 0) {
+        c->cwd[0] = '\0';
     }
-    send_locked_file(client, path, fp);
-    if (flock(fd, LOCK_UN) != 0) {
-        PRINT_ERRNO("flock to unlock failed", path);
+    bzero(&c->stat, sizeof(c->stat));
+    bzero(&c->phases, sizeof(c->phases));
+    if (!bufring_init(&c->ring, READ_SIZE, READ_ALIGNMENT)) {
+        print_error("Cannot allocate buffers.");
+        abort();
     }
-    fclose(fp);
 }
 
-static void backup_dir(Client*, const char*);
-
 static void
-print_skipped_warning(bool disabled, const char* path, const char* name)
+merge_sender(Client* client, Sender* sender)
 {
-    if (disabled) {
-        return;
+    Client* c = &sender->client;
+    client->stat.num_files += c->stat.num_files;
+    client->stat.num_changed += c->stat.num_changed;
+    client->stat.send_bytes += c->stat.send_bytes;
+    client->stat.num_skipped += c->stat.num_skipped;
+    client->stat.num_excluded += c->stat.num_excluded;
+    client->stat.num_dir += c->stat.num_dir;
+    client->stat.num_symlinks += c->stat.num_symlinks;
+    phase_merge(&client->phases, &c->phases);
+    if (c->stream == 0) {
+        memcpy(client->cwd, c->cwd, sizeof(client->cwd));
     }
-    fprintf(stderr, "%s is a %s, skipped.\n", path, name);
+    bufring_destroy(&c->ring);
 }
 
-static bool
-is_ignored(const char* path, const char* name)
+static void
+start_thread(pthread_t* thread, void* (*proc)(void*), void* arg)
 {
-    if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
-        return true;
-    }
-    if (strcmp(name, ".meta") == 0) {
-        print_error("Warning: Ignored %s/%s", path, name);
-        return true;
+    int e = pthread_create(thread, NULL, proc, arg);
+    if (e != 0) {
+        print_errno2("pthread_create failed", e);
+        abort();
     }
-    return false;
 }
 
+/*
+ * Roots are grouped by their devices. Each device has jobs scanners, which
+ * list directories, and one sender, which sends the listings and reads the
+ * bodies, so that every disk has its own stream of reads. With more than one
+ * scanner, subdirectories of roots are scanned concurrently too.
+ */
 static void
-send_dir_entry(Client* client, const char* path, const char* name)
+backup_trees(Client* client, char** paths, size_t num_paths, int jobs)
 {
-    if (is_ignored(path, name)) {
-        return;
+    Scan scan;
+    bzero(&scan, sizeof(scan));
+    scan.client = client;
+    scan.split = 1 < jobs;
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.cond, NULL);
+    size_t i;
+    for (i = 0; i < num_paths; i++) {
+        const char* path = paths[i];
+        backup_parent(client, path);
+        struct stat sb;
+        if (stat(path, &sb) != 0) {
+            PRINT_ERRNO("stat failed", path);
+            continue;
+        }
+        Device* device = find_device(&scan, sb.st_dev);
+        add_dir(device, path);
+        device->num_roots++;
     }
 
-    char fullpath[strlen(path) + strlen(name) + 1];
-    sprintf(fullpath, "%s/%s", path, name);
-    struct stat sb;
-    if (lstat(fullpath, &sb) != 0) {
-        PRINT_ERRNO("lstat directory entry failed", fullpath);
-        return;
+    Mux mux;
+    pthread_mutex_init(&mux.lock, NULL);
+    mux.stream = 0;
+    mux.num_streams = scan.num_devices;
+    pthread_mutex_init(&mux.records, NULL);
+    mux.manifest_writer = &client->manifest_writer;
+    mux.progress = &client->progress;
+    mux.entries = count_entries(client);
+    mux.bytes = client->stat.send_bytes;
+
+    size_t num_scanners = scan.num_devices * jobs;
+    Scanner* scanners = (Scanner*)realloc_or_die(NULL, (num_scanners + 1) * sizeof(Scanner));
+    for (i = 0; i < scan.num_devices; i++) {
+        scan.devices[i].num_scanners = jobs;
     }
-    mode_t mode = sb.st_mode;
-    if (S_ISREG(sb.st_mode)) {
-        client->stat.num_files++;
-        send_file(client, fullpath);
-        return;
+    for (i = 0; i < num_scanners; i++) {
+        Scanner* scanner = &scanners[i];
+        scanner->scan = &scan;
+        scanner->device = &scan.devices[i / jobs];
+        bzero(&scanner->phases, sizeof(scanner->phases));
+        start_thread(&scanner->thread, run_scanner, scanner);
     }
-    if (S_ISDIR(mode)) {
-        client->stat.num_dir++;
-        send_dir(client, fullpath);
-        backup_dir(client, fullpath);
-        return;
+    size_t num_senders = scan.num_devices;
+    Sender* senders = (Sender*)realloc_or_die(NULL, (num_senders + 1) * sizeof(Sender));
+    for (i = 0; i < num_senders; i++) {
+        init_sender(&senders[i], &scan, i, client, &mux);
     }
-    if (S_ISLNK(mode)) {
-        client->stat.num_symlinks++;
-        send_symlink(client, fullpath);
-        return;
+    for (i = 0; i < num_senders; i++) {
+        start_thread(&senders[i].thread, run_sender, &senders[i]);
     }
-    client->stat.num_skipped++;
-#define INFO(pred, desc, flag) do { \
-    if (pred(mode)) { \
-        bool disabled = client->disable_skipped_warning.flag; \
-        print_skipped_warning(disabled, fullpath, desc); \
-        return; \
-    } \
-} while (0)
-    INFO(S_ISBLK, "block special file", block_special);
-    INFO(S_ISCHR, "character special file", char_special);
-    INFO(S_ISFIFO, "pipe for FIFO special file", pipe);
-    INFO(S_ISSOCK, "socket", socket);
-    INFO(S_ISWHT, "whiteout", whiteout);
-#undef INFO
-    /* NOTREACHED */
-    assert(42 != 42);
+    for (i = 0; i < num_scanners; i++) {
+        pthread_join(scanners[i].thread, NULL);
+        phase_merge(&client->phases, &scanners[i].phases);
+    }
+    for (i = 0; i < num_senders; i++) {
+        pthread_join(senders[i].thread, NULL);
+        merge_sender(client, &senders[i]);
+    }
+    free(senders);
+    free(scanners);
+    for (i = 0; i < scan.num_devices; i++) {
+        free(scan.devices[i].dirs);
+    }
+    free(scan.devices);
+    pthread_mutex_destroy(&mux.records);
+    pthread_mutex_destroy(&mux.lock);
+    pthread_cond_destroy(&scan.cond);
+    pthread_mutex_destroy(&scan.lock);
 }
 
-static void
-backup_dir(Client* client, const char* path)
+static bool
+is_under(const char* path, const char* dir)
 {
-    DIR* dirp = opendir(path);
-    if (dirp == NULL) {
-        PRINT_ERRNO("opendir failed", path);
-        return;
+    if (strcmp(dir, "/") == 0) {
+        return true;
     }
-    struct dirent* e;
-    while ((e = readdir(dirp)) != NULL) {
-        send_dir_entry(client, path, e->d_name);
+    size_t len = strlen(dir);
+    return (strncmp(path, dir, len) == 0) && ((path[len] == '\0') || (path[len] == '/'));
+}
+
+static bool
+is_walked(const Client* client, const char* path)
+{
+    size_t i;
+    for (i = 0; i < client->num_walked; i++) {
+        if (is_under(path, client->walked[i])) {
+            return true;
+        }
     }
-    closedir(dirp);
+    return false;
+}
+
+/*
+ * Tells whether a directory between top and path is excluded.
+ */
+static bool
+is_excluded_tree(Client* client, const char* top, const char* path)
+{
+    size_t top_len = strlen(top);
+    char buf[strlen(path) + 1];
+    strcpy(buf, path);
+    char* p = buf + strlen(buf);
+    while (top_len < (size_t)(p - buf)) {
+        *p = '\0';
+        char* slash = strrchr(buf, '/');
+        if (slash == NULL) {
+            break;
+        }
+        if (is_excluded_path(client, buf, slash + 1, true)) {
+            return true;
+        }
+        p = slash;
+    }
+    return false;
 }
 
+/*
+ * Backs up only directories in the journal under path, instead of walking all
+ * of it. path itself is walked if the manifest does not have it, because the
+ * watcher may not watch it.
+ */
 static void
-backup_tree(Client* client, const char* path)
+backup_journaled(Client* client, const char* path, const Journal* journal)
 {
     backup_parent(client, path);
-    backup_dir(client, path);
+    char path_from_root[strlen(path) + 1];
+    get_path_from_root(path_from_root, client->root, path);
+    if (manifest_find_dir(client->manifest, path_from_root) == NULL) {
+        visit_dir(client, path, WALK_JOURNAL);
+        return;
+    }
+    size_t i;
+    for (i = 0; i < journal->num_paths; i++) {
+        const char* dir = journal->paths[i];
+        if (!is_under(dir, path) || is_walked(client, dir)) {
+            continue;
+        }
+        if (is_excluded_tree(client, path, dir)) {
+            continue;
+        }
+        struct stat sb;
+        if ((do_lstat(client, &client->phases, dir, &sb) != 0) || !S_ISDIR(sb.st_mode)) {
+            continue;
+        }
+        visit_dir(client, dir, WALK_JOURNAL);
+    }
 }
 
 static void
 usage(const char* ident)
 {
-    printf("%s [--command=cmd] [--root=root] src_dir ... dest_dir\n", ident);
+    const char* fmt = "%s [--adaptive] [--cgroup=dir] [--command=cmd] [--direct-io] [--exclude-from=file] \
+[--from-journal=file] [--ioprio=idle|best-effort[:level]] [--jobs-per-device=n] [--manifest=file] \
+[--max-bandwidth=size] [--max-iops=n] [--max-load=load] [--progress=file|-] [--progress-interval=sec] \
+[--root=root] [--stats-format=text|json|prometheus] src_dir ... dest_dir\n";
+    printf(fmt, ident);
 }
 
 static void
@@ -509,13 +1873,12 @@ print_version()
 }
 
 static int
-query(Client* client, const char* name, char* value)
+query_with_size(Client* client, const char* name, char* value, size_t size)
 {
     send(client, name);
 
-    size_t size = BUF_SIZE;
-    char buf[BUF_SIZE];
-    if (fgets(buf, size, client->in) == NULL) {
+    char buf[size];
+    if (recv_line(client, buf, size) == NULL) {
         PRINT_ERRNO("Failed quering", name);
         return 1;
     }
@@ -528,10 +1891,16 @@ query(Client* client, const char* name, char* value)
     char* p = buf + len;
     char* q = strchr(p, '\r');
     *q = '\0';
-    strncpy(value, p, BUF_SIZE);
+    strncpy(value, p, size);
     return 0;
 }
 
+static int
+query(Client* client, const char* name, char* value)
+{
+    return query_with_size(client, name, value, BUF_SIZE);
+}
+
 static int
 query_uint64(Client* client, const char* name, uint64_t* value)
 {
@@ -543,45 +1912,60 @@ query_uint64(Client* client, const char* name, uint64_t* value)
     return 0;
 }
 
+enum StatsFormat {
+    STATS_TEXT,
+    STATS_JSON,
+    STATS_PROMETHEUS
+};
+
+typedef enum StatsFormat StatsFormat;
+
+struct Summary {
+    char name[BUF_SIZE];
+    char start_time[BUF_SIZE];
+    char end_time[BUF_SIZE];
+    time_t sec;
+    double elapsed;
+    uint64_t disk_total;
+    uint64_t disk_usage;
+    uint64_t disk_available;
+    Phases server_phases;
+};
+
+typedef struct Summary Summary;
+
+#define PHASES_SIZE (4 * BUF_SIZE)
+
 static void
-make_timestamp(char* buf, time_t t)
+query_server_phases(Client* client, Phases* phases)
 {
-    struct tm tm;
-    localtime_r(&t, &tm);
-    strftime(buf, BUF_SIZE, "%Y-%m-%dT%H:%M:%S", &tm);
+    char buf[PHASES_SIZE];
+    if (query_with_size(client, "PHASES", buf, PHASES_SIZE) != 0) {
+        bzero(phases, sizeof(*phases));
+        return;
+    }
+    if (!phase_decode(phases, buf)) {
+        print_error("Invalid phases: %s", buf);
+        bzero(phases, sizeof(*phases));
+    }
 }
 
-static int
-do_print_stat(Client* client)
+static void
+print_stat_text(Client* client, Summary* summary)
 {
-    char start_time[BUF_SIZE];
-    make_timestamp(start_time, client->stat.start_time);
-    time_t t = time(NULL);
-    char end_time[BUF_SIZE];
-    make_timestamp(end_time, t);
-    time_t sec = t - client->stat.start_time;
+    time_t sec = summary->sec;
     int min = sec / 60;
     int hour = min / 60;
-
-    char name[BUF_SIZE];
-    if (query(client, "NAME", name) != 0) {
-        return 1;
-    }
-    uint64_t disk_total;
-    if (query_uint64(client, "DISK_TOTAL", &disk_total) != 0) {
-        return 1;
-    }
-    uint64_t disk_usage;
-    if (query_uint64(client, "DISK_USAGE", &disk_usage) != 0) {
-        return 1;
-    }
-    uint64_t disk_available = disk_total - disk_usage;
+    uint64_t disk_total = summary->disk_total;
+    uint64_t disk_usage = summary->disk_usage;
+    uint64_t disk_available = summary->disk_available;
 #define GIGA(n) ((n) / (1024 * 1024 * 1024))
     printf("Backup name: %s\n\
 Number of files: %d\n\
 Number of changed files: %d\n\
 Number of unchanged files: %d\n\
 Number of skipped files: %d\n\
+Number of excluded files: %d\n\
 Send bytes: %lu\n\
 Number of symbolic links: %d\n\
 Number of directories: %d\n\
@@ -590,16 +1974,254 @@ End time: %s\n\
 Time: %ld[sec] (%d[hour] %d[min] %ld[sec])\n\
 Disk total: %lu[Gbyte]\n\
 Disk usage: %lu[Gbyte] (%lu%%)\n\
-Disk available: %lu[Gbyte] (%lu%%)\n", name, client->stat.num_files, client->stat.num_changed, client->stat.num_files - client->stat.num_changed, client->stat.num_skipped, client->stat.send_bytes, client->stat.num_symlinks, client->stat.num_dir, start_time, end_time, sec, hour, min % 60, sec % 60, GIGA(disk_total), GIGA(disk_usage), (100 * disk_usage) / disk_total, GIGA(disk_available), (100 * disk_available) / disk_total);
+Disk available: %lu[Gbyte] (%lu%%)\n", summary->name, client->stat.num_files, client->stat.num_changed, client->stat.num_files - client->stat.num_changed, client->stat.num_skipped, client->stat.num_excluded, client->stat.send_bytes, client->stat.num_symlinks, client->stat.num_dir, summary->start_time, summary->end_time, sec, hour, min % 60, sec % 60, GIGA(disk_total), GIGA(disk_usage), (100 * disk_usage) / disk_total, GIGA(disk_available), (100 * disk_available) / disk_total);
 #undef GIGA
+    phase_print_text(stdout, "ubackupee", &client->phases);
+    phase_print_text(stdout, "ubackuper", &summary->server_phases);
+}
+
+static void
+print_json_string(const char* s)
+{
+    putchar('\"');
+    const char* p;
+    for (p = s; *p != '\0'; p++) {
+        if ((*p == '\"') || (*p == '\\')) {
+            putchar('\\');
+        }
+        putchar(*p);
+    }
+    putchar('\"');
+}
+
+static void
+print_stat_json(Client* client, Summary* summary)
+{
+    printf("{\"name\": ");
+    print_json_string(summary->name);
+    printf(", \"files\": %d, \"changed_files\": %d, \"unchanged_files\": %d, \
+\"skipped_files\": %d, \"excluded_files\": %d, \"send_bytes\": %lu, \
+\"symbolic_links\": %d, \"directories\": %d, \"start_time\": \"%s\", \
+\"end_time\": \"%s\", \"seconds\": %.3f, \"disk_total\": %lu, \
+\"disk_usage\": %lu, \"disk_available\": %lu, \"phases\": {", client->stat.num_files, client->stat.num_changed, client->stat.num_files - client->stat.num_changed, client->stat.num_skipped, client->stat.num_excluded, client->stat.send_bytes, client->stat.num_symlinks, client->stat.num_dir, summary->start_time, summary->end_time, summary->elapsed, summary->disk_total, summary->disk_usage, summary->disk_available);
+    phase_print_json(stdout, "ubackupee", &client->phases);
+    printf(", ");
+    phase_print_json(stdout, "ubackuper", &summary->server_phases);
+    printf("}}\n");
+}
+
+static void
+print_stat_prometheus(Client* client, Summary* summary)
+{
+#define PRINT(name, type, fmt, val) do { \
+    printf("# TYPE ubackup_%s %s\n", (name), (type)); \
+    printf("ubackup_%s " fmt "\n", (name), (val)); \
+} while (0)
+    PRINT("files", "gauge", "%d", client->stat.num_files);
+    PRINT("changed_files", "gauge", "%d", client->stat.num_changed);
+    PRINT("skipped_files", "gauge", "%d", client->stat.num_skipped);
+    PRINT("excluded_files", "gauge", "%d", client->stat.num_excluded);
+    PRINT("send_bytes", "gauge", "%lu", client->stat.send_bytes);
+    PRINT("symbolic_links", "gauge", "%d", client->stat.num_symlinks);
+    PRINT("directories", "gauge", "%d", client->stat.num_dir);
+    PRINT("start_time_seconds", "gauge", "%ld", client->stat.start_time);
+    PRINT("duration_seconds", "gauge", "%.3f", summary->elapsed);
+    PRINT("disk_total_bytes", "gauge", "%lu", summary->disk_total);
+    PRINT("disk_usage_bytes", "gauge", "%lu", summary->disk_usage);
+#undef PRINT
+    printf("# TYPE ubackup_phase_seconds histogram\n");
+    phase_print_prometheus(stdout, "ubackupee", &client->phases);
+    phase_print_prometheus(stdout, "ubackuper", &summary->server_phases);
+}
+
+static int
+do_print_stat(Client* client, StatsFormat format)
+{
+    Summary summary;
+    timestamp_format_iso8601(summary.start_time, client->stat.start_time);
+    time_t t = time(NULL);
+    timestamp_format_iso8601(summary.end_time, t);
+    summary.sec = t - client->stat.start_time;
+    summary.elapsed = (phase_now() - client->stat.start_ns) / 1e9;
+
+    if (query(client, "NAME", summary.name) != 0) {
+        return 1;
+    }
+    if (query_uint64(client, "DISK_TOTAL", &summary.disk_total) != 0) {
+        return 1;
+    }
+    if (query_uint64(client, "DISK_USAGE", &summary.disk_usage) != 0) {
+        return 1;
+    }
+    summary.disk_available = summary.disk_total - summary.disk_usage;
+    query_server_phases(client, &summary.server_phases);
+
+    switch (format) {
+    case STATS_JSON:
+        print_stat_json(client, &summary);
+        break;
+    case STATS_PROMETHEUS:
+        print_stat_prometheus(client, &summary);
+        break;
+    case STATS_TEXT:
+    default:
+        print_stat_text(client, &summary);
+        break;
+    }
     return 0;
 }
 
+/*
+ * A size is a number with an optional unit of K, M or G.
+ */
+static bool
+parse_size(uint64_t* dest, const char* s)
+{
+    char* end;
+    unsigned long long n = strtoull(s, &end, 10);
+    if ((end == s) || (*s == '-')) {
+        return false;
+    }
+    const char* units = "KMG";
+    const char* unit = *end != '\0' ? strchr(units, *end) : NULL;
+    int shift = 0;
+    if (unit != NULL) {
+        shift = 10 * (unit - units + 1);
+        end++;
+    }
+    if ((*end != '\0') || ((UINT64_MAX >> shift) < n)) {
+        return false;
+    }
+    *dest = (uint64_t)n << shift;
+    return true;
+}
+
+static bool
+parse_count(uint64_t* dest, const char* s)
+{
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if ((end == s) || (*end != '\0') || (*s == '-') || (errno != 0)) {
+        return false;
+    }
+    *dest = (uint64_t)n;
+    return true;
+}
+
+static bool
+parse_positive(int* dest, const char* s)
+{
+    char* end;
+    errno = 0;
+    long n = strtol(s, &end, 10);
+    if ((end == s) || (*end != '\0') || (errno != 0) || (n < 1) || (INT_MAX < n)) {
+        return false;
+    }
+    *dest = (int)n;
+    return true;
+}
+
+static bool
+parse_load(double* dest, const char* s)
+{
+    char* end;
+    errno = 0;
+    double load = strtod(s, &end);
+    if ((end == s) || (*end != '\0') || (errno != 0) || !(0 <= load)) {
+        return false;
+    }
+    *dest = load;
+    return true;
+}
+
+/*
+ * The process joins the cgroup and sets its I/O priority before any thread is
+ * made, so that all threads get them.
+ */
+static bool
+start_throttle(Client* client, Throttle* throttle, const ThrottleConf* conf, const char* ioprio,
+               const char* cgroup)
+{
+    if ((cgroup != NULL) && !throttle_join_cgroup(cgroup)) {
+        PRINT_ERRNO("Joining the cgroup failed", cgroup);
+        return false;
+    }
+    if ((ioprio != NULL) && !throttle_set_ioprio(ioprio)) {
+        if (errno != ENOTSUP) {
+            PRINT_ERRNO("Setting the I/O priority failed", ioprio);
+            return false;
+        }
+        print_error("--ioprio is not supported on this system, and is ignored.");
+    }
+    if (!throttle_is_enabled(conf)) {
+        return true;
+    }
+    if (!throttle_init(throttle, conf)) {
+        print_error("Cannot initialize throttling.");
+        return false;
+    }
+    client->throttle = throttle;
+    return true;
+}
+
+static bool
+parse_stats_format(StatsFormat* dest, const char* s)
+{
+    struct {
+        const char* name;
+        StatsFormat format;
+    } formats[] = {
+        { "text", STATS_TEXT },
+        { "json", STATS_JSON },
+        { "prometheus", STATS_PROMETHEUS } };
+    size_t i;
+    for (i = 0; i < array_sizeof(formats); i++) {
+        if (strcmp(s, formats[i].name) == 0) {
+            *dest = formats[i].format;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * DIFF base asks the backuper whether the new backup starts as a copy of base,
+ * which the manifest describes. The response has the name of the new backup,
+ * which is the base of the next manifest. An old backuper responds only NG,
+ * and the manifest is removed then.
+ */
+static void
+start_manifest(Client* client, const char* path)
+{
+    client->manifest = manifest_load(path);
+    const char* base = client->manifest != NULL ? manifest_base(client->manifest) : "";
+    char quoted[2 * strlen(base) + 3];
+    protocol_quote(quoted, base);
+    send(client, "DIFF %s", quoted);
+    char buf[BUF_SIZE];
+    if (recv_line(client, buf, sizeof(buf)) == NULL) {
+        PRINT_ERRNO2("Receiving a response of DIFF failed");
+        abort();
+    }
+    buf[strcspn(buf, "\r\n")] = '\0';
+    const char* name = strchr(buf, ' ');
+    if (name == NULL) {
+        unlink(path);
+        return;
+    }
+    client->diff = (client->manifest != NULL) && (strncmp(buf, "OK ", 3) == 0);
+    ManifestWriter* writer = &client->manifest_writer;
+    client->writing_manifest = manifest_writer_open(writer, path, name + 1);
+}
+
 static void
 do_remove_old(Client* client)
 {
+    uint64_t t = phase_now();
     send(client, "REMOVE_OLD");
     recv_ok(client);
+    phase_record(&client->phases, PHASE_REMOVE_OLD, t);
 }
 
 int
@@ -614,28 +2236,119 @@ main(int argc, char* argv[])
     client.disable_skipped_warning.whiteout = false;
 
     struct option opts[] = {
+        { "adaptive", no_argument, NULL, 'a' },
+        { "cgroup", required_argument, NULL, 'c' },
+        { "direct-io", no_argument, NULL, 'd' },
         { "disable-skipped-socket-warning", no_argument, NULL, 1 },
+        { "exclude-from", required_argument, NULL, 'x' },
+        { "from-journal", required_argument, NULL, 'j' },
+        { "ioprio", required_argument, NULL, 'P' },
+        { "jobs-per-device", required_argument, NULL, 'J' },
+        { "manifest", required_argument, NULL, 'm' },
+        { "max-bandwidth", required_argument, NULL, 'B' },
+        { "max-iops", required_argument, NULL, 'I' },
+        { "max-load", required_argument, NULL, 'L' },
         { "print-statistics", no_argument, NULL, 's' },
+        { "progress", required_argument, NULL, 'p' },
+        { "progress-interval", required_argument, NULL, 'i' },
         { "root", required_argument, NULL, 'r' },
+        { "stats-format", required_argument, NULL, 'f' },
         { "version", no_argument, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
 
 #define USAGE() usage(basename(argv[0]))
     const char* root = "/";
+    const char* exclude_from = NULL;
+    const char* from_journal = NULL;
+    const char* manifest = NULL;
+    const char* progress = NULL;
+    int progress_interval = 10;
+    int jobs_per_device = 1;
+    ThrottleConf throttle_conf;
+    bzero(&throttle_conf, sizeof(throttle_conf));
+    const char* ioprio = NULL;
+    const char* cgroup = NULL;
     bool print_stat = false;
+    StatsFormat stats_format = STATS_TEXT;
     int opt;
     while ((opt = getopt_long(argc, argv, "v", opts, NULL)) != -1) {
         switch (opt) {
         case 1:
             client.disable_skipped_warning.socket = true;
             break;
+        case 'B':
+            if (!parse_size(&throttle_conf.max_bandwidth, optarg)) {
+                print_error("Invalid bandwidth: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'I':
+            if (!parse_count(&throttle_conf.max_iops, optarg)) {
+                print_error("Invalid IOPS: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'L':
+            if (!parse_load(&throttle_conf.max_load, optarg)) {
+                print_error("Invalid load: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            ioprio = optarg;
+            break;
+        case 'a':
+            throttle_conf.adaptive = true;
+            break;
+        case 'c':
+            cgroup = optarg;
+            break;
+        case 'd':
+#if defined(O_DIRECT)
+            client.direct_io = true;
+            break;
+#else
+            print_error("--direct-io is not supported on this system.");
+            return 1;
+#endif
+        case 'f':
+            if (!parse_stats_format(&stats_format, optarg)) {
+                print_error("Unknown statistics format: %s", optarg);
+                return 1;
+            }
+            print_stat = true;
+            break;
+        case 'i':
+            if (!parse_positive(&progress_interval, optarg)) {
+                print_error("Invalid progress interval: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            from_journal = optarg;
+            break;
+        case 'J':
+            if (!parse_positive(&jobs_per_device, optarg)) {
+                print_error("Invalid number of jobs: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
+        case 'p':
+            progress = optarg;
+            break;
         case 'r':
             root = optarg;
             break;
         case 's':
             print_stat = true;
             break;
+        case 'x':
+            exclude_from = optarg;
+            break;
         case 'v':
             print_version();
             return 0;
@@ -655,23 +2368,93 @@ main(int argc, char* argv[])
         print_error("time(3) failed.");
         return 1;
     }
+    client.stat.start_ns = phase_now();
+    progress_init(&client.progress, progress, progress_interval);
 
     normalize_path(client.root, PATH_SIZE, root);
+    if (exclude_from != NULL) {
+        client.filter = filter_compile(exclude_from);
+        if (client.filter == NULL) {
+            return 1;
+        }
+    }
 
+    Throttle throttle;
+    if (!start_throttle(&client, &throttle, &throttle_conf, ioprio, cgroup)) {
+        return 1;
+    }
+    if (!bufring_init(&client.ring, READ_SIZE, READ_ALIGNMENT)) {
+        print_error("Cannot allocate buffers.");
+        return 1;
+    }
     client.in = stdin;
     client.out = stdout;
+    if (manifest != NULL) {
+        start_manifest(&client, manifest);
+    }
+    Journal journal;
+    JournalStatus journal_status = JOURNAL_NONE;
+    if (from_journal != NULL) {
+        journal_status = journal_read(&journal, from_journal);
+    }
+    bool journaled = (journal_status == JOURNAL_OK) && client.diff;
 
+    int num_paths = argc - optind;
+    char* paths[num_paths];
     int i;
-    for (i = optind; i < argc; i++) {
+    for (i = 0; i < num_paths; i++) {
         char abs_path[PATH_SIZE];
-        normalize_path(abs_path, array_sizeof(abs_path), argv[i]);
-        backup_tree(&client, abs_path);
+        normalize_path(abs_path, array_sizeof(abs_path), argv[optind + i]);
+        paths[i] = strdup_or_die(abs_path);
+    }
+    if (journaled) {
+        for (i = 0; i < num_paths; i++) {
+            backup_journaled(&client, paths[i], &journal);
+        }
+    }
+    else {
+        backup_trees(&client, paths, num_paths, jobs_per_device);
+    }
+    for (i = 0; i < num_paths; i++) {
+        free(paths[i]);
+    }
+    progress_finish(&client.progress, count_entries(&client), client.stat.send_bytes);
+    bool committed = false;
+    if (client.writing_manifest) {
+        if (journaled) {
+            manifest_write_unvisited(&client.manifest_writer, client.manifest);
+        }
+        committed = manifest_writer_commit(&client.manifest_writer);
+    }
+    if (from_journal != NULL) {
+        if (committed && (journal_status != JOURNAL_NONE)) {
+            journal_save_position(&journal, from_journal);
+        }
+        else {
+            journal_remove_position(from_journal);
+        }
+        journal_destroy(&journal);
     }
     do_remove_old(&client);
-    if (print_stat && (do_print_stat(&client) != 0)) {
+    if (print_stat && (do_print_stat(&client, stats_format) != 0)) {
         print_error("Cannot print statistics.");
     }
     send(&client, "THANK_YOU");
+    if (client.filter != NULL) {
+        filter_destroy(client.filter);
+    }
+    if (client.manifest != NULL) {
+        manifest_destroy(client.manifest);
+    }
+    size_t j;
+    for (j = 0; j < client.num_walked; j++) {
+        free(client.walked[j]);
+    }
+    free(client.walked);
+    bufring_destroy(&client.ring);
+    if (client.throttle != NULL) {
+        throttle_destroy(client.throttle);
+    }
 
     return 0;
 }
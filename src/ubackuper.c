@@ -1,36 +1,61 @@
+#include <ubackup/arena.h>
+#include <ubackup/bufring.h>
+#include <ubackup/catalog.h>
+#include <ubackup/conf.h>
 #include <ubackup/config.h>
+#include <ubackup/hash.h>
+#include <ubackup/inodemap.h>
+#include <ubackup/log.h>
+#include <ubackup/pack.h>
+#include <ubackup/phase.h>
+#include <ubackup/protocol.h>
+#include <ubackup/retention.h>
+#include <ubackup/snapshot.h>
+#include <ubackup/timestamp.h>
+#include <ubackup/versions.h>
 
 #include <assert.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
 #define PATH_SIZE 4096
 #define BUF_SIZE PATH_SIZE
+#define BODY_BUF_SIZE (1024 * 1024)
+#define BODY_BUF_ALIGNMENT 4096
+#define WRITEBACK_SIZE (8 * 1024 * 1024)
+
+#if defined(__linux__) && !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 
 #define TRACE(fmt, ...) do { \
     fprintf(stderr, "%s:%u " fmt "\n", __FILE__, __LINE__, __VA_ARGS__); \
 } while (0)
 
 static void
-record_log(int priority, const char* fmt, va_list ap)
+record_log(LogLevel level, const char* fmt, va_list ap)
 {
-    vsyslog(priority, fmt, ap);
+    log_vwrite(level, fmt, ap);
 }
 
 static void
@@ -38,7 +63,10 @@ print_error(const char* fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
-    record_log(LOG_ERR, fmt, ap);
+    va_list aq;
+    va_copy(aq, ap);
+    record_log(LEVEL_ERROR, fmt, aq);
+    va_end(aq);
 
     FILE* out = stderr;
     vfprintf(out, fmt, ap);
@@ -52,7 +80,7 @@ print_info(const char* fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
-    record_log(LOG_INFO, fmt, ap);
+    record_log(LEVEL_INFO, fmt, ap);
     va_end(ap);
 }
 
@@ -67,67 +95,265 @@ print_errno(const char* msg, int e, const char* info)
     print_error("%s: %s: %s", msg, s, info);
 }
 
+/*
+ * Directory fds of the current directory in the new snapshot and in the
+ * previous one. They are -1 if they do not exist. path is relative to the
+ * roots, and empty at the roots. prev_pack has packed files of the previous
+ * one, and pack_dir is the path from the directory to PACK_DIR.
+ */
+struct Cwd {
+    char path[PATH_SIZE];
+    int dest;
+    int dest_meta;
+    int prev;
+    int prev_meta;
+    bool failed;
+    bool unchanged;
+    PackIndex prev_pack;
+    FILE* pack_index;
+    char pack_dir[PATH_SIZE];
+};
+
+typedef struct Cwd Cwd;
+
+/*
+ * An entry is name in the directory of dest_fd (and prev_fd). Its meta data
+ * file is meta_name in dest_meta_fd (and prev_meta_fd).
+ */
+struct Entry {
+    int dest_fd;
+    int prev_fd;
+    int dest_meta_fd;
+    int prev_meta_fd;
+    const char* name;
+    char meta_name[PATH_SIZE];
+};
+
+typedef struct Entry Entry;
+
+/*
+ * Names which the backupee sent in the current directory. They live until the
+ * next CWD, so they have their own arena.
+ */
+struct NameSet {
+    Arena arena;
+    const char** slots;
+    size_t capacity;
+    size_t num;
+};
+
+typedef struct NameSet NameSet;
+
+/*
+ * Written data are flushed in WRITEBACK_SIZE chunks while a body is being
+ * received. The pages of the previous chunk are dropped after it is on the
+ * disk, so a large body does not fill the page cache with dirty pages.
+ */
+struct Writeback {
+    int fd;
+    off_t synced;
+    off_t started;
+};
+
+typedef struct Writeback Writeback;
+
+struct BodyWriter {
+    BufRing* ring;
+    Writeback wb;
+    Xxh64 hash;
+    off_t written;
+    int error;
+};
+
+typedef struct BodyWriter BodyWriter;
+
+/*
+ * A body which comes in parts between OPEN_BODY and BODY_END. rest is the size
+ * which has not come yet. fallocate_error is kept not to report it again as an
+ * error of writing.
+ */
+struct Body {
+    bool open;
+    BodyWriter writer;
+    size_t size;
+    size_t rest;
+    bool received;
+    int fallocate_error;
+};
+
+typedef struct Body Body;
+
+/*
+ * Commands go to the current stream, which STREAM selects. Each stream has its
+ * own current directory and file, so the backupee can send trees of its
+ * devices concurrently in one session. Stream 0 is the current one at first.
+ */
+struct Stream {
+    unsigned int id;
+    Cwd cwd;
+    int current_fd;
+    char current_file[PATH_SIZE];
+    char current_path[PATH_SIZE];
+    bool current_packable;
+    bool current_packed;
+    off_t pack_mark;
+    NameSet seen;
+    Body body;
+};
+
+typedef struct Stream Stream;
+
+/*
+ * Strings of cmd are allocated in arena, which is reset for each command. In
+ * the snapshot mode, dest_dir is prepopulated when it starts as a snapshot of
+ * prev_dir.
+ */
 struct Server {
     const char* backup_dir;
+    const char* name;
+    const char* prev_name;
+    Conf conf;
+    bool reflink_disabled;
+    bool prepopulated;
+    bool completed;
+    bool remove_old;
     char dest_dir[PATH_SIZE];
     char prev_dir[PATH_SIZE];
-    char current_file[PATH_SIZE];
+    int dest_root;
+    int prev_root;
+    Stream* stream;
+    Stream** streams;
+    size_t num_streams;
+    FILE* hashes;
+    Catalog* catalog;
+    uint64_t num_files;
+    uint64_t num_bytes;
+    bool packing;
+    int packs_fd;
+    PackWriter packs;
+    NameSet packs_used;
+    VersionLog versions;
+    Arena arena;
+    Command cmd;
+    Phases phases;
+    BufRing ring;
 };
 
 typedef struct Server Server;
 
-enum Type {
-    CMD_BODY,
-    CMD_DIR,
-    CMD_DISK_TOTAL,
-    CMD_DISK_USAGE,
-    CMD_FILE,
-    CMD_NAME,
-    CMD_REMOVE_OLD,
-    CMD_SYMLINK,
-    CMD_THANK_YOU,
-};
+#define NAME_SET_CAPACITY 64
 
-typedef enum Type Type;
+static const char**
+find_slot(const char** slots, size_t capacity, const char* name)
+{
+    size_t i = hash_name(name) & (capacity - 1);
+    while ((slots[i] != NULL) && (strcmp(slots[i], name) != 0)) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
 
-struct Command {
-    Type type;
-    union {
-        struct {
-            size_t size;
-        } body;
-        struct {
-            char path[PATH_SIZE];
-            mode_t mode;
-            uid_t uid;
-            gid_t gid;
-            time_t ctime;
-        } dir;
-        struct {
-            char path[PATH_SIZE];
-            mode_t mode;
-            uid_t uid;
-            gid_t gid;
-            time_t mtime;
-            time_t ctime;
-        } file;
-        struct {
-            char path[PATH_SIZE];
-            mode_t mode;
-            uid_t uid;
-            gid_t gid;
-            time_t ctime;
-            char src[PATH_SIZE];
-        } symlink;
-    } u;
-};
+static bool
+alloc_slots(NameSet* set, size_t capacity)
+{
+    const char** slots = (const char**)calloc(capacity, sizeof(slots[0]));
+    if (slots == NULL) {
+        return false;
+    }
+    set->slots = slots;
+    set->capacity = capacity;
+    return true;
+}
+
+static bool
+name_set_init(NameSet* set)
+{
+    set->num = 0;
+    if (!alloc_slots(set, NAME_SET_CAPACITY)) {
+        return false;
+    }
+    if (!arena_init(&set->arena, BUF_SIZE)) {
+        free(set->slots);
+        return false;
+    }
+    return true;
+}
+
+static void
+name_set_destroy(NameSet* set)
+{
+    arena_destroy(&set->arena);
+    free(set->slots);
+}
+
+/*
+ * A table which grew for a large directory is shrunk, so that clearing it for
+ * each of small directories does not cost its size.
+ */
+static void
+name_set_clear(NameSet* set)
+{
+    arena_reset(&set->arena);
+    set->num = 0;
+    if (set->capacity != NAME_SET_CAPACITY) {
+        const char** slots = set->slots;
+        if (alloc_slots(set, NAME_SET_CAPACITY)) {
+            free(slots);
+            return;
+        }
+    }
+    memset(set->slots, 0, set->capacity * sizeof(set->slots[0]));
+}
+
+static bool
+grow_name_set(NameSet* set)
+{
+    const char** slots = set->slots;
+    size_t capacity = set->capacity;
+    if (!alloc_slots(set, 2 * capacity)) {
+        return false;
+    }
+    size_t i;
+    for (i = 0; i < capacity; i++) {
+        if (slots[i] != NULL) {
+            *find_slot(set->slots, set->capacity, slots[i]) = slots[i];
+        }
+    }
+    free(slots);
+    return true;
+}
+
+static bool
+name_set_add(NameSet* set, const char* name)
+{
+    if ((set->capacity <= 2 * (set->num + 1)) && !grow_name_set(set)) {
+        return false;
+    }
+    const char** slot = find_slot(set->slots, set->capacity, name);
+    if (*slot != NULL) {
+        return true;
+    }
+    size_t size = strlen(name) + 1;
+    char* s = (char*)arena_alloc(&set->arena, size);
+    if (s == NULL) {
+        return false;
+    }
+    memcpy(s, name, size);
+    *slot = s;
+    set->num++;
+    return true;
+}
 
-typedef struct Command Command;
+static bool
+name_set_contains(const NameSet* set, const char* name)
+{
+    return *find_slot(set->slots, set->capacity, name) != NULL;
+}
 
 static void
 send(const char* msg)
 {
-    print_info("Send: %s", msg);
+    LOG_PROTOCOL("Send: %s", msg);
     printf("%s\r\n", msg);
     fflush(stdout);
 }
@@ -152,6 +378,8 @@ do_mkdir(const char* path)
 }
 
 #define META_DIR ".meta"
+/* A backup is complete if it has this file in its top .meta directory. */
+#define COMMIT_PATH META_DIR "/.commit"
 
 static void
 join(char* dest, size_t size, const char* front, const char* rear)
@@ -174,6 +402,78 @@ make_backup_dir(const char* path)
     return do_mkdir(path) && make_meta_dir(path);
 }
 
+static bool
+make_backup_dir_at(int dirfd, const char* name)
+{
+    if (mkdirat(dirfd, name, 0755) != 0) {
+        print_errno("mkdir failed", errno, name);
+        return false;
+    }
+    size_t size = strlen(name) + strlen(META_DIR) + 2;
+    char buf[size];
+    join(buf, size, name, META_DIR);
+    if (mkdirat(dirfd, buf, 0755) != 0) {
+        print_errno("mkdir failed", errno, buf);
+        return false;
+    }
+    return true;
+}
+
+static bool
+check_lstat_result(int e, const char* path)
+{
+    if (e == ENOENT) {
+        return true;
+    }
+    print_errno("lstat failed", e, path);
+    return false;
+}
+
+/*
+ * Removes name in dirfd whatever it is. A missing entry is not an error.
+ */
+static bool
+remove_entry_at(int dirfd, const char* name)
+{
+    struct stat sb;
+    if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+        return check_lstat_result(errno, name);
+    }
+    if (!S_ISDIR(sb.st_mode)) {
+        if ((unlinkat(dirfd, name, 0) != 0) && (errno != ENOENT)) {
+            print_errno("unlink failed", errno, name);
+            return false;
+        }
+        return true;
+    }
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR* dirp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dirp == NULL) {
+        print_errno("opendir failed", errno, name);
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    bool removed = true;
+    struct dirent* e;
+    while (removed && ((e = readdir(dirp)) != NULL)) {
+        const char* s = e->d_name;
+        if ((strcmp(s, ".") != 0) && (strcmp(s, "..") != 0)) {
+            removed = remove_entry_at(fd, s);
+        }
+    }
+    closedir(dirp);
+    if (!removed) {
+        return false;
+    }
+    if ((unlinkat(dirfd, name, AT_REMOVEDIR) != 0) && (errno != ENOENT)) {
+        print_errno("rmdir failed", errno, name);
+        return false;
+    }
+    return true;
+}
+
 #define META_EXT ".meta"
 
 static void
@@ -191,654 +491,2057 @@ print_link_error(const char* name, int e, const char* src, const char* dest)
 }
 
 static bool
-make_link(const char* src, const char* dest)
+make_link(Server* server, int src_fd, const char* src, int dest_fd, const char* dest)
 {
-    if (link(src, dest) != 0) {
+    uint64_t t = phase_now();
+    if (linkat(src_fd, src, dest_fd, dest, 0) != 0) {
         print_link_error("link", errno, src, dest);
         return false;
     }
+    phase_record(&server->phases, PHASE_LINK, t);
     return true;
 }
 
+/*
+ * sb is set when the file is unchanged.
+ */
 static bool
-check_file_changed(const Server* server, const char* path, time_t timestamp)
+is_file_changed(Server* server, int dirfd, const char* name, const Timestamp* timestamp,
+                struct stat* sb)
 {
-    if (server->prev_dir[0] == '\0') {
+    if (dirfd == -1) {
         return true;
     }
 
-    struct stat sb;
-    if (lstat(path, &sb) != 0) {
+    uint64_t t = phase_now();
+    int status = fstatat(dirfd, name, sb, AT_SYMLINK_NOFOLLOW);
+    phase_record(&server->phases, PHASE_STAT, t);
+    if (status != 0) {
         return true;
     }
-    return sb.st_mtime < timestamp;
+    Timestamp mtime = { sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec };
+    return timestamp_compare(&mtime, timestamp) < 0;
 }
 
 static bool
-save_meta_data(const Server* server, const char* path, mode_t mode, uid_t uid, gid_t gid, time_t ctime)
+check_file_changed(Server* server, int dirfd, const char* name, const Timestamp* timestamp)
 {
-    char dir[PATH_SIZE];
-    strcpy(dir, dirname(path));
-    const char* s = strcmp(dir, "/") == 0 ? "" : dir;
-    size_t meta_dir_size = strlen(s) + strlen(META_DIR) + 2;
-    char meta_dir[meta_dir_size];
-    join(meta_dir, meta_dir_size, s, META_DIR);
-
-    const char* name = basename(path);
-    char meta_name[strlen(name) + strlen(META_EXT) + 1];
-    sprintf(meta_name, "%s%s", name, META_EXT);
-
-    size_t meta_path_size = strlen(meta_dir) + strlen(meta_name) + 2;
-    char meta_path[meta_path_size];
-    join(meta_path, meta_path_size, meta_dir, meta_name);
-
-    size_t prev_dir_size = strlen(server->prev_dir);
-    char prev_path[prev_dir_size + strlen(meta_path) + 1];
-    sprintf(prev_path, "%s%s", server->prev_dir, meta_path);
-    char abspath[strlen(server->dest_dir) + strlen(meta_path) + 1];
-    sprintf(abspath, "%s%s", server->dest_dir, meta_path);
-
-    if (!check_file_changed(server, prev_path, ctime)) {
-        return make_link(prev_path, abspath);
-    }
+    struct stat sb;
+    return is_file_changed(server, dirfd, name, timestamp, &sb);
+}
 
-    FILE* fp = fopen(abspath, "w");
-    if (fp != NULL) {
-        fprintf(fp, "%o\n", mode);
-        fprintf(fp, "%u\n", uid);
-        fprintf(fp, "%u", gid);
-        fclose(fp);
-        return true;
-    }
-    if (errno == ENAMETOOLONG) {
-        print_info("A meta file \"%s\" has too long name. Ignored.", abspath);
-        return true;
+/*
+ * Paths in the version log are from the top of the backup. dirfd is the top
+ * directory or the current one. A path too long is not indexed, like in
+ * versions_update().
+ */
+static void
+log_version(Server* server, int dirfd, const char* name, VersionRecord* record)
+{
+    const char* dir = dirfd == server->dest_root ? "" : server->stream->cwd.path;
+    char path[PATH_SIZE];
+    size_t n = snprintf(path, sizeof(path), "%s%s%s", dir, *dir == '\0' ? "" : "/", name);
+    if (sizeof(path) <= n) {
+        return;
     }
-    print_errno("fopen failed", errno, abspath);
-    return false;
+    record->path = path;
+    version_log_add(&server->versions, record);
 }
 
-static bool
-do_name(const Server* server)
+static void
+log_file(Server* server, int dirfd, const char* name, const struct stat* sb)
 {
-    char buf[BUF_SIZE];
-    snprintf(buf, BUF_SIZE, "OK %s", server->dest_dir);
-    send(buf);
-    return true;
+    if (!S_ISREG(sb->st_mode)) {
+        return;
+    }
+    VersionRecord record = { '+', sb->st_size, sb->st_mtim, sb->st_ino, NULL };
+    log_version(server, dirfd, name, &record);
 }
 
-static uint64_t
-total_of_statfs(struct statfs* buf)
+static void
+log_removal(Server* server, int dirfd, const char* name)
 {
-    return buf->f_blocks;
+    VersionRecord record = { '-', 0, { 0, 0 }, 0, NULL };
+    log_version(server, dirfd, name, &record);
 }
 
-static uint64_t
-usage_of_statfs(struct statfs* buf)
+/*
+ * remove_entry_at() for entries of the new backup, which are logged.
+ */
+static bool
+remove_backup_entry(Server* server, int dirfd, const char* name)
 {
-    return buf->f_blocks - buf->f_bfree;
+    if (!remove_entry_at(dirfd, name)) {
+        return false;
+    }
+    log_removal(server, dirfd, name);
+    return true;
 }
 
-#define IMPLEMENT_DISK_CMD(name, f) \
-    static bool \
-    name(const Server* server) \
-    { \
-        const char* path = server->dest_dir; \
-        struct statfs buf; \
-        if (statfs(path, &buf) != 0) { \
-            print_errno("statfs failed", errno, path); \
-            send_ng(); \
-            return false; \
-        } \
-        uint64_t val = buf.f_bsize * f(&buf); \
-        char response[BUF_SIZE]; \
-        snprintf(response, BUF_SIZE, "OK %lu", val); \
-        send(response); \
-        return true; \
+/*
+ * Makes "dir/.meta/name.meta" from "dir/name". Returns the length, or zero if
+ * it is too long.
+ */
+static size_t
+make_meta_path(char* dest, size_t size, const char* path, size_t path_len)
+{
+    const char* slash = path + path_len;
+    while ((path < slash) && (*slash != '/')) {
+        slash--;
+    }
+    bool has_dir = *slash == '/';
+    size_t dir_len = has_dir ? slash - path + 1 : 0;
+    const char* name = has_dir ? slash + 1 : path;
+    size_t name_len = path_len - (name - path);
+    const char* meta_dir = META_DIR "/";
+    size_t meta_dir_len = strlen(meta_dir);
+    size_t ext_len = strlen(META_EXT);
+    size_t len = dir_len + meta_dir_len + name_len + ext_len;
+    if (size <= len) {
+        return 0;
     }
-IMPLEMENT_DISK_CMD(do_disk_total, total_of_statfs);
-IMPLEMENT_DISK_CMD(do_disk_usage, usage_of_statfs);
+    char* p = dest;
+    memcpy(p, path, dir_len);
+    p += dir_len;
+    memcpy(p, meta_dir, meta_dir_len);
+    p += meta_dir_len;
+    memcpy(p, name, name_len);
+    p += name_len;
+    memcpy(p, META_EXT, ext_len + 1);
+    return len;
+}
 
+/*
+ * An absolute path is the old form. It is resolved from the roots of the
+ * snapshots. A relative one is a name in the current directory. meta_name is
+ * empty if it is too long.
+ */
 static bool
-do_dir(const Server* server, const Command* cmd)
+resolve_entry(Server* server, Entry* entry, const Slice* path)
 {
-    char path[strlen(server->dest_dir) + strlen(cmd->u.dir.path) + 1];
-    sprintf(path, "%s%s", server->dest_dir, cmd->u.dir.path);
-    if (!make_backup_dir(path)) {
-        send_ng();
-        return false;
+    bool absolute = (0 < path->len) && (path->ptr[0] == '/');
+    if (absolute) {
+        const char* rel = path->ptr + 1;
+        size_t rel_len = path->len - 1;
+        entry->dest_fd = entry->dest_meta_fd = server->dest_root;
+        entry->prev_fd = entry->prev_meta_fd = server->prev_root;
+        entry->name = rel_len == 0 ? "." : rel;
+        size_t size = sizeof(entry->meta_name);
+        if (make_meta_path(entry->meta_name, size, rel, rel_len) == 0) {
+            entry->meta_name[0] = '\0';
+        }
+        return true;
     }
-    mode_t mode = cmd->u.dir.mode;
-    uid_t uid = cmd->u.dir.uid;
-    gid_t gid = cmd->u.dir.gid;
-    time_t ctime = cmd->u.dir.ctime;
-    if (!save_meta_data(server, cmd->u.dir.path, mode, uid, gid, ctime)) {
-        send_ng();
+
+    const Cwd* cwd = &server->stream->cwd;
+    if (cwd->dest == -1) {
+        print_error("No current directory for %s", path->ptr);
         return false;
     }
-    send_ok();
+    entry->dest_fd = cwd->dest;
+    entry->prev_fd = cwd->prev;
+    entry->dest_meta_fd = cwd->dest_meta;
+    entry->prev_meta_fd = cwd->prev_meta;
+    entry->name = path->ptr;
+    size_t ext_len = strlen(META_EXT);
+    if (sizeof(entry->meta_name) <= path->len + ext_len) {
+        entry->meta_name[0] = '\0';
+        return true;
+    }
+    memcpy(entry->meta_name, path->ptr, path->len);
+    memcpy(entry->meta_name + path->len, META_EXT, ext_len + 1);
     return true;
 }
 
-#define array_sizeof(a) (sizeof(a) / sizeof(a[0]))
-
 static bool
-do_file(Server* server, const Command* cmd)
+save_meta_data(Server* server, const Entry* entry, mode_t mode, uid_t uid, gid_t gid, const Timestamp* ctime)
 {
-    char* current_file = server->current_file;
-    const char* path = cmd->u.file.path;
-    snprintf(current_file, PATH_SIZE, "%s%s", server->dest_dir, path);
-
-    mode_t mode = cmd->u.file.mode;
-    uid_t uid = cmd->u.file.uid;
-    gid_t gid = cmd->u.file.gid;
-    if (!save_meta_data(server, path, mode, uid, gid, cmd->u.file.ctime)) {
-        send_ng();
-        return false;
+    const char* meta_name = entry->meta_name;
+    if (meta_name[0] == '\0') {
+        print_info("A meta file of \"%s\" has too long name. Ignored.", entry->name);
+        return true;
+    }
+    if (server->prepopulated) {
+        if (!check_file_changed(server, entry->dest_meta_fd, meta_name, ctime)) {
+            return true;
+        }
+    }
+    else {
+        int prev_fd = entry->prev_meta_fd;
+        if (!check_file_changed(server, prev_fd, meta_name, ctime)) {
+            int dest_fd = entry->dest_meta_fd;
+            return make_link(server, prev_fd, meta_name, dest_fd, meta_name);
+        }
     }
 
-    size_t size = strlen(server->prev_dir) + strlen(path) + 1;
-    char prev_path[size];
-    sprintf(prev_path, "%s%s", server->prev_dir, path);
-    if (check_file_changed(server, prev_path, cmd->u.file.mtime)) {
-        send("CHANGED");
+    uint64_t t = phase_now();
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = openat(entry->dest_meta_fd, meta_name, flags, 0644);
+    FILE* fp = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (fp != NULL) {
+        fprintf(fp, "%o\n", mode);
+        fprintf(fp, "%u\n", uid);
+        fprintf(fp, "%u", gid);
+        fclose(fp);
+        phase_record(&server->phases, PHASE_META, t);
         return true;
     }
-
-    if (!make_link(prev_path, current_file)) {
-        send_ng();
-        return false;
+    int e = errno;
+    if (fd != -1) {
+        close(fd);
     }
-
-    send("UNCHANGED");
-    return true;
+    if (e == ENAMETOOLONG) {
+        print_info("A meta file \"%s\" has too long name. Ignored.", meta_name);
+        return true;
+    }
+    print_errno("open failed", e, meta_name);
+    return false;
 }
 
+/*
+ * Names in the current directory are remembered in a prepopulated snapshot,
+ * so that ENDDIR can remove the others.
+ */
 static bool
-do_body(const Server* server, const Command* cmd)
+remember_name(Server* server, const Entry* entry)
 {
-    const char* path = server->current_file;
-    FILE* fp = fopen(path, "w");
-    if (fp == NULL) {
-        print_errno("fopen failed", errno, path);
-        send_ng();
-        return false;
+    if (!server->prepopulated || (entry->dest_fd != server->stream->cwd.dest)) {
+        return true;
     }
-    size_t rest = cmd->u.body.size;
-    while (0 < rest) {
-        size_t max = 4096;
-        char buf[max];
-        size_t nbytes = fread(buf, 1, max < rest ? max : rest, stdin);
-        fwrite(buf, 1, nbytes, fp);
-        rest -= nbytes;
+    if (!name_set_add(&server->stream->seen, entry->name)) {
+        print_error("Cannot allocate memory for %s", entry->name);
+        return false;
     }
-    fclose(fp);
-
-    send_ok();
     return true;
 }
 
+/*
+ * A prepopulated snapshot may already have name. A directory is kept as it
+ * is. Other entries are replaced.
+ */
 static bool
-do_symlink(const Server* server, const Command* cmd)
+prepare_dir(Server* server, int dirfd, const char* name)
 {
-    const char* path = cmd->u.symlink.path;
-    mode_t mode = cmd->u.symlink.mode;
-    uid_t uid = cmd->u.symlink.uid;
-    gid_t gid = cmd->u.symlink.gid;
-    time_t ctime = cmd->u.symlink.ctime;
-    if (!save_meta_data(server, path, mode, uid, gid, ctime)) {
-        send_ng();
-        return false;
+    struct stat sb;
+    if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+        return make_backup_dir_at(dirfd, name);
     }
-    size_t size = strlen(server->dest_dir) + strlen(path) + 2;
+    if (!S_ISDIR(sb.st_mode)) {
+        return remove_backup_entry(server, dirfd, name) && make_backup_dir_at(dirfd, name);
+    }
+    size_t size = strlen(name) + strlen(META_DIR) + 2;
     char buf[size];
-    join(buf, size, server->dest_dir, path);
-    if (symlink(cmd->u.symlink.src, buf) != 0) {
-        print_link_error("symlink", errno, cmd->u.symlink.src, buf);
-        send_ng();
+    join(buf, size, name, META_DIR);
+    if ((mkdirat(dirfd, buf, 0755) != 0) && (errno != EEXIST)) {
+        print_errno("mkdir failed", errno, buf);
         return false;
     }
-    send_ok();
     return true;
 }
 
-static void
-trim(char* s)
+static bool
+is_regular_file_changed(Server* server, int dirfd, const char* name, const Timestamp* timestamp)
 {
-    char* p = strrchr(s, '\r');
-    if (p == NULL) {
-        return;
+    struct stat sb;
+    if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+        return true;
     }
-    *p = '\0';
+    return !S_ISREG(sb.st_mode) || check_file_changed(server, dirfd, name, timestamp);
 }
 
-struct Name2Type {
-    const char* name;
-    Type type;
-};
-
-typedef struct Name2Type Name2Type;
-
 static bool
-get_type_of_name(Type* type, const char* name, Name2Type* n2t)
+make_symlink(Server* server, const char* src, int dirfd, const char* name)
 {
-    if (strcmp(name, n2t->name) != 0) {
+    if (server->prepopulated) {
+        char buf[PATH_SIZE];
+        ssize_t n = readlinkat(dirfd, name, buf, sizeof(buf));
+        size_t len = strlen(src);
+        if ((0 <= n) && ((size_t)n == len) && (memcmp(buf, src, len) == 0)) {
+            return true;
+        }
+        if (!remove_backup_entry(server, dirfd, name)) {
+            return false;
+        }
+    }
+    if (symlinkat(src, dirfd, name) != 0) {
+        print_link_error("symlink", errno, src, name);
         return false;
     }
-    *type = n2t->type;
     return true;
 }
 
 static void
-skip(const char** p, int (*pred)(int))
+close_dirfd(int* fd)
+{
+    if (*fd != -1) {
+        close(*fd);
+    }
+    *fd = -1;
+}
+
+static int
+open_dirfd(int dirfd, const char* name)
 {
-    while (pred(**p)) {
-        (*p)++;
+    if (dirfd == -1) {
+        return -1;
     }
+    return openat(dirfd, name, O_RDONLY | O_DIRECTORY);
 }
 
 static void
-skip_whitespace(const char** p)
+close_cwd(Cwd* cwd)
 {
-    skip(p, isblank);
+    if ((cwd->pack_index != NULL) && (fclose(cwd->pack_index) != 0)) {
+        print_errno("writing a pack index failed", errno, cwd->path);
+    }
+    cwd->pack_index = NULL;
+    close_dirfd(&cwd->dest);
+    close_dirfd(&cwd->dest_meta);
+    close_dirfd(&cwd->prev);
+    close_dirfd(&cwd->prev_meta);
 }
 
-static int
-is_command_char(int c)
+/*
+ * Records of packed files in the previous backup are read for FILE commands.
+ * If they cannot be read, the files are sent again.
+ */
+static void
+load_pack_index(Cwd* cwd, const char* rel)
 {
-    return isalpha(c) || (c == '_');
+    char* p = cwd->pack_dir;
+    char* end = p + sizeof(cwd->pack_dir) - sizeof(PACK_DIR "/");
+    const char* q;
+    for (q = rel; (*q != '\0') && (p < end); q++) {
+        if ((q == rel) || ((q[-1] == '/') && (*q != '/'))) {
+            memcpy(p, "../", 3);
+            p += 3;
+        }
+    }
+    memcpy(p, PACK_DIR "/", sizeof(PACK_DIR "/"));
+    if ((cwd->prev_meta == -1) || !pack_index_load(&cwd->prev_pack, cwd->prev_meta)) {
+        pack_index_clear(&cwd->prev_pack);
+    }
 }
 
-static int
-parse_type(Type* type, const char** p)
-{
-    const char* from = *p;
-    skip(p, is_command_char);
-    size_t size = *p - from;
-    char name[size + 1];
-    memcpy(name, from, size);
-    name[size] = '\0';
-
-    Name2Type name2type[] = {
-        { "BODY", CMD_BODY },
-        { "DIR", CMD_DIR },
-        { "DISK_TOTAL", CMD_DISK_TOTAL },
-        { "DISK_USAGE", CMD_DISK_USAGE },
-        { "FILE", CMD_FILE },
-        { "NAME", CMD_NAME },
-        { "REMOVE_OLD", CMD_REMOVE_OLD },
-        { "SYMLINK", CMD_SYMLINK },
-        { "THANK_YOU", CMD_THANK_YOU }};
-    bool found = false;
-    size_t i;
-    for (i = 0; !found && (i < array_sizeof(name2type)); i++) {
-        found = get_type_of_name(type, name, &name2type[i]);
+/*
+ * Opens the directory in the new snapshot and in the previous one. The
+ * previous one may not have it.
+ */
+static bool
+do_cwd(Server* server, const Command* cmd)
+{
+    Cwd* cwd = &server->stream->cwd;
+    close_cwd(cwd);
+    cwd->failed = false;
+    cwd->unchanged = false;
+    server->stream->current_fd = -1;
+    name_set_clear(&server->stream->seen);
+
+    const Slice* path = &cmd->u.cwd.path;
+    const char* rel = path->ptr;
+    while (*rel == '/') {
+        rel++;
+    }
+    const char* name = *rel == '\0' ? "." : rel;
+    snprintf(cwd->path, sizeof(cwd->path), "%s", rel);
+    cwd->dest = open_dirfd(server->dest_root, name);
+    cwd->dest_meta = open_dirfd(cwd->dest, META_DIR);
+    if ((cwd->dest == -1) || (cwd->dest_meta == -1)) {
+        print_errno("open directory failed", errno, path->ptr);
+        close_cwd(cwd);
+        send_ng();
+        return false;
     }
-    if (!found) {
-        return 1;
+    cwd->prev = open_dirfd(server->prev_root, name);
+    cwd->prev_meta = open_dirfd(cwd->prev, META_DIR);
+    if (server->packing) {
+        load_pack_index(cwd, rel);
     }
+    send_ok();
+    return true;
+}
 
-    return 0;
+/*
+ * Appends a record into the index of the current directory. Names of pack
+ * files in it are remembered, so that unused ones are removed at the end. Where
+ * the record starts is kept for do_discard().
+ */
+static bool
+add_pack_record(Server* server, const PackRecord* record)
+{
+    Cwd* cwd = &server->stream->cwd;
+    if (cwd->pack_index == NULL) {
+        int flags = O_WRONLY | O_CREAT | O_APPEND;
+        int fd = openat(cwd->dest_meta, PACK_INDEX, flags, 0644);
+        cwd->pack_index = fd != -1 ? fdopen(fd, "a") : NULL;
+        if (cwd->pack_index == NULL) {
+            print_errno("open failed", errno, PACK_INDEX);
+            if (fd != -1) {
+                close(fd);
+            }
+            return false;
+        }
+    }
+    server->stream->pack_mark = ftello(cwd->pack_index);
+    if (!pack_record_write(cwd->pack_index, record)) {
+        print_errno("writing a pack index failed", errno, record->name);
+        return false;
+    }
+    VersionRecord version = { '+', record->length, record->mtime, 0, NULL };
+    log_version(server, cwd->dest, record->name, &version);
+    const char* slash = strrchr(record->pack, '/');
+    return name_set_add(&server->packs_used, slash != NULL ? slash + 1 : record->pack);
 }
 
-static int
-isoctal(int c)
+/*
+ * Makes dest a copy of src which shares extents with it (FICLONE of Linux).
+ * Times are copied, so the copy looks like a hard link for
+ * check_file_changed().
+ */
+static bool
+reflink_at(int src_fd, const char* src, int dest_fd, const char* dest)
 {
-    return ('0' <= c) && (c < '8');
+#if defined(FICLONE)
+    int in = openat(src_fd, src, O_RDONLY | O_NOFOLLOW);
+    if (in == -1) {
+        return false;
+    }
+    struct stat sb;
+    if (fstat(in, &sb) != 0) {
+        close(in);
+        return false;
+    }
+    int out = openat(dest_fd, dest, O_WRONLY | O_CREAT | O_EXCL, sb.st_mode & 07777);
+    if (out == -1) {
+        close(in);
+        return false;
+    }
+    bool cloned = ioctl(out, FICLONE, in) == 0;
+    int e = errno;
+    if (cloned) {
+        struct timespec times[] = { sb.st_atim, sb.st_mtim };
+        futimens(out, times);
+    }
+    close(out);
+    close(in);
+    if (!cloned) {
+        unlinkat(dest_fd, dest, 0);
+        errno = e;
+    }
+    return cloned;
+#else
+    (void)src_fd;
+    (void)src;
+    (void)dest_fd;
+    (void)dest;
+    errno = EOPNOTSUPP;
+    return false;
+#endif
 }
 
-static int
-parse_mode(mode_t* dest, const char** p)
+static bool
+is_reflink_unsupported(int e)
 {
-    skip_whitespace(p);
+    return (e == EOPNOTSUPP) || (e == ENOTTY) || (e == EXDEV) || (e == EINVAL) || (e == ENOSYS);
+}
 
-    const char* from = *p;
-    skip(p, isoctal);
-    size_t size = *p - from;
-    char buf[size + 1];
-    memcpy(buf, from, size);
-    buf[size] = '\0';
-    *dest = strtoul(buf, NULL, 8);
-    return 0;
+/*
+ * Regular files are reflinked in the reflink mode. If the filesystem cannot do
+ * it, hard links are used for the rest of the session.
+ */
+static bool
+clone_file(Server* server, int src_fd, const char* src, int dest_fd, const char* dest, bool regular)
+{
+    if (!regular || (server->conf.clone != CLONE_REFLINK) || server->reflink_disabled) {
+        return make_link(server, src_fd, src, dest_fd, dest);
+    }
+    uint64_t t = phase_now();
+    if (reflink_at(src_fd, src, dest_fd, dest)) {
+        phase_record(&server->phases, PHASE_LINK, t);
+        return true;
+    }
+    if (!is_reflink_unsupported(errno)) {
+        print_link_error("reflink", errno, src, dest);
+        return false;
+    }
+    print_info("reflink is not supported. Hard links are used: %s", strerror(errno));
+    server->reflink_disabled = true;
+    return make_link(server, src_fd, src, dest_fd, dest);
 }
 
-#define IMPLEMENT_PARSE_X(name, type, max) \
-    static int \
-    name(type* dest, const char** p) \
-    { \
-        skip_whitespace(p); \
-\
-        const char* from = *p; \
-        skip(p, isdigit); \
-        size_t size = *p - from; \
-        char buf[size + 1]; \
-        memcpy(buf, from, size); \
-        buf[size] = '\0'; \
-        unsigned long l = strtoul(buf, NULL, 10); \
-        assert(l < max); \
-        *dest = (type)l; \
-        return 0; \
-    }
-IMPLEMENT_PARSE_X(parse_decimal, size_t, ULONG_MAX)
-IMPLEMENT_PARSE_X(parse_integer, unsigned int, UINT_MAX)
+#define DIGEST_NAME ".digest"
 
-static int
-parse_body(Command* cmd, const char* params)
+static bool
+read_digest(int dirfd, char* buf, size_t size)
 {
-    const char* p = params;
-    return parse_decimal(&cmd->u.body.size, &p);
+    if (dirfd == -1) {
+        return false;
+    }
+    int fd = openat(dirfd, DIGEST_NAME, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n <= 0) {
+        return false;
+    }
+    buf[n] = '\0';
+    char* p = strchr(buf, '\n');
+    if (p != NULL) {
+        *p = '\0';
+    }
+    return true;
 }
 
-static void
-skip_double_quote(const char** p)
+static bool
+write_digest(int dirfd, const Slice* digest)
 {
-    assert(**p == '\"');
-    (*p)++;
+    int fd = openat(dirfd, DIGEST_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        print_errno("open failed", errno, DIGEST_NAME);
+        return false;
+    }
+    bool written = write(fd, digest->ptr, digest->len) == (ssize_t)digest->len;
+    written = written && (write(fd, "\n", 1) == 1);
+    if (!written) {
+        print_errno("write failed", errno, DIGEST_NAME);
+    }
+    close(fd);
+    return written;
 }
 
-static int
-parse_string(char* dest, const char** p)
-{
-    skip_whitespace(p);
-    skip_double_quote(p);
+struct NameList {
+    struct NameList* next;
+    char name[];
+};
+
+typedef struct NameList NameList;
 
-    char* q = dest;
-    while (**p != '\"') {
-        if (**p == '\\') {
-            (*p)++;
+static bool
+clone_meta(Server* server, const char* name)
+{
+    Cwd* cwd = &server->stream->cwd;
+    size_t size = strlen(name) + strlen(META_EXT) + 1;
+    char meta_name[size];
+    snprintf(meta_name, size, "%s%s", name, META_EXT);
+    uint64_t t = phase_now();
+    if (linkat(cwd->prev_meta, meta_name, cwd->dest_meta, meta_name, 0) != 0) {
+        if ((errno == ENOENT) || (errno == ENAMETOOLONG)) {
+            return true;
         }
-        *q = **p;
-        (*p)++;
-        q++;
+        print_link_error("link", errno, meta_name, meta_name);
+        return false;
     }
-    *q = '\0';
-
-    skip_double_quote(p);
-    return 0;
+    phase_record(&server->phases, PHASE_LINK, t);
+    return true;
 }
 
-static int
-parse_timestamp(time_t* dest, const char** p)
+static void
+unclone(Server* server, const NameList* cloned)
 {
-    skip_whitespace(p);
-
-    struct tm tm;
-    bzero(&tm, sizeof(tm));
-    const char* q = strptime(*p, "%Y-%m-%dT%H:%M:%S", &tm);
-    if (q == NULL) {
-        return 1;
+    Cwd* cwd = &server->stream->cwd;
+    const NameList* p;
+    for (p = cloned; p != NULL; p = p->next) {
+        unlinkat(cwd->dest, p->name, 0);
+        log_removal(server, cwd->dest, p->name);
+        size_t size = strlen(p->name) + strlen(META_EXT) + 1;
+        char meta_name[size];
+        snprintf(meta_name, size, "%s%s", p->name, META_EXT);
+        unlinkat(cwd->dest_meta, meta_name, 0);
     }
-    *dest = mktime(&tm);
-    *p = q;
-    return 0;
 }
 
-static int
-parse_symlink(Command* cmd, const char* params)
+/*
+ * Clones all non-directory entries of the current directory in the previous
+ * backup with their meta data. Subdirectories are left to DIR commands. If
+ * something fails, the cloned entries are removed.
+ */
+static bool
+clone_dir(Server* server)
 {
-    const char* p = params;
-    if (parse_string(cmd->u.symlink.path, &p) != 0) {
-        return 1;
-    }
-    if (parse_mode(&cmd->u.symlink.mode, &p) != 0) {
-        return 1;
-    }
-    if (parse_integer(&cmd->u.symlink.uid, &p) != 0) {
-        return 1;
+    Cwd* cwd = &server->stream->cwd;
+    int fd = openat(cwd->prev, ".", O_RDONLY | O_DIRECTORY);
+    DIR* dirp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dirp == NULL) {
+        print_errno("opendir failed", errno, "previous backup");
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
     }
-    if (parse_integer(&cmd->u.symlink.gid, &p) != 0) {
-        return 1;
+    NameList* cloned = NULL;
+    bool ok = true;
+    struct dirent* e;
+    while (ok && ((e = readdir(dirp)) != NULL)) {
+        const char* name = e->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+            continue;
+        }
+        if ((strcmp(name, META_DIR) == 0) || (e->d_type == DT_DIR)) {
+            continue;
+        }
+        struct stat sb;
+        if (fstatat(cwd->prev, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+            print_errno("stat failed", errno, name);
+            ok = false;
+            break;
+        }
+        if (S_ISDIR(sb.st_mode)) {
+            continue;
+        }
+        bool regular = S_ISREG(sb.st_mode);
+        if (!clone_file(server, cwd->prev, name, cwd->dest, name, regular)) {
+            ok = false;
+            break;
+        }
+        log_file(server, cwd->dest, name, &sb);
+        size_t len = strlen(name);
+        NameList* p = (NameList*)arena_alloc(&server->arena, sizeof(NameList) + len + 1);
+        if (p == NULL) {
+            unlinkat(cwd->dest, name, 0);
+            ok = false;
+            break;
+        }
+        memcpy(p->name, name, len + 1);
+        p->next = cloned;
+        cloned = p;
+        ok = clone_meta(server, name);
     }
-    if (parse_timestamp(&cmd->u.symlink.ctime, &p) != 0) {
-        return 1;
+    closedir(dirp);
+    const PackIndex* index = &cwd->prev_pack;
+    size_t i;
+    for (i = 0; ok && server->packing && (i < index->num); i++) {
+        ok = add_pack_record(server, &index->records[i]);
     }
-    if (parse_string(cmd->u.symlink.src, &p) != 0) {
-        return 1;
+    if (!ok) {
+        unclone(server, cloned);
     }
-    return 0;
+    return ok;
 }
 
-static int
-parse_file(Command* cmd, const char* params)
+static void
+send_changed(Server* server)
 {
-    const char* p = params;
-    if (parse_string(cmd->u.file.path, &p) != 0) {
-        return 1;
-    }
-    if (parse_mode(&cmd->u.file.mode, &p) != 0) {
-        return 1;
-    }
-    if (parse_integer(&cmd->u.file.uid, &p) != 0) {
-        return 1;
-    }
-    if (parse_integer(&cmd->u.file.gid, &p) != 0) {
-        return 1;
-    }
-    if (parse_timestamp(&cmd->u.file.mtime, &p) != 0) {
-        return 1;
-    }
-    if (parse_timestamp(&cmd->u.file.ctime, &p) != 0) {
-        return 1;
+    if (server->prepopulated) {
+        unlinkat(server->stream->cwd.dest_meta, DIGEST_NAME, 0);
     }
-    return 0;
+    send("CHANGED");
 }
 
-static int
-parse_dir(Command* cmd, const char* params)
+/*
+ * DIGEST digest. If the previous backup has the same digest for the current
+ * directory, all non-directory entries are cloned from it. A prepopulated
+ * snapshot already has them.
+ */
+static bool
+do_digest(Server* server, const Command* cmd)
 {
-    const char* p = params;
-    if (parse_string(cmd->u.dir.path, &p) != 0) {
-        return 1;
+    Cwd* cwd = &server->stream->cwd;
+    const Slice* digest = &cmd->u.digest.value;
+    char prev[BUF_SIZE];
+    if ((cwd->dest == -1) || !read_digest(cwd->prev_meta, prev, sizeof(prev))) {
+        send_changed(server);
+        return true;
     }
-    if (parse_mode(&cmd->u.dir.mode, &p) != 0) {
-        return 1;
+    if (strcmp(prev, digest->ptr) != 0) {
+        send_changed(server);
+        return true;
     }
-    if (parse_integer(&cmd->u.dir.uid, &p) != 0) {
-        return 1;
+    if (server->prepopulated) {
+        cwd->unchanged = true;
+        send("UNCHANGED");
+        return true;
     }
-    if (parse_integer(&cmd->u.dir.gid, &p) != 0) {
-        return 1;
+    if (!clone_dir(server)) {
+        send("CHANGED");
+        return true;
     }
-    if (parse_timestamp(&cmd->u.dir.ctime, &p) != 0) {
-        return 1;
+    if (!write_digest(cwd->dest_meta, digest)) {
+        cwd->failed = true;
     }
-    return 0;
+    send("UNCHANGED");
+    return true;
 }
 
-static int
-parse(Command* cmd, const char* line)
+/*
+ * SAVE_DIGEST digest. The backupee sends this after all non-directory entries
+ * of the current directory. The digest is not saved if some of them failed.
+ */
+static bool
+do_save_digest(Server* server, const Command* cmd)
 {
-    const char* p = line;
-    if (parse_type(&cmd->type, &p) != 0) {
-        return 1;
+    Cwd* cwd = &server->stream->cwd;
+    if ((cwd->dest == -1) || cwd->failed) {
+        send_ng();
+        return false;
     }
-    switch (cmd->type) {
-    case CMD_BODY:
-        return parse_body(cmd, p);
-    case CMD_DIR:
-        return parse_dir(cmd, p);
-    case CMD_FILE:
-        return parse_file(cmd, p);
-    case CMD_SYMLINK:
-        return parse_symlink(cmd, p);
-    case CMD_DISK_TOTAL:
-    case CMD_DISK_USAGE:
-    case CMD_NAME:
-    case CMD_REMOVE_OLD:
-    case CMD_THANK_YOU:
-        return 0;
-    default:
-        break;
+    if (!write_digest(cwd->dest_meta, &cmd->u.digest.value)) {
+        send_ng();
+        return false;
     }
-    return 1;
+    send_ok();
+    return true;
 }
 
-#define BACKUP_MARK '('
-
-static bool
-is_backup_dir(const char* name)
+static void
+remove_cwd_meta(Cwd* cwd, const char* name)
 {
-    char c = name[0];
-    return isdigit(c) || (c == BACKUP_MARK);
+    size_t size = strlen(name) + strlen(META_EXT) + 1;
+    char meta_name[size];
+    snprintf(meta_name, size, "%s%s", name, META_EXT);
+    unlinkat(cwd->dest_meta, meta_name, 0);
 }
 
-static int
-count_entry(const char* name)
+static bool
+remove_cwd_entry(Server* server, const char* name)
 {
-    return is_backup_dir(name) ? 1 : 0;
+    Cwd* cwd = &server->stream->cwd;
+    if (!remove_backup_entry(server, cwd->dest, name)) {
+        return false;
+    }
+    remove_cwd_meta(cwd, name);
+    print_info("Removed: %s", name);
+    return true;
 }
 
-static int
-count_dirent(Server* server)
+/*
+ * Removes entries of the current directory which were not sent. Non-directory
+ * entries are kept when the directory was unchanged.
+ */
+static bool
+prune_dir(Server* server)
 {
-    const char* dir = server->backup_dir;
-    int n = 0;
-    DIR* dirp = opendir(dir);
+    Cwd* cwd = &server->stream->cwd;
+    int fd = openat(cwd->dest, ".", O_RDONLY | O_DIRECTORY);
+    DIR* dirp = fd != -1 ? fdopendir(fd) : NULL;
     if (dirp == NULL) {
-        print_errno("opendir failed", errno, dir);
-        return n;
+        print_errno("opendir failed", errno, "current directory");
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
     }
+    NameList* unseen = NULL;
+    bool ok = true;
     struct dirent* e;
-    while ((e = readdir(dirp)) != NULL) {
-        n += count_entry(e->d_name);
+    while (ok && ((e = readdir(dirp)) != NULL)) {
+        const char* name = e->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+            continue;
+        }
+        if ((strcmp(name, META_DIR) == 0) || name_set_contains(&server->stream->seen, name)) {
+            continue;
+        }
+        if (cwd->unchanged && (e->d_type != DT_DIR)) {
+            struct stat sb;
+            bool stated = fstatat(cwd->dest, name, &sb, AT_SYMLINK_NOFOLLOW) == 0;
+            if (stated && !S_ISDIR(sb.st_mode)) {
+                continue;
+            }
+        }
+        size_t len = strlen(name);
+        NameList* p = (NameList*)arena_alloc(&server->arena, sizeof(NameList) + len + 1);
+        if (p == NULL) {
+            ok = false;
+            break;
+        }
+        memcpy(p->name, name, len + 1);
+        p->next = unseen;
+        unseen = p;
     }
     closedir(dirp);
-    return n;
+    if (!ok) {
+        return false;
+    }
+
+    const NameList* p;
+    for (p = unseen; p != NULL; p = p->next) {
+        if (!remove_cwd_entry(server, p->name)) {
+            return false;
+        }
+    }
+    return true;
 }
 
+/*
+ * ENDDIR. The backupee sent all entries of the current directory. Only a
+ * prepopulated snapshot has something to do. Nothing is removed if some
+ * commands failed, because their entries may be missing in the names.
+ */
 static bool
-check_lstat_result(int e, const char* path)
+do_enddir(Server* server)
 {
-    if (e == ENOENT) {
+    Cwd* cwd = &server->stream->cwd;
+    if (!server->prepopulated || (cwd->dest == -1) || cwd->failed) {
+        send_ok();
         return true;
     }
-    print_errno("lstat failed", e, path);
-    return false;
+    if (!prune_dir(server)) {
+        send_ng();
+        return false;
+    }
+    send_ok();
+    return true;
+}
+
+/*
+ * DIFF base. A backupee with a manifest of the backup base sends only changes
+ * and DELETE commands, which is right only when the new backup is a snapshot
+ * of base. The response is "OK name" or "NG name", where name is of the new
+ * backup.
+ */
+static bool
+do_diff(const Server* server, const Command* cmd)
+{
+    const char* base = cmd->u.diff.base.ptr;
+    bool ok = server->prepopulated && (strcmp(base, server->prev_name) == 0);
+    char buf[BUF_SIZE];
+    snprintf(buf, BUF_SIZE, "%s %s", ok ? "OK" : "NG", server->name);
+    send(buf);
+    return ok;
+}
+
+/*
+ * DELETE name. Removes name in the current directory of a prepopulated
+ * snapshot.
+ */
+static bool
+do_delete(Server* server, const Command* cmd)
+{
+    const char* name = cmd->u.del.name.ptr;
+    bool valid = (strchr(name, '/') == NULL) && (strcmp(name, META_DIR) != 0);
+    valid = valid && (strcmp(name, ".") != 0) && (strcmp(name, "..") != 0) && (name[0] != '\0');
+    if (!server->prepopulated || (server->stream->cwd.dest == -1) || !valid) {
+        send_ng();
+        return false;
+    }
+    if (!remove_cwd_entry(server, name)) {
+        send_ng();
+        return false;
+    }
+    send_ok();
+    return true;
+}
+
+static bool
+do_name(const Server* server)
+{
+    char buf[BUF_SIZE];
+    snprintf(buf, BUF_SIZE, "OK %s", server->dest_dir);
+    send(buf);
+    return true;
+}
+
+static bool
+do_phases(const Server* server)
+{
+    size_t size = 4 * BUF_SIZE;
+    char buf[size];
+    strcpy(buf, "OK ");
+    size_t len = strlen(buf);
+    phase_encode(&server->phases, buf + len, size - len);
+    send(buf);
+    return true;
 }
 
-static bool remove_dir(const char*);
+static uint64_t
+total_of_statfs(struct statfs* buf)
+{
+    return buf->f_blocks;
+}
+
+static uint64_t
+usage_of_statfs(struct statfs* buf)
+{
+    return buf->f_blocks - buf->f_bfree;
+}
+
+#define IMPLEMENT_DISK_CMD(name, f) \
+    static bool \
+    name(const Server* server) \
+    { \
+        const char* path = server->dest_dir; \
+        struct statfs buf; \
+        if (statfs(path, &buf) != 0) { \
+            print_errno("statfs failed", errno, path); \
+            send_ng(); \
+            return false; \
+        } \
+        uint64_t val = buf.f_bsize * f(&buf); \
+        char response[BUF_SIZE]; \
+        snprintf(response, BUF_SIZE, "OK %lu", val); \
+        send(response); \
+        return true; \
+    }
+IMPLEMENT_DISK_CMD(do_disk_total, total_of_statfs);
+IMPLEMENT_DISK_CMD(do_disk_usage, usage_of_statfs);
+
+static bool
+do_dir(Server* server, const Command* cmd)
+{
+    Entry entry;
+    if (!resolve_entry(server, &entry, &cmd->u.dir.path)) {
+        send_ng();
+        return false;
+    }
+    if (!remember_name(server, &entry)) {
+        send_ng();
+        return false;
+    }
+    uint64_t t = phase_now();
+    const char* name = entry.name;
+    bool made = server->prepopulated ? prepare_dir(server, entry.dest_fd, name) : make_backup_dir_at(entry.dest_fd, name);
+    if (!made) {
+        send_ng();
+        return false;
+    }
+    phase_record(&server->phases, PHASE_MKDIR, t);
+    mode_t mode = cmd->u.dir.mode;
+    uid_t uid = cmd->u.dir.uid;
+    gid_t gid = cmd->u.dir.gid;
+    const Timestamp* ctime = &cmd->u.dir.ctime;
+    if (!save_meta_data(server, &entry, mode, uid, gid, ctime)) {
+        send_ng();
+        return false;
+    }
+    send_ok();
+    return true;
+}
+
+#define array_sizeof(a) (sizeof(a) / sizeof(a[0]))
+
+static bool
+do_file(Server* server, const Command* cmd)
+{
+    Stream* stream = server->stream;
+    stream->current_fd = -1;
+    stream->current_packable = false;
+    stream->current_packed = false;
+    Entry entry;
+    const Slice* path = &cmd->u.file.path;
+    if ((PATH_SIZE <= path->len) || !resolve_entry(server, &entry, path)) {
+        send_ng();
+        return false;
+    }
+    if (!remember_name(server, &entry)) {
+        send_ng();
+        return false;
+    }
+
+    mode_t mode = cmd->u.file.mode;
+    uid_t uid = cmd->u.file.uid;
+    gid_t gid = cmd->u.file.gid;
+    if (!save_meta_data(server, &entry, mode, uid, gid, &cmd->u.file.ctime)) {
+        send_ng();
+        return false;
+    }
+
+    server->num_files++;
+    const char* name = entry.name;
+    stream->current_fd = entry.dest_fd;
+    memcpy(stream->current_file, name, strlen(name) + 1);
+    const char* dir = entry.dest_fd == server->dest_root ? "" : stream->cwd.path;
+    const char* sep = *dir == '\0' ? "" : "/";
+    snprintf(stream->current_path, PATH_SIZE, "%s%s%s", dir, sep, name);
+    if (server->prepopulated) {
+        const Timestamp* mtime = &cmd->u.file.mtime;
+        if (!is_regular_file_changed(server, entry.dest_fd, name, mtime)) {
+            send("UNCHANGED");
+            return true;
+        }
+        /* The old one may be a symlink, which O_TRUNC would follow. */
+        if (!remove_backup_entry(server, entry.dest_fd, name)) {
+            stream->current_fd = -1;
+            send_ng();
+            return false;
+        }
+        send("CHANGED");
+        return true;
+    }
+    stream->current_packable = server->packing && (entry.dest_fd == stream->cwd.dest);
+    const PackRecord* record = NULL;
+    if (stream->current_packable) {
+        record = pack_index_find(&stream->cwd.prev_pack, name);
+    }
+    if (record != NULL) {
+        Timestamp packed = { record->mtime.tv_sec, record->mtime.tv_nsec };
+        if (timestamp_compare(&packed, &cmd->u.file.mtime) < 0) {
+            send("CHANGED");
+            return true;
+        }
+        if (!add_pack_record(server, record)) {
+            send_ng();
+            return false;
+        }
+        send("UNCHANGED");
+        return true;
+    }
+    int prev_fd = entry.prev_fd;
+    struct stat sb;
+    if (is_file_changed(server, prev_fd, name, &cmd->u.file.mtime, &sb)) {
+        send("CHANGED");
+        return true;
+    }
+
+    if (!clone_file(server, prev_fd, name, entry.dest_fd, name, S_ISREG(sb.st_mode))) {
+        send_ng();
+        return false;
+    }
+    log_file(server, entry.dest_fd, name, &sb);
+
+    send("UNCHANGED");
+    return true;
+}
+
+static void
+drop_written(Writeback* wb, off_t to)
+{
+#if defined(__linux__)
+    unsigned int flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+    sync_file_range(wb->fd, wb->synced, to - wb->synced, flags);
+#endif
+    posix_fadvise(wb->fd, wb->synced, to - wb->synced, POSIX_FADV_DONTNEED);
+    wb->synced = to;
+}
+
+static void
+write_back(Writeback* wb, off_t written)
+{
+    if (written - wb->started < WRITEBACK_SIZE) {
+        return;
+    }
+#if defined(__linux__)
+    sync_file_range(wb->fd, wb->started, written - wb->started, SYNC_FILE_RANGE_WRITE);
+#endif
+    drop_written(wb, wb->started);
+    wb->started = written;
+}
+
+static bool
+write_all(int fd, const char* buf, size_t size)
+{
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, buf + written, size - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+/*
+ * Writes buffers of the ring until the ring is closed. Buffers after an error
+ * are only released.
+ */
+static void*
+write_body(void* arg)
+{
+    BodyWriter* writer = (BodyWriter*)arg;
+    BufRing* ring = writer->ring;
+    char* buf;
+    size_t len;
+    while ((buf = bufring_peek(ring, &len)) != NULL) {
+        if (writer->error != 0) {
+            bufring_release(ring);
+            continue;
+        }
+        if (!write_all(writer->wb.fd, buf, len)) {
+            writer->error = errno;
+            bufring_release(ring);
+            continue;
+        }
+        xxh64_update(&writer->hash, buf, len);
+        bufring_release(ring);
+        writer->written += len;
+        write_back(&writer->wb, writer->written);
+    }
+    return NULL;
+}
+
+/*
+ * Allocates all blocks of a body before writing it, so that a large file gets
+ * contiguous extents. Returns an error number, which is zero also if the
+ * filesystem does not support it. Linux's fallocate(2) is used because
+ * posix_fallocate() of glibc falls back to writing zeros.
+ */
+static int
+preallocate(int fd, size_t size)
+{
+#if defined(__linux__)
+    if (fallocate(fd, 0, 0, size) == 0) {
+        return 0;
+    }
+    int e = errno;
+#else
+    int e = posix_fallocate(fd, 0, size);
+#endif
+    return (e == EOPNOTSUPP) || (e == EINVAL) || (e == ENOSYS) ? 0 : e;
+}
+
+/*
+ * Records the hash of a body for ubackup-scrub. A failure is only logged,
+ * because the body itself was saved.
+ */
+static void
+save_hash(Server* server, const struct stat* sb, uint64_t hash)
+{
+    if (server->hashes == NULL) {
+        return;
+    }
+    HashRecord record = { hash, sb->st_size, sb->st_mtim, server->stream->current_path };
+    if (!hash_record_write(server->hashes, &record)) {
+        print_errno("writing a hash failed", errno, server->stream->current_path);
+    }
+}
+
+/*
+ * A small body is appended into a pack file instead of being a file. The time
+ * when it was packed is compared with mtime of the next backup like mtime of a
+ * file.
+ */
+static bool
+pack_body(Server* server, size_t size)
+{
+    uint64_t t = phase_now();
+    const char* path = server->stream->current_file;
+    BufRing* ring = &server->ring;
+    bufring_reset(ring);
+    char* buf = bufring_acquire(ring);
+    size_t received = 0;
+    while (received < size) {
+        size_t nbytes = fread(buf + received, 1, size - received, stdin);
+        if (nbytes == 0) {
+            print_error("Receiving a body of %s failed", path);
+            send_ng();
+            return false;
+        }
+        received += nbytes;
+    }
+    PackRecord record;
+    off_t offset;
+    if (!pack_writer_append(&server->packs, buf, size, &offset)) {
+        print_errno("writing a pack failed", errno, path);
+        send_ng();
+        return false;
+    }
+    char pack[PATH_SIZE];
+    snprintf(pack, sizeof(pack), "%s%s", server->stream->cwd.pack_dir, server->packs.name);
+    record.hash = xxh64(buf, size);
+    record.offset = offset;
+    record.length = size;
+    clock_gettime(CLOCK_REALTIME, &record.mtime);
+    record.pack = pack;
+    record.name = path;
+    bool ok = add_pack_record(server, &record);
+    phase_record(&server->phases, PHASE_BODY, t);
+    if (!ok) {
+        send_ng();
+        return false;
+    }
+    server->stream->current_packed = true;
+    server->num_bytes += size;
+    send_ok();
+    return true;
+}
+
+/*
+ * Opens the file of the last FILE command for a body of size bytes. fd of
+ * writer is -1 if it cannot be opened. Returns an error of fallocate(2), which
+ * is reported here.
+ */
+static int
+open_body(Server* server, BodyWriter* writer, size_t size)
+{
+    const Stream* stream = server->stream;
+    const char* path = stream->current_file;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = stream->current_fd != -1 ? openat(stream->current_fd, path, flags, 0644) : -1;
+    if (fd == -1) {
+        print_errno("open failed", errno, path);
+    }
+    BufRing* ring = &server->ring;
+    bufring_reset(ring);
+    BodyWriter init = { ring, { fd, 0, 0 }, { { 0 }, 0, { 0 }, 0 }, 0, 0 };
+    *writer = init;
+    xxh64_init(&writer->hash);
+    int e = (fd != -1) && (ring->size < size) ? preallocate(fd, size) : 0;
+    if (e != 0) {
+        print_errno("fallocate failed", e, path);
+        writer->error = e;
+    }
+    return e;
+}
+
+/*
+ * Reads size bytes of a body from the pipe. Without the writer thread, each
+ * buffer is written as soon as it is read. The rest is read even if writing
+ * failed, to keep the protocol.
+ */
+static bool
+receive_body(Server* server, BodyWriter* writer, size_t size, bool threaded)
+{
+    BufRing* ring = writer->ring;
+    size_t rest = size;
+    while (0 < rest) {
+        char* buf = bufring_acquire(ring);
+        size_t nbytes = fread(buf, 1, ring->size < rest ? ring->size : rest, stdin);
+        if (nbytes == 0) {
+            print_error("Receiving a body of %s failed", server->stream->current_file);
+            return false;
+        }
+        rest -= nbytes;
+        if (writer->wb.fd == -1) {
+            continue;
+        }
+        bufring_commit(ring, nbytes);
+        if (!threaded) {
+            bufring_close(ring);
+            write_body(writer);
+            bufring_reset(ring);
+        }
+    }
+    return true;
+}
+
+/*
+ * Returns false if the body was not received or not written. Then the file is
+ * truncated to what was written, not to leave preallocated blocks.
+ */
+static bool
+close_body(Server* server, BodyWriter* writer, size_t size, bool received, int e)
+{
+    const Stream* stream = server->stream;
+    const char* path = stream->current_file;
+    int fd = writer->wb.fd;
+    bool failed = !received || (fd == -1) || (writer->error != 0);
+    if ((writer->error != 0) && (e == 0)) {
+        print_errno("write failed", writer->error, path);
+    }
+    if (fd == -1) {
+        return false;
+    }
+    if (!failed && (WRITEBACK_SIZE <= size)) {
+        drop_written(&writer->wb, size);
+    }
+    if (failed) {
+        ftruncate(fd, writer->written);
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == 0) {
+        log_file(server, stream->current_fd, path, &sb);
+        if (!failed) {
+            save_hash(server, &sb, xxh64_digest(&writer->hash));
+        }
+    }
+    close(fd);
+    return !failed;
+}
+
+/*
+ * A body of more than one buffer is written by another thread, so that reading
+ * the pipe and writing the disk overlap.
+ */
+static bool
+do_body(Server* server, const Command* cmd)
+{
+    const Stream* stream = server->stream;
+    size_t size = cmd->u.body.size;
+    bool packable = stream->current_packable && (stream->current_fd != -1);
+    if (packable && (size <= server->conf.pack_size)) {
+        return pack_body(server, size);
+    }
+    uint64_t t = phase_now();
+    BodyWriter writer;
+    int e = open_body(server, &writer, size);
+    BufRing* ring = writer.ring;
+    pthread_t writer_thread;
+    bool threaded = (writer.wb.fd != -1) && (ring->size < size);
+    if (threaded && (pthread_create(&writer_thread, NULL, write_body, &writer) != 0)) {
+        threaded = false;
+    }
+    bool received = receive_body(server, &writer, size, threaded);
+    if (threaded) {
+        bufring_close(ring);
+        pthread_join(writer_thread, NULL);
+    }
+    bool stored = close_body(server, &writer, size, received, e);
+    phase_record(&server->phases, PHASE_BODY, t);
+
+    if (!stored) {
+        send_ng();
+        return false;
+    }
+    server->num_bytes += size;
+    send_ok();
+    return true;
+}
+
+/*
+ * Starts a body which comes in BODY_PART commands. Commands of other streams
+ * may come between them, so each part is written before the next command is
+ * read. Neither this nor BODY_PART has a response. A body in parts is never
+ * packed, because the backupee sends only large ones so.
+ */
+static bool
+do_open_body(Server* server, const Command* cmd)
+{
+    Body* body = &server->stream->body;
+    uint64_t t = phase_now();
+    if (body->open) {
+        close_body(server, &body->writer, body->size, false, body->fallocate_error);
+    }
+    body->fallocate_error = open_body(server, &body->writer, cmd->u.body.size);
+    body->open = true;
+    body->size = body->rest = cmd->u.body.size;
+    body->received = true;
+    phase_record(&server->phases, PHASE_BODY, t);
+    return true;
+}
+
+/*
+ * A part which does not fit in the open body is read and dropped, and fails
+ * the body.
+ */
+static bool
+do_body_part(Server* server, const Command* cmd)
+{
+    Body* body = &server->stream->body;
+    size_t size = cmd->u.body.size;
+    uint64_t t = phase_now();
+    bool fits = body->open && (size <= body->rest);
+    BodyWriter dropped = { &server->ring, { -1, 0, 0 }, { { 0 }, 0, { 0 }, 0 }, 0, 0 };
+    bool received = receive_body(server, fits ? &body->writer : &dropped, size, false);
+    if (fits) {
+        body->rest -= size;
+    }
+    body->received = body->received && received && fits;
+    phase_record(&server->phases, PHASE_BODY, t);
+    return received && fits;
+}
+
+static bool
+do_body_end(Server* server)
+{
+    Body* body = &server->stream->body;
+    if (!body->open) {
+        send_ng();
+        return false;
+    }
+    uint64_t t = phase_now();
+    bool received = body->received && (body->rest == 0);
+    bool stored = close_body(server, &body->writer, body->size, received, body->fallocate_error);
+    body->open = false;
+    phase_record(&server->phases, PHASE_BODY, t);
+
+    if (!stored) {
+        send_ng();
+        return false;
+    }
+    server->num_bytes += body->size;
+    send_ok();
+    return true;
+}
+
+/*
+ * The backupee could not read the last body and sent zeros for the rest of it
+ * or ended its parts early, or the body could not be stored. The file or its
+ * pack record is removed, and the directory is marked as failed, so that the
+ * next backup does not trust it.
+ */
+static bool
+do_discard(Server* server)
+{
+    Stream* stream = server->stream;
+    const char* name = stream->current_file;
+    Cwd* cwd = &stream->cwd;
+    bool removed;
+    if (stream->current_packed) {
+        FILE* fp = cwd->pack_index;
+        removed = (fp != NULL) && (fflush(fp) == 0)
+            && (ftruncate(fileno(fp), stream->pack_mark) == 0);
+        if (removed) {
+            remove_cwd_meta(cwd, name);
+            log_removal(server, cwd->dest, name);
+        }
+    }
+    else if ((stream->current_fd != -1) && (stream->current_fd == cwd->dest)) {
+        removed = remove_cwd_entry(server, name);
+    }
+    else {
+        removed = (stream->current_fd != -1) && remove_backup_entry(server, stream->current_fd, name);
+    }
+    if (removed) {
+        print_error("Discarded %s", stream->current_path);
+    }
+    else {
+        print_error("Cannot discard %s", stream->current_path);
+    }
+    stream->current_fd = -1;
+    stream->current_packed = false;
+    send_ok();
+    return false;
+}
+
+static bool
+do_symlink(Server* server, const Command* cmd)
+{
+    Entry entry;
+    if (!resolve_entry(server, &entry, &cmd->u.symlink.path)) {
+        send_ng();
+        return false;
+    }
+    if (!remember_name(server, &entry)) {
+        send_ng();
+        return false;
+    }
+    mode_t mode = cmd->u.symlink.mode;
+    uid_t uid = cmd->u.symlink.uid;
+    gid_t gid = cmd->u.symlink.gid;
+    const Timestamp* ctime = &cmd->u.symlink.ctime;
+    if (!save_meta_data(server, &entry, mode, uid, gid, ctime)) {
+        send_ng();
+        return false;
+    }
+    if (!make_symlink(server, cmd->u.symlink.src.ptr, entry.dest_fd, entry.name)) {
+        send_ng();
+        return false;
+    }
+    send_ok();
+    return true;
+}
+
+static void
+trim(char* s)
+{
+    char* p = strrchr(s, '\r');
+    if (p == NULL) {
+        return;
+    }
+    *p = '\0';
+}
+
+#define BACKUP_MARK '('
+
+static bool remove_dir(const char*);
+
+static bool
+remove_dirent(const char* dir, const char* name)
+{
+    if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+        return true;
+    }
+    char path[PATH_SIZE];
+    snprintf(path, array_sizeof(path), "%s/%s", dir, name);
+    struct stat stat;
+    if (lstat(path, &stat) != 0) {
+        return check_lstat_result(errno, path);
+    }
+    if (S_ISDIR(stat.st_mode)) {
+        return remove_dir(path);
+    }
+    if ((unlink(path) != 0) && (errno != ENOENT)) {
+        print_errno("unlink failed", errno, path);
+        return false;
+    }
+    return true;
+}
+
+static bool
+remove_dir(const char* path)
+{
+    DIR* dirp = opendir(path);
+    if (dirp == NULL) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        print_errno("opendir failed", errno, path);
+        return false;
+    }
+    struct dirent* e;
+    while (((e = readdir(dirp)) != NULL) && remove_dirent(path, e->d_name)) {
+    }
+    closedir(dirp);
+    if ((rmdir(path) != 0) && (errno != ENOENT)) {
+        print_errno("rmdir failed", errno, path);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * A snapshot of the previous backup already has its hashes. Records of new
+ * bodies are appended to them.
+ */
+static FILE*
+open_hashes(int dirfd)
+{
+    int fd = openat(dirfd, HASHES_PATH, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd == -1) {
+        return NULL;
+    }
+    FILE* fp = fdopen(fd, "a");
+    if (fp == NULL) {
+        close(fd);
+    }
+    return fp;
+}
+
+/*
+ * A file under dirfd is the one of record if it has the same size and mtime.
+ */
+static bool
+is_hashed_file(int dirfd, const HashRecord* record)
+{
+    struct stat sb;
+    if (fstatat(dirfd, record->path, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+        return false;
+    }
+    return S_ISREG(sb.st_mode) && ((uint64_t)sb.st_size == record->size)
+        && (sb.st_mtim.tv_sec == record->mtime.tv_sec)
+        && (sb.st_mtim.tv_nsec == record->mtime.tv_nsec);
+}
+
+/*
+ * A body is written only into the backup which got it first, and the newer
+ * ones link or clone it. Records of such files are copied into the newer
+ * backup before the old one is removed.
+ */
+static void
+carry_hashes(const Server* server, const char* old, const char* newer)
+{
+    char path[PATH_SIZE];
+    snprintf(path, array_sizeof(path), "%s/%s/%s", server->backup_dir, old, HASHES_PATH);
+    FILE* in = fopen(path, "r");
+    if (in == NULL) {
+        return;
+    }
+    snprintf(path, array_sizeof(path), "%s/%s", server->backup_dir, newer);
+    int dirfd = open_dirfd(AT_FDCWD, path);
+    FILE* out = dirfd != -1 ? open_hashes(dirfd) : NULL;
+    if (out == NULL) {
+        print_errno("open failed", errno, path);
+        close_dirfd(&dirfd);
+        fclose(in);
+        return;
+    }
+    char* buf = NULL;
+    size_t bufsize = 0;
+    HashRecord record;
+    bool ok = true;
+    while (ok && hash_record_read(in, &record, &buf, &bufsize)) {
+        ok = !is_hashed_file(dirfd, &record) || hash_record_write(out, &record);
+    }
+    if ((fclose(out) != 0) || !ok) {
+        print_errno("writing hashes failed", errno, path);
+    }
+    free(buf);
+    close_dirfd(&dirfd);
+    fclose(in);
+}
+
+/*
+ * A backup in the snapshot mode is a subvolume, which is destroyed at once.
+ * Backups made in the other modes are removed entry by entry. So is a
+ * subvolume when destroying needs privileges which the backuper does not
+ * have, but it must be made writable first.
+ */
+static bool
+remove_backup(const Server* server, const char* name)
+{
+    char path[PATH_SIZE];
+    snprintf(path, array_sizeof(path), "%s/%s", server->backup_dir, name);
+    bool destroyed = false;
+    if (server->conf.clone == CLONE_SNAPSHOT) {
+        int dirfd = open_dirfd(AT_FDCWD, server->backup_dir);
+        destroyed = (dirfd != -1) && snapshot_destroy(dirfd, name);
+        close_dirfd(&dirfd);
+        if (!destroyed) {
+            int fd = open_dirfd(AT_FDCWD, path);
+            if (fd != -1) {
+                snapshot_set_readonly(fd, false);
+            }
+            close_dirfd(&fd);
+        }
+    }
+    if (!destroyed && !remove_dir(path)) {
+        print_error("Cannot remove backup: %s", path);
+        return false;
+    }
+    print_info("Removed backup: %s", path);
+    return true;
+}
+
+/*
+ * Removes backups which are not in keep from the oldest, so that hashes are
+ * carried into the oldest survivor. The next one of the newest backup in the
+ * catalog is newest, or nothing if newest is NULL. Pending sessions are not
+ * backups, so hashes are not carried into them.
+ */
+static void
+remove_backups(Server* server, const bool* keep, const char* newest)
+{
+    Catalog* catalog = server->catalog;
+    size_t num = catalog->num;
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < num; i++) {
+        CatalogEntry* entry = &catalog->entries[i];
+        if (keep[i]) {
+            catalog->entries[n] = *entry;
+            n++;
+            continue;
+        }
+        const char* newer = newest;
+        size_t j;
+        for (j = i + 1; j < num; j++) {
+            if (catalog->entries[j].status != CATALOG_PENDING) {
+                newer = catalog->entries[j].name;
+                break;
+            }
+        }
+        if ((server->conf.clone != CLONE_SNAPSHOT) && (newer != NULL)) {
+            carry_hashes(server, entry->name, newer);
+        }
+        if (!remove_backup(server, entry->name)) {
+            catalog->entries[n] = *entry;
+            n++;
+        }
+    }
+    if (n == num) {
+        return;
+    }
+    catalog->num = n;
+    if (!catalog_save(catalog, server->backup_dir)) {
+        print_errno("writing the catalog failed", errno, server->backup_dir);
+    }
+    versions_compact(server->backup_dir);
+}
+
+/*
+ * A running session holds a lock on its directory, so that other backupers do
+ * not take it for a stale one.
+ */
+static bool
+is_running(const Server* server, const char* tmpdir)
+{
+    int dirfd = open_dirfd(AT_FDCWD, server->backup_dir);
+    int fd = open_dirfd(dirfd, tmpdir);
+    close_dirfd(&dirfd);
+    if (fd == -1) {
+        return false;
+    }
+    bool running = (flock(fd, LOCK_EX | LOCK_NB) != 0) && (errno == EWOULDBLOCK);
+    close(fd);
+    return running;
+}
+
+/*
+ * Sessions which were not committed keep their temporary names and pending
+ * entries in the catalog. Those which are not running any longer are removed,
+ * so that the backup directory is not scanned for them.
+ */
+static void
+remove_stale_sessions(Server* server)
+{
+    Catalog* catalog = server->catalog;
+    size_t num = catalog->num;
+    size_t n = 0;
+    size_t i;
+    for (i = 0; i < num; i++) {
+        CatalogEntry* entry = &catalog->entries[i];
+        char tmpdir[CATALOG_NAME_SIZE + 2];
+        snprintf(tmpdir, sizeof(tmpdir), "%c%s)", BACKUP_MARK, entry->name);
+        bool stale = (entry->status == CATALOG_PENDING) && (strcmp(entry->name, server->name) != 0);
+        if (!stale || is_running(server, tmpdir) || !remove_backup(server, tmpdir)) {
+            catalog->entries[n] = *entry;
+            n++;
+        }
+    }
+    if (n == num) {
+        return;
+    }
+    catalog->num = n;
+    if (!catalog_save(catalog, server->backup_dir)) {
+        print_errno("writing the catalog failed", errno, server->backup_dir);
+    }
+}
+
+static bool scan_backups(Catalog*, const char*);
+
+static bool
+load_catalog(Catalog* catalog, const char* backup_dir)
+{
+    bool found;
+    if (!catalog_load(catalog, backup_dir, &found)) {
+        print_errno("reading the catalog failed", errno, backup_dir);
+        return false;
+    }
+    return found || scan_backups(catalog, backup_dir);
+}
+
+/*
+ * Locks the catalog, and loads it again for a change. Returns the descriptor
+ * to unlock, or -1.
+ */
+static int
+lock_catalog(Server* server)
+{
+    const char* dir = server->backup_dir;
+    int fd = catalog_lock(dir);
+    if (fd == -1) {
+        print_errno("locking the catalog failed", errno, dir);
+        return -1;
+    }
+    catalog_destroy(server->catalog);
+    if (!load_catalog(server->catalog, dir)) {
+        catalog_unlock(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Old backups are selected by the retention policy after the new backup is
+ * committed and added to the locked catalog, so that a session which fails
+ * does not leave fewer committed backups than the policy keeps.
+ */
+static void
+remove_old_backups(Server* server)
+{
+    uint64_t t = phase_now();
+    remove_stale_sessions(server);
+    Catalog* catalog = server->catalog;
+    bool keep[catalog->num + 1];
+    retention_select(&server->conf.retention, catalog, NULL, keep);
+    remove_backups(server, keep, NULL);
+    phase_record(&server->phases, PHASE_REMOVE_OLD, t);
+}
+
+static bool
+do_remove_old(Server* server)
+{
+    server->remove_old = true;
+    send_ok();
+    return true;
+}
+
+/*
+ * Bytes which removing a set of backups frees. A file is freed only when all
+ * of its links are in the set, so links of each file seen so far are counted
+ * in links.
+ */
+struct Reclaim {
+    InodeMap links;
+    uint64_t bytes;
+};
+
+typedef struct Reclaim Reclaim;
 
-static bool
-remove_dirent(const char* dir, const char* name)
+static void count_unique_dir(const char*, Reclaim*);
+
+static void
+count_unique_dirent(const char* dir, const char* name, Reclaim* reclaim)
 {
     if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
-        return true;
+        return;
     }
     char path[PATH_SIZE];
     snprintf(path, array_sizeof(path), "%s/%s", dir, name);
     struct stat stat;
     if (lstat(path, &stat) != 0) {
-        return check_lstat_result(errno, path);
+        return;
     }
+    uint64_t bytes = 512 * (uint64_t)stat.st_blocks;
     if (S_ISDIR(stat.st_mode)) {
-        return remove_dir(path);
+        reclaim->bytes += bytes;
+        count_unique_dir(path, reclaim);
+        return;
     }
-    if ((unlink(path) != 0) && (errno != ENOENT)) {
-        print_errno("unlink failed", errno, path);
-        return false;
+    if (stat.st_nlink <= 1) {
+        reclaim->bytes += bytes;
+        return;
     }
-    return true;
+    InodeMap* links = &reclaim->links;
+    uintptr_t seen = (uintptr_t)inode_map_get(links, stat.st_dev, stat.st_ino) + 1;
+    if (seen == stat.st_nlink) {
+        reclaim->bytes += bytes;
+    }
+    inode_map_put(links, stat.st_dev, stat.st_ino, (void*)seen);
 }
 
-static bool
-remove_dir(const char* path)
+/*
+ * Adds bytes which the backup at path frees with the backups counted before.
+ */
+static void
+count_unique_dir(const char* path, Reclaim* reclaim)
 {
     DIR* dirp = opendir(path);
     if (dirp == NULL) {
-        print_errno("opendir failed", errno, path);
-        return false;
+        return;
     }
     struct dirent* e;
-    while (((e = readdir(dirp)) != NULL) && remove_dirent(path, e->d_name)) {
+    while ((e = readdir(dirp)) != NULL) {
+        count_unique_dirent(path, e->d_name, reclaim);
     }
     closedir(dirp);
-    if ((rmdir(path) != 0) && (errno != ENOENT)) {
-        print_errno("rmdir failed", errno, path);
+}
+
+/*
+ * Bytes to free to have min_free bytes or min_free_percent of the disk free.
+ */
+static bool
+find_shortage(const Server* server, uint64_t* dest)
+{
+    const char* path = server->backup_dir;
+    struct statfs buf;
+    if (statfs(path, &buf) != 0) {
+        print_errno("statfs failed", errno, path);
         return false;
     }
-
+    const Conf* conf = &server->conf;
+    uint64_t total = buf.f_bsize * total_of_statfs(&buf);
+    uint64_t target = MAX(conf->min_free, total / 100 * conf->min_free_percent);
+    uint64_t avail = (uint64_t)buf.f_bsize * buf.f_bavail;
+    *dest = avail < target ? target - avail : 0;
     return true;
 }
 
-static const char*
-find_backup_name(const char* p)
+#define CLEANER_WAIT_SECONDS 60
+
+/*
+ * btrfs frees blocks of a destroyed subvolume in the background after the
+ * transaction is committed. Free space is polled until it stops growing, so
+ * that blocks being freed are not taken for a shortage.
+ */
+static void
+wait_for_cleaner(const Server* server)
 {
-    return p + (p[0] == BACKUP_MARK ? 1 : 0);
+    const char* path = server->backup_dir;
+    int fd = open_dirfd(AT_FDCWD, path);
+    if ((fd == -1) || !snapshot_sync(fd)) {
+        close_dirfd(&fd);
+        return;
+    }
+    close(fd);
+    struct statfs buf;
+    uint64_t avail = statfs(path, &buf) == 0 ? buf.f_bavail : 0;
+    int i;
+    for (i = 0; i < CLEANER_WAIT_SECONDS; i++) {
+        sleep(1);
+        if ((statfs(path, &buf) != 0) || (buf.f_bavail <= avail)) {
+            return;
+        }
+        avail = buf.f_bavail;
+    }
 }
 
-static int
-compar(const void* p, const void* q)
+/*
+ * Removes the oldest backups before a backup until the disk has enough free
+ * space, so that the backup does not find the disk full on the way. In the
+ * link mode, files whose links are all in the oldest backups estimate what
+ * removing them frees, and just enough backups to cover the shortage are
+ * removed at once. Clones share blocks which cannot be seen, so in the other
+ * modes backups are removed one by one. Free space is checked again after each
+ * removal. The previous backup and newer ones are never removed.
+ */
+static void
+prune_for_space(Server* server)
 {
-    const char* s1 = find_backup_name(*((const char**)p));
-    const char* s2 = find_backup_name(*((const char**)q));
-    return - strcmp(s1, s2);
+    const Conf* conf = &server->conf;
+    if ((conf->min_free == 0) && (conf->min_free_percent == 0)) {
+        return;
+    }
+    Catalog* catalog = server->catalog;
+    uint64_t shortage;
+    while (find_shortage(server, &shortage) && (0 < shortage)) {
+        size_t num = catalog->num;
+        bool keep[num + 1];
+        Reclaim reclaim;
+        reclaim.bytes = 0;
+        if ((conf->clone == CLONE_LINK) && !inode_map_init(&reclaim.links)) {
+            print_error("Cannot allocate memory for links");
+            return;
+        }
+        size_t i = 0;
+        size_t removed = 0;
+        while ((i < num) && (reclaim.bytes < shortage)) {
+            const CatalogEntry* entry = &catalog->entries[i];
+            if (strcmp(entry->name, server->prev_name) == 0) {
+                break;
+            }
+            keep[i] = entry->status == CATALOG_PENDING;
+            i++;
+            if (keep[i - 1]) {
+                continue;
+            }
+            removed++;
+            if (conf->clone != CLONE_LINK) {
+                break;
+            }
+            char path[PATH_SIZE];
+            join(path, sizeof(path), server->backup_dir, entry->name);
+            count_unique_dir(path, &reclaim);
+        }
+        if (conf->clone == CLONE_LINK) {
+            inode_map_destroy(&reclaim.links);
+        }
+        if (removed == 0) {
+            print_error("No backup to remove for free space: %s", server->backup_dir);
+            return;
+        }
+        size_t j;
+        for (j = i; j < num; j++) {
+            keep[j] = true;
+        }
+        remove_backups(server, keep, NULL);
+        if (conf->clone == CLONE_SNAPSHOT) {
+            wait_for_cleaner(server);
+        }
+    }
 }
 
-static int
-update_name(const char* name, const char** p)
+static Stream*
+add_stream(Server* server, unsigned int id)
 {
-    if (!is_backup_dir(name)) {
-        return 0;
-    }
-    *p = name;
-    return 1;
+    size_t size = (server->num_streams + 1) * sizeof(server->streams[0]);
+    Stream** streams = (Stream**)realloc(server->streams, size);
+    if (streams == NULL) {
+        return NULL;
+    }
+    server->streams = streams;
+    Stream* stream = (Stream*)malloc(sizeof(Stream));
+    if (stream == NULL) {
+        return NULL;
+    }
+    stream->id = id;
+    Cwd* cwd = &stream->cwd;
+    cwd->path[0] = '\0';
+    cwd->dest = cwd->dest_meta = -1;
+    cwd->prev = cwd->prev_meta = -1;
+    cwd->failed = false;
+    cwd->unchanged = false;
+    cwd->pack_index = NULL;
+    cwd->pack_dir[0] = '\0';
+    stream->current_fd = -1;
+    stream->current_file[0] = '\0';
+    stream->current_path[0] = '\0';
+    stream->current_packable = false;
+    stream->current_packed = false;
+    stream->pack_mark = 0;
+    stream->body.open = false;
+    if (!name_set_init(&stream->seen)) {
+        free(stream);
+        return NULL;
+    }
+    if (!pack_index_init(&cwd->prev_pack)) {
+        name_set_destroy(&stream->seen);
+        free(stream);
+        return NULL;
+    }
+    server->streams[server->num_streams] = stream;
+    server->num_streams++;
+    return stream;
 }
 
+/*
+ * STREAM has no response, so a stream which cannot be made ends the session.
+ */
 static bool
-do_remove_old(Server* server)
+do_stream(Server* server, const Command* cmd)
 {
-    int max = 93;
-
-    int num_ent = count_dirent(server);
-    if (num_ent < max) {
-        send_ok();
-        return true;
+    unsigned int id = cmd->u.stream.id;
+    size_t i;
+    for (i = 0; i < server->num_streams; i++) {
+        if (server->streams[i]->id == id) {
+            server->stream = server->streams[i];
+            return true;
+        }
     }
-    const char* names[num_ent];
-    bzero(names, sizeof(names));
-
-    const char* dir = server->backup_dir;
-    DIR* dirp = opendir(dir);
-    if (dirp == NULL) {
-        print_errno("opendir failed", errno, dir);
-        send_ng();
+    Stream* stream = add_stream(server, id);
+    if (stream == NULL) {
+        print_error("Cannot allocate memory for stream %u", id);
         return false;
     }
-    int i = 0;
-    struct dirent* e;
-    while (((e = readdir(dirp)) != NULL) && (i < num_ent)) {
-        i += update_name(e->d_name, &names[i]);
-    }
-    closedir(dirp);
+    server->stream = stream;
+    return true;
+}
 
-    qsort(names, i, sizeof(names[0]), compar);
-    int j;
-    for (j = max; j < i; j++) {
-        char path[PATH_SIZE];
-        const char* name = names[j];
-        snprintf(path, array_sizeof(path), "%s/%s", server->backup_dir, name);
-        remove_dir(path);
-        print_info("Removed backup: %s", path);
+/*
+ * A body which did not end fails, because the session broke in it.
+ */
+static void
+close_streams(Server* server)
+{
+    size_t i;
+    for (i = 0; i < server->num_streams; i++) {
+        Stream* stream = server->streams[i];
+        Body* body = &stream->body;
+        server->stream = stream;
+        if (body->open) {
+            close_body(server, &body->writer, body->size, false, body->fallocate_error);
+            body->open = false;
+        }
+        close_cwd(&stream->cwd);
     }
+}
 
-    send_ok();
-    return true;
+static void
+destroy_streams(Server* server)
+{
+    size_t i;
+    for (i = 0; i < server->num_streams; i++) {
+        Stream* stream = server->streams[i];
+        pack_index_destroy(&stream->cwd.prev_pack);
+        name_set_destroy(&stream->seen);
+        free(stream);
+    }
+    free(server->streams);
 }
 
 static bool
-run_command(Server* server, const char* line)
+run_command(Server* server, char* line)
 {
-    Command cmd;
-    if (parse(&cmd, line) != 0) {
+    Command* cmd = &server->cmd;
+    arena_reset(&server->arena);
+    if (protocol_parse(cmd, line) != 0) {
         send_ng();
         return true;
     }
-    switch (cmd.type) {
+    bool done = true;
+    switch (cmd->type) {
     case CMD_BODY:
-        do_body(server, &cmd);
+        done = do_body(server, cmd);
+        break;
+    case CMD_BODY_END:
+        done = do_body_end(server);
+        break;
+    case CMD_BODY_PART:
+        done = do_body_part(server, cmd);
+        break;
+    case CMD_CWD:
+        do_cwd(server, cmd);
+        break;
+    case CMD_DELETE:
+        done = do_delete(server, cmd);
+        break;
+    case CMD_DIFF:
+        do_diff(server, cmd);
+        break;
+    case CMD_DIGEST:
+        do_digest(server, cmd);
         break;
     case CMD_DIR:
-        do_dir(server, &cmd);
+        done = do_dir(server, cmd);
+        break;
+    case CMD_DISCARD:
+        done = do_discard(server);
         break;
     case CMD_DISK_TOTAL:
         do_disk_total(server);
@@ -846,22 +2549,39 @@ run_command(Server* server, const char* line)
     case CMD_DISK_USAGE:
         do_disk_usage(server);
         break;
+    case CMD_ENDDIR:
+        do_enddir(server);
+        break;
     case CMD_FILE:
-        do_file(server, &cmd);
+        done = do_file(server, cmd);
         break;
     case CMD_NAME:
         do_name(server);
         break;
+    case CMD_OPEN_BODY:
+        do_open_body(server, cmd);
+        break;
+    case CMD_PHASES:
+        do_phases(server);
+        break;
     case CMD_REMOVE_OLD:
         do_remove_old(server);
         break;
+    case CMD_SAVE_DIGEST:
+        do_save_digest(server, cmd);
+        break;
+    case CMD_STREAM:
+        return do_stream(server, cmd);
     case CMD_SYMLINK:
-        do_symlink(server, &cmd);
+        done = do_symlink(server, cmd);
         break;
     case CMD_THANK_YOU:
+        server->completed = true;
+        return false;
     default:
         return false;
     }
+    server->stream->cwd.failed = server->stream->cwd.failed || !done;
 
     return true;
 }
@@ -874,58 +2594,115 @@ make_timestamp(char* dest, size_t maxsize)
         print_errno("gettimeofday failed", errno, NULL);
         return false;
     }
-    struct tm tm;
-    localtime_r(&tv.tv_sec, &tm);
-    strftime(dest, maxsize, "%Y-%m-%dT%H:%M:%S", &tm);
-    char millisecond[5];
-    sprintf(millisecond, ",%03lu", tv.tv_usec / 1000);
-    strcat(dest, millisecond);
+    if (maxsize < TIMESTAMP_ISO8601_MAXSIZE + 3) {
+        return false;
+    }
+    timestamp_format_iso8601(dest, tv.tv_sec);
+    int millisecond = tv.tv_usec / 1000;
+    char* p = dest + TIMESTAMP_ISO8601_MAXSIZE - 1;
+    p[0] = ',';
+    p[1] = '0' + millisecond / 100;
+    p[2] = '0' + millisecond / 10 % 10;
+    p[3] = '0' + millisecond % 10;
+    p[4] = '\0';
     return true;
 }
 
-static void
-update_prev(const char* name, struct timeval* last, char* buf, size_t bufsize)
+static bool
+is_committed(int dirfd, const char* name)
 {
-    char timestamp[strlen(name) + 1];
-    strcpy(timestamp, name);
-    char* p = strchr(timestamp, ',');
-    if (p == NULL) {
-        return;
-    }
-    *p = '\0';
-    struct tm tm;
-    if (strptime(timestamp, "%Y-%m-%dT%H:%M:%S", &tm) == NULL) {
-        return;
-    }
-    struct timeval tv = { mktime(&tm), atoi(p + 1) };
-    if (tv.tv_sec < last->tv_sec) {
-        return;
-    }
-    if ((tv.tv_sec == last->tv_sec) && (tv.tv_usec < last->tv_usec)) {
-        return;
-    }
-    memcpy(last, &tv, sizeof(tv));
-    strncpy(buf, name, bufsize);
+    char path[strlen(name) + strlen(COMMIT_PATH) + 2];
+    sprintf(path, "%s/%s", name, COMMIT_PATH);
+    return faccessat(dirfd, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
 }
 
+/*
+ * Backups made before the catalog are found by scanning the backup directory
+ * once. A backup without a commit marker is incomplete.
+ */
 static bool
-find_prev(char* dest, const char* dir)
+scan_backups(Catalog* catalog, const char* dir)
 {
     DIR* dirp = opendir(dir);
     if (dirp == NULL) {
         print_errno("opendir failed", errno, dir);
         return false;
     }
-    char buf[PATH_SIZE];
-    buf[0] = '\0';
-    struct timeval last = { 0, 0 };
+    bool ok = true;
     struct dirent* e;
-    while ((e = readdir(dirp)) != NULL) {
-        update_prev(e->d_name, &last, buf, PATH_SIZE);
+    while (ok && ((e = readdir(dirp)) != NULL)) {
+        const char* name = e->d_name;
+        if (!isdigit(name[0]) || (CATALOG_NAME_SIZE <= strlen(name))) {
+            continue;
+        }
+        CatalogEntry entry;
+        bzero(&entry, sizeof(entry));
+        strcpy(entry.name, name);
+        bool committed = is_committed(dirfd(dirp), name);
+        entry.status = committed ? CATALOG_COMMITTED : CATALOG_INCOMPLETE;
+        ok = catalog_add(catalog, &entry);
     }
     closedir(dirp);
-    strcpy(dest, buf);
-    return true;
+    return ok;
+}
+
+/*
+ * The latest committed backup is the previous one. Backups before commit
+ * markers have none, so the latest backup is used if no backup is committed.
+ * Pending sessions are not backups. A backup which was removed by hand is
+ * dropped from the catalog when it would be the previous one, so that only
+ * candidates are looked up.
+ */
+static void
+find_prev(char* dest, size_t size, Catalog* catalog, const char* backup_dir)
+{
+    dest[0] = '\0';
+    size_t i = catalog->num;
+    while (0 < i) {
+        i--;
+        const CatalogEntry* entry = &catalog->entries[i];
+        if (entry->status == CATALOG_PENDING) {
+            continue;
+        }
+        char path[PATH_SIZE];
+        join(path, sizeof(path), backup_dir, entry->name);
+        if ((access(path, F_OK) != 0) && (errno == ENOENT)) {
+            char name[CATALOG_NAME_SIZE];
+            strcpy(name, entry->name);
+            print_info("Dropped a missing backup from the catalog: %s", name);
+            catalog_remove(catalog, name);
+            continue;
+        }
+        if ((dest[0] == '\0') || (entry->status == CATALOG_COMMITTED)) {
+            snprintf(dest, size, "%s", entry->name);
+        }
+        if (entry->status == CATALOG_COMMITTED) {
+            return;
+        }
+    }
+}
+
+/*
+ * A session is added as pending before it makes its backup, and it is replaced
+ * with a committed entry at the end.
+ */
+static void
+add_to_catalog(Server* server, CatalogStatus status, const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    CatalogEntry entry;
+    bzero(&entry, sizeof(entry));
+    snprintf(entry.name, sizeof(entry.name), "%s", server->name);
+    entry.status = status;
+    entry.files = server->num_files;
+    entry.bytes = server->num_bytes;
+    int64_t msec = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+    entry.msec = 0 < msec ? msec : 0;
+    Catalog* catalog = server->catalog;
+    if (!catalog_add(catalog, &entry) || !catalog_save(catalog, server->backup_dir)) {
+        print_errno("writing the catalog failed", errno, server->backup_dir);
+    }
 }
 
 static void
@@ -954,16 +2731,263 @@ do_rename(const char* from, const char* to)
     print_info("Renamed: %s -> %s", from, to);
 }
 
+/*
+ * The snapshot mode starts the new backup as a writable snapshot of the
+ * previous one. The first backup, or one after a backup which is not a
+ * subvolume, starts as an empty subvolume. If the filesystem has no
+ * subvolumes, the link mode is used.
+ */
+static bool
+make_snapshot(Server* server, const char* name, const char* prev)
+{
+    const char* backup_dir = server->backup_dir;
+    int dirfd = open_dirfd(AT_FDCWD, backup_dir);
+    if (dirfd == -1) {
+        print_errno("open failed", errno, backup_dir);
+        return false;
+    }
+    int prev_fd = prev[0] != '\0' ? open_dirfd(dirfd, prev) : -1;
+    if (prev_fd != -1) {
+        server->prepopulated = snapshot_create(dirfd, name, prev_fd);
+        if (!server->prepopulated) {
+            print_info("Cannot snapshot %s: %s", prev, strerror(errno));
+        }
+        close(prev_fd);
+    }
+    if (server->prepopulated) {
+        close(dirfd);
+        return true;
+    }
+    bool created = snapshot_create_subvolume(dirfd, name);
+    int e = errno;
+    close(dirfd);
+    if (created) {
+        return make_meta_dir(server->dest_dir);
+    }
+    if (!is_reflink_unsupported(e) && (e != ENOTSUP)) {
+        print_errno("Creating a subvolume failed", e, name);
+        return false;
+    }
+    print_info("Subvolumes are not supported. Hard links are used: %s", strerror(e));
+    server->conf.clone = CLONE_LINK;
+    return true;
+}
+
+/*
+ * Pack files of the previous backup are linked into the new one, so that
+ * records of unchanged files can point to them. Packs which no record uses
+ * are removed by remove_unused_packs() at the end. Packs are not used in the
+ * snapshot mode, where unchanged files are already in the new backup.
+ */
+static bool
+open_packs(Server* server)
+{
+    if (mkdirat(server->dest_root, PACK_DIR, 0755) != 0) {
+        print_errno("mkdir failed", errno, PACK_DIR);
+        return false;
+    }
+    server->packs_fd = open_dirfd(server->dest_root, PACK_DIR);
+    if (server->packs_fd == -1) {
+        print_errno("open failed", errno, PACK_DIR);
+        return false;
+    }
+    pack_writer_init(&server->packs, server->packs_fd, server->name);
+    int prev_root = server->prev_root;
+    int fd = prev_root != -1 ? openat(prev_root, PACK_DIR, O_RDONLY | O_DIRECTORY) : -1;
+    DIR* dirp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dirp == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return true;
+    }
+    bool ok = true;
+    struct dirent* e;
+    while (ok && ((e = readdir(dirp)) != NULL)) {
+        const char* name = e->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+            continue;
+        }
+        ok = linkat(dirfd(dirp), name, server->packs_fd, name, 0) == 0;
+        if (!ok) {
+            print_errno("link failed", errno, name);
+        }
+    }
+    closedir(dirp);
+    return ok;
+}
+
+static void
+remove_unused_packs(Server* server)
+{
+    pack_writer_close(&server->packs);
+    int fd = openat(server->packs_fd, ".", O_RDONLY | O_DIRECTORY);
+    DIR* dirp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dirp == NULL) {
+        print_errno("opendir failed", errno, PACK_DIR);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    struct dirent* e;
+    while ((e = readdir(dirp)) != NULL) {
+        const char* name = e->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+            continue;
+        }
+        if (!name_set_contains(&server->packs_used, name)) {
+            unlinkat(server->packs_fd, name, 0);
+        }
+    }
+    closedir(dirp);
+}
+
+static void
+make_readonly(const char* path)
+{
+    int fd = open_dirfd(AT_FDCWD, path);
+    if ((fd == -1) || !snapshot_set_readonly(fd, true)) {
+        print_info("Cannot make %s read-only: %s", path, strerror(errno));
+    }
+    close_dirfd(&fd);
+}
+
+static void
+sync_dirfd(int fd, const char* path)
+{
+    if (fsync(fd) != 0) {
+        print_errno("fsync failed", errno, path);
+    }
+}
+
+#define HASHES_TMP_PATH HASHES_PATH ".tmp"
+
+/*
+ * In the snapshot mode, hashes of a new backup are the ones of the previous
+ * backup with records of new bodies appended. Records of files which were
+ * changed or removed since are dropped at the commit, so that the file does
+ * not grow with every backup.
+ */
+static void
+compact_hashes(int dirfd)
+{
+    int fd = openat(dirfd, HASHES_PATH, O_RDONLY);
+    FILE* in = fd != -1 ? fdopen(fd, "r") : NULL;
+    if (in == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    fd = openat(dirfd, HASHES_TMP_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    FILE* out = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (out == NULL) {
+        print_errno("open failed", errno, HASHES_TMP_PATH);
+        if (fd != -1) {
+            close(fd);
+        }
+        fclose(in);
+        return;
+    }
+    char* buf = NULL;
+    size_t bufsize = 0;
+    HashRecord record;
+    bool ok = true;
+    while (ok && hash_record_read(in, &record, &buf, &bufsize)) {
+        ok = !is_hashed_file(dirfd, &record) || hash_record_write(out, &record);
+    }
+    ok = (fclose(out) == 0) && ok;
+    if (ok && (renameat(dirfd, HASHES_TMP_PATH, dirfd, HASHES_PATH) != 0)) {
+        ok = false;
+    }
+    if (!ok) {
+        print_errno("compacting hashes failed", errno, HASHES_PATH);
+        unlinkat(dirfd, HASHES_TMP_PATH, 0);
+    }
+    free(buf);
+    fclose(in);
+}
+
+/*
+ * Makes all files of the new backup durable at once by syncfs(2), instead of
+ * fsync(2) for each of them. Then the commit marker is written. The backup
+ * directory is synced after the rename in finish_backup().
+ */
+static bool
+commit_backup(Server* server)
+{
+    int dirfd = server->dest_root;
+    if (server->conf.clone == CLONE_SNAPSHOT) {
+        compact_hashes(dirfd);
+    }
+#if defined(__linux__)
+    if (syncfs(dirfd) != 0) {
+        print_errno("syncfs failed", errno, server->dest_dir);
+        return false;
+    }
+#else
+    sync();
+#endif
+    int fd = openat(dirfd, COMMIT_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        print_errno("open failed", errno, COMMIT_PATH);
+        return false;
+    }
+    bool ok = write_all(fd, server->name, strlen(server->name)) && (fsync(fd) == 0);
+    if (!ok) {
+        print_errno("writing a commit marker failed", errno, server->dest_dir);
+    }
+    close(fd);
+    int meta_fd = open_dirfd(dirfd, META_DIR);
+    if (meta_fd != -1) {
+        sync_dirfd(meta_fd, META_DIR);
+        close(meta_fd);
+    }
+    sync_dirfd(dirfd, server->dest_dir);
+    return ok;
+}
+
+static void
+finish_backup(const char* backup_dir)
+{
+    int fd = open_dirfd(AT_FDCWD, backup_dir);
+    if (fd == -1) {
+        print_errno("open failed", errno, backup_dir);
+        return;
+    }
+    sync_dirfd(fd, backup_dir);
+    close(fd);
+}
+
 int
 main(int argc, char* argv[])
 {
     struct option opts[] = {
+        { "log-dir", required_argument, NULL, 'd' },
+        { "log-level", required_argument, NULL, 'l' },
+        { "trace-sample", required_argument, NULL, 't' },
         { "version", no_argument, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
+    const char* log_dir = NULL;
+    LogLevel level = LEVEL_INFO;
+    int trace_sample = 1;
     int opt;
     while ((opt = getopt_long(argc, argv, "v", opts, NULL)) != -1) {
         switch (opt) {
+        case 'd':
+            log_dir = optarg;
+            break;
+        case 'l':
+            if (!log_parse_level(&level, optarg)) {
+                print_error("Unknown log level: %s", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            trace_sample = atoi(optarg);
+            break;
         case 'v':
             print_version();
             return 0;
@@ -973,52 +2997,163 @@ main(int argc, char* argv[])
     }
 
     const char* s = basename(argv[0]);
-    if (argc < 2) {
-        print_error("Usage: %s <backup_dir>", s);
+    if (argc - 1 < optind) {
+        print_error("Usage: %s [--log-dir=dir] [--log-level=error|info|debug|trace] [--trace-sample=n] <backup_dir>", s);
         return 1;
     }
     char ident[strlen(s) + 1];
     strcpy(ident, s);
-    openlog(ident, LOG_PID, LOG_LOCAL0);
 
     const char* backup_dir = argv[optind];
     size_t maxsize = strlen("yyyy-mm-ddThh:nn:ss,000");
-    char prev[maxsize + 1];
-    if (!find_prev(prev, backup_dir)) {
+    char timestamp[maxsize + 1];
+    if (!make_timestamp(timestamp, maxsize)) {
+        return 1;
+    }
+    if (!log_open(ident, log_dir, timestamp, level, trace_sample)) {
         return 1;
     }
 
-    char timestamp[maxsize + 1];
-    if (!make_timestamp(timestamp, maxsize)) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    /* The catalog is locked until this session is in it. */
+    int lock = catalog_lock(backup_dir);
+    if (lock == -1) {
+        print_errno("locking the catalog failed", errno, backup_dir);
+        return 1;
+    }
+    Catalog catalog;
+    if (!load_catalog(&catalog, backup_dir)) {
         return 1;
     }
+    char prev[maxsize + 1];
+    find_prev(prev, sizeof(prev), &catalog, backup_dir);
 
     Server server;
     server.backup_dir = backup_dir;
+    server.name = timestamp;
+    server.prev_name = prev;
+    server.catalog = &catalog;
+    server.num_files = server.num_bytes = 0;
+    if (!conf_load(&server.conf, backup_dir)) {
+        return 1;
+    }
     char tmpdir[PATH_SIZE];
     snprintf(tmpdir, PATH_SIZE, "(%s)", timestamp);
     join(server.dest_dir, PATH_SIZE, backup_dir, tmpdir);
     set_prev_dir(server.prev_dir, PATH_SIZE, backup_dir, prev);
-    server.current_file[0] = '\0';
+    server.reflink_disabled = false;
+    server.prepopulated = false;
+    server.completed = false;
+    server.remove_old = false;
+    server.packing = false;
+    server.packs_fd = -1;
+    server.streams = NULL;
+    server.num_streams = 0;
+    server.stream = add_stream(&server, 0);
+    bool initialized = (server.stream != NULL) && arena_init(&server.arena, BUF_SIZE)
+        && name_set_init(&server.packs_used) && version_log_init(&server.versions);
+    if (!initialized) {
+        print_error("Cannot allocate memory for commands");
+        return 1;
+    }
+    if (!bufring_init(&server.ring, BODY_BUF_SIZE, BODY_BUF_ALIGNMENT)) {
+        print_error("Cannot allocate buffers for bodies");
+        return 1;
+    }
+    bzero(&server.phases, sizeof(server.phases));
     print_info("New backup (temporary): %s", server.dest_dir);
     print_info("Prev backup: %s", server.prev_dir);
-    if (!make_backup_dir(server.dest_dir)) {
+    prune_for_space(&server);
+    if ((server.conf.clone == CLONE_SNAPSHOT) && !make_snapshot(&server, tmpdir, prev)) {
+        return 1;
+    }
+    /* make_snapshot() may fall back to the link mode. */
+    if ((server.conf.clone != CLONE_SNAPSHOT) && !make_backup_dir(server.dest_dir)) {
+        return 1;
+    }
+    server.dest_root = open_dirfd(AT_FDCWD, server.dest_dir);
+    if (server.dest_root == -1) {
+        print_errno("open failed", errno, server.dest_dir);
         return 1;
     }
+    /* Closing dest_root unlocks it. See is_running(). */
+    if (flock(server.dest_root, LOCK_EX | LOCK_NB) != 0) {
+        print_errno("flock failed", errno, server.dest_dir);
+    }
+    add_to_catalog(&server, CATALOG_PENDING, &start);
+    catalog_unlock(lock);
+    /* A snapshot of the previous backup has its marker. */
+    unlinkat(server.dest_root, COMMIT_PATH, 0);
+    server.hashes = open_hashes(server.dest_root);
+    if (server.hashes == NULL) {
+        print_errno("open failed", errno, HASHES_PATH);
+    }
+    /* Hard links cannot go across subvolumes. */
+    const char* prev_dir = server.prev_dir;
+    bool linkable = (server.conf.clone != CLONE_SNAPSHOT) || server.prepopulated;
+    server.prev_root = linkable && (prev_dir[0] != '\0') ? open_dirfd(AT_FDCWD, prev_dir) : -1;
+    if ((server.conf.pack_size != 0) && (server.conf.clone != CLONE_SNAPSHOT)) {
+        server.packing = open_packs(&server);
+    }
 
     size_t size = 4096;
     char buf[size];
     bool status = true;
     while (status && (fgets(buf, size, stdin) != NULL)) {
         trim(buf);
-        print_info("Recv: %s", buf);
+        log_sample_next();
+        LOG_PROTOCOL("Recv: %s", buf);
         status = run_command(&server, buf);
     }
     char dir[PATH_SIZE];
     join(dir, PATH_SIZE, backup_dir, timestamp);
-    do_rename(server.dest_dir, dir);
+    close_streams(&server);
+    if ((server.hashes != NULL) && (fclose(server.hashes) != 0)) {
+        print_errno("writing hashes failed", errno, HASHES_PATH);
+    }
+    if (server.packing) {
+        remove_unused_packs(&server);
+    }
+    close_dirfd(&server.packs_fd);
+    bool committed = server.completed && commit_backup(&server);
+    if (committed) {
+        const char* base = server.prepopulated ? server.prev_name : NULL;
+        versions_update(backup_dir, timestamp, server.dest_root, &server.versions, base);
+    }
+    /*
+     * The catalog is locked before the session unlocks its backup, so that no
+     * other backuper removes it as a stale session before it is renamed.
+     */
+    lock = lock_catalog(&server);
+    close_dirfd(&server.dest_root);
+    close_dirfd(&server.prev_root);
+    /* An uncommitted backup keeps its temporary name and its pending entry. */
+    if (committed) {
+        do_rename(server.dest_dir, dir);
+        if (lock != -1) {
+            add_to_catalog(&server, CATALOG_COMMITTED, &start);
+        }
+        finish_backup(backup_dir);
+        if (server.conf.clone == CLONE_SNAPSHOT) {
+            make_readonly(dir);
+        }
+        if ((lock != -1) && server.remove_old) {
+            remove_old_backups(&server);
+        }
+    }
+    else {
+        print_error("The backup was not committed: %s", server.dest_dir);
+    }
+    catalog_unlock(lock);
 
-    closelog();
+    catalog_destroy(&catalog);
+    bufring_destroy(&server.ring);
+    destroy_streams(&server);
+    name_set_destroy(&server.packs_used);
+    version_log_destroy(&server.versions);
+    arena_destroy(&server.arena);
+    log_close();
 
     return status ? 0 : 1;
 }
@@ -0,0 +1,328 @@
+#include <ubackup/config.h>
+#include <ubackup/journal.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#define PATH_SIZE 4096
+
+static void
+print_error(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static void
+print_version()
+{
+    printf("%s of ubackup %s\n", getprogname(), UBACKUP_VERSION);
+}
+
+#if defined(__linux__)
+#define EVENT_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                    IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_DONT_FOLLOW | \
+                    IN_EXCL_UNLINK | IN_ONLYDIR)
+
+/*
+ * paths are indexed by watch descriptors. Records of events in a read(2) are
+ * written into the journal at once.
+ */
+struct Watcher {
+    int journal;
+    int inotify;
+    char** paths;
+    int num_paths;
+    char* records;
+    size_t len;
+    size_t capacity;
+};
+
+typedef struct Watcher Watcher;
+
+static volatile sig_atomic_t terminated = 0;
+
+static void
+terminate(int sig)
+{
+    (void)sig;
+    terminated = 1;
+}
+
+static void*
+realloc_or_die(void* p, size_t size)
+{
+    void* q = realloc(p, size);
+    if (q == NULL) {
+        print_error("Cannot allocate memory.");
+        exit(1);
+    }
+    return q;
+}
+
+static void
+set_path(Watcher* watcher, int wd, const char* path)
+{
+    if (watcher->num_paths <= wd) {
+        int n = watcher->num_paths == 0 ? 1024 : watcher->num_paths;
+        while (n <= wd) {
+            n *= 2;
+        }
+        size_t size = n * sizeof(watcher->paths[0]);
+        watcher->paths = (char**)realloc_or_die(watcher->paths, size);
+        int i;
+        for (i = watcher->num_paths; i < n; i++) {
+            watcher->paths[i] = NULL;
+        }
+        watcher->num_paths = n;
+    }
+    free(watcher->paths[wd]);
+    watcher->paths[wd] = path != NULL ? strdup(path) : NULL;
+}
+
+static void
+add_record(Watcher* watcher, char type, const char* path)
+{
+    size_t size = strlen(path) + 2;
+    if (watcher->capacity < watcher->len + size) {
+        size_t n = watcher->capacity == 0 ? 4096 : 2 * watcher->capacity;
+        while (n < watcher->len + size) {
+            n *= 2;
+        }
+        watcher->records = (char*)realloc_or_die(watcher->records, n);
+        watcher->capacity = n;
+    }
+    char* p = watcher->records + watcher->len;
+    p[0] = type;
+    memcpy(p + 1, path, size - 1);
+    watcher->len += size;
+}
+
+static bool
+flush_records(Watcher* watcher)
+{
+    size_t n = 0;
+    while (n < watcher->len) {
+        ssize_t m = write(watcher->journal, watcher->records + n, watcher->len - n);
+        if (m < 0) {
+            print_error("write failed: %s", strerror(errno));
+            return false;
+        }
+        n += m;
+    }
+    watcher->len = 0;
+    return true;
+}
+
+/*
+ * Watches path and all directories under it. Directories which appeared after
+ * the last backup are recorded too, because their entries may have been made
+ * before they were watched. A lack of watches is fatal, because changes would
+ * be lost silently.
+ */
+static bool
+watch_tree(Watcher* watcher, const char* path, bool record)
+{
+    int wd = inotify_add_watch(watcher->inotify, path, EVENT_MASK);
+    if (wd == -1) {
+        if (errno == ENOSPC) {
+            print_error("Too many directories. Raise fs.inotify.max_user_watches.");
+            return false;
+        }
+        return true;
+    }
+    set_path(watcher, wd, path);
+    if (record) {
+        add_record(watcher, JOURNAL_CHANGED, path);
+    }
+    DIR* dirp = opendir(path);
+    if (dirp == NULL) {
+        return true;
+    }
+    bool ok = true;
+    struct dirent* e;
+    while (ok && ((e = readdir(dirp)) != NULL)) {
+        const char* name = e->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+            continue;
+        }
+        char child[strlen(path) + strlen(name) + 2];
+        sprintf(child, "%s/%s", strcmp(path, "/") == 0 ? "" : path, name);
+        struct stat sb;
+        bool is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN) {
+            is_dir = (lstat(child, &sb) == 0) && S_ISDIR(sb.st_mode);
+        }
+        if (is_dir) {
+            ok = watch_tree(watcher, child, record);
+        }
+    }
+    closedir(dirp);
+    return ok;
+}
+
+/*
+ * A change of an entry is recorded as a change of its directory. A change of
+ * attributes of a watched directory itself is a change in its parent.
+ */
+static bool
+handle_event(Watcher* watcher, const struct inotify_event* event)
+{
+    if ((event->mask & IN_Q_OVERFLOW) != 0) {
+        add_record(watcher, JOURNAL_OVERFLOW, "");
+        return true;
+    }
+    int wd = event->wd;
+    const char* dir = (0 <= wd) && (wd < watcher->num_paths) ? watcher->paths[wd] : NULL;
+    if (dir == NULL) {
+        return true;
+    }
+    if ((event->mask & IN_IGNORED) != 0) {
+        set_path(watcher, wd, NULL);
+        return true;
+    }
+    if (event->len == 0) {
+        char buf[strlen(dir) + 1];
+        strcpy(buf, dir);
+        add_record(watcher, JOURNAL_CHANGED, dirname(buf));
+        return true;
+    }
+    add_record(watcher, JOURNAL_CHANGED, dir);
+    bool is_new_dir = (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0;
+    if (!is_new_dir || ((event->mask & IN_ISDIR) == 0)) {
+        return true;
+    }
+    char path[strlen(dir) + strlen(event->name) + 2];
+    sprintf(path, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, event->name);
+    return watch_tree(watcher, path, true);
+}
+
+static int
+watch(const char* journal, char* dirs[], int num_dirs)
+{
+    Watcher watcher;
+    memset(&watcher, 0, sizeof(watcher));
+    watcher.inotify = inotify_init();
+    if (watcher.inotify == -1) {
+        print_error("inotify_init failed: %s", strerror(errno));
+        return 1;
+    }
+    int i;
+    for (i = 0; i < num_dirs; i++) {
+        if (!watch_tree(&watcher, dirs[i], false)) {
+            return 1;
+        }
+    }
+    /* A session starts after all directories are watched. */
+    watcher.journal = journal_create(journal);
+    if (watcher.journal == -1) {
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = terminate;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    size_t size = 64 * 1024;
+    char* buf = (char*)realloc_or_die(NULL, size);
+    bool ok = true;
+    while (ok && !terminated) {
+        ssize_t n = read(watcher.inotify, buf, size);
+        if (n < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+        ssize_t pos = 0;
+        while (ok && (pos < n)) {
+            const struct inotify_event* event = (const struct inotify_event*)(buf + pos);
+            ok = handle_event(&watcher, event);
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+        ok = flush_records(&watcher) && ok;
+        ok = ok && journal_compact(watcher.journal, journal);
+    }
+    free(buf);
+    return ok ? 0 : 1;
+}
+#else
+static int
+watch(const char* journal, char* dirs[], int num_dirs)
+{
+    (void)journal;
+    (void)dirs;
+    (void)num_dirs;
+    print_error("inotify is not available on this system.");
+    return 1;
+}
+#endif
+
+static void
+usage(const char* ident)
+{
+    printf("%s journal dir ...\n", ident);
+}
+
+/*
+ * Directories must be absolute paths as same as ones given to ubackupee.
+ */
+int
+main(int argc, char* argv[])
+{
+    struct option opts[] = {
+        { "version", no_argument, NULL, 'v' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "v", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'v':
+            print_version();
+            return 0;
+        default:
+            usage(basename(argv[0]));
+            return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage(basename(argv[0]));
+        return 1;
+    }
+    int i;
+    for (i = optind + 1; i < argc; i++) {
+        char* dir = argv[i];
+        if (dir[0] != '/') {
+            print_error("Give an absolute path: %s", dir);
+            return 1;
+        }
+        size_t len = strlen(dir);
+        while ((1 < len) && (dir[len - 1] == '/')) {
+            len--;
+            dir[len] = '\0';
+        }
+    }
+    return watch(argv[optind], &argv[optind + 1], argc - optind - 1);
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */
@@ -0,0 +1,753 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ubackup/pack.h>
+#include <ubackup/versions.h>
+
+#define PATH_SIZE 4096
+#define META_DIR ".meta"
+
+static void
+print_errno(const char* msg, int e, const char* info)
+{
+    fprintf(stderr, "%s: %s: %s\n", msg, strerror(e), info);
+}
+
+bool
+version_record_write(FILE* fp, const VersionRecord* record)
+{
+    int n;
+    if (record->op == '-') {
+        n = fprintf(fp, "- %s", record->path);
+    }
+    else {
+        const char* fmt = "%c %" PRIu64 " %" PRId64 ".%09ld %" PRIu64 " %s";
+        n = fprintf(fp, fmt, record->op, record->size, (int64_t)record->mtime.tv_sec,
+                    record->mtime.tv_nsec, record->ino, record->path);
+    }
+    return (0 <= n) && (fputc('\0', fp) != EOF);
+}
+
+/*
+ * record->path points into *buf, which is reused for the next record.
+ */
+bool
+version_record_read(FILE* fp, VersionRecord* record, char** buf, size_t* bufsize)
+{
+    while (getdelim(buf, bufsize, '\0', fp) != -1) {
+        char* p = *buf;
+        if (((p[0] != '+') && (p[0] != '-')) || (p[1] != ' ')) {
+            continue;
+        }
+        record->op = p[0];
+        if (p[0] == '-') {
+            record->size = record->ino = 0;
+            record->mtime.tv_sec = record->mtime.tv_nsec = 0;
+            record->path = p + 2;
+            return true;
+        }
+        char* end;
+        record->size = strtoull(p + 2, &end, 10);
+        if (*end != ' ') {
+            continue;
+        }
+        record->mtime.tv_sec = strtoll(end + 1, &end, 10);
+        if (*end != '.') {
+            continue;
+        }
+        record->mtime.tv_nsec = strtol(end + 1, &end, 10);
+        if (*end != ' ') {
+            continue;
+        }
+        record->ino = strtoull(end + 1, &end, 10);
+        if (*end != ' ') {
+            continue;
+        }
+        record->path = end + 1;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * The order of a depth first walk with sorted names, in which "a/b" comes
+ * before "a.txt". It is strcmp(3) where '/' is less than any other character.
+ */
+int
+versions_compare_paths(const char* a, const char* b)
+{
+    const unsigned char* p = (const unsigned char*)a;
+    const unsigned char* q = (const unsigned char*)b;
+    while ((*p != '\0') && (*p == *q)) {
+        p++;
+        q++;
+    }
+    if (*p == *q) {
+        return 0;
+    }
+    if ((*p == '\0') || (*q == '\0')) {
+        return *p == '\0' ? -1 : 1;
+    }
+    if ((*p == '/') || (*q == '/')) {
+        return *p == '/' ? -1 : 1;
+    }
+    return *p < *q ? -1 : 1;
+}
+
+bool
+version_log_init(VersionLog* log)
+{
+    log->records = NULL;
+    log->num = log->capacity = 0;
+    log->failed = false;
+    return arena_init(&log->arena, 16 * 1024);
+}
+
+void
+version_log_destroy(VersionLog* log)
+{
+    arena_destroy(&log->arena);
+    free(log->records);
+}
+
+/*
+ * A record which cannot be kept fails the log, and then versions_update()
+ * walks the new backup.
+ */
+void
+version_log_add(VersionLog* log, const VersionRecord* record)
+{
+    if (log->failed) {
+        return;
+    }
+    if (log->num == log->capacity) {
+        size_t capacity = log->capacity == 0 ? 1024 : 2 * log->capacity;
+        VersionRecord* p = (VersionRecord*)realloc(log->records, capacity * sizeof(VersionRecord));
+        if (p == NULL) {
+            log->failed = true;
+            return;
+        }
+        log->records = p;
+        log->capacity = capacity;
+    }
+    size_t size = strlen(record->path) + 1;
+    char* path = (char*)arena_alloc(&log->arena, size);
+    if (path == NULL) {
+        log->failed = true;
+        return;
+    }
+    memcpy(path, record->path, size);
+    VersionRecord* r = &log->records[log->num];
+    *r = *record;
+    r->path = path;
+    log->num++;
+}
+
+static bool
+is_same_version(const VersionRecord* a, const VersionRecord* b)
+{
+    return (a->size == b->size) && (a->mtime.tv_sec == b->mtime.tv_sec)
+        && (a->mtime.tv_nsec == b->mtime.tv_nsec);
+}
+
+/*
+ * Files of a new backup are merged with the live list of the last indexed
+ * one. Both are in the same order.
+ */
+struct Indexer {
+    FILE* old;
+    VersionRecord old_record;
+    bool old_valid;
+    char* old_buf;
+    size_t old_bufsize;
+    FILE* live;
+    FILE* changes;
+    bool ok;
+};
+
+typedef struct Indexer Indexer;
+
+static void
+write_record(Indexer* indexer, FILE* fp, const VersionRecord* record)
+{
+    if (!version_record_write(fp, record)) {
+        indexer->ok = false;
+    }
+}
+
+static void
+advance_old(Indexer* indexer)
+{
+    FILE* fp = indexer->old;
+    bool valid = fp != NULL;
+    valid = valid && version_record_read(fp, &indexer->old_record, &indexer->old_buf,
+                                         &indexer->old_bufsize);
+    indexer->old_valid = valid;
+}
+
+/*
+ * Files before path in the live list were removed.
+ */
+static void
+remove_until(Indexer* indexer, const char* path)
+{
+    while (indexer->old_valid) {
+        const VersionRecord* old = &indexer->old_record;
+        if ((path != NULL) && (0 <= versions_compare_paths(old->path, path))) {
+            return;
+        }
+        VersionRecord removed = *old;
+        removed.op = '-';
+        write_record(indexer, indexer->changes, &removed);
+        advance_old(indexer);
+    }
+}
+
+static void
+index_file(Indexer* indexer, const VersionRecord* record)
+{
+    remove_until(indexer, record->path);
+    const VersionRecord* old = &indexer->old_record;
+    bool existed = indexer->old_valid && (versions_compare_paths(old->path, record->path) == 0);
+    bool same = existed && is_same_version(old, record);
+    if (existed) {
+        advance_old(indexer);
+    }
+    if (!same) {
+        write_record(indexer, indexer->changes, record);
+    }
+    write_record(indexer, indexer->live, record);
+}
+
+struct DirEntry {
+    char* name;
+    bool packed;
+    uint64_t size;
+    struct timespec mtime;
+};
+
+typedef struct DirEntry DirEntry;
+
+static int
+compare_entries(const void* a, const void* b)
+{
+    return strcmp(((const DirEntry*)a)->name, ((const DirEntry*)b)->name);
+}
+
+static bool
+add_entry(DirEntry** entries, size_t* num, const char* name)
+{
+    DirEntry* p = (DirEntry*)realloc(*entries, (*num + 1) * sizeof(DirEntry));
+    if (p == NULL) {
+        return false;
+    }
+    *entries = p;
+    DirEntry* e = &p[*num];
+    e->name = strdup(name);
+    e->packed = false;
+    if (e->name == NULL) {
+        return false;
+    }
+    (*num)++;
+    return true;
+}
+
+static void
+add_packed(DirEntry** entries, size_t* num, int dirfd)
+{
+    int fd = openat(dirfd, META_DIR "/" PACK_INDEX, O_RDONLY);
+    FILE* fp = fd != -1 ? fdopen(fd, "r") : NULL;
+    if (fp == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    char* buf = NULL;
+    size_t bufsize = 0;
+    PackRecord record;
+    while (pack_record_read(fp, &record, &buf, &bufsize) && add_entry(entries, num, record.name)) {
+        DirEntry* e = &(*entries)[*num - 1];
+        e->packed = true;
+        e->size = record.length;
+        e->mtime = record.mtime;
+    }
+    free(buf);
+    fclose(fp);
+}
+
+static void
+walk(Indexer* indexer, int dirfd, char* path, size_t len)
+{
+    int fd = dup(dirfd);
+    DIR* dirp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dirp == NULL) {
+        print_errno("opendir failed", errno, path);
+        if (fd != -1) {
+            close(fd);
+        }
+        indexer->ok = false;
+        return;
+    }
+    DirEntry* entries = NULL;
+    size_t num = 0;
+    struct dirent* e;
+    while ((e = readdir(dirp)) != NULL) {
+        const char* name = e->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0) || (strcmp(name, META_DIR) == 0)) {
+            continue;
+        }
+        if (!add_entry(&entries, &num, name)) {
+            indexer->ok = false;
+            break;
+        }
+    }
+    closedir(dirp);
+    add_packed(&entries, &num, dirfd);
+    qsort(entries, num, sizeof(entries[0]), compare_entries);
+
+    size_t i;
+    for (i = 0; i < num; i++) {
+        const DirEntry* entry = &entries[i];
+        size_t n = snprintf(path + len, PATH_SIZE - len, "%s%s", len == 0 ? "" : "/", entry->name);
+        if (PATH_SIZE - len <= n) {
+            continue;
+        }
+        VersionRecord record = { '+', entry->size, entry->mtime, 0, path };
+        if (entry->packed) {
+            index_file(indexer, &record);
+            continue;
+        }
+        struct stat sb;
+        if (fstatat(dirfd, entry->name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        if (S_ISREG(sb.st_mode)) {
+            record.size = sb.st_size;
+            record.mtime = sb.st_mtim;
+            record.ino = sb.st_ino;
+            index_file(indexer, &record);
+            continue;
+        }
+        if (!S_ISDIR(sb.st_mode)) {
+            continue;
+        }
+        int subfd = openat(dirfd, entry->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (subfd == -1) {
+            print_errno("open failed", errno, path);
+            indexer->ok = false;
+            continue;
+        }
+        walk(indexer, subfd, path, len + n);
+        close(subfd);
+    }
+    path[len] = '\0';
+    for (i = 0; i < num; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+/*
+ * Records of a log are sorted by their paths, and then by the order in which
+ * they were added.
+ */
+static int
+compare_ops(const void* a, const void* b)
+{
+    const VersionRecord* p = *(const VersionRecord* const*)a;
+    const VersionRecord* q = *(const VersionRecord* const*)b;
+    int n = versions_compare_paths(p->path, q->path);
+    if (n != 0) {
+        return n;
+    }
+    return p < q ? -1 : (q < p ? 1 : 0);
+}
+
+static bool
+is_under(const char* path, const char* dir)
+{
+    size_t len = strlen(dir);
+    return (strncmp(path, dir, len) == 0) && ((path[len] == '\0') || (path[len] == '/'));
+}
+
+/*
+ * A removed path, which covers the following paths under it. last is the
+ * latest removal of the path or of its ancestors.
+ */
+struct Removal {
+    const char* path;
+    const VersionRecord* last;
+};
+
+typedef struct Removal Removal;
+
+static size_t
+pop_removals(const Removal* removals, size_t depth, const char* path)
+{
+    while ((0 < depth) && !is_under(path, removals[depth - 1].path)) {
+        depth--;
+    }
+    return depth;
+}
+
+/*
+ * Indexes files of a new backup from the log of its session instead of
+ * walking it. A path is in the new backup when it was added after its last
+ * removal, which may be of an ancestor. If base is not NULL, the new backup
+ * started as the backup listed in base, and its files which the log does not
+ * mention are kept.
+ */
+static void
+replay(Indexer* indexer, const VersionLog* log, FILE* base)
+{
+    size_t num = log->num;
+    const VersionRecord** ops = (const VersionRecord**)malloc((num + 1) * sizeof(ops[0]));
+    Removal* removals = (Removal*)malloc((num + 1) * sizeof(removals[0]));
+    if ((ops == NULL) || (removals == NULL)) {
+        free(ops);
+        free(removals);
+        indexer->ok = false;
+        return;
+    }
+    size_t i;
+    for (i = 0; i < num; i++) {
+        ops[i] = &log->records[i];
+    }
+    qsort(ops, num, sizeof(ops[0]), compare_ops);
+
+    VersionRecord old;
+    char* buf = NULL;
+    size_t bufsize = 0;
+    bool old_valid = (base != NULL) && version_record_read(base, &old, &buf, &bufsize);
+    size_t depth = 0;
+    i = 0;
+    while ((i < num) || old_valid) {
+        int n = i == num ? 1 : (!old_valid ? -1 : versions_compare_paths(ops[i]->path, old.path));
+        if (0 < n) {
+            depth = pop_removals(removals, depth, old.path);
+            if (depth == 0) {
+                index_file(indexer, &old);
+            }
+            old_valid = version_record_read(base, &old, &buf, &bufsize);
+            continue;
+        }
+        if (n == 0) {
+            old_valid = version_record_read(base, &old, &buf, &bufsize);
+        }
+        const char* path = ops[i]->path;
+        const VersionRecord* added = NULL;
+        const VersionRecord* removed = NULL;
+        for (; (i < num) && (strcmp(ops[i]->path, path) == 0); i++) {
+            if (ops[i]->op == '+') {
+                added = ops[i];
+            }
+            else {
+                removed = ops[i];
+            }
+        }
+        depth = pop_removals(removals, depth, path);
+        const VersionRecord* last = 0 < depth ? removals[depth - 1].last : NULL;
+        if ((removed != NULL) && ((last == NULL) || (last < removed))) {
+            last = removed;
+        }
+        if ((added != NULL) && ((last == NULL) || (last < added))) {
+            index_file(indexer, added);
+        }
+        if (removed != NULL) {
+            removals[depth].path = path;
+            removals[depth].last = last;
+            depth++;
+        }
+    }
+    free(buf);
+    free(removals);
+    free(ops);
+}
+
+static FILE*
+create_at(int dirfd, const char* name)
+{
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    FILE* fp = fd != -1 ? fdopen(fd, "w") : NULL;
+    if ((fp == NULL) && (fd != -1)) {
+        close(fd);
+    }
+    return fp;
+}
+
+static bool
+close_file(FILE* fp)
+{
+    bool ok = (fflush(fp) == 0) && (fsync(fileno(fp)) == 0);
+    return (fclose(fp) == 0) && ok;
+}
+
+static int
+open_versions_dir(const char* backup_dir)
+{
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", backup_dir, VERSIONS_DIR);
+    if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) {
+        print_errno("mkdir failed", errno, path);
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        print_errno("open failed", errno, path);
+    }
+    return fd;
+}
+
+static int
+compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+static void
+free_names(char** names, size_t num)
+{
+    size_t i;
+    for (i = 0; i < num; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+/*
+ * Names starting with a digit in dirfd, sorted.
+ */
+static char**
+list_names(int dirfd, size_t* num)
+{
+    *num = 0;
+    int fd = dup(dirfd);
+    DIR* dirp = fd != -1 ? fdopendir(fd) : NULL;
+    if (dirp == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    char** names = NULL;
+    struct dirent* e;
+    while ((e = readdir(dirp)) != NULL) {
+        if (!isdigit((unsigned char)e->d_name[0])) {
+            continue;
+        }
+        char** p = (char**)realloc(names, (*num + 1) * sizeof(char*));
+        char* name = p != NULL ? strdup(e->d_name) : NULL;
+        if (name == NULL) {
+            names = p != NULL ? p : names;
+            break;
+        }
+        names = p;
+        names[*num] = name;
+        (*num)++;
+    }
+    closedir(dirp);
+    qsort(names, *num, sizeof(char*), compare_names);
+    return names;
+}
+
+/*
+ * The live list is of base only when base is the last indexed backup.
+ */
+static FILE*
+open_base(int dirfd, const char* base)
+{
+    size_t num;
+    char** names = list_names(dirfd, &num);
+    bool last = (0 < num) && (strcmp(names[num - 1], base) == 0);
+    free_names(names, num);
+    int fd = last ? openat(dirfd, VERSIONS_LIVE, O_RDONLY) : -1;
+    FILE* fp = fd != -1 ? fdopen(fd, "r") : NULL;
+    if ((fp == NULL) && (fd != -1)) {
+        close(fd);
+    }
+    return fp;
+}
+
+/*
+ * Writes changes of the backup of name, whose top directory is root_fd, from
+ * the last indexed backup. The changes and the new live list are written into
+ * temporary files, and then they are renamed.
+ *
+ * Files are taken from log of the session, and base is the backup which the
+ * new one started as a snapshot of, or NULL if the log has all of its files.
+ * The new backup is walked when there is no log, the log failed, or base is
+ * not the last indexed backup.
+ */
+bool
+versions_update(const char* backup_dir, const char* name, int root_fd, const VersionLog* log,
+                const char* base)
+{
+    int dirfd = open_versions_dir(backup_dir);
+    if (dirfd == -1) {
+        return false;
+    }
+    char changes_tmp[PATH_SIZE];
+    snprintf(changes_tmp, sizeof(changes_tmp), ".%s.tmp", name);
+    int fd = openat(dirfd, VERSIONS_LIVE, O_RDONLY);
+    Indexer indexer;
+    indexer.old = fd != -1 ? fdopen(fd, "r") : NULL;
+    indexer.old_buf = NULL;
+    indexer.old_bufsize = 0;
+    indexer.live = create_at(dirfd, "." VERSIONS_LIVE ".tmp");
+    indexer.changes = create_at(dirfd, changes_tmp);
+    indexer.ok = (indexer.live != NULL) && (indexer.changes != NULL);
+    if (indexer.ok) {
+        advance_old(&indexer);
+        bool logged = (log != NULL) && !log->failed;
+        FILE* fp = logged && (base != NULL) ? open_base(dirfd, base) : NULL;
+        if (logged && ((base == NULL) || (fp != NULL))) {
+            replay(&indexer, log, fp);
+        }
+        else {
+            char path[PATH_SIZE] = "";
+            walk(&indexer, root_fd, path, 0);
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        remove_until(&indexer, NULL);
+    }
+    if (indexer.old != NULL) {
+        fclose(indexer.old);
+    }
+    else if (fd != -1) {
+        close(fd);
+    }
+    free(indexer.old_buf);
+    bool ok = indexer.ok;
+    ok = (indexer.changes != NULL) && close_file(indexer.changes) && ok;
+    ok = (indexer.live != NULL) && close_file(indexer.live) && ok;
+    ok = ok && (renameat(dirfd, changes_tmp, dirfd, name) == 0);
+    ok = ok && (renameat(dirfd, "." VERSIONS_LIVE ".tmp", dirfd, VERSIONS_LIVE) == 0);
+    if (!ok) {
+        print_errno("updating the version index failed", errno, name);
+        unlinkat(dirfd, changes_tmp, 0);
+        unlinkat(dirfd, "." VERSIONS_LIVE ".tmp", 0);
+    }
+    else {
+        fsync(dirfd);
+    }
+    close(dirfd);
+    return ok;
+}
+
+/*
+ * Applies the changes of newer to base, a list of files like the first one.
+ */
+static bool
+fold(int dirfd, const char* base, const char* newer, const char* tmp)
+{
+    int fd1 = openat(dirfd, base, O_RDONLY);
+    int fd2 = openat(dirfd, newer, O_RDONLY);
+    FILE* in1 = fd1 != -1 ? fdopen(fd1, "r") : NULL;
+    FILE* in2 = fd2 != -1 ? fdopen(fd2, "r") : NULL;
+    FILE* out = create_at(dirfd, tmp);
+    bool ok = (in1 != NULL) && (in2 != NULL) && (out != NULL);
+    char* buf1 = NULL;
+    char* buf2 = NULL;
+    size_t size1 = 0, size2 = 0;
+    VersionRecord r1, r2;
+    bool valid1 = ok && version_record_read(in1, &r1, &buf1, &size1);
+    bool valid2 = ok && version_record_read(in2, &r2, &buf2, &size2);
+    while (ok && (valid1 || valid2)) {
+        int cmp = !valid1 ? 1 : !valid2 ? -1 : versions_compare_paths(r1.path, r2.path);
+        if (cmp < 0) {
+            ok = version_record_write(out, &r1);
+        }
+        else if (r2.op == '+') {
+            ok = version_record_write(out, &r2);
+        }
+        if (cmp <= 0) {
+            valid1 = version_record_read(in1, &r1, &buf1, &size1);
+        }
+        if (0 <= cmp) {
+            valid2 = version_record_read(in2, &r2, &buf2, &size2);
+        }
+    }
+    free(buf1);
+    free(buf2);
+    if (in1 != NULL) {
+        fclose(in1);
+    }
+    else if (fd1 != -1) {
+        close(fd1);
+    }
+    if (in2 != NULL) {
+        fclose(in2);
+    }
+    else if (fd2 != -1) {
+        close(fd2);
+    }
+    ok = (out != NULL) && close_file(out) && ok;
+    ok = ok && (renameat(dirfd, tmp, dirfd, newer) == 0);
+    if (!ok) {
+        unlinkat(dirfd, tmp, 0);
+    }
+    return ok;
+}
+
+/*
+ * Changes of removed backups are folded into the oldest remaining one, so the
+ * index does not grow with backups which no longer exist.
+ */
+bool
+versions_compact(const char* backup_dir)
+{
+    char path[PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", backup_dir, VERSIONS_DIR);
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        return errno == ENOENT;
+    }
+    int backups_fd = open(backup_dir, O_RDONLY | O_DIRECTORY);
+    size_t num_changes, num_backups;
+    char** changes = list_names(dirfd, &num_changes);
+    char** backups = backups_fd != -1 ? list_names(backups_fd, &num_backups) : NULL;
+    bool ok = backups_fd != -1;
+    size_t i = 0;
+    while (ok && (i + 1 < num_changes)) {
+        const char* name = changes[i];
+        bool exists = bsearch(&name, backups, num_backups, sizeof(char*), compare_names) != NULL;
+        if (exists) {
+            break;
+        }
+        ok = fold(dirfd, changes[i], changes[i + 1], ".fold.tmp")
+            && (unlinkat(dirfd, changes[i], 0) == 0);
+        if (!ok) {
+            print_errno("compacting the version index failed", errno, changes[i]);
+        }
+        i++;
+    }
+    free_names(changes, num_changes);
+    if (backups != NULL) {
+        free_names(backups, num_backups);
+    }
+    if (backups_fd != -1) {
+        close(backups_fd);
+    }
+    close(dirfd);
+    return ok;
+}
+
+/**
+ * vim: tabstop=4 shiftwidth=4 expandtab softtabstop=4
+ */